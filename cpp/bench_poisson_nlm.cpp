@@ -0,0 +1,364 @@
+// cpp/bench_poisson_nlm.cpp
+// 泊松 NLM 核心的独立基准程序（不经过 Python/numpy），用于新版本上线前的性能回归把关。
+//
+// 编译：
+//   Linux/macOS: g++ -O3 -fopenmp -std=c++14 cpp/bench_poisson_nlm.cpp -o bench_poisson_nlm
+//   MSVC:        cl /O2 /openmp /std:c++14 /EHsc cpp\bench_poisson_nlm.cpp
+//
+// 用法：
+//   bench_poisson_nlm                      默认扫描：以 512²/sr=2/pr=1/topk=25/lq=0.02 为基准逐项变化，并做线程扩展
+//   bench_poisson_nlm --full               sizes × sr × pr × topk × lq × threads 全组合
+//   bench_poisson_nlm --sizes 256,1024 --sr 1,2,3 --threads 1,8 --csv out.csv
+//   bench_poisson_nlm --baseline old.csv --tolerance 0.10   Mpx/s 比基线低 10% 以上时返回码为 1
+//   bench_poisson_nlm --min-efficiency 0.6  512² 基准配置在最大线程数下扩展效率低于 60% 时返回码为 1
+//
+// 输出列：每次调用耗时（中位数）、吞吐 Mpx/s、相对单线程的扩展效率 T1/(n·Tn)、d 表命中率
+//（块距离查表中落在稠密表内、无需回退到逐项求和的比例，按行抽样统计）。
+#include "poisson_nlm_core.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <random>
+#include <sstream>
+
+namespace {
+
+struct BenchConfig {
+    int size;
+    int sr, pr, topk;
+    double lq;
+    int threads;
+
+    std::string name() const {
+        char buf[160];
+        std::snprintf(buf, sizeof(buf), "BM_PoissonNLM/%dx%d/sr:%d/pr:%d/topk:%d/lq:%g/threads:%d",
+                      size, size, sr, pr, topk, lq, threads);
+        return buf;
+    }
+    // 去掉线程数的键，用于查找同配置的单线程结果
+    std::string serial_key() const {
+        char buf[128];
+        std::snprintf(buf, sizeof(buf), "%d/%d/%d/%d/%g", size, sr, pr, topk, lq);
+        return buf;
+    }
+};
+
+struct BenchResult {
+    double ms = 0.0;        // 每次调用的中位耗时
+    double mpx_s = 0.0;
+    double efficiency = 0.0;
+    double lut_hit = 0.0;
+    int iterations = 0;
+};
+
+// 合成梯度场：缓变结构 + 噪声 + 块状强边缘，λ 分布接近实际 X 光片
+static void make_gradients(int H, int W, std::vector<float>& gx, std::vector<float>& gy) {
+    gx.resize(std::size_t(H) * W);
+    gy.resize(std::size_t(H) * W);
+    std::mt19937 rng(12345);
+    std::normal_distribution<float> nd(0.f, 1.f);
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            float s = 0.02f * std::sin(0.05f * x) * std::cos(0.07f * y);
+            float a = s + 0.01f * nd(rng), b = 0.5f * s + 0.01f * nd(rng);
+            if ((x / 32 + y / 32) % 7 == 0) { a *= 3.0f; b *= 3.0f; }
+            gx[std::size_t(y) * W + x] = a;
+            gy[std::size_t(y) * W + x] = b;
+        }
+    }
+}
+
+// d 表命中率：与块距离核完全相同的查表集合（搜索窗裁剪、patch 元素），抽样约 64 行
+static double lut_hit_rate(const std::vector<float>& gx, const std::vector<float>& gy, int H, int W,
+                           const NLMParams& prm) {
+    std::vector<float> lam_bar(std::size_t(H) * W);
+    LambdaMaps lm;
+    prepare_lambda_maps(contiguous_plane(gx.data(), W), contiguous_plane(gy.data(), W), H, W, prm,
+                        lam_bar.data(), lm);
+    const int n = acquire_distance_table(prm.lam_quant, lm.lam_max)->n;
+    const int pr = prm.patch_radius, sr = prm.search_radius;
+    const int step = std::max(1, (H - 2*pr) / 64);
+    long long hits = 0, total = 0;
+    for (int y = pr; y < H - pr; y += step) {
+        for (int x = pr; x < W - pr; ++x) {
+            int sy0 = std::max(pr, y - sr), sy1 = std::min(H - pr, y + sr + 1);
+            int sx0 = std::max(pr, x - sr), sx1 = std::min(W - pr, x + sr + 1);
+            for (int yy = sy0; yy < sy1; ++yy) {
+                for (int xx = sx0; xx < sx1; ++xx) {
+                    for (int dy = -pr; dy <= pr; ++dy) {
+                        for (int dx = -pr; dx <= pr; ++dx) {
+                            int qa = lm.lam_q[std::size_t(y + dy) * W + (x + dx)];
+                            int qb = lm.lam_q[std::size_t(yy + dy) * W + (xx + dx)];
+                            hits += (std::max(qa, qb) < n);
+                            ++total;
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return total ? double(hits) / double(total) : 1.0;
+}
+
+static void set_threads(int n) {
+#ifdef _OPENMP
+    omp_set_num_threads(n);
+#else
+    (void)n;
+#endif
+}
+
+static int max_threads() {
+#ifdef _OPENMP
+    return omp_get_max_threads();
+#else
+    return 1;
+#endif
+}
+
+// 预热一次（含 d 表构建，不计时），随后至少 min_reps 次、累计至少 min_time 秒，取中位数
+static BenchResult run_one(const BenchConfig& c, int min_reps, double min_time, int block_size,
+                           int precision) {
+    std::vector<float> gx, gy;
+    make_gradients(c.size, c.size, gx, gy);
+    const int H = c.size, W = c.size;
+    std::vector<float> ox(gx.size()), oy(gx.size()), lb(gx.size());
+
+    NLMParams prm;
+    prm.search_radius = c.sr; prm.patch_radius = c.pr;
+    prm.topk = c.topk; prm.lam_quant = c.lq;
+    prm.block_size = block_size;
+    prm.precision = precision;
+
+    set_threads(c.threads);
+    auto run = [&] {
+        poisson_nlm_core(contiguous_plane(gx.data(), W), contiguous_plane(gy.data(), W), H, W, prm,
+                         ox.data(), oy.data(), lb.data());
+    };
+    run();
+
+    std::vector<double> times;
+    double elapsed = 0.0;
+    while ((int)times.size() < min_reps || elapsed < min_time) {
+        auto t0 = std::chrono::steady_clock::now();
+        run();
+        double dt = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        times.push_back(dt);
+        elapsed += dt;
+        if (times.size() >= 1000) break;
+    }
+    std::sort(times.begin(), times.end());
+
+    BenchResult r;
+    r.iterations = (int)times.size();
+    r.ms = times[times.size() / 2] * 1e3;
+    r.mpx_s = double(H) * W / 1e6 / (r.ms / 1e3);
+    r.lut_hit = lut_hit_rate(gx, gy, H, W, prm);
+    return r;
+}
+
+static std::vector<int> parse_ints(const char* s) {
+    std::vector<int> v;
+    std::stringstream ss(s);
+    std::string tok;
+    while (std::getline(ss, tok, ',')) if (!tok.empty()) v.push_back(std::atoi(tok.c_str()));
+    return v;
+}
+
+static std::vector<double> parse_doubles(const char* s) {
+    std::vector<double> v;
+    std::stringstream ss(s);
+    std::string tok;
+    while (std::getline(ss, tok, ',')) if (!tok.empty()) v.push_back(std::atof(tok.c_str()));
+    return v;
+}
+
+// 基线 CSV：name,ms,mpx_s,...；返回 name → Mpx/s
+static std::map<std::string, double> load_baseline(const std::string& path) {
+    std::map<std::string, double> m;
+    std::ifstream f(path);
+    if (!f) throw std::runtime_error("cannot open baseline: " + path);
+    std::string line;
+    std::getline(f, line);  // 表头
+    while (std::getline(f, line)) {
+        std::stringstream ss(line);
+        std::string name, ms, mpx;
+        if (std::getline(ss, name, ',') && std::getline(ss, ms, ',') && std::getline(ss, mpx, ',')) {
+            m[name] = std::atof(mpx.c_str());
+        }
+    }
+    return m;
+}
+
+static void usage() {
+    std::printf(
+        "usage: bench_poisson_nlm [--sizes N,..] [--sr R,..] [--pr R,..] [--topk K,..] [--lq Q,..]\n"
+        "                         [--threads T,..] [--full] [--reps N] [--min-time SEC]\n"
+        "                         [--backend auto|scalar|avx2|avx512|neon] [--block N]\n"
+        "                         [--precision double|float32]\n"
+        "                         [--csv OUT] [--baseline CSV] [--tolerance FRAC]\n"
+        "                         [--min-efficiency FRAC]\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::vector<int> sizes = {512}, srs = {2}, prs = {1}, topks = {25}, threads;
+    std::vector<double> lqs = {0.02};
+    bool full = false, custom = false;
+    int reps = 3, block_size = 0;
+    double min_time = 0.5, tolerance = 0.10, min_efficiency = 0.0;
+    std::string csv_path, baseline_path, backend = "auto", precision = "double";
+
+    for (int i = 1; i < argc; ++i) {
+        std::string a = argv[i];
+        auto next = [&]() -> const char* {
+            if (i + 1 >= argc) { usage(); std::exit(2); }
+            return argv[++i];
+        };
+        if (a == "--sizes") { sizes = parse_ints(next()); custom = true; }
+        else if (a == "--sr") { srs = parse_ints(next()); custom = true; }
+        else if (a == "--pr") { prs = parse_ints(next()); custom = true; }
+        else if (a == "--topk") { topks = parse_ints(next()); custom = true; }
+        else if (a == "--lq") { lqs = parse_doubles(next()); custom = true; }
+        else if (a == "--threads") threads = parse_ints(next());
+        else if (a == "--full") full = true;
+        else if (a == "--reps") reps = std::max(1, std::atoi(next()));
+        else if (a == "--min-time") min_time = std::atof(next());
+        else if (a == "--backend") backend = next();
+        else if (a == "--block") block_size = std::max(0, std::atoi(next()));
+        else if (a == "--precision") precision = next();
+        else if (a == "--csv") csv_path = next();
+        else if (a == "--baseline") baseline_path = next();
+        else if (a == "--tolerance") tolerance = std::atof(next());
+        else if (a == "--min-efficiency") min_efficiency = std::atof(next());
+        else if (a == "-h" || a == "--help") { usage(); return 0; }
+        else { std::fprintf(stderr, "unknown option: %s\n", a.c_str()); usage(); return 2; }
+    }
+
+    int prec = kNLMPrecisionDouble;
+    try {
+        prec = parse_nlm_precision(precision);
+    } catch (const std::exception& e) {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 2;
+    }
+
+    // 选择块距离实现
+    {
+        auto impls = available_row_distance_impls();
+        std::lock_guard<std::mutex> lock(g_row_distance_mtx);
+        bool found = false;
+        for (const auto& impl : impls) {
+            if (backend == "auto" || backend == impl.name) { g_row_distance = impl; found = true; break; }
+        }
+        if (!found) { std::fprintf(stderr, "SIMD backend not available: %s\n", backend.c_str()); return 2; }
+    }
+
+    const int hw = max_threads();
+    if (threads.empty()) {
+        for (int t = 1; t < hw; t *= 2) threads.push_back(t);
+        threads.push_back(hw);
+    }
+    // 扩展效率需要单线程结果作参照
+    if (std::find(threads.begin(), threads.end(), 1) == threads.end()) threads.insert(threads.begin(), 1);
+
+    std::vector<BenchConfig> configs;
+    if (full || custom) {
+        for (int s : sizes) for (int sr : srs) for (int pr : prs) for (int k : topks)
+            for (double lq : lqs) for (int t : threads) configs.push_back({s, sr, pr, k, lq, t});
+    } else {
+        // 默认：围绕基准配置逐项变化（全线程），外加基准配置的线程扩展
+        const BenchConfig base = {512, 2, 1, 25, 0.02, hw};
+        configs.push_back(base);
+        for (int s : {256, 1024, 2048}) { BenchConfig c = base; c.size = s; configs.push_back(c); }
+        for (int sr : {1, 3, 5}) { BenchConfig c = base; c.sr = sr; configs.push_back(c); }
+        for (int pr : {2, 3}) { BenchConfig c = base; c.pr = pr; configs.push_back(c); }
+        for (int k : {0, 10}) { BenchConfig c = base; c.topk = k; configs.push_back(c); }
+        for (double lq : {0.01, 0.05}) { BenchConfig c = base; c.lq = lq; configs.push_back(c); }
+        for (int t : threads) {
+            if (t == hw) continue;
+            BenchConfig c = base; c.threads = t; configs.push_back(c);
+        }
+        // 单线程参照放在最前，便于按序计算效率
+        std::stable_sort(configs.begin(), configs.end(),
+                         [](const BenchConfig& a, const BenchConfig& b) { return a.threads < b.threads; });
+    }
+
+    std::printf("simd backend: %s, max threads: %d, L2: %zu KiB, block: %s, precision: %s\n",
+                g_row_distance.name, hw, l2_cache_bytes() / 1024,
+                block_size > 0 ? std::to_string(block_size).c_str() : "auto", precision.c_str());
+    std::printf("%-72s %10s %9s %6s %8s %6s\n", "Benchmark", "Time(ms)", "Mpx/s", "Eff", "LUT-hit", "Iters");
+    std::printf("%s\n", std::string(116, '-').c_str());
+
+    std::map<std::string, double> serial_ms;
+    std::vector<std::pair<BenchConfig, BenchResult>> results;
+    for (const BenchConfig& c : configs) {
+        BenchResult r = run_one(c, reps, min_time, block_size, prec);
+        if (c.threads == 1) serial_ms[c.serial_key()] = r.ms;
+        auto it = serial_ms.find(c.serial_key());
+        r.efficiency = (it != serial_ms.end()) ? it->second / (r.ms * c.threads) : 0.0;
+        if (it != serial_ms.end()) {
+            std::printf("%-72s %10.2f %9.3f %5.0f%% %7.2f%% %6d\n", c.name().c_str(), r.ms, r.mpx_s,
+                        r.efficiency * 100.0, r.lut_hit * 100.0, r.iterations);
+        } else {
+            std::printf("%-72s %10.2f %9.3f %6s %7.2f%% %6d\n", c.name().c_str(), r.ms, r.mpx_s,
+                        "-", r.lut_hit * 100.0, r.iterations);
+        }
+        std::fflush(stdout);
+        results.push_back(std::make_pair(c, r));
+    }
+
+    if (!csv_path.empty()) {
+        std::ofstream f(csv_path);
+        f << "name,ms,mpx_s,efficiency,lut_hit,iterations\n";
+        for (const auto& cr : results) {
+            f << cr.first.name() << ',' << cr.second.ms << ',' << cr.second.mpx_s << ','
+              << cr.second.efficiency << ',' << cr.second.lut_hit << ',' << cr.second.iterations << '\n';
+        }
+    }
+
+    int status = 0;
+    if (!baseline_path.empty()) {
+        std::map<std::string, double> base = load_baseline(baseline_path);
+        int compared = 0;
+        for (const auto& cr : results) {
+            auto it = base.find(cr.first.name());
+            if (it == base.end() || it->second <= 0.0) continue;
+            ++compared;
+            double ratio = cr.second.mpx_s / it->second;
+            if (ratio < 1.0 - tolerance) {
+                std::printf("REGRESSION %s: %.3f Mpx/s vs baseline %.3f (%.1f%%)\n",
+                            cr.first.name().c_str(), cr.second.mpx_s, it->second, (ratio - 1.0) * 100.0);
+                status = 1;
+            }
+        }
+        std::printf("baseline: %d configs compared, %s\n", compared, status ? "FAILED" : "OK");
+    }
+
+    // 线程扩展把关：512² 基准配置（sr=2/pr=1/topk=25）在最大线程数下的效率。
+    // 小图上输出块过大时线程分不到块，效率会明显掉下来
+    if (min_efficiency > 0.0) {
+        const BenchConfig probe = {512, 2, 1, 25, 0.02, hw};
+        BenchResult serial, parallel;
+        bool have_serial = false, have_parallel = false;
+        for (const auto& cr : results) {
+            if (cr.first.serial_key() != probe.serial_key()) continue;
+            if (cr.first.threads == 1) { serial = cr.second; have_serial = true; }
+            if (cr.first.threads == hw) { parallel = cr.second; have_parallel = true; }
+        }
+        if (!have_serial || !have_parallel) {
+            serial = run_one({512, 2, 1, 25, 0.02, 1}, reps, min_time, block_size, prec);
+            parallel = run_one(probe, reps, min_time, block_size, prec);
+        }
+        const double eff = serial.ms / (parallel.ms * hw);
+        const bool ok = hw == 1 || eff >= min_efficiency;
+        std::printf("scaling 512x512 @ %d threads: %.0f%% (min %.0f%%), %s\n",
+                    hw, eff * 100.0, min_efficiency * 100.0, ok ? "OK" : "FAILED");
+        if (!ok) status = 1;
+    }
+    return status;
+}
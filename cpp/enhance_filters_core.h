@@ -0,0 +1,1154 @@
+// cpp/enhance_filters_core.h
+// DicomEnhancer 等 OpenCV 风格增强算法的纯 C++ 核心（不依赖 Python）：与 cv2 一致的高斯核与边界，
+// 多尺度细节增强 + 光照归一化的融合实现，以及 EdgeProcessor 的边缘算子与图像直方图统计。由 poisson_nlm.cpp 在 poisson_nlm_core.h 之后包含。
+#pragma once
+#include <cfloat>
+#include "poisson_nlm_core.h"
+
+// -------------------- cv2 兼容的高斯核与 BORDER_REFLECT_101 --------------------
+// cv2::BORDER_REFLECT_101 下标映射（gfedcb|abcdefgh|gfedcba），cv2.GaussianBlur 的默认边界
+static inline int reflect101_index(int i, int n) {
+    if (n == 1) return 0;
+    while (i < 0 || i >= n) i = (i < 0) ? -i : (2*n - i - 2);
+    return i;
+}
+
+struct GaussKernel {
+    std::vector<float> w;    // 2r+1 个权重，和为 1
+    int r = 0;
+};
+
+// 同 cv2.getGaussianKernel：ksize<=0 时按 float 图像规则由 sigma 推出（round(8σ+1)|1）；
+// sigma<=0 时由 ksize 推出，且 ksize<=7 用 OpenCV 的固定小核
+static inline GaussKernel cv_gaussian_kernel(int ksize, double sigma) {
+    if (ksize <= 0) ksize = (int)std::lround(sigma * 8.0 + 1.0) | 1;
+    if (ksize % 2 == 0) throw std::runtime_error("gaussian ksize must be odd");
+    GaussKernel g;
+    g.r = ksize / 2;
+    g.w.resize(ksize);
+    static const float small[4][7] = {
+        {1.f},
+        {0.25f, 0.5f, 0.25f},
+        {0.0625f, 0.25f, 0.375f, 0.25f, 0.0625f},
+        {0.03125f, 0.109375f, 0.21875f, 0.28125f, 0.21875f, 0.109375f, 0.03125f}
+    };
+    if (sigma <= 0.0 && ksize <= 7) {
+        for (int i = 0; i < ksize; ++i) g.w[i] = small[ksize / 2][i];
+        return g;
+    }
+    if (sigma <= 0.0) sigma = 0.3 * ((ksize - 1) * 0.5 - 1.0) + 0.8;
+    double sum = 0.0;
+    std::vector<double> t(ksize);
+    for (int i = 0; i < ksize; ++i) {
+        const double x = i - g.r;
+        t[i] = std::exp(-x*x / (2.0*sigma*sigma));
+        sum += t[i];
+    }
+    for (int i = 0; i < ksize; ++i) g.w[i] = (float)(t[i] / sum);
+    return g;
+}
+
+// 一行水平高斯（反射边界）；内部区域走无分支的快速路径
+static inline void gauss_row(const float* in, int W, const GaussKernel& g, float* out) {
+    const int r = g.r;
+    const float* w = g.w.data();
+    const int x_lo = std::min(W, r), x_hi = std::max(x_lo, W - r);
+    for (int x = 0; x < x_lo; ++x) {
+        float s = 0.f;
+        for (int k = -r; k <= r; ++k) s += w[k + r] * in[reflect101_index(x + k, W)];
+        out[x] = s;
+    }
+    for (int x = x_lo; x < x_hi; ++x) {
+        const float* p = in + x - r;
+        float s = 0.f;
+        for (int k = 0; k <= 2*r; ++k) s += w[k] * p[k];
+        out[x] = s;
+    }
+    for (int x = x_hi; x < W; ++x) {
+        float s = 0.f;
+        for (int k = -r; k <= r; ++k) s += w[k + r] * in[reflect101_index(x + k, W)];
+        out[x] = s;
+    }
+}
+
+// 整幅可分离高斯（小图用：光照估计的降采样网格）；tmp 为 H×W 临时区
+static inline void gauss_blur_plane(const float* src, float* dst, float* tmp, int H, int W, const GaussKernel& g) {
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) gauss_row(src + std::size_t(y) * W, W, g, tmp + std::size_t(y) * W);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) {
+        float* o = dst + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) o[x] = 0.f;
+        for (int k = -g.r; k <= g.r; ++k) {
+            const float wk = g.w[k + g.r];
+            const float* s = tmp + std::size_t(reflect101_index(y + k, H)) * W;
+            for (int x = 0; x < W; ++x) o[x] += wk * s[x];
+        }
+    }
+}
+
+// -------------------- 多尺度细节增强 + 光照归一化（DicomEnhancer.advanced/super_enhance 的前三步） --------------------
+// 记 I 为 min-max 归一化图像，h_i = I - G_{σ_i} * I，v = clip(局部方差 / 全图最大值, 0, 1)：
+//   D = clip(I + Σ_i (a_i + b_i·v)·h_i, 0, 1)
+//   L_j = D / (G_{s_j} * D + 1e-6)，L̂_j = clip(L_j / max L_j, 0, 1)
+//   out = clip(w_0·D + Σ_j w_j·L̂_j, 0, 1)
+// 细节与方差按行条带计算（条带缓冲只有几百行），D 直接写入输出；大 σ 的光照模糊在按 2 的幂降采样的网格上做，
+// 再双线性插值回全分辨率。整幅只有输出这一份全尺寸 float 缓冲。
+struct MultiScaleParams {
+    int var_ksize = 0;                          // 局部方差的高斯核尺寸（sigma 由 ksize 推出）；0 表示 v ≡ 0
+    std::vector<double> detail_sigma, detail_a, detail_b;
+    double base_weight = 1.0;                   // w_0
+    std::vector<double> illum_sigma, illum_weight;
+    int illum_decimation = 0;                   // 0：按 σ 自动选择；1：全分辨率（与 cv2 逐像素一致，多一份全尺寸缓冲）
+};
+
+static const int kMultiScaleStripRows = 256;
+
+static inline void validate_multiscale_params(const MultiScaleParams& mp) {
+    if (mp.var_ksize < 0 || (mp.var_ksize > 0 && mp.var_ksize % 2 == 0)) {
+        throw std::runtime_error("var_ksize must be 0 or a positive odd number");
+    }
+    if (mp.detail_a.size() != mp.detail_sigma.size() || mp.detail_b.size() != mp.detail_sigma.size()) {
+        throw std::runtime_error("detail_sigma, detail_a and detail_b must have the same length");
+    }
+    if (mp.illum_weight.size() != mp.illum_sigma.size()) {
+        throw std::runtime_error("illum_sigma and illum_weight must have the same length");
+    }
+    for (double s : mp.detail_sigma) if (!(s > 0.0)) throw std::runtime_error("detail sigmas must be positive");
+    for (double s : mp.illum_sigma) if (!(s > 0.0)) throw std::runtime_error("illumination sigmas must be positive");
+    if (mp.illum_decimation < 0) throw std::runtime_error("illum_decimation must be >= 0");
+}
+
+// 光照模糊的降采样倍数：保持降采样后 σ/f 不小于 2，且网格每边至少 64 格
+static inline int illumination_decimation(double sigma, int requested, int H, int W) {
+    if (requested > 0) return requested;
+    int f = 1;
+    while (sigma / (2.0 * f) >= 2.0 && std::min(H, W) / (2 * f) >= 64) f *= 2;
+    return f;
+}
+
+template <typename T>
+static inline std::pair<double,double> plane_min_max(const Plane<T>& src, int H, int W) {
+    double lo = (double)src(0, 0), hi = lo;
+    #pragma omp parallel
+    {
+        double l = lo, h = hi;
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            for (int x = 0; x < W; ++x) {
+                const double v = (double)src(y, x);
+                if (v < l) l = v;
+                if (v > h) h = v;
+            }
+        }
+        #pragma omp critical(plane_min_max)
+        {
+            if (l < lo) lo = l;
+            if (h > hi) hi = h;
+        }
+    }
+    return std::make_pair(lo, hi);
+}
+
+// 一个条带的工作区：虚拟行 [y0-R, y1+R) 以反射下标取自整幅
+struct MultiScaleStrip {
+    int W = 0, R = 0, y0 = 0, y1 = 0;
+    std::vector<float> img, tmp, tmp2, var, acc_a, acc_b;
+    float* row(std::vector<float>& b, int yv) { return &b[std::size_t(yv - (y0 - R)) * W]; }
+};
+
+template <typename T>
+static inline void multiscale_load_strip(const Plane<T>& src, int H, int W, double dmin, double inv_range,
+                                         MultiScaleStrip& s) {
+    const int n = (s.y1 - s.y0) + 2*s.R;
+    s.img.resize(std::size_t(n) * W);
+    #pragma omp parallel for schedule(static)
+    for (int i = 0; i < n; ++i) {
+        const int y = reflect101_index(s.y0 - s.R + i, H);
+        float* o = &s.img[std::size_t(i) * W];
+        for (int x = 0; x < W; ++x) o[x] = (float)(((double)src(y, x) - dmin) * inv_range);
+    }
+}
+
+// 条带内局部方差：rows [y0, y1) 写入 s.var（未除以全图最大值）
+static inline void multiscale_strip_variance(MultiScaleStrip& s, const GaussKernel& g) {
+    const int W = s.W, r = g.r;
+    const int n = (s.y1 - s.y0) + 2*r;
+    s.tmp.resize(std::size_t(n) * W);
+    s.tmp2.resize(std::size_t(n) * W);
+    s.var.resize(std::size_t(s.y1 - s.y0) * W);
+    #pragma omp parallel
+    {
+        std::vector<float> sq(W);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; ++i) {
+            const float* in = s.row(s.img, s.y0 - r + i);
+            for (int x = 0; x < W; ++x) sq[x] = in[x] * in[x];
+            gauss_row(in, W, g, &s.tmp[std::size_t(i) * W]);
+            gauss_row(sq.data(), W, g, &s.tmp2[std::size_t(i) * W]);
+        }
+        #pragma omp for schedule(static)
+        for (int y = s.y0; y < s.y1; ++y) {
+            float* o = &s.var[std::size_t(y - s.y0) * W];
+            for (int x = 0; x < W; ++x) {
+                float m1 = 0.f, m2 = 0.f;
+                for (int k = 0; k <= 2*r; ++k) {
+                    const std::size_t off = std::size_t(y - s.y0 + k) * W + x;
+                    m1 += g.w[k] * s.tmp[off];
+                    m2 += g.w[k] * s.tmp2[off];
+                }
+                o[x] = m2 - m1*m1;
+            }
+        }
+    }
+}
+
+// 条带内一个尺度：acc_a += a·h，acc_b += b·h
+static inline void multiscale_strip_detail(MultiScaleStrip& s, const GaussKernel& g, float a, float b) {
+    const int W = s.W, r = g.r;
+    const int n = (s.y1 - s.y0) + 2*r;
+    s.tmp.resize(std::size_t(n) * W);
+    #pragma omp parallel
+    {
+        std::vector<float> blur(W);
+        #pragma omp for schedule(static)
+        for (int i = 0; i < n; ++i) gauss_row(s.row(s.img, s.y0 - r + i), W, g, &s.tmp[std::size_t(i) * W]);
+        #pragma omp for schedule(static)
+        for (int y = s.y0; y < s.y1; ++y) {
+            for (int x = 0; x < W; ++x) blur[x] = 0.f;
+            for (int k = 0; k <= 2*r; ++k) {
+                const float wk = g.w[k];
+                const float* t = &s.tmp[std::size_t(y - s.y0 + k) * W];
+                for (int x = 0; x < W; ++x) blur[x] += wk * t[x];
+            }
+            const float* in = s.row(s.img, y);
+            float* pa = &s.acc_a[std::size_t(y - s.y0) * W];
+            float* pb = &s.acc_b[std::size_t(y - s.y0) * W];
+            for (int x = 0; x < W; ++x) {
+                const float h = in[x] - blur[x];
+                pa[x] += a * h;
+                pb[x] += b * h;
+            }
+        }
+    }
+}
+
+// 光照估计 G_σ * D：在 f 倍降采样网格上模糊后双线性插值；返回网格（Hc×Wc）
+struct IlluminationGrid {
+    int f = 1, Hc = 0, Wc = 0;
+    std::vector<float> g;
+    float sample(int y, int x) const {
+        if (f == 1) return g[std::size_t(y) * Wc + x];
+        const float cy = std::min(std::max((y + 0.5f) / f - 0.5f, 0.f), (float)(Hc - 1));
+        const float cx = std::min(std::max((x + 0.5f) / f - 0.5f, 0.f), (float)(Wc - 1));
+        const int y0 = (int)cy, x0 = (int)cx;
+        const int y1 = std::min(y0 + 1, Hc - 1), x1 = std::min(x0 + 1, Wc - 1);
+        const float ty = cy - y0, tx = cx - x0;
+        const float* r0 = &g[std::size_t(y0) * Wc];
+        const float* r1 = &g[std::size_t(y1) * Wc];
+        const float top = r0[x0] + tx * (r0[x1] - r0[x0]);
+        const float bot = r1[x0] + tx * (r1[x1] - r1[x0]);
+        return top + ty * (bot - top);
+    }
+};
+
+static inline IlluminationGrid build_illumination_grid(const float* D, int H, int W, double sigma, int decimation) {
+    IlluminationGrid G;
+    G.f = illumination_decimation(sigma, decimation, H, W);
+    const int f = G.f;
+    G.Hc = (H + f - 1) / f; G.Wc = (W + f - 1) / f;
+    std::vector<float> coarse(std::size_t(G.Hc) * G.Wc), tmp(coarse.size());
+    #pragma omp parallel for schedule(static)
+    for (int yc = 0; yc < G.Hc; ++yc) {
+        const int ya = yc * f, yb = std::min(H, ya + f);
+        for (int xc = 0; xc < G.Wc; ++xc) {
+            const int xa = xc * f, xb = std::min(W, xa + f);
+            double s = 0.0;
+            for (int y = ya; y < yb; ++y) for (int x = xa; x < xb; ++x) s += D[std::size_t(y) * W + x];
+            coarse[std::size_t(yc) * G.Wc + xc] = (float)(s / double((yb - ya) * (xb - xa)));
+        }
+    }
+    G.g.resize(coarse.size());
+    // 块均值（方差 (f²-1)/12）与双线性插值（约 1/6 格²）本身带有平滑，从网格上的 σ 中扣除
+    double sc = sigma / f;
+    if (f > 1) sc = std::sqrt(std::max(0.25, (sigma*sigma - (f*f - 1) / 12.0) / double(f*f) - 1.0 / 6.0));
+    gauss_blur_plane(coarse.data(), G.g.data(), tmp.data(), G.Hc, G.Wc, cv_gaussian_kernel(0, sc));
+    return G;
+}
+
+template <typename T>
+static inline void multiscale_enhance_core(const Plane<T>& src, int H, int W, const MultiScaleParams& mp, float* out) {
+    validate_multiscale_params(mp);
+    if (H <= 0 || W <= 0) return;
+    NLM_SCOPED_TIMER(kStatMultiscale, (long long)H * W);
+    const std::pair<double,double> mm = plane_min_max(src, H, W);
+    // 同 _normalize_image：常数图得到 NaN，这里置 0
+    const double inv_range = mm.second > mm.first ? 1.0 / (mm.second - mm.first) : 0.0;
+
+    const bool use_var = mp.var_ksize > 0;
+    GaussKernel gv;
+    if (use_var) gv = cv_gaussian_kernel(mp.var_ksize, 0.0);
+    std::vector<GaussKernel> gd;
+    int R = use_var ? gv.r : 0;
+    for (double s : mp.detail_sigma) {
+        gd.push_back(cv_gaussian_kernel(0, s));
+        R = std::max(R, gd.back().r);
+    }
+
+    MultiScaleStrip s;
+    s.W = W; s.R = R;
+    // 第 1 遍：全图局部方差最大值（只算方差核，代价小）
+    double vmax = 0.0;
+    if (use_var) {
+        for (int y0 = 0; y0 < H; y0 += kMultiScaleStripRows) {
+            s.y0 = y0; s.y1 = std::min(H, y0 + kMultiScaleStripRows);
+            multiscale_load_strip(src, H, W, mm.first, inv_range, s);
+            multiscale_strip_variance(s, gv);
+            for (float v : s.var) vmax = std::max(vmax, (double)v);
+        }
+    }
+    const float inv_vmax = vmax > 0.0 ? (float)(1.0 / vmax) : 0.f;
+
+    // 第 2 遍：逐条带累加各尺度细节，D 写入 out
+    for (int y0 = 0; y0 < H; y0 += kMultiScaleStripRows) {
+        s.y0 = y0; s.y1 = std::min(H, y0 + kMultiScaleStripRows);
+        const std::size_t n = std::size_t(s.y1 - s.y0) * W;
+        multiscale_load_strip(src, H, W, mm.first, inv_range, s);
+        if (use_var) multiscale_strip_variance(s, gv);
+        s.acc_a.assign(n, 0.f);
+        s.acc_b.assign(n, 0.f);
+        for (std::size_t i = 0; i < gd.size(); ++i) {
+            multiscale_strip_detail(s, gd[i], (float)mp.detail_a[i], (float)mp.detail_b[i]);
+        }
+        #pragma omp parallel for schedule(static)
+        for (int y = s.y0; y < s.y1; ++y) {
+            const std::size_t off = std::size_t(y - s.y0) * W;
+            const float* in = s.row(s.img, y);
+            float* o = out + std::size_t(y) * W;
+            for (int x = 0; x < W; ++x) {
+                const float v = use_var ? std::min(std::max(s.var[off + x] * inv_vmax, 0.f), 1.f) : 0.f;
+                o[x] = std::min(std::max(in[x] + s.acc_a[off + x] + v * s.acc_b[off + x], 0.f), 1.f);
+            }
+        }
+    }
+    // 条带缓冲到此不再需要
+    s = MultiScaleStrip();
+
+    if (mp.illum_sigma.empty()) {
+        if (mp.base_weight != 1.0) {
+            const float w0 = (float)mp.base_weight;
+            #pragma omp parallel for schedule(static)
+            for (int y = 0; y < H; ++y) {
+                float* o = out + std::size_t(y) * W;
+                for (int x = 0; x < W; ++x) o[x] = std::min(std::max(w0 * o[x], 0.f), 1.f);
+            }
+        }
+        return;
+    }
+
+    // 第 3 遍：各光照尺度的 max(D / (G*D + 1e-6))
+    const int J = (int)mp.illum_sigma.size();
+    std::vector<IlluminationGrid> grids;
+    for (int j = 0; j < J; ++j) grids.push_back(build_illumination_grid(out, H, W, mp.illum_sigma[j], mp.illum_decimation));
+    std::vector<double> lmax(J, 0.0);
+    #pragma omp parallel
+    {
+        std::vector<double> local(J, 0.0);
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            const float* d = out + std::size_t(y) * W;
+            for (int j = 0; j < J; ++j) {
+                double m = local[j];
+                for (int x = 0; x < W; ++x) m = std::max(m, (double)(d[x] / (grids[j].sample(y, x) + 1e-6f)));
+                local[j] = m;
+            }
+        }
+        #pragma omp critical(multiscale_illum_max)
+        {
+            for (int j = 0; j < J; ++j) lmax[j] = std::max(lmax[j], local[j]);
+        }
+    }
+
+    // 第 4 遍：就地融合
+    std::vector<float> scale(J);
+    for (int j = 0; j < J; ++j) scale[j] = lmax[j] > 0.0 ? (float)(1.0 / lmax[j]) : 0.f;
+    const float w0 = (float)mp.base_weight;
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) {
+        float* o = out + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) {
+            const float d = o[x];
+            float acc = w0 * d;
+            for (int j = 0; j < J; ++j) {
+                const float l = d / (grids[j].sample(y, x) + 1e-6f) * scale[j];
+                acc += (float)mp.illum_weight[j] * std::min(std::max(l, 0.f), 1.f);
+            }
+            o[x] = std::min(std::max(acc, 0.f), 1.f);
+        }
+    }
+}
+
+// -------------------- 窗宽窗位自适应增强（WindowBasedEnhancer.window_based_enhance） --------------------
+// CLAHE 之前（prepare）与之后（finish）两段；CLAHE 本身仍由 cv2 完成。
+// prepare 的统计只需两遍并行归约：第 1 遍给出 min/max/ROI 像素数（verbose 时附带均值与标准差），
+// 第 2 遍按条带计算 7×7 局部方差，同时得到其最大值与 ROI 内 Σmax(var, 0)，即噪声水平
+//   noise = mean_ROI(clip(var / (max + 1e-8), 0, 1))。
+// 第 3 遍按条带做 ROI 权重（21×21、σ=7 的可分离高斯）与两个尺度的细节，写出 D；
+// 光照 σ=50 在降采样网格上估计（同 multiscale_enhance_core），最后一遍融合、gamma 并量化为 uint16。
+struct WindowEnhanceInfo {
+    double data_min = 0.0, data_max = 0.0;
+    long long roi_pixels = 0;
+    double roi_ratio = 0.0, noise_level = 0.0, gamma = 0.8;
+    double strength_small = 0.0, strength_large = 0.0;
+    // 以下仅 verbose 时计算
+    double mean = 0.0, std = 0.0, high_noise_ratio = 0.0;
+    double weight_min = 0.0, weight_max = 0.0, detail_min = 0.0, detail_max = 0.0, detail_mean = 0.0;
+};
+
+template <typename T>
+static inline void window_enhance_prepare_core(const Plane<T>& src, int H, int W, double window_width, double window_level,
+                                               bool verbose, int illum_decimation, std::uint16_t* out,
+                                               WindowEnhanceInfo* info) {
+    if (H <= 0 || W <= 0) throw std::runtime_error("data must be non-empty");
+    if (illum_decimation < 0) throw std::runtime_error("illum_decimation must be >= 0");
+    NLM_SCOPED_TIMER(kStatWindowEnhance, (long long)H * W);
+    const double wl_min = window_level - window_width / 2.0, wl_max = window_level + window_width / 2.0;
+    const double N = double(H) * W;
+    WindowEnhanceInfo& st = *info;
+
+    // 第 1 遍：范围、ROI 像素数（与可选的一、二阶矩）
+    double dmin = (double)src(0, 0), dmax = dmin, sum = 0.0, sum2 = 0.0;
+    long long roi = 0;
+    #pragma omp parallel
+    {
+        double lo = dmin, hi = dmax, s1 = 0.0, s2 = 0.0;
+        long long n = 0;
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            for (int x = 0; x < W; ++x) {
+                const double v = (double)src(y, x);
+                if (v < lo) lo = v;
+                if (v > hi) hi = v;
+                n += (v >= wl_min && v <= wl_max) ? 1 : 0;
+                if (verbose) { s1 += v; s2 += v*v; }
+            }
+        }
+        #pragma omp critical(window_enhance_stats)
+        {
+            if (lo < dmin) dmin = lo;
+            if (hi > dmax) dmax = hi;
+            roi += n; sum += s1; sum2 += s2;
+        }
+    }
+    st.data_min = dmin; st.data_max = dmax;
+    st.roi_pixels = roi;
+    st.roi_ratio = roi / N;
+    if (verbose) {
+        st.mean = sum / N;
+        st.std = std::sqrt(std::max(0.0, sum2 / N - st.mean * st.mean));
+    }
+    const double inv_range = dmax > dmin ? 1.0 / (dmax - dmin) : 0.0;
+    auto in_roi = [&](int y, int x) {
+        const double v = (double)src(y, x);
+        return v >= wl_min && v <= wl_max;
+    };
+
+    // 第 2 遍：局部方差的最大值与 ROI 内（ROI 为空时为全图）的正部之和
+    const GaussKernel gv = cv_gaussian_kernel(7, 0.0);
+    const GaussKernel gw = cv_gaussian_kernel(21, 7.0);
+    const GaussKernel gs = cv_gaussian_kernel(0, 1.0), gl = cv_gaussian_kernel(0, 5.0);
+    MultiScaleStrip s;
+    s.W = W;
+    s.R = std::max(std::max(gv.r, gw.r), std::max(gs.r, gl.r));
+    double vmax = -1e300, var_roi = 0.0, var_all = 0.0;
+    for (int y0 = 0; y0 < H; y0 += kMultiScaleStripRows) {
+        s.y0 = y0; s.y1 = std::min(H, y0 + kMultiScaleStripRows);
+        multiscale_load_strip(src, H, W, dmin, inv_range, s);
+        multiscale_strip_variance(s, gv);
+        #pragma omp parallel
+        {
+            double m = -1e300, sr = 0.0, sa = 0.0;
+            #pragma omp for schedule(static)
+            for (int y = s.y0; y < s.y1; ++y) {
+                const float* v = &s.var[std::size_t(y - s.y0) * W];
+                for (int x = 0; x < W; ++x) {
+                    const double p = std::max(0.f, v[x]);
+                    if (v[x] > m) m = v[x];
+                    sa += p;
+                    if (in_roi(y, x)) sr += p;
+                }
+            }
+            #pragma omp critical(window_enhance_var)
+            {
+                if (m > vmax) vmax = m;
+                var_roi += sr; var_all += sa;
+            }
+        }
+    }
+    const double vden = vmax + 1e-8;
+    st.noise_level = (roi > 0 ? var_roi / roi : var_all / N) / vden;
+
+    double bs, bl;
+    if (st.noise_level > 0.1) { bs = 0.8; bl = 0.4; }
+    else if (st.noise_level > 0.05) { bs = 1.2; bl = 0.6; }
+    else { bs = 1.5; bl = 0.8; }
+    st.strength_small = bs; st.strength_large = bl;
+    st.gamma = st.noise_level > 0.1 ? 0.9 : 0.8;
+
+    // 第 3 遍：D = clip(I + (bs·w + 0.3(1-w))·h_s + (bl·w + 0.2(1-w))·h_l, 0, 1)
+    //        = clip(I + [0.3 h_s + 0.2 h_l] + w·[(bs-0.3) h_s + (bl-0.2) h_l], 0, 1)
+    std::vector<float> D(std::size_t(H) * W);
+    double wmin = 1e300, wmax = -1e300, dmn = 1e300, dmx = -1e300, dsum = 0.0;
+    long long high_noise = 0;
+    std::vector<float> mask_h, weight;
+    for (int y0 = 0; y0 < H; y0 += kMultiScaleStripRows) {
+        s.y0 = y0; s.y1 = std::min(H, y0 + kMultiScaleStripRows);
+        const int rows = s.y1 - s.y0;
+        const std::size_t n = std::size_t(rows) * W;
+        multiscale_load_strip(src, H, W, dmin, inv_range, s);
+        // ROI 权重：掩膜的水平模糊 → 垂直模糊
+        const int nw = rows + 2*gw.r;
+        mask_h.resize(std::size_t(nw) * W);
+        weight.resize(n);
+        #pragma omp parallel
+        {
+            std::vector<float> m(W);
+            #pragma omp for schedule(static)
+            for (int i = 0; i < nw; ++i) {
+                const int y = reflect101_index(s.y0 - gw.r + i, H);
+                for (int x = 0; x < W; ++x) m[x] = in_roi(y, x) ? 1.f : 0.f;
+                gauss_row(m.data(), W, gw, &mask_h[std::size_t(i) * W]);
+            }
+            #pragma omp for schedule(static)
+            for (int y = s.y0; y < s.y1; ++y) {
+                float* o = &weight[std::size_t(y - s.y0) * W];
+                for (int x = 0; x < W; ++x) o[x] = 0.f;
+                for (int k = 0; k <= 2*gw.r; ++k) {
+                    const float wk = gw.w[k];
+                    const float* t = &mask_h[std::size_t(y - s.y0 + k) * W];
+                    for (int x = 0; x < W; ++x) o[x] += wk * t[x];
+                }
+            }
+        }
+        s.acc_a.assign(n, 0.f);
+        s.acc_b.assign(n, 0.f);
+        multiscale_strip_detail(s, gs, 0.3f, (float)(bs - 0.3));
+        multiscale_strip_detail(s, gl, 0.2f, (float)(bl - 0.2));
+        if (verbose) multiscale_strip_variance(s, gv);
+        #pragma omp parallel
+        {
+            double w_lo = 1e300, w_hi = -1e300, d_lo = 1e300, d_hi = -1e300, d_sum = 0.0;
+            long long hn = 0;
+            #pragma omp for schedule(static)
+            for (int y = s.y0; y < s.y1; ++y) {
+                const std::size_t off = std::size_t(y - s.y0) * W;
+                const float* in = s.row(s.img, y);
+                float* d = &D[std::size_t(y) * W];
+                for (int x = 0; x < W; ++x) {
+                    const float w = weight[off + x];
+                    d[x] = std::min(std::max(in[x] + s.acc_a[off + x] + w * s.acc_b[off + x], 0.f), 1.f);
+                    if (verbose) {
+                        w_lo = std::min(w_lo, (double)w); w_hi = std::max(w_hi, (double)w);
+                        d_lo = std::min(d_lo, (double)d[x]); d_hi = std::max(d_hi, (double)d[x]);
+                        d_sum += d[x];
+                        if (in_roi(y, x) && s.var[off + x] / vden > 0.5) ++hn;
+                    }
+                }
+            }
+            if (verbose) {
+                #pragma omp critical(window_enhance_detail)
+                {
+                    wmin = std::min(wmin, w_lo); wmax = std::max(wmax, w_hi);
+                    dmn = std::min(dmn, d_lo); dmx = std::max(dmx, d_hi);
+                    dsum += d_sum; high_noise += hn;
+                }
+            }
+        }
+    }
+    s = MultiScaleStrip();
+    std::vector<float>().swap(mask_h);
+    std::vector<float>().swap(weight);
+    if (verbose) {
+        st.weight_min = wmin; st.weight_max = wmax;
+        st.detail_min = dmn; st.detail_max = dmx; st.detail_mean = dsum / N;
+        st.high_noise_ratio = roi > 0 ? double(high_noise) / roi : 0.0;
+    }
+
+    // 光照 σ=50 与最终融合：L = clip(D / clip(G*D, 0.1, 1), 0, 2)，M = clip(0.3L + 0.7D, 0, 1)，输出 M^γ·65535
+    const IlluminationGrid G = build_illumination_grid(D.data(), H, W, 50.0, illum_decimation);
+    const float gamma = (float)st.gamma;
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) {
+        const float* d = &D[std::size_t(y) * W];
+        std::uint16_t* o = out + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) {
+            const float il = std::min(std::max(G.sample(y, x), 0.1f), 1.f);
+            const float l = std::min(std::max(d[x] / il, 0.f), 2.f);
+            const float m = std::min(std::max(0.3f * l + 0.7f * d[x], 0.f), 1.f);
+            o[x] = (std::uint16_t)(std::pow(m, gamma) * 65535.f);
+        }
+    }
+}
+
+// CLAHE 结果线性映射回输入范围 [data_min, data_max]，再与原图按 alpha 混合并截断为 uint16
+template <typename T>
+static inline void window_enhance_finish_core(const Plane<std::uint16_t>& clahe, const Plane<T>& src, int H, int W,
+                                              double data_min, double data_max, double alpha, std::uint16_t* out) {
+    NLM_SCOPED_TIMER(kStatWindowEnhance, (long long)H * W);
+    const std::pair<double,double> cm = plane_min_max(clahe, H, W);
+    const float scale = cm.second > cm.first ? (float)((data_max - data_min) / (cm.second - cm.first)) : 0.f;
+    const float cmin = (float)cm.first, dmin = (float)data_min, dmax = (float)data_max;
+    const float a = (float)alpha, b = (float)(1.0 - alpha);
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) {
+        std::uint16_t* o = out + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) {
+            const float r = ((float)clahe(y, x) - cmin) * scale + dmin;
+            const float v = std::min(std::max(a * r + b * (float)src(y, x), dmin), dmax);
+            o[x] = (std::uint16_t)std::min(std::max(v, 0.f), 65535.f);
+        }
+    }
+}
+
+// -------------------- 边缘算子（EdgeProcessor：Sobel / Laplacian / Roberts / 边缘增强） --------------------
+// 模板同 skimage.filters 的 sobel_h/sobel_v、laplace、roberts（mode='reflect'，3×3 邻域下即边界夹取，不清零边框）。
+// 邻域在 int32 下精确求和后转 float 开方，按行计算幅值：第一遍只归约幅值与输入的最小/最大值，
+// 第二遍重算幅值并直接写出归一化结果（及可选的边缘增强混合），不产生整幅浮点临时图。
+// AVX2 行核与标量行核的浮点运算顺序相同，结果逐位一致。
+enum { kEdgeSobel = 0, kEdgeLaplacian = 1, kEdgeRoberts = 2 };
+static const double kEdgeSqrt2 = 1.4142135623730951;
+
+static inline int parse_edge_operator(const std::string& name) {
+    if (name == "sobel") return kEdgeSobel;
+    if (name == "laplacian" || name == "laplace") return kEdgeLaplacian;
+    if (name == "roberts") return kEdgeRoberts;
+    throw std::runtime_error("edge operator must be 'sobel', 'laplacian' or 'roberts': " + name);
+}
+
+// 单像素幅值。r0/r1/r2 为第 y-1/y/y+1 行（已夹取到图内），xl/xr 为夹取后的左右列；Roberts 只用 r1/r2 与 xr
+static inline float edge_value(int op, const std::uint16_t* r0, const std::uint16_t* r1, const std::uint16_t* r2,
+                               int xl, int x, int xr) {
+    if (op == kEdgeSobel) {
+        const int h = (r0[xl] + 2*r0[x] + r0[xr]) - (r2[xl] + 2*r2[x] + r2[xr]);
+        const int v = (r0[xl] + 2*r1[xl] + r2[xl]) - (r0[xr] + 2*r1[xr] + r2[xr]);
+        const float hf = (float)h * 0.25f, vf = (float)v * 0.25f;
+        return std::sqrt(hf*hf + vf*vf);
+    }
+    if (op == kEdgeLaplacian) {
+        const int l = 4*r1[x] - r0[x] - r2[x] - r1[xl] - r1[xr];
+        return (float)std::abs(l);
+    }
+    // 同 skimage：float32 幅值原地除以 float64 的 √2
+    const float pd = (float)((int)r2[xr] - (int)r1[x]), nd = (float)((int)r2[x] - (int)r1[xr]);
+    return (float)((double)std::sqrt(pd*pd + nd*nd) / kEdgeSqrt2);
+}
+
+#ifdef NLM_SIMD_X86
+NLM_TARGET("avx2")
+static inline __m256i edge_load8(const std::uint16_t* p) {
+    return _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)p));
+}
+
+// 每次 8 个像素，邻列直接偏移加载；返回已处理的列区间 [*x_begin, 返回值)
+NLM_TARGET("avx2")
+static inline int edge_row_avx2(int op, const std::uint16_t* r0, const std::uint16_t* r1, const std::uint16_t* r2,
+                                int W, float* mag, int* x_begin) {
+    int x = (op == kEdgeRoberts) ? 0 : 1;
+    *x_begin = x;
+    if (op == kEdgeSobel) {
+        const __m256 q = _mm256_set1_ps(0.25f);
+        for (; x + 9 <= W; x += 8) {
+            const __m256i a = edge_load8(r0 + x - 1), b = edge_load8(r0 + x), c = edge_load8(r0 + x + 1);
+            const __m256i d = edge_load8(r1 + x - 1), f = edge_load8(r1 + x + 1);
+            const __m256i g = edge_load8(r2 + x - 1), e = edge_load8(r2 + x), i = edge_load8(r2 + x + 1);
+            const __m256i h = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(a, c), _mm256_slli_epi32(b, 1)),
+                                               _mm256_add_epi32(_mm256_add_epi32(g, i), _mm256_slli_epi32(e, 1)));
+            const __m256i v = _mm256_sub_epi32(_mm256_add_epi32(_mm256_add_epi32(a, g), _mm256_slli_epi32(d, 1)),
+                                               _mm256_add_epi32(_mm256_add_epi32(c, i), _mm256_slli_epi32(f, 1)));
+            const __m256 hf = _mm256_mul_ps(_mm256_cvtepi32_ps(h), q), vf = _mm256_mul_ps(_mm256_cvtepi32_ps(v), q);
+            _mm256_storeu_ps(mag + x, _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(hf, hf), _mm256_mul_ps(vf, vf))));
+        }
+    } else if (op == kEdgeLaplacian) {
+        for (; x + 9 <= W; x += 8) {
+            const __m256i c = edge_load8(r1 + x);
+            __m256i l = _mm256_slli_epi32(c, 2);
+            l = _mm256_sub_epi32(l, _mm256_add_epi32(edge_load8(r0 + x), edge_load8(r2 + x)));
+            l = _mm256_sub_epi32(l, _mm256_add_epi32(edge_load8(r1 + x - 1), edge_load8(r1 + x + 1)));
+            _mm256_storeu_ps(mag + x, _mm256_cvtepi32_ps(_mm256_abs_epi32(l)));
+        }
+    } else {
+        const __m256d s2 = _mm256_set1_pd(kEdgeSqrt2);
+        for (; x + 9 <= W; x += 8) {
+            const __m256 pd = _mm256_cvtepi32_ps(_mm256_sub_epi32(edge_load8(r2 + x + 1), edge_load8(r1 + x)));
+            const __m256 nd = _mm256_cvtepi32_ps(_mm256_sub_epi32(edge_load8(r2 + x), edge_load8(r1 + x + 1)));
+            const __m256 m = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(pd, pd), _mm256_mul_ps(nd, nd)));
+            const __m128 lo = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(m)), s2));
+            const __m128 hi = _mm256_cvtpd_ps(_mm256_div_pd(_mm256_cvtps_pd(_mm256_extractf128_ps(m, 1)), s2));
+            _mm256_storeu_ps(mag + x, _mm256_insertf128_ps(_mm256_castps128_ps256(lo), hi, 1));
+        }
+    }
+    return x;
+}
+#endif
+
+// 当前块距离实现不是 "scalar" 且 CPU 支持 AVX2 时走 SIMD 行核（set_simd_backend("scalar") 可强制标量以便比对）
+static inline bool edge_simd_enabled() {
+#ifdef NLM_SIMD_X86
+    return std::strcmp(current_row_distance().name, "scalar") != 0 && cpu_has_avx2();
+#else
+    return false;
+#endif
+}
+
+// 一行幅值
+static inline void edge_row(int op, const std::uint16_t* r0, const std::uint16_t* r1, const std::uint16_t* r2,
+                            int W, bool simd, float* mag) {
+    int xb = 0, xe = 0;   // [xb, xe) 已由 SIMD 完成
+#ifdef NLM_SIMD_X86
+    if (simd) xe = edge_row_avx2(op, r0, r1, r2, W, mag, &xb);
+#else
+    (void)simd;
+#endif
+    for (int x = 0; x < W; ++x) {
+        if (x == xb && xe > xb) { x = xe - 1; continue; }
+        mag[x] = edge_value(op, r0, r1, r2, std::max(x - 1, 0), x, std::min(x + 1, W - 1));
+    }
+}
+
+// 第 y 行（夹取到 [0, H)）的连续指针：行内连续时直接引用，否则拷进 buf
+static inline const std::uint16_t* edge_src_row(const Plane<std::uint16_t>& src, int y, int H, int W,
+                                                std::uint16_t* buf) {
+    y = std::min(std::max(y, 0), H - 1);
+    if (src.sx == 1) return src.p + y * src.sy;
+    for (int x = 0; x < W; ++x) buf[x] = src(y, x);
+    return buf;
+}
+
+struct EdgeRowBuffers {
+    std::vector<std::uint16_t> rows;   // 非连续输入时三行的拷贝
+    std::vector<float> mag;
+    const std::uint16_t *r0 = nullptr, *r1 = nullptr, *r2 = nullptr;
+
+    explicit EdgeRowBuffers(int W) : rows(std::size_t(3) * W), mag(W) {}
+
+    // Sobel/Laplacian 取 y-1/y/y+1 行，Roberts 取 y/y+1 行
+    void load(const Plane<std::uint16_t>& src, int op, int y, int H, int W) {
+        const int up = (op == kEdgeRoberts) ? y : y - 1;
+        r0 = edge_src_row(src, up, H, W, rows.data());
+        r1 = edge_src_row(src, y, H, W, rows.data() + W);
+        r2 = edge_src_row(src, y + 1, H, W, rows.data() + 2 * W);
+    }
+};
+
+// 边缘幅值 → uint16：normalize 时线性映射到输入的 [min, max]（同 EdgeProcessor：幅值为常数时不映射），
+// 否则截断到 [0, 65535]。blend_out 非空时同一遍写出 edge_enhancement 的结果：
+// data + strength · (edge / max(edge)) · max(data) · 0.1，其中 edge 为未归一化的 uint16 幅值
+static inline void edge_filter_core(const Plane<std::uint16_t>& src, int H, int W, int op, bool normalize,
+                                    std::uint16_t* out, double blend_strength, std::uint16_t* blend_out) {
+    if (H <= 0 || W <= 0) throw std::runtime_error("data must be non-empty");
+    NLM_SCOPED_TIMER(kStatEdge, (long long)H * W);
+    const bool simd = edge_simd_enabled();
+    const bool need_stats = normalize || blend_out;
+
+    // 第一遍：幅值与输入的最小/最大值
+    float mag_min = 0.f, mag_max = 0.f;
+    int data_min = 0, data_max = 0;
+    if (need_stats) {
+        mag_min = HUGE_VALF; mag_max = -HUGE_VALF;
+        data_min = 65535; data_max = 0;
+        #pragma omp parallel
+        {
+            EdgeRowBuffers b(W);
+            float lo = HUGE_VALF, hi = -HUGE_VALF;
+            int dlo = 65535, dhi = 0;
+            #pragma omp for schedule(static)
+            for (int y = 0; y < H; ++y) {
+                b.load(src, op, y, H, W);
+                edge_row(op, b.r0, b.r1, b.r2, W, simd, b.mag.data());
+                for (int x = 0; x < W; ++x) {
+                    const float m = b.mag[x];
+                    lo = std::min(lo, m); hi = std::max(hi, m);
+                    const int v = b.r1[x];
+                    dlo = std::min(dlo, v); dhi = std::max(dhi, v);
+                }
+            }
+            #pragma omp critical(edge_filter_stats)
+            {
+                mag_min = std::min(mag_min, lo); mag_max = std::max(mag_max, hi);
+                data_min = std::min(data_min, dlo); data_max = std::max(data_max, dhi);
+            }
+        }
+    }
+
+    // 第二遍：重算幅值并写出。运算顺序与 numpy float32 版一致：((m - min) / (max - min)) · (dmax - dmin) + dmin
+    const bool map_range = normalize && mag_max > mag_min;
+    const float rng = mag_max - mag_min, drange = float(data_max - data_min), dmin = float(data_min);
+    // 未归一化边缘图的最大值（uint16 截断后）；为 0 时不除
+    const float edge_max = std::floor(std::min(std::max(mag_max, 0.f), 65535.f));
+    const float gain = float(blend_strength), dmax01 = float(data_max), tenth = 0.1f;
+    #pragma omp parallel
+    {
+        EdgeRowBuffers b(W);
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            b.load(src, op, y, H, W);
+            float* m = b.mag.data();
+            edge_row(op, b.r0, b.r1, b.r2, W, simd, m);
+            if (out) {
+                std::uint16_t* o = out + std::size_t(y) * W;
+                for (int x = 0; x < W; ++x) {
+                    float v = m[x];
+                    if (map_range) v = ((v - mag_min) / rng) * drange + dmin;
+                    o[x] = (std::uint16_t)std::min(std::max(v, 0.f), 65535.f);
+                }
+            }
+            if (blend_out) {
+                std::uint16_t* o = blend_out + std::size_t(y) * W;
+                for (int x = 0; x < W; ++x) {
+                    float e = (float)(std::uint16_t)std::min(std::max(m[x], 0.f), 65535.f);
+                    if (edge_max > 0.f) e = e / edge_max;
+                    const float v = (float)b.r1[x] + ((gain * e) * dmax01) * tenth;
+                    o[x] = (std::uint16_t)std::min(std::max(v, 0.f), 65535.f);
+                }
+            }
+        }
+    }
+}
+
+// -------------------- Canny（skimage.feature.canny 的默认路径） --------------------
+// 1) 图像 /65535 后做常数 0 边界的高斯（truncate=4），再除以同样模糊的全 1 掩膜（边缘补偿）；
+// 2) scipy.ndimage.sobel（未归一化，reflect 边界）的 isobel/jsobel 与幅值 sqrt(i² + j²)；
+// 3) 去掉最外一圈后按梯度方向双线性插值做非极大值抑制，幅值 < low 的像素不参与；
+// 4) 滞后阈值：保留含有幅值 ≥ high 像素的 8 连通分量。
+// 一维相关按 scipy 对称核的累加顺序（中心项起，由外向内逐对相加）以 double 计算、float 存储。
+// 只用两个整幅 float 平面（平滑图、幅值），状态直接记在输出缓冲里。
+static inline std::vector<double> canny_gaussian_weights(double sigma, int* radius) {
+    const int r = int(4.0 * sigma + 0.5);
+    std::vector<double> w(2 * r + 1);
+    double sum = 0.0;
+    for (int i = -r; i <= r; ++i) { w[i + r] = std::exp(-0.5 / (sigma * sigma) * double(i) * i); sum += w[i + r]; }
+    for (double& v : w) v /= sum;
+    *radius = r;
+    return w;
+}
+
+// 对称核一维相关：f(i) 取第 i 个输入（越界为 0，由调用方判断）
+template <class F>
+static inline double canny_symmetric_tap(const double* wc, int r, int c, int n, F f) {
+    double a = f(c) * wc[0];
+    for (int j = r; j >= 1; --j) {
+        const double lo = (c - j >= 0) ? f(c - j) : 0.0;
+        const double hi = (c + j < n) ? f(c + j) : 0.0;
+        a += (lo + hi) * wc[j];
+    }
+    return a;
+}
+
+// 平滑图 S 在 (y, x) 处的 scipy 式 Sobel 分量（3×3 邻域，reflect 边界即夹取）
+static inline void canny_gradient(const float* S, int H, int W, int y, int x, float* gi, float* gj) {
+    const int ym = std::max(y - 1, 0), yp = std::min(y + 1, H - 1);
+    const int xm = std::max(x - 1, 0), xp = std::min(x + 1, W - 1);
+    const float* rm = S + std::size_t(ym) * W;
+    const float* r0 = S + std::size_t(y) * W;
+    const float* rp = S + std::size_t(yp) * W;
+    // 先沿求导轴差分（存为 float），再沿另一轴 [1, 2, 1] 平滑
+    const float di_l = float(double(rp[xm]) - rm[xm]), di_c = float(double(rp[x]) - rm[x]), di_r = float(double(rp[xp]) - rm[xp]);
+    const float dj_u = float(double(rm[xp]) - rm[xm]), dj_c = float(double(r0[xp]) - r0[xm]), dj_d = float(double(rp[xp]) - rp[xm]);
+    *gi = float(double(di_c) * 2.0 + (double(di_l) + di_r));
+    *gj = float(double(dj_c) * 2.0 + (double(dj_u) + dj_d));
+}
+
+static inline void canny_edge_core(const Plane<std::uint16_t>& src, int H, int W, double sigma,
+                                   double low_threshold, double high_threshold, std::uint16_t* out) {
+    if (H <= 0 || W <= 0) throw std::runtime_error("data must be non-empty");
+    if (!(sigma > 0.0)) throw std::runtime_error("sigma must be positive");
+    if (!(low_threshold >= 0.0) || !(high_threshold >= low_threshold)) {
+        throw std::runtime_error("thresholds must satisfy 0 <= low_threshold <= high_threshold");
+    }
+    NLM_SCOPED_TIMER(kStatEdge, (long long)H * W);
+    const std::size_t N = std::size_t(H) * W;
+    int r = 0;
+    const std::vector<double> w = canny_gaussian_weights(sigma, &r);
+    const double* wc = w.data() + r;   // 中心权重，wc[j] == wc[-j]
+
+    // 全 1 掩膜的纵向模糊只与行有关
+    std::vector<float> bleed_y(H);
+    for (int y = 0; y < H; ++y) bleed_y[y] = float(canny_symmetric_tap(wc, r, y, H, [](int) { return 1.0; }));
+
+    // 1) 纵向（axis 0）再横向（axis 1）
+    std::vector<float> S(N), T(N);
+    NLM_STAT_ADD(kStatBytesAllocated, 2 * N * sizeof(float));
+    #pragma omp parallel
+    {
+        std::vector<double> acc(W);
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            auto u = [&](int yy, int x) { return double(float(src(yy, x)) / 65535.f); };
+            for (int x = 0; x < W; ++x) acc[x] = u(y, x) * wc[0];
+            for (int j = r; j >= 1; --j) {
+                const bool has_lo = y - j >= 0, has_hi = y + j < H;
+                for (int x = 0; x < W; ++x) {
+                    const double lo = has_lo ? u(y - j, x) : 0.0, hi = has_hi ? u(y + j, x) : 0.0;
+                    acc[x] += (lo + hi) * wc[j];
+                }
+            }
+            float* t = T.data() + std::size_t(y) * W;
+            for (int x = 0; x < W; ++x) t[x] = float(acc[x]);
+        }
+        // 掩膜的横向模糊：同一线程的行连续，内部行的纵向值相同，行缓存只在其变化时重算
+        std::vector<float> bleed(W);
+        float bleed_for = -1.f;
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            if (bleed_y[y] != bleed_for) {
+                bleed_for = bleed_y[y];
+                const double by = bleed_for;
+                for (int x = 0; x < W; ++x) {
+                    bleed[x] = float(canny_symmetric_tap(wc, r, x, W, [by](int) { return by; })) + FLT_EPSILON;
+                }
+            }
+            const float* t = T.data() + std::size_t(y) * W;
+            float* s = S.data() + std::size_t(y) * W;
+            for (int x = 0; x < W; ++x) {
+                s[x] = float(canny_symmetric_tap(wc, r, x, W, [t](int i) { return double(t[i]); })) / bleed[x];
+            }
+        }
+        // 2) 幅值（写回 T）
+        #pragma omp for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            float* m = T.data() + std::size_t(y) * W;
+            for (int x = 0; x < W; ++x) {
+                float gi, gj;
+                canny_gradient(S.data(), H, W, y, x, &gi, &gj);
+                m[x] = std::sqrt(gi * gi + gj * gj);
+            }
+        }
+    }
+    const float* M = T.data();
+
+    // 3) 非极大值抑制：状态 0 无，1 弱边缘候选，2 强边缘（暂存在 out 中）
+    const float lo = float(low_threshold), hi = float(high_threshold);
+    std::fill(out, out + N, std::uint16_t(0));
+    #pragma omp parallel for schedule(static)
+    for (int y = 1; y < H - 1; ++y) {
+        for (int x = 1; x < W - 1; ++x) {
+            const float m = M[std::size_t(y) * W + x];
+            if (!(m >= lo)) continue;
+            float gi, gj;
+            canny_gradient(S.data(), H, W, y, x, &gi, &gj);
+            const bool up = gi >= 0.f, down = gi <= 0.f, right = gj >= 0.f, left = gj <= 0.f;
+            const bool cond1 = (up && right) || (down && left);
+            const bool cond2 = (down && right) || (up && left);
+            if (!cond1 && !cond2) continue;
+            const float ai = std::fabs(gi), aj = std::fabs(gj);
+            float wgt;
+            int n11y, n11x, n12y, n12x, n21y, n21x, n22y, n22x;
+            if (cond1) {
+                if (ai > aj) {
+                    wgt = aj / ai;
+                    n11y = 1;  n11x = 0;  n12y = 1;  n12x = 1;  n21y = -1; n21x = 0;  n22y = -1; n22x = -1;
+                } else {
+                    wgt = ai / aj;
+                    n11y = 0;  n11x = 1;  n12y = 1;  n12x = 1;  n21y = 0;  n21x = -1; n22y = -1; n22x = -1;
+                }
+            } else {
+                if (ai < aj) {
+                    wgt = ai / aj;
+                    n11y = 0;  n11x = 1;  n12y = -1; n12x = 1;  n21y = 0;  n21x = -1; n22y = 1;  n22x = -1;
+                } else {
+                    wgt = aj / ai;
+                    n11y = -1; n11x = 0;  n12y = -1; n12x = 1;  n21y = 1;  n21x = 0;  n22y = 1;  n22x = -1;
+                }
+            }
+            auto at = [&](int dy, int dx) { return M[std::size_t(y + dy) * W + (x + dx)]; };
+            if (!(wgt * at(n12y, n12x) + (1.f - wgt) * at(n11y, n11x) <= m)) continue;
+            if (!(wgt * at(n22y, n22x) + (1.f - wgt) * at(n21y, n21x) <= m)) continue;
+            out[std::size_t(y) * W + x] = (m >= hi) ? 2 : 1;
+        }
+    }
+
+    // 4) 滞后阈值：从强边缘出发沿 8 邻域吸收弱边缘（已吸收记为 3）
+    std::vector<int> stack;
+    for (std::size_t i = 0; i < N; ++i) {
+        if (out[i] == 2) { out[i] = 3; stack.push_back(int(i)); }
+    }
+    while (!stack.empty()) {
+        const int i = stack.back();
+        stack.pop_back();
+        const int y = i / W, x = i % W;
+        for (int dy = -1; dy <= 1; ++dy) {
+            for (int dx = -1; dx <= 1; ++dx) {
+                const int yy = y + dy, xx = x + dx;
+                if (yy < 0 || yy >= H || xx < 0 || xx >= W) continue;
+                std::uint16_t& s = out[std::size_t(yy) * W + xx];
+                if (s == 1) { s = 3; stack.push_back(yy * W + xx); }
+            }
+        }
+    }
+    #pragma omp parallel for schedule(static)
+    for (int y = 0; y < H; ++y) {
+        std::uint16_t* o = out + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) o[x] = (o[x] == 3) ? 65535 : 0;
+    }
+}
+
+// -------------------- 直方图统计（ImageManager / WindowBasedEnhancer / 直方图窗口共用） --------------------
+// 一次 65536 档直方图之后，分位数、np.histogram 分箱、有效范围与智能滑块范围都只遍历 65536 个桶，不再扫描像素。
+// 分箱与 np.histogram(data, bins, range=(lo, hi)) 逐桶一致：桶边界同 np.linspace，归属按边界判定（最后一桶含右端）。
+struct HistogramBins {
+    double first = 0.0, last = 0.0, step = 0.0;
+    int bins = 0;
+
+    HistogramBins(int nbins, double lo, double hi) : first(lo), last(hi), bins(nbins) {
+        if (nbins <= 0) throw std::runtime_error("bins must be positive");
+        if (!(lo <= hi)) throw std::runtime_error("max must be larger than min in range parameter");
+        if (first == last) { first -= 0.5; last += 0.5; }
+        step = (last - first) / double(bins);
+    }
+    double edge(int i) const { return i == bins ? last : double(i) * step + first; }
+    double center(int i) const { return 0.5 * (edge(i) + edge(i + 1)); }
+    // 值 v（须在 [first, last] 内）所在的桶
+    int index_of(double v) const {
+        int i = std::min(bins - 1, std::max(0, int((v - first) / (last - first) * double(bins))));
+        while (i > 0 && v < edge(i)) --i;
+        while (i < bins - 1 && v >= edge(i + 1)) ++i;
+        return i;
+    }
+};
+
+struct HistogramRangeStats {
+    std::uint64_t count = 0;
+    double mean = 0.0, std = 0.0;
+    int min = 0, max = 0;
+};
+
+struct ImageHistogramCore {
+    U16Histogram hist;
+    int data_min = 0, data_max = 0;
+    double mean = 0.0, std = 0.0;
+
+    void build(const Plane<std::uint16_t>& src, int H, int W) {
+        if (H <= 0 || W <= 0) throw std::runtime_error("data must be non-empty");
+        NLM_SCOPED_TIMER(kStatHistogram, (long long)H * W);
+        hist.build(src, H, W);
+        const HistogramRangeStats all = range_stats(0, 65535);
+        data_min = all.min; data_max = all.max;
+        mean = all.mean; std = all.std;
+    }
+
+    // [lo, hi] 内像素的个数、均值、标准差（ddof=0）与最值；区间内无像素时 count 为 0
+    HistogramRangeStats range_stats(int lo, int hi) const {
+        HistogramRangeStats r;
+        lo = std::max(lo, 0); hi = std::min(hi, 65535);
+        double sum = 0.0;
+        for (int b = lo; b <= hi; ++b) {
+            const std::uint64_t c = hist.counts[b];
+            if (!c) continue;
+            if (!r.count) r.min = b;
+            r.max = b;
+            r.count += c;
+            sum += double(c) * b;
+        }
+        if (!r.count) return r;
+        r.mean = sum / double(r.count);
+        double ss = 0.0;
+        for (int b = r.min; b <= r.max; ++b) {
+            const std::uint64_t c = hist.counts[b];
+            if (c) ss += double(c) * (b - r.mean) * (b - r.mean);
+        }
+        r.std = std::sqrt(ss / double(r.count));
+        return r;
+    }
+
+    // np.histogram 的各桶计数
+    void binned(const HistogramBins& hb, std::int64_t* out) const {
+        std::fill(out, out + hb.bins, std::int64_t(0));
+        const int v0 = std::max(0, (int)std::ceil(hb.first)), v1 = std::min(65535, (int)std::floor(hb.last));
+        for (int v = v0; v <= v1; ++v) {
+            if (hist.counts[v]) out[hb.index_of(v)] += std::int64_t(hist.counts[v]);
+        }
+    }
+
+    // ImageManager._detect_effective_range：range=(min, max) 的 65536 桶直方图上，
+    // 有 > 80% 灰度处占比 > 5% 的过曝峰时，在峰以下、计数 > 万分之一的桶里取 5%–95%；否则整幅取 5%–95%。
+    // 值为桶中心（同 Python 版）
+    void effective_range(double* lo, double* hi) const {
+        const HistogramBins hb(65536, data_min, data_max);
+        // 非空桶（uint16 的取值跨度 < 65536，每个灰度独占一桶）
+        std::vector<int> idx;
+        std::vector<std::uint64_t> cnt;
+        for (int v = data_min; v <= data_max; ++v) {
+            if (!hist.counts[v]) continue;
+            const int i = hb.index_of(v);
+            if (!idx.empty() && idx.back() == i) cnt.back() += hist.counts[v];
+            else { idx.push_back(i); cnt.push_back(hist.counts[v]); }
+        }
+        const double total = double(hist.n);
+        const double overexposed_from = data_min + (data_max - data_min) * 0.8;
+        double threshold = 0.0;
+        bool overexposed = false;
+        for (std::size_t k = 0; k < idx.size(); ++k) {
+            if (double(cnt[k]) / total > 0.05 && hb.center(idx[k]) > overexposed_from) {
+                threshold = hb.center(idx[k]);   // 桶中心递增，第一个即最小的过曝峰
+                overexposed = true;
+                break;
+            }
+        }
+        // 在选中的桶序列上取累计计数首次达到 5% / 95% 的桶中心
+        auto quantiles = [&](const std::vector<std::size_t>& sel) {
+            std::uint64_t sum = 0;
+            for (std::size_t k : sel) sum += cnt[k];
+            const double lt = double(sum) * 0.05, ut = double(sum) * 0.95;
+            std::uint64_t c = 0;
+            bool have_lo = false;
+            for (std::size_t k : sel) {
+                c += cnt[k];
+                if (!have_lo && double(c) >= lt) { *lo = hb.center(idx[k]); have_lo = true; }
+                if (double(c) >= ut) { *hi = hb.center(idx[k]); return; }
+            }
+        };
+        if (overexposed) {
+            const double noise = total * 0.0001;
+            std::vector<std::size_t> valid;
+            for (std::size_t k = 0; k < idx.size(); ++k) {
+                if (hb.center(idx[k]) < threshold && double(cnt[k]) > noise) valid.push_back(k);
+            }
+            if (valid.size() > 10) { quantiles(valid); return; }
+        }
+        std::vector<std::size_t> all(idx.size());
+        for (std::size_t k = 0; k < all.size(); ++k) all[k] = k;
+        *lo = data_min; *hi = data_max;
+        quantiles(all);
+    }
+
+    // ImageManager.calculate_smart_slider_ranges：out = {ww_min, ww_max, wl_min, wl_max}
+    void slider_ranges(double ww, double wl, int out[4]) const {
+        double emin, emax;
+        effective_range(&emin, &emax);
+        double ww_min, ww_max, wl_min, wl_max;
+        if (ww > 0 && wl > 0) {
+            const double er = emax - emin;
+            const double wl_margin = std::max(ww * 2, er * 0.1);
+            wl_min = std::max(emin - er * 0.1, wl - wl_margin);
+            wl_max = std::min(emax + er * 0.1, wl + wl_margin);
+            ww_min = std::max(1.0, std::floor(ww / 10.0));   // Python 的 ww // 10
+            ww_max = std::min(ww * 5, er * 3);
+            if (ww_max - ww_min < 1000) ww_max = ww_min + 1000;
+            if (wl_max - wl_min < ww) {
+                const double c = (wl_min + wl_max) / 2;
+                wl_min = c - ww;
+                wl_max = c + ww;
+            }
+        } else {
+            wl_min = emin; wl_max = emax;
+            ww_min = 1; ww_max = emax - emin;
+        }
+        // int() 向零截断后夹取（先限幅，避免超出 int 的转换）
+        auto trunc = [](double v) { return (int)std::max(-1e9, std::min(1e9, v)); };
+        int a = std::max(1, trunc(ww_min)), b = std::min(65535, trunc(ww_max));
+        int c = std::max(0, trunc(wl_min)), d = std::min(65535, trunc(wl_max));
+        if (a >= b) b = a + 1000;
+        if (c >= d) d = c + 1000;
+        out[0] = a; out[1] = b; out[2] = c; out[3] = d;
+    }
+};
@@ -0,0 +1,469 @@
+// cpp/frequency_filter_core.h
+// 频域滤波（理想/高斯，低通/高通）的纯 C++ 核心（不依赖 Python）：实数 FFT、计划缓存、掩膜缓存与频谱缓存。
+// 由 poisson_nlm.cpp 在 poisson_nlm_core.h 之后包含。
+#pragma once
+#include "poisson_nlm_core.h"
+#include <complex>
+#include <map>
+#include <list>
+
+typedef std::complex<float> fft_cpx;
+
+// -------------------- 一维复数 FFT 计划（混合基，按长度全局缓存） --------------------
+// 长度分解为 4、2、3、5 及其它不超过 kFFTMaxRadix 的素因子，递归按时间抽取；
+// 含更大素因子的长度走 Bluestein（转成 2 的幂长度的循环卷积）。旋转因子以 double 计算后存为 float。
+static const int kFFTMaxRadix = 31;
+
+struct FFTPlan {
+    int n = 0;
+    std::vector<int> factors;          // 递归各层的基，乘积为 n
+    std::vector<fft_cpx> tw, itw;      // exp(∓2πi j/n)，j < n
+    // Bluestein：n 含大素因子时 factors 为空，改用长度 m 的子计划做卷积
+    int m = 0;
+    std::shared_ptr<const FFTPlan> sub;
+    std::vector<fft_cpx> chirp;        // exp(iπ j²/n)，j < n
+    std::vector<fft_cpx> chirp_fft;    // 卷积核的 FFT，已含 1/m
+    std::size_t scratch_size() const { return m > 0 ? std::size_t(2) * m + sub->scratch_size() : 0; }
+};
+
+static inline bool fft_factorize(int n, std::vector<int>& f) {
+    f.clear();
+    while (n % 4 == 0) { f.push_back(4); n /= 4; }
+    if (n % 2 == 0) { f.push_back(2); n /= 2; }
+    for (int p = 3; n > 1; p += 2) {
+        if ((long long)p * p > n) p = n;          // 余下的 n 是素数
+        while (n % p == 0) {
+            if (p > kFFTMaxRadix) return false;
+            f.push_back(p); n /= p;
+        }
+    }
+    return true;
+}
+
+static inline void fft_exec(const FFTPlan& P, const fft_cpx* in, fft_cpx* out, bool inverse, fft_cpx* scratch);
+
+static inline std::shared_ptr<const FFTPlan> make_fft_plan(int n);
+
+static inline std::shared_ptr<const FFTPlan> get_fft_plan(int n) {
+    static std::mutex mtx;
+    static std::map<int, std::shared_ptr<const FFTPlan>> cache;
+    {
+        std::lock_guard<std::mutex> lock(mtx);
+        auto it = cache.find(n);
+        if (it != cache.end()) return it->second;
+    }
+    std::shared_ptr<const FFTPlan> p = make_fft_plan(n);   // Bluestein 会递归取子计划，建表时不持锁
+    std::lock_guard<std::mutex> lock(mtx);
+    return cache.emplace(n, p).first->second;
+}
+
+static inline std::shared_ptr<const FFTPlan> make_fft_plan(int n) {
+    if (n <= 0) throw std::runtime_error("FFT length must be positive");
+    const double pi = 3.14159265358979323846;
+    std::shared_ptr<FFTPlan> P = std::make_shared<FFTPlan>();
+    P->n = n;
+    if (fft_factorize(n, P->factors)) {
+        P->tw.resize(n); P->itw.resize(n);
+        for (int j = 0; j < n; ++j) {
+            const double a = -2.0 * pi * j / n;
+            P->tw[j] = fft_cpx((float)std::cos(a), (float)std::sin(a));
+            P->itw[j] = std::conj(P->tw[j]);
+        }
+        return P;
+    }
+    P->factors.clear();
+    int m = 1;
+    while (m < 2 * n - 1) m <<= 1;
+    P->m = m;
+    P->sub = get_fft_plan(m);
+    P->chirp.resize(n);
+    for (int j = 0; j < n; ++j) {
+        const long long j2 = ((long long)j * j) % (2LL * n);   // 取模保证大 j 时的相位精度
+        const double a = pi * (double)j2 / n;
+        P->chirp[j] = fft_cpx((float)std::cos(a), (float)std::sin(a));
+    }
+    std::vector<fft_cpx> b(m, fft_cpx(0.f, 0.f)), scratch(P->sub->scratch_size());
+    b[0] = P->chirp[0];
+    for (int j = 1; j < n; ++j) b[j] = b[m - j] = P->chirp[j];
+    P->chirp_fft.resize(m);
+    fft_exec(*P->sub, b.data(), P->chirp_fft.data(), false, scratch.data());
+    for (int k = 0; k < m; ++k) P->chirp_fft[k] /= (float)m;
+    return P;
+}
+
+// 递归一层：n = p*m，先对 p 个间隔 s*p 的子序列做长度 m 的变换，再做 m 组基 p 蝶形（就地，下标集合不变）
+static inline void fft_rec(const FFTPlan& P, bool inverse, const fft_cpx* in, std::ptrdiff_t s,
+                           fft_cpx* out, int n, int level, int tws) {
+    const fft_cpx* tw = inverse ? P.itw.data() : P.tw.data();
+    const int p = P.factors[level], m = n / p;
+    if (m > 1) {
+        for (int q = 0; q < p; ++q) fft_rec(P, inverse, in + q*s, s*p, out + q*m, m, level + 1, tws*p);
+    } else {
+        for (int q = 0; q < p; ++q) out[q] = in[q*s];
+    }
+    const int root = P.n / p;          // tw[root] = exp(∓2πi/p)
+    fft_cpx t[kFFTMaxRadix + 1];
+    for (int k = 0; k < m; ++k) {
+        t[0] = out[k];
+        for (int q = 1; q < p; ++q) t[q] = out[q*m + k] * tw[(std::ptrdiff_t)q * k * tws];
+        if (p == 2) {
+            out[k] = t[0] + t[1];
+            out[k + m] = t[0] - t[1];
+        } else if (p == 4) {
+            const fft_cpx a0 = t[0] + t[2], a1 = t[0] - t[2], a2 = t[1] + t[3];
+            const fft_cpx d = t[1] - t[3];
+            const fft_cpx a3 = inverse ? fft_cpx(-d.imag(), d.real()) : fft_cpx(d.imag(), -d.real());   // ·(±i)
+            out[k] = a0 + a2;
+            out[k + m] = a1 + a3;
+            out[k + 2*m] = a0 - a2;
+            out[k + 3*m] = a1 - a3;
+        } else {
+            for (int r = 0; r < p; ++r) {
+                fft_cpx acc = t[0];
+                for (int q = 1; q < p; ++q) acc += t[q] * tw[(std::ptrdiff_t)((q * r) % p) * root];
+                out[k + r*m] = acc;
+            }
+        }
+    }
+}
+
+// out = DFT(in)（inverse 时为不归一化的逆变换）；in 与 out 不得重叠，scratch 至少 P.scratch_size()
+static inline void fft_exec(const FFTPlan& P, const fft_cpx* in, fft_cpx* out, bool inverse, fft_cpx* scratch) {
+    const int n = P.n;
+    if (n == 1) { out[0] = in[0]; return; }
+    if (P.m == 0) {
+        fft_rec(P, inverse, in, 1, out, n, 0, 1);
+        return;
+    }
+    // Bluestein：X_k = c*_k Σ_j (x_j c*_j) c_{k-j}；逆变换对 chirp 取共轭
+    const int m = P.m;
+    fft_cpx* a = scratch;
+    fft_cpx* A = scratch + m;
+    fft_cpx* sub_scratch = scratch + 2*m;
+    for (int j = 0; j < n; ++j) a[j] = in[j] * (inverse ? P.chirp[j] : std::conj(P.chirp[j]));
+    for (int j = n; j < m; ++j) a[j] = fft_cpx(0.f, 0.f);
+    fft_exec(*P.sub, a, A, false, sub_scratch);
+    for (int k = 0; k < m; ++k) A[k] *= inverse ? std::conj(P.chirp_fft[k]) : P.chirp_fft[k];
+    fft_exec(*P.sub, A, a, true, sub_scratch);
+    for (int k = 0; k < n; ++k) out[k] = a[k] * (inverse ? P.chirp[k] : std::conj(P.chirp[k]));
+}
+
+// -------------------- 一维实数 FFT（行方向） --------------------
+// 偶数长度打包成 n/2 点复数变换后拆分；奇数长度按虚部为零的复数变换处理。频谱只保留 0..n/2。
+struct RealFFTPlan {
+    int n = 0;
+    std::shared_ptr<const FFTPlan> cplx;   // 偶数：n/2 点；奇数：n 点
+    std::vector<fft_cpx> rtw;              // exp(-2πi k/n)，k ≤ n/2（仅偶数长度）
+    int bins() const { return n / 2 + 1; }
+    std::size_t scratch_size() const { return std::size_t(2) * cplx->n + cplx->scratch_size(); }
+};
+
+static inline RealFFTPlan make_real_fft_plan(int n) {
+    RealFFTPlan R;
+    R.n = n;
+    if (n % 2 == 0) {
+        R.cplx = get_fft_plan(n / 2);
+        R.rtw.resize(n / 2 + 1);
+        for (int k = 0; k <= n / 2; ++k) {
+            const double a = -2.0 * 3.14159265358979323846 * k / n;
+            R.rtw[k] = fft_cpx((float)std::cos(a), (float)std::sin(a));
+        }
+    } else {
+        R.cplx = get_fft_plan(n);
+    }
+    return R;
+}
+
+template <typename T>
+static inline void rfft_row(const RealFFTPlan& R, const T* x, std::ptrdiff_t sx, fft_cpx* X, fft_cpx* scratch) {
+    const int n = R.n, c = R.cplx->n;
+    fft_cpx* z = scratch;
+    fft_cpx* Z = scratch + c;
+    fft_cpx* sub = scratch + 2*c;
+    if (n % 2 != 0) {
+        for (int j = 0; j < n; ++j) z[j] = fft_cpx((float)x[j*sx], 0.f);
+        fft_exec(*R.cplx, z, Z, false, sub);
+        for (int k = 0; k <= n / 2; ++k) X[k] = Z[k];
+        return;
+    }
+    for (int j = 0; j < c; ++j) z[j] = fft_cpx((float)x[(2*j)*sx], (float)x[(2*j + 1)*sx]);
+    fft_exec(*R.cplx, z, Z, false, sub);
+    for (int k = 0; k <= c; ++k) {
+        const fft_cpx zk = Z[k % c], zc = std::conj(Z[(c - k) % c]);
+        const fft_cpx e = 0.5f * (zk + zc);
+        const fft_cpx d = 0.5f * (zk - zc);
+        const fft_cpx o(d.imag(), -d.real());                   // d / i
+        X[k] = e + R.rtw[k] * o;
+    }
+}
+
+// x（n 个实数）= 不归一化逆变换（即 n·真实值）；X 只读 0..n/2
+static inline void irfft_row(const RealFFTPlan& R, const fft_cpx* X, float* x, fft_cpx* scratch) {
+    const int n = R.n, c = R.cplx->n;
+    fft_cpx* Z = scratch;
+    fft_cpx* z = scratch + c;
+    fft_cpx* sub = scratch + 2*c;
+    if (n % 2 != 0) {
+        for (int k = 0; k < n; ++k) Z[k] = k <= n / 2 ? X[k] : std::conj(X[n - k]);
+        fft_exec(*R.cplx, Z, z, true, sub);
+        for (int j = 0; j < n; ++j) x[j] = z[j].real();
+        return;
+    }
+    for (int k = 0; k < c; ++k) {
+        const fft_cpx xk = X[k], xc = std::conj(X[c - k]);
+        const fft_cpx o = (xk - xc) * std::conj(R.rtw[k]);
+        Z[k] = (xk + xc) + fft_cpx(-o.imag(), o.real());        // E + i·O（各含因子 2）
+    }
+    fft_exec(*R.cplx, Z, z, true, sub);
+    for (int j = 0; j < c; ++j) { x[2*j] = z[j].real(); x[2*j + 1] = z[j].imag(); }
+}
+
+// -------------------- 频域掩膜（按可分离因子存储） --------------------
+// 掩膜定义与 FrequencyProcessor._create_frequency_filter 相同（fftshift 后以 (rows//2, cols//2) 为中心的距离），
+// 这里换算到未移位的半平面频谱上。高斯掩膜 exp(-(u²+v²)/2c²) 可分离为行、列两个一维因子；
+// 理想掩膜只需比较 u²+v² 与 c²。因此每个 (形状, 截止比例, 类型) 只缓存 O(H+W) 的一维表。
+enum { kFreqIdealLow = 0, kFreqIdealHigh = 1, kFreqGaussianLow = 2, kFreqGaussianHigh = 3 };
+
+static inline int parse_frequency_filter_type(const std::string& s) {
+    if (s == "ideal_low") return kFreqIdealLow;
+    if (s == "ideal_high") return kFreqIdealHigh;
+    if (s == "gaussian_low") return kFreqGaussianLow;
+    if (s == "gaussian_high") return kFreqGaussianHigh;
+    throw std::runtime_error("filter_type must be 'ideal_low', 'ideal_high', 'gaussian_low' or 'gaussian_high'");
+}
+
+struct FrequencyMask {
+    int H = 0, W = 0, type = 0;
+    double cutoff_ratio = 0.0;
+    double c2 = 0.0;                  // 截止频率的平方
+    std::vector<double> fu, fv;       // 理想：u²、v²；高斯：exp(-u²/2c²)、exp(-v²/2c²)
+
+    float operator()(int u, int v) const {
+        switch (type) {
+        case kFreqIdealLow:  return fu[u] + fv[v] <= c2 ? 1.f : 0.f;
+        case kFreqIdealHigh: return fu[u] + fv[v] > c2 ? 1.f : 0.f;
+        case kFreqGaussianLow: return (float)(fu[u] * fv[v]);
+        default: return (float)(1.0 - fu[u] * fv[v]);
+        }
+    }
+};
+
+static inline FrequencyMask make_frequency_mask(int H, int W, double cutoff_ratio, int type) {
+    if (!(cutoff_ratio > 0.0)) throw std::runtime_error("cutoff_ratio must be positive");
+    FrequencyMask M;
+    M.H = H; M.W = W; M.type = type; M.cutoff_ratio = cutoff_ratio;
+    const int crow = H / 2, ccol = W / 2;
+    const double cutoff = cutoff_ratio * std::sqrt((double)crow*crow + (double)ccol*ccol);
+    M.c2 = cutoff * cutoff;
+    const bool gaussian = type == kFreqGaussianLow || type == kFreqGaussianHigh;
+    if (gaussian && !(M.c2 > 0.0)) throw std::runtime_error("gaussian filter needs a positive cutoff frequency");
+    const int bins = W / 2 + 1;
+    M.fu.resize(H); M.fv.resize(bins);
+    for (int u = 0; u < H; ++u) {
+        const double f = (double)((u + H / 2) % H - H / 2);     // 未移位下标对应的有符号频率
+        M.fu[u] = gaussian ? std::exp(-f*f / (2.0*M.c2)) : f*f;
+    }
+    for (int v = 0; v < bins; ++v) {
+        const double f = (double)((v + W / 2) % W - W / 2);
+        M.fv[v] = gaussian ? std::exp(-f*f / (2.0*M.c2)) : f*f;
+    }
+    return M;
+}
+
+// -------------------- 二维频域滤波引擎 --------------------
+// 正变换频谱按输入内容（形状 + 逐行哈希）缓存：同一幅图反复调 cutoff_ratio 时只做 掩膜乘法 + 逆变换。
+// 逆变换在引擎自有的频谱工作区内就地完成；取实部（原 Python 实现取模，会丢掉高通结果的符号），
+// 再按原实现归一化到输入的 [min, max] 并截断为 uint16。
+class FrequencyFilterCore {
+public:
+    static const int kMaxMasks = 16;
+
+    // 输入已是缓存频谱对应的图像时返回 true（跳过正变换）
+    template <typename T>
+    bool load(const Plane<T>& src, int H, int W) {
+        if (H <= 0 || W <= 0) throw std::runtime_error("image must be non-empty");
+        const std::uint64_t key = image_key(src, H, W);
+        if (key == key_ && H == H_ && W == W_ && !spectrum_.empty()) return true;
+        NLM_SCOPED_TIMER(kStatFFTLoad, (long long)H * W);
+        if (H != H_ || W != W_) {
+            masks_.clear();
+            col_plan_ = get_fft_plan(H);
+            row_plan_ = make_real_fft_plan(W);
+        }
+        H_ = H; W_ = W; key_ = key;
+        const int bins = W / 2 + 1;
+        spectrum_.assign(std::size_t(H) * bins, fft_cpx(0.f, 0.f));
+
+        // 行方向实数 FFT，同时统计输入范围
+        double dmin = 0.0, dmax = 0.0;
+        bool first = true;
+        #pragma omp parallel
+        {
+            std::vector<fft_cpx> scratch(row_plan_.scratch_size());
+            double lo = 0.0, hi = 0.0;
+            bool any = false;
+            #pragma omp for schedule(static)
+            for (int y = 0; y < H; ++y) {
+                const T* row = src.p + src.offset(y, 0);
+                for (int x = 0; x < W; ++x) {
+                    const double v = (double)row[x*src.sx];
+                    if (!any) { lo = hi = v; any = true; }
+                    else { lo = std::min(lo, v); hi = std::max(hi, v); }
+                }
+                rfft_row(row_plan_, row, src.sx, &spectrum_[std::size_t(y) * bins], scratch.data());
+            }
+            #pragma omp critical(freq_filter_range)
+            {
+                if (any) {
+                    if (first) { dmin = lo; dmax = hi; first = false; }
+                    else { dmin = std::min(dmin, lo); dmax = std::max(dmax, hi); }
+                }
+            }
+        }
+        dmin_ = dmin; dmax_ = dmax;
+        // 列方向复数 FFT（按列组收集成连续数组再变换）
+        column_pass(spectrum_.data(), spectrum_.data(), nullptr, false);
+        return false;
+    }
+
+    // 对 load 过的图像滤波，结果写入 out（H×W，行跨度 out_stride 个元素）
+    template <typename T>
+    void filter(const Plane<T>& src, double cutoff_ratio, int type, std::uint16_t* out, std::ptrdiff_t out_stride) {
+        const int H = H_, W = W_, bins = W / 2 + 1;
+        NLM_SCOPED_TIMER(kStatFFTFilter, (long long)H * W);
+        const FrequencyMask& M = mask(cutoff_ratio, type);
+        work_.resize(spectrum_.size());
+        column_pass(spectrum_.data(), work_.data(), &M, true);
+
+        // 行方向逆实数 FFT，实部就地写回工作区行首（W 个 float 不超过该行 2*bins 个 float）
+        double rmin = 0.0, rmax = 0.0;
+        bool first = true;
+        #pragma omp parallel
+        {
+            std::vector<fft_cpx> scratch(row_plan_.scratch_size());
+            std::vector<float> row(W);
+            double lo = 0.0, hi = 0.0;
+            bool any = false;
+            #pragma omp for schedule(static)
+            for (int y = 0; y < H; ++y) {
+                fft_cpx* X = &work_[std::size_t(y) * bins];
+                irfft_row(row_plan_, X, row.data(), scratch.data());
+                float* dst = reinterpret_cast<float*>(X);
+                for (int x = 0; x < W; ++x) {
+                    const double v = row[x];
+                    dst[x] = row[x];
+                    if (!any) { lo = hi = v; any = true; }
+                    else { lo = std::min(lo, v); hi = std::max(hi, v); }
+                }
+            }
+            #pragma omp critical(freq_filter_range)
+            {
+                if (any) {
+                    if (first) { rmin = lo; rmax = hi; first = false; }
+                    else { rmin = std::min(rmin, lo); rmax = std::max(rmax, hi); }
+                }
+            }
+        }
+
+        // 归一化到输入范围；逆变换未除以 H·W，线性归一化与该比例无关
+        const bool flat = !(rmax > rmin);
+        const double scale = flat ? 0.0 : (dmax_ - dmin_) / (rmax - rmin);
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            const float* r = reinterpret_cast<const float*>(&work_[std::size_t(y) * bins]);
+            const T* s = src.p + src.offset(y, 0);
+            std::uint16_t* o = out + (std::ptrdiff_t)y * out_stride;
+            for (int x = 0; x < W; ++x) {
+                double v = flat ? (double)(float)s[x*src.sx] : (r[x] - rmin) * scale + dmin_;
+                v = std::min(65535.0, std::max(0.0, v));
+                o[x] = (std::uint16_t)v;
+            }
+        }
+    }
+
+    int height() const { return H_; }
+    int width() const { return W_; }
+
+    std::size_t memory_bytes() const {
+        std::size_t b = (spectrum_.capacity() + work_.capacity()) * sizeof(fft_cpx);
+        for (const FrequencyMask& m : masks_) b += (m.fu.capacity() + m.fv.capacity()) * sizeof(double);
+        return b;
+    }
+
+    void release() {
+        std::vector<fft_cpx>().swap(spectrum_);
+        std::vector<fft_cpx>().swap(work_);
+        masks_.clear();
+        H_ = W_ = 0;
+        key_ = 0;
+    }
+
+private:
+    // 形状与逐行 FNV-1a 哈希的组合；按行并行计算后顺序合并，结果与线程数无关
+    template <typename T>
+    static std::uint64_t image_key(const Plane<T>& src, int H, int W) {
+        std::vector<std::uint64_t> rows(H);
+        #pragma omp parallel for schedule(static)
+        for (int y = 0; y < H; ++y) {
+            std::uint64_t h = 1469598103934665603ULL;
+            const T* row = src.p + src.offset(y, 0);
+            for (int x = 0; x < W; ++x) {
+                T v = row[x*src.sx];
+                std::uint64_t bits = 0;
+                std::memcpy(&bits, &v, sizeof(T));
+                h = (h ^ bits) * 1099511628211ULL;
+            }
+            rows[y] = h;
+        }
+        std::uint64_t h = 1469598103934665603ULL ^ ((std::uint64_t)H << 32) ^ (std::uint64_t)W ^ ((std::uint64_t)sizeof(T) << 56);
+        for (int y = 0; y < H; ++y) h = (h ^ rows[y]) * 1099511628211ULL;
+        return h;
+    }
+
+    const FrequencyMask& mask(double cutoff_ratio, int type) {
+        for (auto it = masks_.begin(); it != masks_.end(); ++it) {
+            if (it->type == type && it->cutoff_ratio == cutoff_ratio) {
+                masks_.splice(masks_.begin(), masks_, it);     // LRU：移到表头
+                return masks_.front();
+            }
+        }
+        masks_.push_front(make_frequency_mask(H_, W_, cutoff_ratio, type));
+        if ((int)masks_.size() > kMaxMasks) masks_.pop_back();
+        return masks_.front();
+    }
+
+    // 列方向一维 FFT：每次收集 kCols 列为连续数组，变换后写回 dst（可与 src 相同）；
+    // M 非空时收集的同时乘以掩膜
+    void column_pass(const fft_cpx* src, fft_cpx* dst, const FrequencyMask* M, bool inverse) {
+        static const int kCols = 8;
+        const int H = H_, bins = W_ / 2 + 1;
+        const FFTPlan& P = *col_plan_;
+        const int groups = (bins + kCols - 1) / kCols;
+        #pragma omp parallel
+        {
+            std::vector<fft_cpx> in(std::size_t(kCols) * H), res(H), scratch(P.scratch_size());
+            #pragma omp for schedule(dynamic, 4)
+            for (int g = 0; g < groups; ++g) {
+                const int c0 = g * kCols, nc = std::min(kCols, bins - c0);
+                for (int u = 0; u < H; ++u) {
+                    const fft_cpx* s = src + std::size_t(u) * bins + c0;
+                    for (int j = 0; j < nc; ++j) {
+                        in[std::size_t(j) * H + u] = M ? s[j] * (*M)(u, c0 + j) : s[j];
+                    }
+                }
+                for (int j = 0; j < nc; ++j) {
+                    fft_exec(P, &in[std::size_t(j) * H], res.data(), inverse, scratch.data());
+                    for (int u = 0; u < H; ++u) dst[std::size_t(u) * bins + c0 + j] = res[u];
+                }
+            }
+        }
+    }
+
+    int H_ = 0, W_ = 0;
+    std::uint64_t key_ = 0;
+    double dmin_ = 0.0, dmax_ = 0.0;
+    std::shared_ptr<const FFTPlan> col_plan_;
+    RealFFTPlan row_plan_;
+    std::vector<fft_cpx> spectrum_, work_;
+    std::list<FrequencyMask> masks_;
+};
@@ -0,0 +1,240 @@
+#pragma once
+// 热路径计数与分阶段计时（纯 C++，不依赖 Python）：供 get_stats() 与 Chrome trace 导出。
+// 编译时定义 POISSON_NLM_NO_STATS 后所有埋点宏展开为空操作，计时与计数的开销完全移除；
+// 默认编入，运行时可用 set_stats_enabled(false) 关闭（此时每个埋点只剩一次 relaxed 原子读）。
+// 计时用 steady_clock；阶段计数与线程忙碌时间均为原子累加，跨线程汇总时不加锁。
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// ----- 阶段与计数器 -----
+enum StatStage {
+    kStatNormalize = 0,     // 归一化区间（65536 档直方图）
+    kStatStep1,             // 自适应梯度增强
+    kStatNLM,               // 泊松 NLM（含 λ 预处理）
+    kStatReconstruct,       // 变分重建
+    kStatPipelineTile,      // 流水线单块（Step1 → NLM → Step3）
+    kStatDistanceTable,     // d 表建表/扩容
+    kStatWindowLUT,         // 窗宽窗位 LUT 显示映射
+    kStatFFTLoad,           // 频域滤波：正变换与频谱缓存
+    kStatFFTFilter,         // 频域滤波：掩膜、逆变换与归一化
+    kStatMultiscale,        // 多尺度细节增强
+    kStatWindowEnhance,     // 窗位增强（准备 + 收尾）
+    kStatEdge,              // 边缘算子（Sobel/Laplacian/Roberts/Canny）
+    kStatHistogram,         // 图像直方图统计（ImageHistogram）
+    kStatStageCount
+};
+
+static const char* const kStatStageNames[kStatStageCount] = {
+    "normalize", "step1", "nlm", "reconstruct", "pipeline_tile", "distance_table",
+    "window_lut", "fft_load", "fft_filter", "multiscale", "window_enhance", "edge",
+    "histogram",
+};
+
+enum StatCounter {
+    kStatDistTableHits = 0,      // 取表时已有足够大的同 lam_quant 表
+    kStatDistTableMisses,        // 需要建表或扩容
+    kStatDistTableBytes,         // 当前全局 d 表大小（字节，覆盖写）
+    kStatCandidates,             // NLM 逐块/金字塔引擎评估的候选数（topk 之前）
+    kStatCandidatesKept,         // topk 之后参与加权的候选数
+    kStatBytesAllocated,         // 各内核临时缓冲的分配量（字节，累计）
+    kStatCounterCount
+};
+
+static const char* const kStatCounterNames[kStatCounterCount] = {
+    "distance_table_hits", "distance_table_misses", "distance_table_bytes",
+    "nlm_candidates", "nlm_candidates_kept", "bytes_allocated",
+};
+
+// 线程忙碌时间的槽位上限（池 worker + OpenMP 线程）；超出的线程并入最后一个槽位
+static const int kStatMaxThreads = 256;
+
+struct TraceEvent {
+    const char* name;
+    long long ts_ns, dur_ns;
+    int tid;
+};
+
+class PipelineStats {
+public:
+    struct Stage {
+        std::atomic<long long> calls{0}, ns{0}, max_ns{0}, pixels{0};
+    };
+    struct ThreadSlot {
+        std::atomic<long long> busy_ns{0}, scopes{0};
+    };
+
+    std::atomic<bool> enabled{true};
+    std::atomic<bool> tracing{false};
+    Stage stages[kStatStageCount];
+    std::atomic<long long> counters[kStatCounterCount];
+    ThreadSlot threads[kStatMaxThreads];
+    std::atomic<int> thread_count{0};
+
+    PipelineStats() : epoch_(std::chrono::steady_clock::now()) {
+        for (int i = 0; i < kStatCounterCount; ++i) counters[i] = 0;
+    }
+
+    long long now_ns() const {
+        return (long long)std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - epoch_).count();
+    }
+
+    // 当前线程的槽位（首次使用时分配）
+    int thread_slot() {
+        thread_local int slot = -1;
+        if (slot < 0) slot = std::min(thread_count.fetch_add(1), kStatMaxThreads - 1);
+        return slot;
+    }
+
+    void record_stage(int stage, long long pixels, long long t0, long long t1) {
+        const long long dur = t1 - t0;
+        Stage& s = stages[stage];
+        ++s.calls;
+        s.ns += dur;
+        s.pixels += pixels;
+        long long prev = s.max_ns.load(std::memory_order_relaxed);
+        while (dur > prev && !s.max_ns.compare_exchange_weak(prev, dur)) {}
+        if (tracing.load(std::memory_order_relaxed)) trace(kStatStageNames[stage], t0, t1);
+    }
+
+    void record_busy(long long t0, long long t1) {
+        ThreadSlot& s = threads[thread_slot()];
+        s.busy_ns += t1 - t0;
+        ++s.scopes;
+    }
+
+    void trace(const char* name, long long t0, long long t1) {
+        const int tid = thread_slot();
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        if (events_.size() >= trace_limit_) { ++trace_dropped_; return; }
+        TraceEvent e = { name, t0, t1 - t0, tid };
+        events_.push_back(e);
+    }
+
+    void start_trace(std::size_t max_events) {
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        events_.clear();
+        trace_limit_ = max_events;
+        trace_dropped_ = 0;
+        tracing = true;
+    }
+
+    void stop_trace() { tracing = false; }
+
+    std::size_t trace_size() {
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        return events_.size();
+    }
+
+    long long trace_dropped() {
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        return trace_dropped_;
+    }
+
+    // Chrome trace 事件格式（chrome://tracing / Perfetto 可直接打开），时间单位为微秒
+    std::string chrome_trace_json() {
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        std::string js = "{\"traceEvents\":[";
+        char buf[192];
+        for (std::size_t i = 0; i < events_.size(); ++i) {
+            const TraceEvent& e = events_[i];
+            std::snprintf(buf, sizeof(buf), "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                          i ? "," : "", e.name, e.tid, e.ts_ns / 1000.0, e.dur_ns / 1000.0);
+            js += buf;
+        }
+        js += "],\"displayTimeUnit\":\"ms\"}";
+        return js;
+    }
+
+    // 清零计数与计时（线程槽位的分配保留，已有线程继续使用原槽位）
+    void reset() {
+        for (int i = 0; i < kStatStageCount; ++i) {
+            stages[i].calls = 0; stages[i].ns = 0; stages[i].max_ns = 0; stages[i].pixels = 0;
+        }
+        for (int i = 0; i < kStatCounterCount; ++i) counters[i] = 0;
+        for (int i = 0; i < kStatMaxThreads; ++i) { threads[i].busy_ns = 0; threads[i].scopes = 0; }
+        std::lock_guard<std::mutex> lock(trace_mtx_);
+        events_.clear();
+        trace_dropped_ = 0;
+    }
+
+private:
+    std::chrono::steady_clock::time_point epoch_;
+    std::mutex trace_mtx_;
+    std::vector<TraceEvent> events_;
+    std::size_t trace_limit_ = 0;
+    long long trace_dropped_ = 0;
+};
+
+// 进程级实例（有意不析构，同 global_pool）
+static inline PipelineStats& pipeline_stats() {
+    static PipelineStats* stats = new PipelineStats();
+    return *stats;
+}
+
+// ----- 作用域计时 -----
+// 阶段计时：析构时累加调用次数、耗时、最大耗时与像素数；trace 开启时同时记一条事件
+class ScopedStageTimer {
+public:
+    ScopedStageTimer(int stage, long long pixels)
+        : stage_(stage), pixels_(pixels), active_(pipeline_stats().enabled.load(std::memory_order_relaxed)) {
+        if (active_) t0_ = pipeline_stats().now_ns();
+    }
+    ~ScopedStageTimer() {
+        if (active_) pipeline_stats().record_stage(stage_, pixels_, t0_, pipeline_stats().now_ns());
+    }
+private:
+    int stage_;
+    long long pixels_, t0_ = 0;
+    bool active_;
+};
+
+// 线程忙碌计时：同一线程上只有最外层作用域计入（池 worker 内的 OpenMP 主线程即 worker 本身，不重复计）
+class ScopedBusyTimer {
+public:
+    ScopedBusyTimer() : entered_(pipeline_stats().enabled.load(std::memory_order_relaxed)), active_(false) {
+        if (!entered_) return;
+        active_ = (depth()++ == 0);
+        if (active_) t0_ = pipeline_stats().now_ns();
+    }
+    ~ScopedBusyTimer() {
+        if (!entered_) return;
+        --depth();
+        if (active_) pipeline_stats().record_busy(t0_, pipeline_stats().now_ns());
+    }
+private:
+    static int& depth() { thread_local int d = 0; return d; }
+    long long t0_ = 0;
+    bool entered_, active_;
+};
+
+static inline void stats_add(int counter, long long v) {
+    PipelineStats& s = pipeline_stats();
+    if (s.enabled.load(std::memory_order_relaxed)) s.counters[counter] += v;
+}
+
+static inline void stats_set(int counter, long long v) {
+    PipelineStats& s = pipeline_stats();
+    if (s.enabled.load(std::memory_order_relaxed)) s.counters[counter] = v;
+}
+
+#define NLM_STAT_CONCAT2(a, b) a##b
+#define NLM_STAT_CONCAT(a, b) NLM_STAT_CONCAT2(a, b)
+
+#ifndef POISSON_NLM_NO_STATS
+#define NLM_SCOPED_TIMER(stage, pixels) ScopedStageTimer NLM_STAT_CONCAT(nlm_stage_timer_, __LINE__)((stage), (long long)(pixels))
+#define NLM_BUSY_TIMER() ScopedBusyTimer NLM_STAT_CONCAT(nlm_busy_timer_, __LINE__)
+#define NLM_STAT_ADD(counter, v) stats_add((counter), (long long)(v))
+#define NLM_STAT_SET(counter, v) stats_set((counter), (long long)(v))
+#else
+#define NLM_SCOPED_TIMER(stage, pixels) ((void)0)
+#define NLM_BUSY_TIMER() ((void)0)
+#define NLM_STAT_ADD(counter, v) ((void)(v))
+#define NLM_STAT_SET(counter, v) ((void)(v))
+#endif
@@ -1,236 +1,1212 @@
 // cpp/poisson_nlm.cpp
 #include <pybind11/pybind11.h>
 #include <pybind11/numpy.h>
-#include <vector>
-#include <cmath>
-#include <algorithm>
-#include <unordered_map>
-#include <mutex>
-#include <numeric>
-
-#ifdef _OPENMP
-#include <omp.h>
-#endif
+#include <pybind11/stl.h>
+#include "poisson_nlm_core.h"
+#include "frequency_filter_core.h"
+#include "enhance_filters_core.h"
 
 namespace py = pybind11;
 
-// -------------------- 工具：哈希键（量化 λ） --------------------
-struct Key {
-    float a, b;
-    bool operator==(const Key& o) const noexcept { return a==o.a && b==o.b; }
-};
-struct KeyHash {
-    std::size_t operator()(Key const& k) const noexcept {
-        // 简单混合
-        auto ha = std::hash<int>{}(int(k.a*1000));
-        auto hb = std::hash<int>{}(int(k.b*1000));
-        return ha ^ (hb << 1);
+// 校验一对同形 2D 梯度数组，返回 (H, W)
+static std::pair<int,int> checked_gradient_shape(const py::buffer_info& bx, const py::buffer_info& by) {
+    if (bx.ndim != 2 || by.ndim != 2 || bx.shape[0]!=by.shape[0] || bx.shape[1]!=by.shape[1]) {
+        throw std::runtime_error("Gx_p/Gy_p must be same 2D shape");
     }
-};
-
-// -------------------- d(λx,λy) LUT（L2分布距离） --------------------
-static std::unordered_map<Key, double, KeyHash> g_dlut;
-static std::mutex g_dlut_mtx;
+    return std::make_pair((int)bx.shape[0], (int)bx.shape[1]);
+}
 
-static double poisson_L2_distance(double lx, double ly) {
-    if (lx <= 0.0 && ly <= 0.0) return 0.0;
-    double lmax = std::max(lx, ly);
-    int Rmax = int(std::ceil(lmax + 6.0*std::sqrt(std::max(lmax, 1e-12))));
+static std::pair<int,int> checked_gradient_shape(const py::array& gx, const py::array& gy) {
+    if (gx.ndim() != 2 || gy.ndim() != 2 || gx.shape(0) != gy.shape(0) || gx.shape(1) != gy.shape(1)) {
+        throw std::runtime_error("Gx_p/Gy_p must be same 2D shape");
+    }
+    return std::make_pair((int)gx.shape(0), (int)gx.shape(1));
+}
 
-    // 递推 PMF： p(0)=e^{-λ}, p(r)=p(r-1)*λ/r
-    double px_prev = std::exp(-lx);
-    double py_prev = std::exp(-ly);
-    double d = (px_prev - py_prev) * (px_prev - py_prev);
+// -------------------- 零拷贝输入与调用方输出缓冲 --------------------
+// 2D 数组 dtype 与 T 一致且跨度为元素整数倍时直接引用其内存（切片/转置视图均可）；
+// 否则转换一次。keep 持有可能产生的临时数组，须活过整个计算过程。
+template <typename T>
+static Plane<T> plane_of(const py::array& a, py::array& keep, const char* name) {
+    if (a.ndim() != 2) throw std::runtime_error(std::string(name) + " must be a 2D array");
+    keep = a;
+    const py::ssize_t isz = (py::ssize_t)sizeof(T);
+    if (!py::isinstance<py::array_t<T>>(a) || a.strides(0) % isz != 0 || a.strides(1) % isz != 0) {
+        keep = py::array_t<T, py::array::c_style | py::array::forcecast>::ensure(a);
+        if (!keep) throw py::error_already_set();
+    }
+    Plane<T> v = { (const T*)keep.data(), keep.strides(0) / isz, keep.strides(1) / isz };
+    return v;
+}
 
-    for (int r = 1; r <= Rmax; ++r) {
-        px_prev = px_prev * lx / double(r);
-        py_prev = py_prev * ly / double(r);
-        double diff = px_prev - py_prev;
-        d += diff * diff;
+// 数组覆盖的字节区间 [lo, hi)，用于拒绝输出与输入别名
+static std::pair<const char*, const char*> array_extent(const py::array& a) {
+    const char* lo = (const char*)a.data();
+    const char* hi = lo;
+    for (py::ssize_t d = 0; d < a.ndim(); ++d) {
+        if (a.shape(d) == 0) return std::make_pair(lo, lo);
+        py::ssize_t span = (a.shape(d) - 1) * a.strides(d);
+        if (span < 0) lo += span; else hi += span;
     }
-    return d;
+    return std::make_pair(lo, hi + a.itemsize());
 }
 
-static double dlut_query(double lx, double ly, double lam_quant) {
-    // 量化以提升缓存命中
-    double qx = std::round(lx / lam_quant) * lam_quant;
-    double qy = std::round(ly / lam_quant) * lam_quant;
-    Key key{ float(qx), float(qy) };
+static bool arrays_overlap(const py::array& a, const py::array& b) {
+    auto ea = array_extent(a), eb = array_extent(b);
+    return ea.first < eb.second && eb.first < ea.second;
+}
 
-    {
-        std::lock_guard<std::mutex> lock(g_dlut_mtx);
-        auto it = g_dlut.find(key);
-        if (it != g_dlut.end()) return it->second;
+// 调用方提供的输出缓冲：须为 dtype T、可写、C 连续、形状 H×W，且不与任何输入重叠；None 时新分配
+template <typename T>
+static py::array_t<T> output_buffer(py::object o, int H, int W, const char* name,
+                                    std::initializer_list<const py::array*> inputs) {
+    if (o.is_none()) return py::array_t<T>({H, W});
+    if (!py::isinstance<py::array_t<T>>(o)) {
+        throw std::runtime_error(std::string(name) + " has the wrong dtype");
     }
-    double val = poisson_L2_distance(qx, qy);
-    {
-        std::lock_guard<std::mutex> lock(g_dlut_mtx);
-        g_dlut.emplace(key, val);
+    py::array_t<T> a = o.cast<py::array_t<T>>();
+    if (a.ndim() != 2 || a.shape(0) != H || a.shape(1) != W ||
+        !(a.flags() & py::array::c_style) || !a.writeable()) {
+        throw std::runtime_error(std::string(name) + " must be a writable C-contiguous (H, W) array");
+    }
+    for (const py::array* in : inputs) {
+        if (arrays_overlap(a, *in)) throw std::runtime_error(std::string(name) + " must not overlap an input array");
     }
-    return val;
+    return a;
+}
+
+// 两个梯度分量都是 float64 时走 double 实例，其余 dtype 按 float32 读取
+static bool use_double_gradients(const py::array& gx, const py::array& gy) {
+    return py::isinstance<py::array_t<double>>(gx) && py::isinstance<py::array_t<double>>(gy);
+}
+
+// 以零拷贝视图运行 NLM 核心，计算期间释放 GIL
+template <typename T>
+static double nlm_on_arrays(const py::array& Gx_p, const py::array& Gy_p, int H, int W,
+                            const NLMParams& prm, float* gx_out, float* gy_out, float* lam_out,
+                            RunControl* ctl, NLMWorkspace* ws = nullptr) {
+    py::array kx, ky;
+    Plane<T> vx = plane_of<T>(Gx_p, kx, "Gx_p");
+    Plane<T> vy = plane_of<T>(Gy_p, ky, "Gy_p");
+    py::gil_scoped_release release;
+    return poisson_nlm_core(vx, vy, H, W, prm, gx_out, gy_out, lam_out, ctl, ws);
+}
+
+// 金字塔引擎的粗层引导图（如 ImagePyramid 已有的一层），按 float 视图交给核心；keep 持有转换后的数组
+static void bind_pyramid_guide(NLMWorkspace& ws, py::object guide, py::array& keep) {
+    if (guide.is_none()) return;
+    py::array g = guide.cast<py::array>();
+    if (g.ndim() != 2) throw std::runtime_error("guide must be a 2D array");
+    ws.guide = plane_of<float>(g, keep, "guide");
+    ws.guide_h = (int)g.shape(0);
+    ws.guide_w = (int)g.shape(1);
 }
 
-// 盒均值（用于 λ̂ 的局部均值近似，ksize=2*pr+1）
-static inline float box_mean(const float* img, int H, int W, int y0, int x0, int k) {
-    int y1 = y0 + k, x1 = x0 + k;
-    double s = 0.0;
-    for (int y = y0; y < y1; ++y) {
-        const float* row = img + y*W;
-        for (int x = x0; x < x1; ++x) s += row[x];
+// 由 Python 参数装配 RunControl（需持有 GIL）。
+// progress_callback(done, total) 在计算期间临时取回 GIL 执行，显式返回 False 即取消；
+// cancel_flag 为可写的单字节缓冲（如 np.zeros(1, np.uint8)），置非 0 即取消。
+static void bind_run_control(RunControl& ctl, py::object progress_callback, py::object cancel_flag) {
+    if (!progress_callback.is_none()) {
+        py::function cb = progress_callback.cast<py::function>();
+        ctl.progress = [cb](long long done, long long total) {
+            py::gil_scoped_acquire gil;
+            py::object r = cb(done, total);
+            return !(py::isinstance<py::bool_>(r) && !r.cast<bool>());
+        };
+    }
+    if (!cancel_flag.is_none()) {
+        py::buffer_info bi = cancel_flag.cast<py::buffer>().request(true);
+        if (bi.itemsize != 1 || bi.size < 1) {
+            throw std::runtime_error("cancel_flag must be a writable 1-byte buffer, e.g. np.zeros(1, np.uint8)");
+        }
+        ctl.cancel_flag = (const volatile std::uint8_t*)bi.ptr;
     }
-    return float(s / double(k*k));
 }
 
 // -------------------- 主函数：泊松 NLM 在梯度域 --------------------
+// Gx_p/Gy_p 可为任意跨度的 float32/float64 数组（其它 dtype 转换一次）；
+// Gx_out/Gy_out/lam_bar_out 为可选的调用方输出缓冲，重复调用时可免去输出分配。
 py::tuple poisson_nlm_on_gradient_exact_cpp(
-    py::array_t<float, py::array::c_style | py::array::forcecast> Gx_p,
-    py::array_t<float, py::array::c_style | py::array::forcecast> Gy_p,
+    py::array Gx_p,
+    py::array Gy_p,
     int search_radius, int patch_radius,
     double rho,                // ρ
     double count_target_mean,  // 目标平均 λ（自动尺度）
     double lam_quant,          // λ 量化步长（如 0.02）
-    int topk                   // <=0 表示不用 topk
+    int topk,                  // <=0 表示不用 topk
+    bool return_lambda,        // 额外返回 λ̄ 图，供上层复用
+    const std::string& engine, // "patch"（逐块，支持 topk）、"offset"（按位移，全搜索窗）或 "pyramid"（由粗到精，近似）
+    int block_size,            // 逐块引擎的输出块边长，0 按 L2 自动
+    const std::string& precision, // "double"（参考）或 "float32"（单精度累加 + 快速 exp）
+    int pyramid_levels,        // engine="pyramid"：粗层缩小 2^levels 倍
+    int refine_candidates,     // engine="pyramid"：每像素细化的粗位移个数
+    py::object guide,          // engine="pyramid"：可选粗层引导图，形状 (H>>levels, W>>levels)
+    py::object progress_callback,  // 可选 progress(rows_done, rows_total)
+    py::object cancel_flag,        // 可选单字节取消标志
+    py::object Gx_out, py::object Gy_out, py::object lam_bar_out
 ){
-    py::buffer_info bx = Gx_p.request();
-    py::buffer_info by = Gy_p.request();
-    if (bx.ndim != 2 || by.ndim != 2 || bx.shape[0]!=by.shape[0] || bx.shape[1]!=by.shape[1]) {
-        throw std::runtime_error("Gx_p/Gy_p must be same 2D shape");
+    auto hw = checked_gradient_shape(Gx_p, Gy_p);
+    int H = hw.first, W = hw.second;
+
+    NLMParams prm;
+    prm.search_radius = search_radius; prm.patch_radius = patch_radius;
+    prm.rho = rho; prm.count_target_mean = count_target_mean;
+    prm.lam_quant = lam_quant; prm.topk = topk;
+    prm.engine = parse_nlm_engine(engine);
+    prm.block_size = block_size;
+    prm.precision = parse_nlm_precision(precision);
+    prm.pyramid_levels = pyramid_levels;
+    prm.refine_candidates = refine_candidates;
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    NLMWorkspace ws;
+    py::array guide_keep;
+    bind_pyramid_guide(ws, guide, guide_keep);
+
+    py::array_t<float> Gx = output_buffer<float>(Gx_out, H, W, "Gx_out", {&Gx_p, &Gy_p});
+    py::array_t<float> Gy = output_buffer<float>(Gy_out, H, W, "Gy_out", {&Gx_p, &Gy_p, &Gx});
+    py::array_t<float> LamBar = output_buffer<float>(lam_bar_out, H, W, "lam_bar_out", {&Gx_p, &Gy_p, &Gx, &Gy});
+    double count_scale = use_double_gradients(Gx_p, Gy_p)
+        ? nlm_on_arrays<double>(Gx_p, Gy_p, H, W, prm, Gx.mutable_data(), Gy.mutable_data(),
+                                LamBar.mutable_data(), &ctl, &ws)
+        : nlm_on_arrays<float>(Gx_p, Gy_p, H, W, prm, Gx.mutable_data(), Gy.mutable_data(),
+                               LamBar.mutable_data(), &ctl, &ws);
+
+    if (return_lambda) return py::make_tuple(Gx, Gy, count_scale, LamBar);
+    return py::make_tuple(Gx, Gy, count_scale);
+}
+
+// 精度验证：同一输入分别以 double / float32 累加运行，返回偏差统计 dict
+// （max_abs、rms、ref_peak、max_rel；max_rel 相对 double 路径 |G| 峰值）
+py::dict validate_nlm_precision_cpp(
+    py::array Gx_p, py::array Gy_p,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk, const std::string& engine
+){
+    auto hw = checked_gradient_shape(Gx_p, Gy_p);
+    int H = hw.first, W = hw.second;
+
+    NLMParams prm;
+    prm.search_radius = search_radius; prm.patch_radius = patch_radius;
+    prm.rho = rho; prm.count_target_mean = count_target_mean;
+    prm.lam_quant = lam_quant; prm.topk = topk;
+    prm.engine = parse_nlm_engine(engine);
+
+    PrecisionDeviation dev;
+    py::array kx, ky;
+    if (use_double_gradients(Gx_p, Gy_p)) {
+        Plane<double> vx = plane_of<double>(Gx_p, kx, "Gx_p"), vy = plane_of<double>(Gy_p, ky, "Gy_p");
+        py::gil_scoped_release release;
+        dev = nlm_precision_deviation(vx, vy, H, W, prm);
+    } else {
+        Plane<float> vx = plane_of<float>(Gx_p, kx, "Gx_p"), vy = plane_of<float>(Gy_p, ky, "Gy_p");
+        py::gil_scoped_release release;
+        dev = nlm_precision_deviation(vx, vy, H, W, prm);
     }
-    int H = (int)bx.shape[0], W = (int)bx.shape[1];
-    const float* gx_in = (const float*)bx.ptr;
-    const float* gy_in = (const float*)by.ptr;
-
-    // 1) 计算 |G'| 与全图均值，确定 count_scale，使均值 λ ≈ count_target_mean
-    double sum_mag = 0.0;
-    #pragma omp parallel for reduction(+:sum_mag) if(H*W>100000)
-    for (int i = 0; i < H*W; ++i) {
-        double gx = gx_in[i], gy = gy_in[i];
-        sum_mag += std::sqrt(gx*gx + gy*gy);
-    }
-    double gm = sum_mag / double(H*W);
-    double count_scale = (gm > 1e-12) ? (count_target_mean / gm) : 1.0;
-
-    // 2) 计算 λ 图（先不做盒均值），再计算 λ̂（局部均值）
-    std::vector<float> lam(H*W), lam_hat(H*W);
-    #pragma omp parallel for if(H*W>100000)
-    for (int i = 0; i < H*W; ++i) {
-        double gx = gx_in[i], gy = gy_in[i];
-        double mag = std::sqrt(gx*gx + gy*gy);
-        lam[i] = float(std::max(0.0, mag * count_scale));
-    }
-    int k = 2*patch_radius + 1;
-    // 简单盒均值（可替换成积分图/Separable blur）
-    #pragma omp parallel for if(H>64)
-    for (int y = 0; y < H; ++y) {
-        int y0 = std::max(0, y - patch_radius);
-        int y1 = std::min(H, y + patch_radius + 1);
-        for (int x = 0; x < W; ++x) {
-            int x0 = std::max(0, x - patch_radius);
-            int x1 = std::min(W, x + patch_radius + 1);
-            // 保证边界也能算；与 Python 版本一致性要靠主循环边界裁切
-            double s = 0.0;
-            int cnt = 0;
-            for (int yy = y0; yy < y1; ++yy) {
-                const float* row = lam.data() + yy*W;
-                for (int xx = x0; xx < x1; ++xx) { s += row[xx]; ++cnt; }
-            }
-            lam_hat[y*W + x] = float(s / std::max(1, cnt));
+    py::dict d;
+    d["max_abs"] = dev.max_abs;
+    d["rms"] = dev.rms;
+    d["ref_peak"] = dev.ref_peak;
+    d["max_rel"] = dev.max_rel;
+    return d;
+}
+
+// -------------------- Step 1：自适应梯度增强 --------------------
+// 与 paper_enhance.adaptive_gradient_enhance_unit 同式；C 取 σ 的第 90 百分位（默认直方图近似，
+// exact_percentile=True 时精确）。return_magnitude 时追加 |G'|，可作为 grad_mag 交给
+// poisson_nlm_reconstruct_cpp，省去 λ 预处理中的幅值计算。
+py::tuple adaptive_gradient_enhance_cpp(
+    py::array_t<float, py::array::c_style | py::array::forcecast> R_unit,
+    double epsilon_unit, double mu, int ksize_var,
+    bool exact_percentile, bool return_magnitude,
+    py::object Gx_out, py::object Gy_out
+){
+    py::buffer_info br = R_unit.request();
+    if (br.ndim != 2) throw std::runtime_error("R_unit must be 2D");
+    const int H = (int)br.shape[0], W = (int)br.shape[1];
+    if (ksize_var < 1) throw std::runtime_error("ksize_var must be >= 1");
+    py::array_t<float> Gx = output_buffer<float>(Gx_out, H, W, "Gx_out", {&R_unit});
+    py::array_t<float> Gy = output_buffer<float>(Gy_out, H, W, "Gy_out", {&R_unit, &Gx});
+    py::array_t<float> Gmag;
+    if (return_magnitude) Gmag = py::array_t<float>({H, W});
+    float* gx = Gx.mutable_data();
+    float* gy = Gy.mutable_data();
+    float* gm = return_magnitude ? Gmag.mutable_data() : nullptr;
+    {
+        py::gil_scoped_release release;
+        adaptive_gradient_enhance_core((const float*)br.ptr, H, W, epsilon_unit, mu, ksize_var,
+                                       gx, gy, gm, exact_percentile);
+    }
+    if (return_magnitude) return py::make_tuple(Gx, Gy, Gmag);
+    return py::make_tuple(Gx, Gy);
+}
+
+// I 原地更新：须为可写、C 连续的 float32 (H, W) 数组（不做隐式转换，否则结果会写进临时副本而丢失）
+void variational_reconstruct_cpp(
+    py::object I,
+    py::array_t<float, py::array::c_style | py::array::forcecast> Gx,
+    py::array_t<float, py::array::c_style | py::array::forcecast> Gy,
+    double gamma, double delta, int iters, double dt
+){
+    py::buffer_info bx = Gx.request();
+    py::buffer_info by = Gy.request();
+    auto hw = checked_gradient_shape(bx, by);
+    if (I.is_none()) throw std::runtime_error("I must be a writable C-contiguous float32 (H, W) array");
+    py::array_t<float> Ia = output_buffer<float>(I, hw.first, hw.second, "I", {&Gx, &Gy});
+    float* pi = Ia.mutable_data();
+    py::gil_scoped_release release;
+    variational_reconstruct_core(pi, hw.first, hw.second,
+                                 (const float*)bx.ptr, (const float*)by.ptr,
+                                 gamma, delta, iters, dt);
+}
+
+// NLM + 变分重建一次完成：NLM 输出的 Gx/Gy 不回到 Python，直接进入 Step 3。
+// 返回 (I, count_scale)，return_lambda 时追加 λ̄ 图
+// R_unit/Gx_p/Gy_p 均可为任意跨度的视图（如 R_unit[in_y, in_x]），无需先 copy/astype；
+// I_out/lam_bar_out 为可选的调用方输出缓冲；grad_mag 为可选的 |G'|（adaptive_gradient_enhance_cpp 给出）。
+py::tuple poisson_nlm_reconstruct_cpp(
+    py::array R_unit,
+    py::array Gx_p,
+    py::array Gy_p,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt,
+    bool return_lambda, const std::string& engine, int block_size, const std::string& precision,
+    py::object I_out, py::object lam_bar_out, py::object grad_mag
+){
+    auto hw = checked_gradient_shape(Gx_p, Gy_p);
+    int H = hw.first, W = hw.second;
+    if (R_unit.ndim() != 2 || R_unit.shape(0) != H || R_unit.shape(1) != W) {
+        throw std::runtime_error("R_unit must be 2D with the same shape as Gx_p/Gy_p");
+    }
+
+    NLMParams prm;
+    prm.search_radius = search_radius; prm.patch_radius = patch_radius;
+    prm.rho = rho; prm.count_target_mean = count_target_mean;
+    prm.lam_quant = lam_quant; prm.topk = topk;
+    prm.engine = parse_nlm_engine(engine);
+    prm.block_size = block_size;
+    prm.precision = parse_nlm_precision(precision);
+
+    std::vector<float> gx(std::size_t(H) * W), gy(std::size_t(H) * W);
+    py::array_t<float> I = output_buffer<float>(I_out, H, W, "I_out", {&R_unit, &Gx_p, &Gy_p});
+    py::array_t<float> LamBar = output_buffer<float>(lam_bar_out, H, W, "lam_bar_out", {&R_unit, &Gx_p, &Gy_p, &I});
+    py::array_t<float, py::array::c_style | py::array::forcecast> Mag;
+    if (!grad_mag.is_none()) {
+        Mag = grad_mag.cast<py::array_t<float, py::array::c_style | py::array::forcecast>>();
+        if (Mag.ndim() != 2 || Mag.shape(0) != H || Mag.shape(1) != W) {
+            throw std::runtime_error("grad_mag must be 2D with the same shape as Gx_p/Gy_p");
         }
     }
+    NLMWorkspace ws;
+    ws.grad_mag = grad_mag.is_none() ? nullptr : Mag.data();
+    double count_scale = use_double_gradients(Gx_p, Gy_p)
+        ? nlm_on_arrays<double>(Gx_p, Gy_p, H, W, prm, gx.data(), gy.data(), LamBar.mutable_data(), nullptr, &ws)
+        : nlm_on_arrays<float>(Gx_p, Gy_p, H, W, prm, gx.data(), gy.data(), LamBar.mutable_data(), nullptr, &ws);
 
-    // 3) 输出
-    py::array_t<float> Gx({H, W});
-    py::array_t<float> Gy({H, W});
-    auto bxo = Gx.request(); auto byo = Gy.request();
-    float* gx_out = (float*)bxo.ptr;
-    float* gy_out = (float*)byo.ptr;
-
-    int pr = patch_radius, sr = search_radius;
-
-    // 4) 主循环：对每个像素做非局部权重加权（严格式(11)(12)）
-    #pragma omp parallel for schedule(dynamic, 4) if(H>16)
-    for (int y = pr; y < H-pr; ++y) {
-        for (int x = pr; x < W-pr; ++x) {
-            // x 的 patch 与 λ̂
-            int x0p = x - pr, y0p = y - pr;
-            float lam_x_bar = box_mean(lam_hat.data(), H, W, y0p, x0p, k);
-            double denom = rho * std::max(double(lam_x_bar), 1e-8);
-
-            // 搜索窗
-            int sy0 = std::max(pr, y - sr), sy1 = std::min(H - pr, y + sr + 1);
-            int sx0 = std::max(pr, x - sr), sx1 = std::min(W - pr, x + sr + 1);
-
-            // 收集候选的 D 与坐标
-            std::vector<double> Ds;
-            std::vector<std::pair<int,int>> Cs;
-            Ds.reserve((sx1-sx0)*(sy1-sy0));
-            Cs.reserve(Ds.capacity());
-
-            for (int yy = sy0; yy < sy1; ++yy) {
-                for (int xx = sx0; xx < sx1; ++xx) {
-                    // Σ_m d(λx_m, λy_m)
-                    double D_xy = 0.0;
-                    for (int j = 0; j < k; ++j) {
-                        const float* row_x = lam_hat.data() + (y0p + j)*W + x0p;
-                        const float* row_y = lam_hat.data() + (yy - pr + j)*W + (xx - pr);
-                        for (int i = 0; i < k; ++i) {
-                            double lx = (double)row_x[i];
-                            double ly = (double)row_y[i];
-                            D_xy += dlut_query(lx, ly, lam_quant);
-                        }
-                    }
-                    Ds.push_back(D_xy);
-                    Cs.emplace_back(yy, xx);
-                }
-            }
+    // R_unit 直接按视图读入输出缓冲（float32/float64 原生读取），随后原地重建
+    float* out = I.mutable_data();
+    if (py::isinstance<py::array_t<double>>(R_unit)) {
+        py::array keep;
+        copy_plane(plane_of<double>(R_unit, keep, "R_unit"), H, W, out);
+    } else {
+        py::array keep;
+        copy_plane(plane_of<float>(R_unit, keep, "R_unit"), H, W, out);
+    }
+    {
+        py::gil_scoped_release release;
+        variational_reconstruct_core(out, H, W, gx.data(), gy.data(), gamma, delta, iters, dt);
+    }
 
-            // 选 topk（可选）
-            if (topk > 0 && (int)Ds.size() > topk) {
-                std::vector<int> idx(Ds.size());
-                std::iota(idx.begin(), idx.end(), 0);
-                std::nth_element(idx.begin(), idx.begin()+topk, idx.end(),
-                    [&](int a, int b){ return Ds[a] < Ds[b]; });
-                idx.resize(topk);
-
-                std::vector<double> Ds2; Ds2.reserve(topk);
-                std::vector<std::pair<int,int>> Cs2; Cs2.reserve(topk);
-                for (int id : idx) { Ds2.push_back(Ds[id]); Cs2.push_back(Cs[id]); }
-                Ds.swap(Ds2); Cs.swap(Cs2);
-            }
+    if (return_lambda) return py::make_tuple(I, count_scale, LamBar);
+    return py::make_tuple(I, count_scale);
+}
 
-            // 权重
-            std::vector<double> ws; ws.reserve(Ds.size());
-            double wsum = 0.0;
-            for (double Dxy : Ds) {
-                double w = std::exp(- Dxy / denom);
-                ws.push_back(w); wsum += w;
-            }
-            if (wsum <= 0.0) { ws.assign(ws.size(), 1.0); wsum = (double)ws.size(); }
-
-            // 加权平均 G'
-            double gxv = 0.0, gyv = 0.0;
-            for (size_t i = 0; i < ws.size(); ++i) {
-                double w = ws[i] / wsum;
-                int yy = Cs[i].first, xx = Cs[i].second;
-                gxv += w * (double)gx_in[yy*W + xx];
-                gyv += w * (double)gy_in[yy*W + xx];
-            }
-            gx_out[y*W + x] = float(gxv);
-            gy_out[y*W + x] = float(gyv);
+// -------------------- 跨帧复用的 NLM 引擎 --------------------
+// 同一组参数处理整个序列时使用：λ 中间图、λ̄ 临时图与 d 表由引擎持有，逐帧只剩纯计算。
+// max_shape 给出时预留对应容量，超出的帧直接拒绝，长时间运行内存有界；reset() 释放全部缓存。
+// OpenMP 线程组本身跨调用常驻；threads>0 时仅在 process 期间把调用线程的并行度设为该值。
+class PoissonNLMEngine {
+public:
+    PoissonNLMEngine(int search_radius, int patch_radius, double rho,
+                     double count_target_mean, double lam_quant, int topk,
+                     const std::string& engine, int block_size, const std::string& precision,
+                     std::pair<int,int> max_shape, int threads,
+                     int pyramid_levels, int refine_candidates)
+        : max_h_(max_shape.first), max_w_(max_shape.second), threads_(threads) {
+        prm_.search_radius = search_radius; prm_.patch_radius = patch_radius;
+        prm_.rho = rho; prm_.count_target_mean = count_target_mean;
+        prm_.lam_quant = lam_quant; prm_.topk = topk;
+        prm_.engine = parse_nlm_engine(engine);
+        prm_.block_size = block_size;
+        prm_.precision = parse_nlm_precision(precision);
+        prm_.pyramid_levels = pyramid_levels;
+        prm_.refine_candidates = refine_candidates;
+        validate_nlm_params(prm_);
+        if (max_h_ < 0 || max_w_ < 0) throw std::runtime_error("max_shape must be non-negative");
+        const std::size_t px = std::size_t(max_h_) * max_w_;
+        ws_.reserve(px);
+        lam_bar_.reserve(px);
+    }
+
+    py::tuple process(py::array Gx_p, py::array Gy_p,
+                      py::object Gx_out, py::object Gy_out, py::object lam_bar_out,
+                      bool return_lambda, py::object progress_callback, py::object cancel_flag) {
+        auto hw = checked_gradient_shape(Gx_p, Gy_p);
+        const int H = hw.first, W = hw.second;
+        if (max_h_ > 0 && max_w_ > 0 && (H > max_h_ || W > max_w_)) {
+            throw std::runtime_error("frame shape exceeds max_shape of this PoissonNLMEngine");
+        }
+        RunControl ctl;
+        bind_run_control(ctl, progress_callback, cancel_flag);
+
+        py::array_t<float> Gx = output_buffer<float>(Gx_out, H, W, "Gx_out", {&Gx_p, &Gy_p});
+        py::array_t<float> Gy = output_buffer<float>(Gy_out, H, W, "Gy_out", {&Gx_p, &Gy_p, &Gx});
+        // 不需要返回 λ̄ 时写入引擎自有的临时图，避免逐帧分配
+        const bool want_lambda = return_lambda || !lam_bar_out.is_none();
+        py::array_t<float> LamBar;
+        if (want_lambda) {
+            LamBar = output_buffer<float>(lam_bar_out, H, W, "lam_bar_out", {&Gx_p, &Gy_p, &Gx, &Gy});
         }
+
+        double count_scale = use_double_gradients(Gx_p, Gy_p)
+            ? run<double>(Gx_p, Gy_p, H, W, Gx.mutable_data(), Gy.mutable_data(),
+                          want_lambda ? LamBar.mutable_data() : nullptr, &ctl)
+            : run<float>(Gx_p, Gy_p, H, W, Gx.mutable_data(), Gy.mutable_data(),
+                         want_lambda ? LamBar.mutable_data() : nullptr, &ctl);
+
+        if (return_lambda) return py::make_tuple(Gx, Gy, count_scale, LamBar);
+        return py::make_tuple(Gx, Gy, count_scale);
+    }
+
+    // 引擎当前持有的内存（字节）：中间图、λ̄ 临时图与 d 表（d 表可能与其它调用共享）
+    py::dict memory_usage() {
+        std::size_t scratch = 0, table = 0;
+        long long frames = 0;
+        {
+            py::gil_scoped_release release;   // process 持锁期间可能回调 Python，须先放 GIL 再等锁
+            std::lock_guard<std::mutex> lock(mtx_);
+            scratch = ws_.scratch_bytes() + lam_bar_.capacity() * sizeof(float);
+            table = ws_.table_bytes();
+            frames = frames_;
+        }
+        py::dict d;
+        d["scratch_bytes"] = (long long)scratch;
+        d["table_bytes"] = (long long)table;
+        d["total_bytes"] = (long long)(scratch + table);
+        d["frames"] = frames;
+        return d;
+    }
+
+    // 释放中间图与 d 表，并清空全局 d 表缓存；之后的 process 按需重新分配
+    void reset() {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mtx_);
+        ws_.release();
+        std::vector<float>().swap(lam_bar_);
+        release_distance_table_cache();
+        frames_ = 0;
     }
 
-    // 边界直接拷回原值
-    for (int y = 0; y < H; ++y) {
-        for (int x = 0; x < W; ++x) {
-            if (y<pr || y>=H-pr || x<pr || x>=W-pr) {
-                gx_out[y*W + x] = gx_in[y*W + x];
-                gy_out[y*W + x] = gy_in[y*W + x];
+private:
+    template <typename T>
+    double run(const py::array& Gx_p, const py::array& Gy_p, int H, int W,
+               float* gx_out, float* gy_out, float* lam_out, RunControl* ctl) {
+        py::array kx, ky;
+        Plane<T> vx = plane_of<T>(Gx_p, kx, "Gx_p");
+        Plane<T> vy = plane_of<T>(Gy_p, ky, "Gy_p");
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mtx_);  // 工作区不可并发使用：同一引擎的调用串行执行
+#ifdef _OPENMP
+        const int prev_threads = omp_get_max_threads();
+        if (threads_ > 0) omp_set_num_threads(threads_);
+#endif
+        double count_scale = 0.0;
+        try {
+            if (!lam_out) {
+                lam_bar_.resize(std::size_t(H) * W);
+                lam_out = lam_bar_.data();
             }
+            count_scale = poisson_nlm_core(vx, vy, H, W, prm_, gx_out, gy_out, lam_out, ctl, &ws_);
+        } catch (...) {
+#ifdef _OPENMP
+            if (threads_ > 0) omp_set_num_threads(prev_threads);
+#endif
+            throw;
         }
+#ifdef _OPENMP
+        if (threads_ > 0) omp_set_num_threads(prev_threads);
+#endif
+        ++frames_;
+        return count_scale;
     }
 
-    return py::make_tuple(Gx, Gy, count_scale);
+    NLMParams prm_;
+    int max_h_, max_w_, threads_;
+    NLMWorkspace ws_;
+    std::vector<float> lam_bar_;
+    long long frames_ = 0;
+    std::mutex mtx_;
+};
+
+// -------------------- 端到端流水线入口 --------------------
+// 分块并行的入口（strict / band / tiles / batch / region）共用进程级线程池：不同 Python 线程
+// 同时调用时排队串行执行；progress_callback 内再调用这些入口会抛出 RuntimeError（不可重入）。
+static PipelineParams make_pipeline_params(
+    const std::string& norm_mode, double p_lo, double p_hi, py::object wl, py::object ww,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt, int max_tiles_in_flight,
+    const std::string& engine, const std::string& precision) {
+    PipelineParams pp;
+    pp.norm_window = (norm_mode == "window" && !wl.is_none() && !ww.is_none());
+    if (pp.norm_window) { pp.wl = wl.cast<double>(); pp.ww = ww.cast<double>(); }
+    pp.p_lo = p_lo; pp.p_hi = p_hi;
+    pp.tile_h = tile.first; pp.tile_w = tile.second; pp.overlap = overlap;
+    pp.epsilon_8bit = epsilon_8bit; pp.mu = mu; pp.ksize_var = ksize_var;
+    pp.nlm.search_radius = search_radius; pp.nlm.patch_radius = patch_radius;
+    pp.nlm.rho = rho; pp.nlm.count_target_mean = count_target_mean;
+    pp.nlm.lam_quant = lam_quant; pp.nlm.topk = topk;
+    pp.nlm.engine = parse_nlm_engine(engine);
+    pp.nlm.precision = parse_nlm_precision(precision);
+    pp.gamma = gamma; pp.delta = delta; pp.iters = iters; pp.dt = dt;
+    pp.max_tiles_in_flight = max_tiles_in_flight;
+    return pp;
+}
+
+// Python 入口：uint16 进、uint16 出；计算期间释放 GIL。
+// R16 可为任意跨度的 uint16 视图（零拷贝）；out 为可选的调用方 uint16 输出缓冲。
+py::array_t<std::uint16_t> enhance_xray_poisson_nlm_strict_cpp(
+    py::array R16,
+    const std::string& norm_mode, double p_lo, double p_hi, py::object wl, py::object ww,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt, int max_tiles_in_flight,
+    const std::string& engine, const std::string& precision,
+    py::object progress_callback, py::object cancel_flag, py::object out_buf
+){
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(R16, keep, "R16");
+    const int H = (int)R16.shape(0), W = (int)R16.shape(1);
+    PipelineParams pp = make_pipeline_params(norm_mode, p_lo, p_hi, wl, ww, tile, overlap,
+                                             epsilon_8bit, mu, ksize_var,
+                                             search_radius, patch_radius, rho,
+                                             count_target_mean, lam_quant, topk,
+                                             gamma, delta, iters, dt, max_tiles_in_flight, engine, precision);
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&R16});
+    std::uint16_t* dst = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        enhance_pipeline_core(src, H, W, pp, dst, &ctl);
+    }
+    return out;
+}
+
+// 行带流式处理：带 [row0, row1) 所需的输入行区间 (in_row0, in_row1)
+std::pair<int,int> pipeline_band_input_rows_cpp(int H, int row0, int row1,
+                                                std::pair<int,int> tile, int overlap) {
+    PipelineParams pp;
+    pp.tile_h = tile.first; pp.tile_w = tile.second; pp.overlap = overlap;
+    return pipeline_band_input_rows(H, pp, row0, row1);
+}
+
+// 行带流式处理：R16_band 为整幅（H 行）中的输入行 [in_row0, in_row1)（如 memmap 切片，零拷贝），
+// 返回归属行 [row0, row1) 的结果；(vmin, vmax) 为整幅的归一化区间。逐带拼接与整幅调用逐位一致。
+py::array_t<std::uint16_t> enhance_pipeline_band_cpp(
+    py::array R16_band, int H, int row0, int row1, double vmin, double vmax,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt, int max_tiles_in_flight,
+    const std::string& engine, const std::string& precision,
+    py::object progress_callback, py::object cancel_flag, py::object out_buf
+){
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(R16_band, keep, "R16_band");
+    const int W = (int)R16_band.shape(1);
+    PipelineParams pp = make_pipeline_params("percentile", 0.5, 99.5, py::none(), py::none(), tile, overlap,
+                                             epsilon_8bit, mu, ksize_var,
+                                             search_radius, patch_radius, rho,
+                                             count_target_mean, lam_quant, topk,
+                                             gamma, delta, iters, dt, max_tiles_in_flight, engine, precision);
+    const std::pair<int,int> in_rows = pipeline_band_input_rows(H, pp, row0, row1);
+    if (R16_band.shape(0) != in_rows.second - in_rows.first) {
+        throw std::runtime_error("R16_band must hold rows [in_row0, in_row1) from pipeline_band_input_rows_cpp");
+    }
+    if (!(vmax > vmin)) throw std::runtime_error("vmax must be greater than vmin");
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, row1 - row0, W, "out", {&R16_band});
+    std::uint16_t* dst = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        enhance_pipeline_band_core(src, H, W, row0, row1, std::make_pair(vmin, vmax), pp, dst, &ctl);
+    }
+    return out;
+}
+
+// 整幅归一化区间 (vmin, vmax)，与 enhance_xray_poisson_nlm_strict_cpp 内部所用完全相同
+std::pair<double,double> pipeline_normalization_range_cpp(py::array R16, const std::string& norm_mode,
+                                                          double p_lo, double p_hi, py::object wl, py::object ww) {
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(R16, keep, "R16");
+    const int H = (int)R16.shape(0), W = (int)R16.shape(1);
+    PipelineParams pp;
+    pp.norm_window = (norm_mode == "window" && !wl.is_none() && !ww.is_none());
+    if (pp.norm_window) { pp.wl = wl.cast<double>(); pp.ww = ww.cast<double>(); }
+    pp.p_lo = p_lo; pp.p_hi = p_hi;
+    py::gil_scoped_release release;
+    return normalization_range(src, H, W, pp);
+}
+
+// 渐进式细化：分块按到 center = (cy, cx) 的距离由近到远的下标顺序
+std::vector<int> pipeline_tile_order_cpp(int H, int W, std::pair<double,double> center,
+                                         std::pair<int,int> tile, int overlap) {
+    PipelineParams pp;
+    pp.tile_h = tile.first; pp.tile_w = tile.second; pp.overlap = overlap;
+    return pipeline_tile_order(H, W, pp, center.first, center.second);
+}
+
+// 在给定归一化区间下处理 tiles 列出的分块（None 为全部），写回各自的归属区。
+// 只处理部分分块时 out 须为调用方缓冲（其余像素保持原值，如预览的放大结果）；
+// 处理全部分块时 out 可省略，结果与 enhance_xray_poisson_nlm_strict_cpp 在同一区间下逐位一致
+py::array_t<std::uint16_t> enhance_pipeline_tiles_cpp(
+    py::array R16, py::object tiles_obj, double vmin, double vmax,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt, int max_tiles_in_flight,
+    const std::string& engine, const std::string& precision,
+    py::object progress_callback, py::object cancel_flag, py::object out_buf
+){
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(R16, keep, "R16");
+    const int H = (int)R16.shape(0), W = (int)R16.shape(1);
+    PipelineParams pp = make_pipeline_params("percentile", 0.5, 99.5, py::none(), py::none(), tile, overlap,
+                                             epsilon_8bit, mu, ksize_var,
+                                             search_radius, patch_radius, rho,
+                                             count_target_mean, lam_quant, topk,
+                                             gamma, delta, iters, dt, max_tiles_in_flight, engine, precision);
+    if (!(vmax > vmin)) throw std::runtime_error("vmax must be greater than vmin");
+    std::vector<int> index;
+    if (tiles_obj.is_none()) {
+        const int n = (int)iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap).size();
+        for (int i = 0; i < n; ++i) index.push_back(i);
+    } else {
+        if (out_buf.is_none()) throw std::runtime_error("out is required when only some tiles are processed");
+        index = tiles_obj.cast<std::vector<int>>();
+    }
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&R16});
+    std::uint16_t* dst = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        enhance_pipeline_tile_list_core(src, H, W, index, std::make_pair(vmin, vmax), pp, dst, &ctl);
+    }
+    return out;
+}
+
+// 多帧批处理：frames 为 uint16 二维数组列表（形状可各不相同），所有帧的分块在常驻池上统一调度，计算期间释放 GIL。
+// outs 为可选的输出缓冲列表（与 frames 等长，元素可为 None）。progress_callback(done, total) 按全部帧的已完成分块数回调。
+// 返回 (结果列表, 每帧耗时 dict 列表)
+py::tuple enhance_pipeline_batch_cpp(
+    py::list frames, const std::string& norm_mode, double p_lo, double p_hi, py::object wl, py::object ww,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt,
+    const std::string& engine, const std::string& precision,
+    py::object progress_callback, py::object cancel_flag, py::object outs
+){
+    PipelineParams pp = make_pipeline_params(norm_mode, p_lo, p_hi, wl, ww, tile, overlap,
+                                             epsilon_8bit, mu, ksize_var,
+                                             search_radius, patch_radius, rho,
+                                             count_target_mean, lam_quant, topk,
+                                             gamma, delta, iters, dt, 0, engine, precision);
+    const int n = (int)frames.size();
+    py::list out_list = outs.is_none() ? py::list() : outs.cast<py::list>();
+    if (!outs.is_none() && (int)out_list.size() != n) throw std::runtime_error("outs must have one entry per frame");
+
+    std::vector<py::array> arrays(n), keeps(n);
+    std::vector<py::array_t<std::uint16_t>> results(n);
+    std::vector<BatchFrame> batch(n);
+    for (int f = 0; f < n; ++f) {
+        arrays[f] = frames[f].cast<py::array>();
+        BatchFrame& fr = batch[f];
+        fr.src = plane_of<std::uint16_t>(arrays[f], keeps[f], "frame");
+        fr.H = (int)arrays[f].shape(0); fr.W = (int)arrays[f].shape(1);
+        if (fr.H == 0 || fr.W == 0) throw std::runtime_error("frames must not be empty");
+    }
+    for (int f = 0; f < n; ++f) {
+        results[f] = output_buffer<std::uint16_t>(outs.is_none() ? py::none() : py::object(out_list[f]),
+                                                  batch[f].H, batch[f].W, "out", {});
+        for (int g = 0; g < n; ++g) {
+            if (arrays_overlap(results[f], arrays[g])) throw std::runtime_error("out must not overlap an input array");
+            if (g < f && arrays_overlap(results[f], results[g])) throw std::runtime_error("outs must not overlap each other");
+        }
+        batch[f].out = results[f].mutable_data();
+    }
+
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    std::vector<BatchFrameTiming> timing;
+    {
+        py::gil_scoped_release release;
+        enhance_pipeline_batch_core(batch, pp, timing, &ctl);
+    }
+
+    py::list res, stats;
+    for (int f = 0; f < n; ++f) {
+        res.append(results[f]);
+        py::dict d;
+        d["shape"] = py::make_tuple(batch[f].H, batch[f].W);
+        d["tiles"] = timing[f].tiles;
+        d["norm_ms"] = timing[f].norm_ms;
+        d["compute_ms"] = timing[f].compute_ms;
+        d["start_ms"] = timing[f].start_ms;
+        d["end_ms"] = timing[f].end_ms;
+        d["wall_ms"] = timing[f].end_ms - timing[f].start_ms;
+        stats.append(d);
+    }
+    return py::make_tuple(res, stats);
+}
+
+// 脏区域重算：R16 为编辑后的整幅图像，out 为同一组参数下上一次的整幅结果（原地更新，
+// 须为可写、C 连续的 H×W uint16，且不与 R16 重叠）；dirty = (y0, y1, x0, x1) 为编辑过的像素区域。
+// (vmin, vmax) 为上一次结果所用的归一化区间。返回重跑的分块数
+int enhance_pipeline_region_cpp(
+    py::array R16, py::array out_buf, std::tuple<int,int,int,int> dirty, double vmin, double vmax,
+    std::pair<int,int> tile, int overlap,
+    double epsilon_8bit, double mu, int ksize_var,
+    int search_radius, int patch_radius, double rho,
+    double count_target_mean, double lam_quant, int topk,
+    double gamma, double delta, int iters, double dt, int max_tiles_in_flight,
+    const std::string& engine, const std::string& precision,
+    py::object progress_callback, py::object cancel_flag
+){
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(R16, keep, "R16");
+    const int H = (int)R16.shape(0), W = (int)R16.shape(1);
+    PipelineParams pp = make_pipeline_params("percentile", 0.5, 99.5, py::none(), py::none(), tile, overlap,
+                                             epsilon_8bit, mu, ksize_var,
+                                             search_radius, patch_radius, rho,
+                                             count_target_mean, lam_quant, topk,
+                                             gamma, delta, iters, dt, max_tiles_in_flight, engine, precision);
+    if (!(vmax > vmin)) throw std::runtime_error("vmax must be greater than vmin");
+    RunControl ctl;
+    bind_run_control(ctl, progress_callback, cancel_flag);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&R16});
+    std::uint16_t* dst = out.mutable_data();
+    int tiles = 0;
+    {
+        py::gil_scoped_release release;
+        tiles = enhance_pipeline_region_core(src, H, W, std::get<0>(dirty), std::get<1>(dirty),
+                                             std::get<2>(dirty), std::get<3>(dirty),
+                                             std::make_pair(vmin, vmax), pp, dst, &ctl);
+    }
+    return tiles;
+}
+
+// -------------------- 窗宽窗位显示映射 --------------------
+// image 为 2D 像素（uint16 零拷贝；int16/int32/uint8/float32/float64 逐像素裁剪，不生成中间数组），
+// lut 为 65536 项 uint8 查找表（WindowLevelLUT.get_lut 的结果）。out 可为调用方缓冲：
+// 可写 uint8、形状 (H/downsample, W/downsample)、列连续，行跨度任意（如 QImage 的 bytesPerLine）。
+template <typename T>
+static bool window_lut_dispatch(const py::array& image, py::array& keep, int H, int W, const std::uint8_t* lut,
+                                bool invert, int factor, std::uint8_t* dst, std::ptrdiff_t stride) {
+    if (!py::isinstance<py::array_t<T>>(image)) return false;
+    Plane<T> src = plane_of<T>(image, keep, "image");
+    py::gil_scoped_release release;
+    apply_window_lut_core(src, H, W, lut, invert, factor, dst, stride);
+    return true;
+}
+
+py::array_t<std::uint8_t> apply_window_lut_cpp(py::array image, py::array_t<std::uint8_t, py::array::c_style | py::array::forcecast> lut,
+                                               bool invert, int downsample, py::object out_buf) {
+    if (image.ndim() != 2) throw std::runtime_error("image must be a 2D array");
+    if (lut.ndim() != 1 || lut.shape(0) != 65536) throw std::runtime_error("lut must hold 65536 uint8 entries");
+    if (downsample != 1 && downsample != 2 && downsample != 4) throw std::runtime_error("downsample must be 1, 2 or 4");
+    const int H = (int)image.shape(0), W = (int)image.shape(1);
+    const int Ho = H / downsample, Wo = W / downsample;
+
+    py::array_t<std::uint8_t> out;
+    if (out_buf.is_none()) {
+        out = py::array_t<std::uint8_t>({Ho, Wo});
+    } else {
+        if (!py::isinstance<py::array_t<std::uint8_t>>(out_buf)) throw std::runtime_error("out has the wrong dtype");
+        out = out_buf.cast<py::array_t<std::uint8_t>>();
+        if (out.ndim() != 2 || out.shape(0) != Ho || out.shape(1) != Wo || !out.writeable() ||
+            (Wo > 1 && out.strides(1) != 1) || (Ho > 1 && out.strides(0) < Wo)) {
+            throw std::runtime_error("out must be a writable uint8 (H/downsample, W/downsample) array with contiguous rows");
+        }
+        if (arrays_overlap(out, image)) throw std::runtime_error("out must not overlap image");
+    }
+    if (Ho == 0 || Wo == 0) return out;
+    std::uint8_t* dst = out.mutable_data();
+    const std::ptrdiff_t stride = out.strides(0);
+    const std::uint8_t* table = lut.data();
+
+    py::array keep;
+    if (window_lut_dispatch<std::uint16_t>(image, keep, H, W, table, invert, downsample, dst, stride) ||
+        window_lut_dispatch<std::int16_t>(image, keep, H, W, table, invert, downsample, dst, stride) ||
+        window_lut_dispatch<std::int32_t>(image, keep, H, W, table, invert, downsample, dst, stride) ||
+        window_lut_dispatch<std::uint8_t>(image, keep, H, W, table, invert, downsample, dst, stride) ||
+        window_lut_dispatch<float>(image, keep, H, W, table, invert, downsample, dst, stride)) {
+        return out;
+    }
+    // 其余 dtype 按 float64 读取（plane_of 必要时转换一次）
+    Plane<double> src = plane_of<double>(image, keep, "image");
+    {
+        py::gil_scoped_release release;
+        apply_window_lut_core(src, H, W, table, invert, downsample, dst, stride);
+    }
+    return out;
+}
+
+// -------------------- 频域滤波引擎 --------------------
+// 同一引擎缓存 FFT 计划、最近的掩膜与最近一幅输入的频谱；输入内容不变时（如拖动 cutoff_ratio）跳过正变换。
+class FrequencyFilterEngine {
+public:
+    py::array_t<std::uint16_t> filter(py::array image, double cutoff_ratio, const std::string& filter_type,
+                                      py::object out_buf) {
+        if (image.ndim() != 2) throw std::runtime_error("image must be a 2D array");
+        const int type = parse_frequency_filter_type(filter_type);
+        const int H = (int)image.shape(0), W = (int)image.shape(1);
+        py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&image});
+        std::uint16_t* dst = out.mutable_data();
+        if (py::isinstance<py::array_t<std::uint16_t>>(image)) {
+            run<std::uint16_t>(image, H, W, cutoff_ratio, type, dst);
+        } else if (py::isinstance<py::array_t<double>>(image)) {
+            run<double>(image, H, W, cutoff_ratio, type, dst);
+        } else {
+            run<float>(image, H, W, cutoff_ratio, type, dst);
+        }
+        return out;
+    }
+
+    // 引擎当前持有的频谱、工作区与掩膜内存（字节）
+    py::dict memory_usage() {
+        std::size_t bytes = 0;
+        int H = 0, W = 0;
+        long long hits = 0, misses = 0;
+        {
+            py::gil_scoped_release release;
+            std::lock_guard<std::mutex> lock(mtx_);
+            bytes = core_.memory_bytes();
+            H = core_.height(); W = core_.width();
+            hits = hits_; misses = misses_;
+        }
+        py::dict d;
+        d["total_bytes"] = (long long)bytes;
+        d["shape"] = py::make_tuple(H, W);
+        d["spectrum_hits"] = hits;
+        d["spectrum_misses"] = misses;
+        return d;
+    }
+
+    void reset() {
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mtx_);
+        core_.release();
+    }
+
+private:
+    template <typename T>
+    void run(const py::array& image, int H, int W, double cutoff_ratio, int type, std::uint16_t* dst) {
+        py::array keep;
+        Plane<T> src = plane_of<T>(image, keep, "image");
+        py::gil_scoped_release release;
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (core_.load(src, H, W)) ++hits_; else ++misses_;
+        core_.filter(src, cutoff_ratio, type, dst, W);
+    }
+
+    FrequencyFilterCore core_;
+    long long hits_ = 0, misses_ = 0;
+    std::mutex mtx_;
+};
+
+// -------------------- 多尺度细节增强 + 光照归一化 --------------------
+// DicomEnhancer.advanced/super_enhance 前三步的融合实现，返回 [0, 1] 的 float32 图像（见 multiscale_enhance_core）
+py::array_t<float> multiscale_enhance_cpp(py::array data, int var_ksize,
+                                          std::vector<double> detail_sigma, std::vector<double> detail_a,
+                                          std::vector<double> detail_b, double base_weight,
+                                          std::vector<double> illum_sigma, std::vector<double> illum_weight,
+                                          int illum_decimation, py::object out_buf) {
+    if (data.ndim() != 2) throw std::runtime_error("data must be a 2D array");
+    MultiScaleParams mp;
+    mp.var_ksize = var_ksize;
+    mp.detail_sigma = detail_sigma; mp.detail_a = detail_a; mp.detail_b = detail_b;
+    mp.base_weight = base_weight;
+    mp.illum_sigma = illum_sigma; mp.illum_weight = illum_weight;
+    mp.illum_decimation = illum_decimation;
+    validate_multiscale_params(mp);
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array_t<float> out = output_buffer<float>(out_buf, H, W, "out", {&data});
+    float* dst = out.mutable_data();
+    py::array keep;
+    if (py::isinstance<py::array_t<std::uint16_t>>(data)) {
+        Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+        py::gil_scoped_release release;
+        multiscale_enhance_core(src, H, W, mp, dst);
+    } else if (py::isinstance<py::array_t<double>>(data)) {
+        Plane<double> src = plane_of<double>(data, keep, "data");
+        py::gil_scoped_release release;
+        multiscale_enhance_core(src, H, W, mp, dst);
+    } else {
+        Plane<float> src = plane_of<float>(data, keep, "data");
+        py::gil_scoped_release release;
+        multiscale_enhance_core(src, H, W, mp, dst);
+    }
+    return out;
+}
+
+// -------------------- 窗宽窗位自适应增强 --------------------
+// CLAHE 之前的部分：返回 (uint16 图像, 统计 dict)；verbose=False 时只做算法必需的统计
+py::tuple window_enhance_prepare_cpp(py::array data, double window_width, double window_level,
+                                     bool verbose, int illum_decimation) {
+    if (data.ndim() != 2) throw std::runtime_error("data must be a 2D array");
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array_t<std::uint16_t> out({H, W});
+    std::uint16_t* dst = out.mutable_data();
+    WindowEnhanceInfo st;
+    py::array keep;
+    if (py::isinstance<py::array_t<std::uint16_t>>(data)) {
+        Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+        py::gil_scoped_release release;
+        window_enhance_prepare_core(src, H, W, window_width, window_level, verbose, illum_decimation, dst, &st);
+    } else {
+        Plane<float> src = plane_of<float>(data, keep, "data");
+        py::gil_scoped_release release;
+        window_enhance_prepare_core(src, H, W, window_width, window_level, verbose, illum_decimation, dst, &st);
+    }
+    py::dict d;
+    d["data_min"] = st.data_min; d["data_max"] = st.data_max;
+    d["roi_pixels"] = st.roi_pixels; d["roi_ratio"] = st.roi_ratio;
+    d["noise_level"] = st.noise_level; d["gamma"] = st.gamma;
+    d["strength_small"] = st.strength_small; d["strength_large"] = st.strength_large;
+    if (verbose) {
+        d["mean"] = st.mean; d["std"] = st.std; d["high_noise_ratio"] = st.high_noise_ratio;
+        d["weight_range"] = py::make_tuple(st.weight_min, st.weight_max);
+        d["detail_range"] = py::make_tuple(st.detail_min, st.detail_max);
+        d["detail_mean"] = st.detail_mean;
+    }
+    return py::make_tuple(out, d);
+}
+
+// CLAHE 之后的部分：映射回 [data_min, data_max] 并与原图按 alpha 混合
+py::array_t<std::uint16_t> window_enhance_finish_cpp(py::array clahe, py::array data, double data_min,
+                                                     double data_max, double alpha, py::object out_buf) {
+    if (clahe.ndim() != 2 || data.ndim() != 2 || clahe.shape(0) != data.shape(0) || clahe.shape(1) != data.shape(1)) {
+        throw std::runtime_error("clahe and data must be 2D arrays of the same shape");
+    }
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array kc, kd;
+    Plane<std::uint16_t> c = plane_of<std::uint16_t>(clahe, kc, "clahe");
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&clahe, &data});
+    std::uint16_t* dst = out.mutable_data();
+    if (py::isinstance<py::array_t<std::uint16_t>>(data)) {
+        Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, kd, "data");
+        py::gil_scoped_release release;
+        window_enhance_finish_core(c, src, H, W, data_min, data_max, alpha, dst);
+    } else {
+        Plane<float> src = plane_of<float>(data, kd, "data");
+        py::gil_scoped_release release;
+        window_enhance_finish_core(c, src, H, W, data_min, data_max, alpha, dst);
+    }
+    return out;
+}
+
+// -------------------- 边缘算子 --------------------
+// EdgeProcessor.sobel/laplacian/roberts_edge：uint16 进、uint16 出，幅值与归一化一遍写出（见 edge_filter_core）
+py::array_t<std::uint16_t> edge_filter_cpp(py::array data, const std::string& op, bool normalize,
+                                           py::object out_buf) {
+    const int kind = parse_edge_operator(op);
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&data});
+    std::uint16_t* dst = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        edge_filter_core(src, H, W, kind, normalize, dst, 0.0, nullptr);
+    }
+    return out;
+}
+
+// EdgeProcessor.edge_enhancement：原图 + 边缘；edges_out 非空时同一遍写出未归一化的边缘图（可直接做叠加显示）
+py::array_t<std::uint16_t> edge_enhance_cpp(py::array data, double edge_strength, const std::string& op,
+                                            py::object out_buf, py::object edges_buf) {
+    const int kind = parse_edge_operator(op);
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&data});
+    std::uint16_t* dst = out.mutable_data();
+    std::uint16_t* edges = nullptr;
+    py::array_t<std::uint16_t> edges_arr;
+    if (!edges_buf.is_none()) {
+        edges_arr = output_buffer<std::uint16_t>(edges_buf, H, W, "edges_out", {&data, &out});
+        edges = edges_arr.mutable_data();
+    }
+    {
+        py::gil_scoped_release release;
+        edge_filter_core(src, H, W, kind, false, edges, edge_strength, dst);
+    }
+    return out;
+}
+
+// EdgeProcessor.canny_edge：边缘像素 65535，其余 0（见 canny_edge_core）
+py::array_t<std::uint16_t> canny_edge_cpp(py::array data, double sigma, double low_threshold,
+                                          double high_threshold, py::object out_buf) {
+    py::array keep;
+    Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+    const int H = (int)data.shape(0), W = (int)data.shape(1);
+    py::array_t<std::uint16_t> out = output_buffer<std::uint16_t>(out_buf, H, W, "out", {&data});
+    std::uint16_t* dst = out.mutable_data();
+    {
+        py::gil_scoped_release release;
+        canny_edge_core(src, H, W, sigma, low_threshold, high_threshold, dst);
+    }
+    return out;
+}
+
+// -------------------- 图像直方图统计 --------------------
+// 构造时建一次 65536 档直方图（计算期间释放 GIL）；分位数、np.histogram 分箱、有效范围与智能滑块范围
+// 之后都只读直方图。Python 侧按图像缓存同一个实例，ImageManager / WindowBasedEnhancer / 直方图窗口共用
+class ImageHistogram {
+public:
+    explicit ImageHistogram(py::array data) {
+        if (!py::isinstance<py::array_t<std::uint16_t>>(data)) throw std::runtime_error("data must be a uint16 array");
+        py::array keep;
+        Plane<std::uint16_t> src = plane_of<std::uint16_t>(data, keep, "data");
+        H_ = (int)data.shape(0); W_ = (int)data.shape(1);
+        py::gil_scoped_release release;
+        core_.build(src, H_, W_);
+    }
+
+    double percentile(double p) const {
+        if (!(p >= 0.0 && p <= 100.0)) throw std::runtime_error("percentile must be in [0, 100]");
+        return core_.hist.percentile(p);
+    }
+
+    std::vector<double> percentiles(const std::vector<double>& ps) const {
+        std::vector<double> r;
+        for (double p : ps) r.push_back(percentile(p));
+        return r;
+    }
+
+    std::pair<double,double> effective_range() const {
+        double lo, hi;
+        core_.effective_range(&lo, &hi);
+        return std::make_pair(lo, hi);
+    }
+
+    // ((ww_min, ww_max), (wl_min, wl_max))
+    py::tuple slider_ranges(double window_width, double window_level) const {
+        int r[4];
+        core_.slider_ranges(window_width, window_level, r);
+        return py::make_tuple(py::make_tuple(r[0], r[1]), py::make_tuple(r[2], r[3]));
+    }
+
+    // 同 np.histogram(data, bins, range)：返回 (int64 计数, float64 边界)；range=None 时为 (min, max)
+    py::tuple histogram(int bins, py::object range) const {
+        double lo = core_.data_min, hi = core_.data_max;
+        if (!range.is_none()) {
+            std::pair<double,double> r = range.cast<std::pair<double,double>>();
+            lo = r.first; hi = r.second;
+        }
+        const HistogramBins hb(bins, lo, hi);
+        py::array_t<std::int64_t> counts(bins);
+        py::array_t<double> edges(bins + 1);
+        double* e = edges.mutable_data();
+        for (int i = 0; i <= bins; ++i) e[i] = hb.edge(i);
+        core_.binned(hb, counts.mutable_data());
+        return py::make_tuple(counts, edges);
+    }
+
+    // 65536 档原始计数（下标即灰度）
+    py::array_t<std::int64_t> counts() const {
+        py::array_t<std::int64_t> out(65536);
+        std::int64_t* dst = out.mutable_data();
+        for (int b = 0; b < 65536; ++b) dst[b] = (std::int64_t)core_.hist.counts[b];
+        return out;
+    }
+
+    // [lo, hi] 灰度区间内像素的 count / mean / std / min / max（count 为 0 时其余为 0）
+    py::dict range_stats(int lo, int hi) const {
+        const HistogramRangeStats st = core_.range_stats(lo, hi);
+        py::dict d;
+        d["count"] = st.count; d["mean"] = st.mean; d["std"] = st.std;
+        d["min"] = st.min; d["max"] = st.max;
+        return d;
+    }
+
+    py::tuple shape() const { return py::make_tuple(H_, W_); }
+    std::uint64_t size() const { return core_.hist.n; }
+    int min() const { return core_.data_min; }
+    int max() const { return core_.data_max; }
+    double mean() const { return core_.mean; }
+    double std() const { return core_.std; }
+
+private:
+    ImageHistogramCore core_;
+    int H_ = 0, W_ = 0;
+};
+
+// -------------------- 运行环境查询与 SIMD 实现选择 --------------------
+// 当前使用的块距离实现名
+std::string get_simd_backend() {
+    return current_row_distance().name;
+}
+
+// 强制选择实现（"auto" 恢复自动检测）；用于对比验证与问题排查
+void set_simd_backend(const std::string& name) {
+    auto impls = available_row_distance_impls();
+    std::lock_guard<std::mutex> lock(g_row_distance_mtx);
+    if (name == "auto") { g_row_distance = impls.front(); return; }
+    for (const auto& impl : impls) {
+        if (name == impl.name) { g_row_distance = impl; return; }
+    }
+    throw std::runtime_error("SIMD backend not available on this CPU: " + name);
+}
+
+// 所有可用实现名
+std::vector<std::string> get_available_simd_backends() {
+    std::vector<std::string> names;
+    for (const auto& impl : available_row_distance_impls()) names.push_back(impl.name);
+    return names;
+}
+
+// -------------------- 计算后端（CPU / CUDA）选择 --------------------
+// 当前实际使用的后端："cuda" 或 "cpu"
+std::string get_compute_backend() {
+    return use_cuda_backend() ? "cuda" : "cpu";
+}
+
+// "auto" / "cpu" / "cuda"；强制 "cuda" 而本机不可用时报错（"auto" 会静默回退）
+void set_compute_backend(const std::string& name) {
+    const int b = parse_compute_backend(name);
+    if (b == kComputeCUDA && !cuda_backend_usable()) {
+#ifdef POISSON_NLM_WITH_CUDA
+        throw std::runtime_error("CUDA backend not available: no CUDA device found");
+#else
+        throw std::runtime_error("CUDA backend not available: extension was built without CUDA");
+#endif
+    }
+    g_compute_backend = b;
+}
+
+std::vector<std::string> get_available_compute_backends() {
+    std::vector<std::string> names(1, "cpu");
+    if (cuda_backend_usable()) names.push_back("cuda");
+    return names;
+}
+
+// GPU 设备描述（无 CUDA 后端或无设备时为空串）
+std::string get_cuda_device_info() {
+#ifdef POISSON_NLM_WITH_CUDA
+    return nlm_cuda_device_info();
+#else
+    return std::string();
+#endif
+}
+
+// -------------------- 热路径统计与 trace --------------------
+// 分阶段计时、计数器与线程忙碌时间（毫秒）；imbalance 为最忙线程与平均忙碌时间之比（1 为完全均衡）
+py::dict get_stats() {
+    py::dict res;
+#ifdef POISSON_NLM_NO_STATS
+    res["compiled"] = false;
+#else
+    res["compiled"] = true;
+#endif
+    PipelineStats& st = pipeline_stats();
+    res["enabled"] = st.enabled.load();
+
+    py::dict stages;
+    for (int i = 0; i < kStatStageCount; ++i) {
+        const PipelineStats::Stage& s = st.stages[i];
+        const long long calls = s.calls.load();
+        if (calls == 0) continue;
+        const double total_ms = s.ns.load() / 1e6;
+        const long long pixels = s.pixels.load();
+        py::dict d;
+        d["calls"] = calls;
+        d["total_ms"] = total_ms;
+        d["mean_ms"] = total_ms / calls;
+        d["max_ms"] = s.max_ns.load() / 1e6;
+        d["pixels"] = pixels;
+        d["mpix_per_s"] = total_ms > 0.0 ? pixels / (total_ms * 1e3) : 0.0;
+        stages[kStatStageNames[i]] = d;
+    }
+    res["stages"] = stages;
+
+    py::dict counters;
+    for (int i = 0; i < kStatCounterCount; ++i) counters[kStatCounterNames[i]] = st.counters[i].load();
+    res["counters"] = counters;
+
+    py::list busy;
+    double total = 0.0, peak = 0.0;
+    int active = 0;
+    const int nslots = std::min(st.thread_count.load(), kStatMaxThreads);
+    for (int i = 0; i < nslots; ++i) {
+        const long long scopes = st.threads[i].scopes.load();
+        if (scopes == 0) continue;
+        const double ms = st.threads[i].busy_ns.load() / 1e6;
+        py::dict d;
+        d["slot"] = i;
+        d["busy_ms"] = ms;
+        d["scopes"] = scopes;
+        busy.append(d);
+        total += ms;
+        peak = std::max(peak, ms);
+        ++active;
+    }
+    py::dict threads;
+    threads["busy"] = busy;
+    threads["imbalance"] = (active > 0 && total > 0.0) ? peak / (total / active) : 1.0;
+    res["threads"] = threads;
+
+    py::dict trace;
+    trace["active"] = st.tracing.load();
+    trace["events"] = (long long)st.trace_size();
+    trace["dropped"] = st.trace_dropped();
+    res["trace"] = trace;
+    return res;
+}
+
+void reset_stats() { pipeline_stats().reset(); }
+
+void set_stats_enabled(bool enabled) { pipeline_stats().enabled = enabled; }
+
+// 开始记录阶段事件（清空上一段 trace）；超过 max_events 的事件丢弃并计数
+void start_trace(long long max_events) {
+    if (max_events <= 0) throw std::runtime_error("max_events must be > 0");
+    pipeline_stats().start_trace(std::size_t(max_events));
+}
+
+void stop_trace() { pipeline_stats().stop_trace(); }
+
+// 写出 Chrome trace JSON（chrome://tracing / Perfetto），返回事件数
+long long dump_trace(const std::string& path) {
+    PipelineStats& st = pipeline_stats();
+    const std::string js = st.chrome_trace_json();
+    std::FILE* f = std::fopen(path.c_str(), "wb");
+    if (!f) throw std::runtime_error("cannot open trace file: " + path);
+    const bool ok = std::fwrite(js.data(), 1, js.size(), f) == js.size();
+    if (std::fclose(f) != 0 || !ok) throw std::runtime_error("failed to write trace file: " + path);
+    return (long long)st.trace_size();
 }
 
 // 检查OpenMP是否可用
@@ -253,13 +1229,187 @@ int get_openmp_threads() {
 
 PYBIND11_MODULE(poisson_nlm_cpp, m) {
     m.doc() = "Strict Poisson NLM on gradient field (pybind11 + OpenMP)";
+    // 取消时抛出；继承 InterruptedError，调用方可按 Python 内建异常捕获
+    py::register_exception<CancelledError>(m, "CancelledError", PyExc_InterruptedError);
     m.def("poisson_nlm_on_gradient_exact_cpp", &poisson_nlm_on_gradient_exact_cpp,
           py::arg("Gx_prime"), py::arg("Gy_prime"),
           py::arg("search_radius")=3, py::arg("patch_radius")=1,
           py::arg("rho")=1.5, py::arg("count_target_mean")=30.0,
-          py::arg("lam_quant")=0.02, py::arg("topk")=0);
+          py::arg("lam_quant")=0.02, py::arg("topk")=0,
+          py::arg("return_lambda")=false, py::arg("engine")="patch", py::arg("block_size")=0,
+          py::arg("precision")="double",
+          py::arg("pyramid_levels")=1, py::arg("refine_candidates")=4, py::arg("guide")=py::none(),
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none(),
+          py::arg("Gx_out")=py::none(), py::arg("Gy_out")=py::none(),
+          py::arg("lam_bar_out")=py::none());
+    // d(λx,λy) 的闭式求值（与建 d 表同一实现），可传数组；供与直接 PMF 求和对照
+    m.def("poisson_l2_distance_cpp",
+          py::vectorize(static_cast<double (*)(double, double)>(&poisson_L2_distance)),
+          py::arg("lam_x"), py::arg("lam_y"));
+    m.def("validate_nlm_precision_cpp", &validate_nlm_precision_cpp,
+          py::arg("Gx_prime"), py::arg("Gy_prime"),
+          py::arg("search_radius")=3, py::arg("patch_radius")=1,
+          py::arg("rho")=1.5, py::arg("count_target_mean")=30.0,
+          py::arg("lam_quant")=0.02, py::arg("topk")=0, py::arg("engine")="patch");
+    py::class_<PoissonNLMEngine>(m, "PoissonNLMEngine")
+        .def(py::init<int, int, double, double, double, int, const std::string&, int,
+                      const std::string&, std::pair<int,int>, int, int, int>(),
+             py::arg("search_radius")=3, py::arg("patch_radius")=1,
+             py::arg("rho")=1.5, py::arg("count_target_mean")=30.0,
+             py::arg("lam_quant")=0.02, py::arg("topk")=0,
+             py::arg("engine")="patch", py::arg("block_size")=0, py::arg("precision")="double",
+             py::arg("max_shape")=std::make_pair(0, 0), py::arg("threads")=0,
+             py::arg("pyramid_levels")=1, py::arg("refine_candidates")=4)
+        .def("process", &PoissonNLMEngine::process,
+             py::arg("Gx_prime"), py::arg("Gy_prime"),
+             py::arg("Gx_out")=py::none(), py::arg("Gy_out")=py::none(),
+             py::arg("lam_bar_out")=py::none(), py::arg("return_lambda")=false,
+             py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none())
+        .def("memory_usage", &PoissonNLMEngine::memory_usage)
+        .def("reset", &PoissonNLMEngine::reset);
+    m.def("adaptive_gradient_enhance_cpp", &adaptive_gradient_enhance_cpp,
+          py::arg("R_unit"), py::arg("epsilon_unit")=2.3/(255.0*255.0),
+          py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("exact_percentile")=false, py::arg("return_magnitude")=false,
+          py::arg("Gx_out")=py::none(), py::arg("Gy_out")=py::none());
+    m.def("variational_reconstruct_cpp", &variational_reconstruct_cpp,
+          py::arg("I"), py::arg("Gx"), py::arg("Gy"),
+          py::arg("gamma")=0.2, py::arg("delta")=0.8,
+          py::arg("iters")=10, py::arg("dt")=0.15);
+    m.def("poisson_nlm_reconstruct_cpp", &poisson_nlm_reconstruct_cpp,
+          py::arg("R_unit"), py::arg("Gx_prime"), py::arg("Gy_prime"),
+          py::arg("search_radius")=3, py::arg("patch_radius")=1,
+          py::arg("rho")=1.5, py::arg("count_target_mean")=30.0,
+          py::arg("lam_quant")=0.02, py::arg("topk")=0,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8,
+          py::arg("iters")=10, py::arg("dt")=0.15,
+          py::arg("return_lambda")=false, py::arg("engine")="patch", py::arg("block_size")=0,
+          py::arg("precision")="double",
+          py::arg("I_out")=py::none(), py::arg("lam_bar_out")=py::none(),
+          py::arg("grad_mag")=py::none());
+    m.def("enhance_xray_poisson_nlm_strict_cpp", &enhance_xray_poisson_nlm_strict_cpp,
+          py::arg("R16"),
+          py::arg("norm_mode")="percentile", py::arg("p_lo")=0.5, py::arg("p_hi")=99.5,
+          py::arg("wl")=py::none(), py::arg("ww")=py::none(),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32,
+          py::arg("epsilon_8bit")=2.3, py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("search_radius")=2, py::arg("patch_radius")=1, py::arg("rho")=1.5,
+          py::arg("count_target_mean")=30.0, py::arg("lam_quant")=0.02, py::arg("topk")=25,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8, py::arg("iters")=6, py::arg("dt")=0.15,
+          py::arg("max_tiles_in_flight")=0, py::arg("engine")="patch", py::arg("precision")="double",
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none(),
+          py::arg("out")=py::none());
+    m.def("pipeline_band_input_rows_cpp", &pipeline_band_input_rows_cpp,
+          py::arg("H"), py::arg("row0"), py::arg("row1"),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32);
+    m.def("enhance_pipeline_band_cpp", &enhance_pipeline_band_cpp,
+          py::arg("R16_band"), py::arg("H"), py::arg("row0"), py::arg("row1"),
+          py::arg("vmin"), py::arg("vmax"),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32,
+          py::arg("epsilon_8bit")=2.3, py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("search_radius")=2, py::arg("patch_radius")=1, py::arg("rho")=1.5,
+          py::arg("count_target_mean")=30.0, py::arg("lam_quant")=0.02, py::arg("topk")=25,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8, py::arg("iters")=6, py::arg("dt")=0.15,
+          py::arg("max_tiles_in_flight")=0, py::arg("engine")="patch", py::arg("precision")="double",
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none(),
+          py::arg("out")=py::none());
+    m.def("pipeline_normalization_range_cpp", &pipeline_normalization_range_cpp,
+          py::arg("R16"), py::arg("norm_mode")="percentile", py::arg("p_lo")=0.5, py::arg("p_hi")=99.5,
+          py::arg("wl")=py::none(), py::arg("ww")=py::none());
+    m.def("pipeline_tile_order_cpp", &pipeline_tile_order_cpp,
+          py::arg("H"), py::arg("W"), py::arg("center"),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32);
+    m.def("enhance_pipeline_tiles_cpp", &enhance_pipeline_tiles_cpp,
+          py::arg("R16"), py::arg("tiles"), py::arg("vmin"), py::arg("vmax"),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32,
+          py::arg("epsilon_8bit")=2.3, py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("search_radius")=2, py::arg("patch_radius")=1, py::arg("rho")=1.5,
+          py::arg("count_target_mean")=30.0, py::arg("lam_quant")=0.02, py::arg("topk")=25,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8, py::arg("iters")=6, py::arg("dt")=0.15,
+          py::arg("max_tiles_in_flight")=0, py::arg("engine")="patch", py::arg("precision")="double",
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none(),
+          py::arg("out")=py::none());
+    m.def("enhance_pipeline_batch_cpp", &enhance_pipeline_batch_cpp,
+          py::arg("frames"),
+          py::arg("norm_mode")="percentile", py::arg("p_lo")=0.5, py::arg("p_hi")=99.5,
+          py::arg("wl")=py::none(), py::arg("ww")=py::none(),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32,
+          py::arg("epsilon_8bit")=2.3, py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("search_radius")=2, py::arg("patch_radius")=1, py::arg("rho")=1.5,
+          py::arg("count_target_mean")=30.0, py::arg("lam_quant")=0.02, py::arg("topk")=25,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8, py::arg("iters")=6, py::arg("dt")=0.15,
+          py::arg("engine")="patch", py::arg("precision")="double",
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none(),
+          py::arg("outs")=py::none());
+    m.def("enhance_pipeline_region_cpp", &enhance_pipeline_region_cpp,
+          py::arg("R16"), py::arg("out"), py::arg("dirty"), py::arg("vmin"), py::arg("vmax"),
+          py::arg("tile")=std::make_pair(1024, 1024), py::arg("overlap")=32,
+          py::arg("epsilon_8bit")=2.3, py::arg("mu")=10.0, py::arg("ksize_var")=5,
+          py::arg("search_radius")=2, py::arg("patch_radius")=1, py::arg("rho")=1.5,
+          py::arg("count_target_mean")=30.0, py::arg("lam_quant")=0.02, py::arg("topk")=25,
+          py::arg("gamma")=0.2, py::arg("delta")=0.8, py::arg("iters")=6, py::arg("dt")=0.15,
+          py::arg("max_tiles_in_flight")=0, py::arg("engine")="patch", py::arg("precision")="double",
+          py::arg("progress_callback")=py::none(), py::arg("cancel_flag")=py::none());
+    m.def("apply_window_lut_cpp", &apply_window_lut_cpp,
+          py::arg("image"), py::arg("lut"), py::arg("invert")=false, py::arg("downsample")=1,
+          py::arg("out")=py::none());
+    m.def("multiscale_enhance_cpp", &multiscale_enhance_cpp,
+          py::arg("data"), py::arg("var_ksize")=0,
+          py::arg("detail_sigma")=std::vector<double>(), py::arg("detail_a")=std::vector<double>(),
+          py::arg("detail_b")=std::vector<double>(), py::arg("base_weight")=1.0,
+          py::arg("illum_sigma")=std::vector<double>(), py::arg("illum_weight")=std::vector<double>(),
+          py::arg("illum_decimation")=0, py::arg("out")=py::none());
+    m.def("window_enhance_prepare_cpp", &window_enhance_prepare_cpp,
+          py::arg("data"), py::arg("window_width"), py::arg("window_level"),
+          py::arg("verbose")=false, py::arg("illum_decimation")=0);
+    m.def("window_enhance_finish_cpp", &window_enhance_finish_cpp,
+          py::arg("clahe"), py::arg("data"), py::arg("data_min"), py::arg("data_max"),
+          py::arg("alpha")=0.85, py::arg("out")=py::none());
+    m.def("edge_filter_cpp", &edge_filter_cpp,
+          py::arg("data"), py::arg("op")="sobel", py::arg("normalize")=true, py::arg("out")=py::none());
+    m.def("edge_enhance_cpp", &edge_enhance_cpp,
+          py::arg("data"), py::arg("edge_strength")=1.0, py::arg("op")="sobel",
+          py::arg("out")=py::none(), py::arg("edges_out")=py::none());
+    m.def("canny_edge_cpp", &canny_edge_cpp,
+          py::arg("data"), py::arg("sigma")=1.0, py::arg("low_threshold")=0.1,
+          py::arg("high_threshold")=0.2, py::arg("out")=py::none());
+    py::class_<ImageHistogram>(m, "ImageHistogram")
+        .def(py::init<py::array>(), py::arg("data"))
+        .def("percentile", &ImageHistogram::percentile, py::arg("p"))
+        .def("percentiles", &ImageHistogram::percentiles, py::arg("ps"))
+        .def("effective_range", &ImageHistogram::effective_range)
+        .def("slider_ranges", &ImageHistogram::slider_ranges, py::arg("window_width"), py::arg("window_level"))
+        .def("histogram", &ImageHistogram::histogram, py::arg("bins")=65536, py::arg("range")=py::none())
+        .def("counts", &ImageHistogram::counts)
+        .def("range_stats", &ImageHistogram::range_stats, py::arg("lo"), py::arg("hi"))
+        .def_property_readonly("shape", &ImageHistogram::shape)
+        .def_property_readonly("size", &ImageHistogram::size)
+        .def_property_readonly("min", &ImageHistogram::min)
+        .def_property_readonly("max", &ImageHistogram::max)
+        .def_property_readonly("mean", &ImageHistogram::mean)
+        .def_property_readonly("std", &ImageHistogram::std);
+    py::class_<FrequencyFilterEngine>(m, "FrequencyFilterEngine")
+        .def(py::init<>())
+        .def("filter", &FrequencyFilterEngine::filter,
+             py::arg("image"), py::arg("cutoff_ratio"), py::arg("filter_type"), py::arg("out")=py::none())
+        .def("memory_usage", &FrequencyFilterEngine::memory_usage)
+        .def("reset", &FrequencyFilterEngine::reset);
     m.def("is_openmp_available", &is_openmp_available);
     m.def("get_openmp_threads", &get_openmp_threads);
+    m.def("get_simd_backend", &get_simd_backend);
+    m.def("set_simd_backend", &set_simd_backend, py::arg("name"));
+    m.def("get_available_simd_backends", &get_available_simd_backends);
+    m.def("get_compute_backend", &get_compute_backend);
+    m.def("set_compute_backend", &set_compute_backend, py::arg("name"));
+    m.def("get_available_compute_backends", &get_available_compute_backends);
+    m.def("get_cuda_device_info", &get_cuda_device_info);
+    m.def("get_compute_fallback_reason", &compute_backend_fallback_reason);
+    m.def("get_stats", &get_stats);
+    m.def("reset_stats", &reset_stats);
+    m.def("set_stats_enabled", &set_stats_enabled, py::arg("enabled"));
+    m.def("start_trace", &start_trace, py::arg("max_events") = 1LL << 20);
+    m.def("stop_trace", &stop_trace);
+    m.def("dump_trace", &dump_trace, py::arg("path"));
     m.attr("__version__") = "0.1.0";
 }
 
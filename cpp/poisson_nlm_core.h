@@ -0,0 +1,2401 @@
+// cpp/poisson_nlm_core.h
+// 泊松 NLM 流水线的纯 C++ 核心（不依赖 Python）：d 表、SIMD 块距离核、NLM、变分重建、分块流水线。
+// 由 poisson_nlm.cpp（pybind11 绑定）与 bench_poisson_nlm.cpp（基准程序）各自包含，每个目标只含一个翻译单元。
+#pragma once
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <chrono>
+#include <type_traits>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#ifdef POISSON_NLM_WITH_CUDA
+#include "poisson_nlm_cuda.h"
+#endif
+
+#include "pipeline_stats.h"
+
+#if defined(__linux__)
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <sys/sysctl.h>
+#endif
+
+// -------------------- d(λx,λy)（L2分布距离） --------------------
+// d = Σ_r (p_x(r) - p_y(r))² = S(λx,λx) + S(λy,λy) - 2·S(λx,λy)，其中
+// S(a,b) = Σ_r p_a(r)·p_b(r) = e^{-(a+b)}·I₀(2√(ab))（闭式，无截断误差，代价与 λ 无关）。
+// 2√(ab) < kBesselAsymptoticZ 时按 I₀ 幂级数求和（全为正项，无相消）；
+// 否则用大参数渐近展开 e^{-z}·I₀(z) ≈ 1/√(2πz)·Σ_k [(2k-1)!!]²/(k!·(8z)^k)，首项即高斯近似
+static const double kBesselAsymptoticZ = 30.0;
+
+// 单个 λ 的预计算量：建表时每个格点只算一次
+struct PoissonTerms {
+    double lam, sqrt_lam, exp_neg;   // λ, √λ, e^{-λ}
+};
+
+static inline PoissonTerms poisson_terms(double lam) {
+    PoissonTerms t = { lam, std::sqrt(lam), std::exp(-lam) };
+    return t;
+}
+
+static inline double poisson_pmf_inner(const PoissonTerms& a, const PoissonTerms& b) {
+    const double s = a.lam * b.lam;
+    if (s < 0.25 * kBesselAsymptoticZ * kBesselAsymptoticZ) {
+        // I₀(2√s) = Σ_k s^k/(k!)²
+        double term = 1.0, sum = 1.0;
+        for (int k = 1; term > sum * 1e-17; ++k) {
+            term *= s / (double(k) * k);
+            sum += term;
+        }
+        return a.exp_neg * b.exp_neg * sum;
+    }
+    const double z = 2.0 * a.sqrt_lam * b.sqrt_lam, t = 0.125 / z;
+    double term = 1.0, sum = 1.0;
+    for (int k = 1; k < 64; ++k) {
+        term *= double(2*k - 1) * (2*k - 1) * t / k;
+        sum += term;
+        if (term < sum * 1e-17) break;
+    }
+    // e^{-(a+b)}·e^{z} = e^{-(√a-√b)²}
+    const double dr = a.sqrt_lam - b.sqrt_lam;
+    return std::exp(-dr * dr) * sum / std::sqrt(2.0 * 3.14159265358979323846 * z);
+}
+
+// 同一 λ 的三项完全相同，λx == λy 时 d 精确为 0；舍入造成的微小负值截到 0
+static inline double poisson_L2_distance(const PoissonTerms& x, const PoissonTerms& y,
+                                         double self_x, double self_y) {
+    if (x.lam <= 0.0 && y.lam <= 0.0) return 0.0;
+    return std::max(0.0, self_x + self_y - 2.0 * poisson_pmf_inner(x, y));
+}
+
+static inline double poisson_L2_distance(double lx, double ly) {
+    const PoissonTerms x = poisson_terms(lx), y = poisson_terms(ly);
+    return poisson_L2_distance(x, y, poisson_pmf_inner(x, x), poisson_pmf_inner(y, y));
+}
+
+// -------------------- 稠密 d 表（按量化 λ 索引，建好后无锁只读） --------------------
+// 下标 q 对应 λ = q*lam_quant；d 对称，只存下三角 (qa>=qb)，行主序。
+// 三角布局的前 n 行与更大的表完全一致，因此扩容时只需补算新增的行。
+struct DistanceTable {
+    double lam_quant = 0.0;
+    int n = 0;
+    std::vector<double> d;
+
+    inline double query(int qa, int qb) const {
+        int hi = std::max(qa, qb), lo = std::min(qa, qb);
+        if (hi < n) return d[std::size_t(hi) * (hi + 1) / 2 + lo];
+        // 超出表容量的少量极大 λ：直接精确计算（无共享状态，线程安全）
+        return poisson_L2_distance(qa * lam_quant, qb * lam_quant);
+    }
+};
+
+// 表维度上限：4096 → 约 67MB（double 下三角），默认 lam_quant=0.02 时覆盖 λ≤81.9
+static const int kDistanceTableMaxDim = 4096;
+
+static std::shared_ptr<const DistanceTable> g_dtable;
+static std::mutex g_dtable_mtx;
+
+// 覆盖 [0, lam_max] 所需的表维度（受 kDistanceTableMaxDim 限制）
+static inline int distance_table_dim(double lam_quant, double lam_max) {
+    double qmax = std::ceil(std::max(0.0, lam_max) / lam_quant);
+    return int(std::min<double>(qmax, kDistanceTableMaxDim - 1)) + 1;
+}
+
+// 取得覆盖 [0, lam_max] 的表；相同 lam_quant 的后续调用直接复用（必要时增量扩容）
+static inline std::shared_ptr<const DistanceTable> acquire_distance_table(double lam_quant, double lam_max) {
+    const int need = distance_table_dim(lam_quant, lam_max);
+
+    std::lock_guard<std::mutex> lock(g_dtable_mtx);
+    if (g_dtable && g_dtable->lam_quant == lam_quant && g_dtable->n >= need) {
+        NLM_STAT_ADD(kStatDistTableHits, 1);
+        return g_dtable;
+    }
+    NLM_STAT_ADD(kStatDistTableMisses, 1);
+    NLM_SCOPED_TIMER(kStatDistanceTable, need);
+
+    auto tab = std::make_shared<DistanceTable>();
+    tab->lam_quant = lam_quant;
+    tab->n = need;
+    int n_old = 0;
+    if (g_dtable && g_dtable->lam_quant == lam_quant) {
+        n_old = g_dtable->n;
+        tab->d.reserve(std::size_t(need) * (need + 1) / 2);
+        tab->d.assign(g_dtable->d.begin(), g_dtable->d.end());
+    }
+    tab->d.resize(std::size_t(need) * (need + 1) / 2);
+
+    // 每个格点的 √λ、e^{-λ} 与 S(λ,λ) 先算好，表项只剩一次交叉项求值；
+    // 与 poisson_L2_distance(qa*lam_quant, qb*lam_quant) 的计算完全相同，结果逐位一致
+    std::vector<PoissonTerms> terms(need);
+    std::vector<double> self(need);
+    #pragma omp parallel for
+    for (int q = 0; q < need; ++q) {
+        terms[q] = poisson_terms(q * lam_quant);
+        self[q] = poisson_pmf_inner(terms[q], terms[q]);
+    }
+
+    double* d = tab->d.data();
+    #pragma omp parallel for schedule(dynamic, 16)
+    for (int qa = n_old; qa < need; ++qa) {
+        double* row = d + std::size_t(qa) * (qa + 1) / 2;
+        for (int qb = 0; qb <= qa; ++qb) row[qb] = poisson_L2_distance(terms[qa], terms[qb], self[qa], self[qb]);
+    }
+
+    NLM_STAT_ADD(kStatBytesAllocated, tab->d.size() * sizeof(double));
+    NLM_STAT_SET(kStatDistTableBytes, tab->d.size() * sizeof(double));
+    g_dtable = tab;
+    return g_dtable;
+}
+
+// 持有者已有足够大的同 lam_quant 表时直接使用（不经全局锁，也不受其它 lam_quant 调用换表影响），
+// 否则取全局表并更新持有者
+static const DistanceTable& acquire_distance_table(std::shared_ptr<const DistanceTable>& held,
+                                                   double lam_quant, double lam_max) {
+    if (!held || held->lam_quant != lam_quant || held->n < distance_table_dim(lam_quant, lam_max)) {
+        held = acquire_distance_table(lam_quant, lam_max);
+    } else {
+        NLM_STAT_ADD(kStatDistTableHits, 1);
+    }
+    return *held;
+}
+
+// 丢弃全局表缓存；仍被持有的表在最后一个持有者释放时析构。
+// CUDA 后端的设备缓冲、锁页缓冲与设备端 d 表一并释放（设备表按主机表地址判断是否需重传，不能比主机表活得久）
+static inline void release_distance_table_cache() {
+    {
+        std::lock_guard<std::mutex> lock(g_dtable_mtx);
+        g_dtable.reset();
+    }
+#ifdef POISSON_NLM_WITH_CUDA
+    nlm_cuda_release();
+#endif
+}
+
+// -------------------- 块距离核：一行连续候选的 Σ_m d（SIMD + 运行时分派） --------------------
+// 对搜索窗内同一行的 count 个相邻候选，lane c 对应候选 xx = sx0 + c；
+// 各 lane 按与标量版相同的 (j,i) 顺序累加，因此所有实现结果逐位一致。
+//   qxp    : 当前像素 x 的 patch 量化 λ̂（k*k，行主序）
+//   base_y : 第一个候选 patch 左上角在 lam_q 中的位置
+// 模板参数 K > 0 时 patch 边长为编译期常量（k 参数被忽略），k×k 循环完全展开；K = 0 为运行期通用版本。
+typedef void (*RowDistanceFn)(const DistanceTable& tab, const int* qxp, const int* base_y,
+                              int W, int k, int count, double* D);
+
+template <int K>
+static inline void row_distances_scalar(const DistanceTable& tab, const int* qxp, const int* base_y,
+                                        int W, int k_rt, int count, double* D) {
+    const int k = K > 0 ? K : k_rt;
+    for (int c = 0; c < count; ++c) {
+        double s = 0.0;
+        for (int j = 0; j < k; ++j) {
+            const int* ry = base_y + j*W + c;
+            for (int i = 0; i < k; ++i) s += tab.query(qxp[j*k + i], ry[i]);
+        }
+        D[c] = s;
+    }
+}
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define NLM_SIMD_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+#define NLM_TARGET(x)        // MSVC 无需 target 属性即可使用 AVX 内建函数
+#else
+#define NLM_TARGET(x) __attribute__((target(x)))
+#endif
+
+// 表外 lane（hi >= n）的精确回退：与 DistanceTable::query 相同
+static inline void patch_out_of_table(const DistanceTable& tab, int qa, const int* qb,
+                                      const int* oob, double* vals, int lanes) {
+    for (int l = 0; l < lanes; ++l) {
+        if (oob[l]) vals[l] = poisson_L2_distance(qa * tab.lam_quant, qb[l] * tab.lam_quant);
+    }
+}
+
+template <int K>
+NLM_TARGET("avx2")
+static inline void row_distances_avx2(const DistanceTable& tab, const int* qxp, const int* base_y,
+                                      int W, int k_rt, int count, double* D) {
+    const int k = K > 0 ? K : k_rt;
+    const double* d = tab.d.data();
+    const __m128i vlim = _mm_set1_epi32(tab.n - 1);
+    const __m128i one = _mm_set1_epi32(1);
+    int c = 0;
+    for (; c + 4 <= count; c += 4) {
+        __m256d acc = _mm256_setzero_pd();
+        for (int j = 0; j < k; ++j) {
+            const int* ry = base_y + j*W + c;
+            for (int i = 0; i < k; ++i) {
+                const int qa = qxp[j*k + i];
+                __m128i qb = _mm_loadu_si128((const __m128i*)(ry + i));
+                __m128i qa4 = _mm_set1_epi32(qa);
+                __m128i hi = _mm_max_epi32(qa4, qb), lo = _mm_min_epi32(qa4, qb);
+                __m128i oob = _mm_cmpgt_epi32(hi, vlim);
+                __m128i idx = _mm_add_epi32(_mm_srli_epi32(_mm_mullo_epi32(hi, _mm_add_epi32(hi, one)), 1), lo);
+                idx = _mm_andnot_si128(oob, idx);
+                __m256d v = _mm256_i32gather_pd(d, idx, 8);
+                if (_mm_movemask_epi8(oob)) {
+                    alignas(32) double vals[4]; alignas(16) int qbs[4], flags[4];
+                    _mm256_store_pd(vals, v);
+                    _mm_store_si128((__m128i*)qbs, qb);
+                    _mm_store_si128((__m128i*)flags, oob);
+                    patch_out_of_table(tab, qa, qbs, flags, vals, 4);
+                    v = _mm256_load_pd(vals);
+                }
+                acc = _mm256_add_pd(acc, v);
+            }
+        }
+        _mm256_storeu_pd(D + c, acc);
+    }
+    if (c < count) row_distances_scalar<K>(tab, qxp, base_y + c, W, k, count - c, D + c);
+}
+
+template <int K>
+NLM_TARGET("avx512f")
+static inline void row_distances_avx512(const DistanceTable& tab, const int* qxp, const int* base_y,
+                                        int W, int k_rt, int count, double* D) {
+    const int k = K > 0 ? K : k_rt;
+    const double* d = tab.d.data();
+    const __m256i vlim = _mm256_set1_epi32(tab.n - 1);
+    const __m256i one = _mm256_set1_epi32(1);
+    for (int c = 0; c < count; c += 8) {
+        const int lanes = std::min(8, count - c);
+        const __mmask8 m8 = (__mmask8)((1u << lanes) - 1u);
+        const __mmask16 m16 = (__mmask16)m8;
+        __m512d acc = _mm512_setzero_pd();
+        for (int j = 0; j < k; ++j) {
+            const int* ry = base_y + j*W + c;
+            for (int i = 0; i < k; ++i) {
+                const int qa = qxp[j*k + i];
+                // 掩码加载：尾部 lane 不触碰越界内存
+                __m256i qb = _mm512_castsi512_si256(_mm512_maskz_loadu_epi32(m16, ry + i));
+                __m256i qa8 = _mm256_set1_epi32(qa);
+                __m256i hi = _mm256_max_epi32(qa8, qb), lo = _mm256_min_epi32(qa8, qb);
+                __m256i oob = _mm256_cmpgt_epi32(hi, vlim);
+                __m256i idx = _mm256_add_epi32(_mm256_srli_epi32(_mm256_mullo_epi32(hi, _mm256_add_epi32(hi, one)), 1), lo);
+                idx = _mm256_andnot_si256(oob, idx);
+                __m512d v = _mm512_mask_i32gather_pd(_mm512_setzero_pd(), m8, idx, d, 8);
+                const int lane_bits = (lanes == 8) ? -1 : ((1 << (4*lanes)) - 1);
+                if (_mm256_movemask_epi8(oob) & lane_bits) {
+                    alignas(64) double vals[8]; alignas(32) int qbs[8], flags[8];
+                    _mm512_store_pd(vals, v);
+                    _mm256_store_si256((__m256i*)qbs, qb);
+                    _mm256_store_si256((__m256i*)flags, oob);
+                    patch_out_of_table(tab, qa, qbs, flags, vals, lanes);
+                    v = _mm512_load_pd(vals);
+                }
+                acc = _mm512_add_pd(acc, v);
+            }
+        }
+        _mm512_mask_storeu_pd(D + c, m8, acc);
+    }
+}
+
+static inline bool cpu_has_avx2() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    __cpuid(r, 0);
+    if (r[0] < 7) return false;
+    __cpuid(r, 1);
+    if (!(r[2] & (1 << 27)) || (_xgetbv(0) & 0x6) != 0x6) return false;   // OSXSAVE + YMM 状态
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+static inline bool cpu_has_avx512f() {
+#if defined(_MSC_VER) && !defined(__clang__)
+    int r[4];
+    if (!cpu_has_avx2() || (_xgetbv(0) & 0xE6) != 0xE6) return false;  // ZMM/opmask 状态
+    __cpuidex(r, 7, 0);
+    return (r[1] & (1 << 16)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f");
+#endif
+}
+#endif // x86
+
+#if defined(__aarch64__) || defined(_M_ARM64)
+#define NLM_SIMD_NEON 1
+#include <arm_neon.h>
+
+// AArch64 无 gather：下标计算与累加向量化，表读取逐 lane
+template <int K>
+static inline void row_distances_neon(const DistanceTable& tab, const int* qxp, const int* base_y,
+                                      int W, int k_rt, int count, double* D) {
+    const int k = K > 0 ? K : k_rt;
+    const double* d = tab.d.data();
+    const int32x4_t vlim = vdupq_n_s32(tab.n - 1);
+    const int32x4_t one = vdupq_n_s32(1);
+    int c = 0;
+    for (; c + 4 <= count; c += 4) {
+        float64x2_t acc0 = vdupq_n_f64(0.0), acc1 = vdupq_n_f64(0.0);
+        for (int j = 0; j < k; ++j) {
+            const int* ry = base_y + j*W + c;
+            for (int i = 0; i < k; ++i) {
+                const int qa = qxp[j*k + i];
+                int32x4_t qb = vld1q_s32(ry + i);
+                int32x4_t qa4 = vdupq_n_s32(qa);
+                int32x4_t hi = vmaxq_s32(qa4, qb), lo = vminq_s32(qa4, qb);
+                uint32x4_t oob = vcgtq_s32(hi, vlim);
+                int32x4_t idx = vaddq_s32(vshrq_n_s32(vmulq_s32(hi, vaddq_s32(hi, one)), 1), lo);
+                int ix[4], flags[4], qbs[4];
+                vst1q_s32(ix, idx);
+                vst1q_s32(qbs, qb);
+                vst1q_u32((uint32_t*)flags, oob);
+                double vals[4];
+                for (int l = 0; l < 4; ++l) {
+                    vals[l] = flags[l] ? poisson_L2_distance(qa * tab.lam_quant, qbs[l] * tab.lam_quant)
+                                       : d[(unsigned)ix[l]];
+                }
+                acc0 = vaddq_f64(acc0, vld1q_f64(vals));
+                acc1 = vaddq_f64(acc1, vld1q_f64(vals + 2));
+            }
+        }
+        vst1q_f64(D + c, acc0);
+        vst1q_f64(D + c + 2, acc1);
+    }
+    if (c < count) row_distances_scalar<K>(tab, qxp, base_y + c, W, k, count - c, D + c);
+}
+#endif // NEON
+
+// 可用实现（按优先级排列），首项为当前 CPU 上最快者。
+// fn 为通用版本；fn_k3 / fn_k5 为 patch_radius = 1 / 2 的编译期特化，by_patch() 按 k 选取
+struct RowDistanceImpl {
+    const char* name;
+    RowDistanceFn fn, fn_k3, fn_k5;
+
+    RowDistanceFn by_patch(int k) const {
+        return k == 3 ? fn_k3 : (k == 5 ? fn_k5 : fn);
+    }
+};
+
+static inline std::vector<RowDistanceImpl> available_row_distance_impls() {
+    std::vector<RowDistanceImpl> v;
+#ifdef NLM_SIMD_X86
+    if (cpu_has_avx512f()) v.push_back({"avx512", row_distances_avx512<0>, row_distances_avx512<3>, row_distances_avx512<5>});
+    if (cpu_has_avx2()) v.push_back({"avx2", row_distances_avx2<0>, row_distances_avx2<3>, row_distances_avx2<5>});
+#endif
+#ifdef NLM_SIMD_NEON
+    v.push_back({"neon", row_distances_neon<0>, row_distances_neon<3>, row_distances_neon<5>});
+#endif
+    v.push_back({"scalar", row_distances_scalar<0>, row_distances_scalar<3>, row_distances_scalar<5>});
+    return v;
+}
+
+static RowDistanceImpl g_row_distance = available_row_distance_impls().front();
+static std::mutex g_row_distance_mtx;
+
+static inline RowDistanceImpl current_row_distance() {
+    std::lock_guard<std::mutex> lock(g_row_distance_mtx);
+    return g_row_distance;
+}
+
+// -------------------- 截断边界盒均值（λ̂ 与 λ̄ 共用） --------------------
+// 窗口 (2r+1)²，边界处只平均落在图内的像素。列方向维护滑动列和、行方向滑动求和，
+// 每像素 O(1)，代价与 r 无关。按行块并行，每块只需 O(W) 的 double 累加行。
+static inline void box_mean_truncated(const float* src, float* dst, int H, int W, int r) {
+    const int kRowBlock = 64;
+    const int nblk = (H + kRowBlock - 1) / kRowBlock;
+    #pragma omp parallel for schedule(static) if(H*W>100000)
+    for (int b = 0; b < nblk; ++b) {
+        const int ya = b * kRowBlock, yb = std::min(H, ya + kRowBlock);
+        std::vector<double> col(W, 0.0);
+        int lo = std::max(0, ya - r), hi = lo;          // col = Σ src[lo..hi)
+        for (int y = ya; y < yb; ++y) {
+            const int nlo = std::max(0, y - r), nhi = std::min(H, y + r + 1);
+            for (; hi < nhi; ++hi) {
+                const float* row = src + std::size_t(hi) * W;
+                for (int x = 0; x < W; ++x) col[x] += row[x];
+            }
+            for (; lo < nlo; ++lo) {
+                const float* row = src + std::size_t(lo) * W;
+                for (int x = 0; x < W; ++x) col[x] -= row[x];
+            }
+            const double rows = double(hi - lo);
+            float* out = dst + std::size_t(y) * W;
+            double acc = 0.0;
+            int x0 = 0, x1 = 0;                         // acc = Σ col[x0..x1)
+            for (int x = 0; x < W; ++x) {
+                const int nx1 = std::min(W, x + r + 1), nx0 = std::max(0, x - r);
+                for (; x1 < nx1; ++x1) acc += col[x1];
+                for (; x0 < nx0; ++x0) acc -= col[x0];
+                out[x] = float(acc / (rows * double(x1 - x0)));
+            }
+        }
+    }
+}
+
+// -------------------- 运行控制：进度回调与协作式取消 --------------------
+// progress 只在发起调用的线程上执行（返回 false 即请求取消）；cancel_flag 指向调用方可写的
+// 单字节标志（如 numpy 数组），计算线程按行轮询，非 0 即取消。取消后尽快结束并抛 CancelledError。
+struct CancelledError : std::runtime_error {
+    CancelledError() : std::runtime_error("operation cancelled") {}
+};
+
+struct RunControl {
+    std::function<bool(long long done, long long total)> progress;
+    const volatile std::uint8_t* cancel_flag = nullptr;
+    std::atomic<bool> cancelled{false};
+    std::exception_ptr error;      // progress 抛出的异常，留到并行区外重新抛出
+
+    bool stop_requested() {
+        if (cancelled.load(std::memory_order_relaxed)) return true;
+        if (cancel_flag && *cancel_flag) { cancelled = true; return true; }
+        return false;
+    }
+
+    void report(long long done, long long total) {
+        if (!progress || cancelled.load()) return;
+        try {
+            if (!progress(done, total)) cancelled = true;
+        } catch (...) {
+            error = std::current_exception();
+            cancelled = true;
+        }
+    }
+
+    void raise_if_stopped() {
+        if (error) std::rethrow_exception(error);
+        if (cancelled.load()) throw CancelledError();
+    }
+};
+
+// -------------------- 只读 2D 视图：任意行/列跨度（以元素计） --------------------
+// 直接引用 numpy 切片、转置等非连续数组，避免 forcecast 连续化拷贝
+template <typename T>
+struct Plane {
+    const T* p;
+    std::ptrdiff_t sy, sx;
+    std::ptrdiff_t offset(int y, int x) const { return y*sy + x*sx; }
+    T operator()(int y, int x) const { return p[offset(y, x)]; }
+};
+
+template <typename T>
+static inline Plane<T> contiguous_plane(const T* p, int W) {
+    Plane<T> v = { p, (std::ptrdiff_t)W, 1 };
+    return v;
+}
+
+// 视图 → H×W 行主序 float
+template <typename T>
+static inline void copy_plane(const Plane<T>& src, int H, int W, float* dst) {
+    #pragma omp parallel for if(H*W>100000)
+    for (int y = 0; y < H; ++y) {
+        float* row = dst + std::size_t(y) * W;
+        for (int x = 0; x < W; ++x) row[x] = float(src(y, x));
+    }
+}
+
+// NLM 候选：块距离 D 与候选像素坐标（gx/gy 视图跨度可以不同，故不存线性偏移）
+struct Candidate {
+    double D;
+    int y, x;
+};
+
+// -------------------- NLM 参数 --------------------
+struct NLMParams {
+    int search_radius = 3;
+    int patch_radius = 1;
+    double rho = 1.5;                // ρ
+    double count_target_mean = 30.0; // 目标平均 λ（自动尺度）
+    double lam_quant = 0.02;         // λ 量化步长
+    int topk = 0;                    // <=0 表示不用 topk
+    int engine = 0;                  // kNLMEnginePatch / kNLMEngineOffset
+    int block_size = 0;              // 逐块引擎的输出块边长（像素），<=0 按 L2 大小自动选取
+    int precision = 0;               // kNLMPrecisionDouble / kNLMPrecisionFloat32
+    int pyramid_levels = 1;          // 金字塔引擎：粗层缩小 2^levels 倍
+    int refine_candidates = 4;       // 金字塔引擎：每像素在细层细化的粗位移个数
+};
+
+// 逐块引擎：逐 (像素, 候选) 求块距离，支持 topk；位移引擎：按位移求 d 图再盒求和，与 patch 大小无关；
+// 金字塔引擎：粗层搜索候选位移、细层只细化最优的几个（近似，大搜索半径下代价接近 search_radius=1）
+enum { kNLMEnginePatch = 0, kNLMEngineOffset = 1, kNLMEnginePyramid = 2 };
+
+static inline int parse_nlm_engine(const std::string& name) {
+    if (name == "patch") return kNLMEnginePatch;
+    if (name == "offset") return kNLMEngineOffset;
+    if (name == "pyramid") return kNLMEnginePyramid;
+    throw std::runtime_error("engine must be 'patch', 'offset' or 'pyramid': " + name);
+}
+
+// 权重与加权和的精度：double 为参考路径；float32 用单精度累加 + 快速 exp（块距离仍由 double d 表给出）
+enum { kNLMPrecisionDouble = 0, kNLMPrecisionFloat32 = 1 };
+
+static inline int parse_nlm_precision(const std::string& name) {
+    if (name == "double" || name == "float64") return kNLMPrecisionDouble;
+    if (name == "float32" || name == "float") return kNLMPrecisionFloat32;
+    throw std::runtime_error("precision must be 'double' or 'float32': " + name);
+}
+
+static inline void validate_nlm_params(const NLMParams& prm) {
+    if (prm.search_radius < 0 || prm.patch_radius < 0) {
+        throw std::runtime_error("search_radius/patch_radius must be non-negative");
+    }
+    if (!(prm.lam_quant > 0.0)) {
+        throw std::runtime_error("lam_quant must be positive");
+    }
+    if (prm.block_size < 0) {
+        throw std::runtime_error("block_size must be non-negative (0 = auto)");
+    }
+    if (prm.engine == kNLMEngineOffset && prm.topk > 0) {
+        throw std::runtime_error("offset engine does not support topk; use engine='patch' or topk=0");
+    }
+    if (prm.engine == kNLMEnginePyramid) {
+        if (prm.pyramid_levels < 1 || prm.pyramid_levels > 4) {
+            throw std::runtime_error("pyramid_levels must be in [1, 4]");
+        }
+        if (prm.refine_candidates < 1) {
+            throw std::runtime_error("refine_candidates must be >= 1");
+        }
+    }
+}
+
+// -------------------- λ 预处理：count_scale、λ̂ 量化下标、λ̄（NLM 核心与基准程序共用） --------------------
+struct LambdaMaps {
+    double count_scale = 1.0;
+    std::vector<int> lam_q;   // round(λ̂ / lam_quant)，即 d 表下标
+    float lam_max = 0.0f;     // λ̂ 最大值
+    std::vector<float> lam, lam_hat;   // 中间图；跨帧复用同一 LambdaMaps 时不再重新分配
+};
+
+// NLM 跨帧工作区：λ 中间图与所用 d 表（PoissonNLMEngine 持有；单次调用时为局部临时量）
+struct NLMWorkspace {
+    LambdaMaps lm;
+    std::shared_ptr<const DistanceTable> table;
+    // 可选：本次调用输入梯度的 |G'|（H×W 行主序，由 Step 1 顺带写出）；非空时 λ 预处理不再重算。
+    // 只对一次调用有效，不参与跨帧复用
+    const float* grad_mag = nullptr;
+    // 可选：金字塔引擎的粗层引导图（调用方已有的金字塔层，尺寸 (H>>levels)×(W>>levels)），同样只对一次调用有效
+    Plane<float> guide = { nullptr, 0, 0 };
+    int guide_h = 0, guide_w = 0;
+    // 金字塔引擎的粗层中间图：粗 λ̂、量化下标与每个粗像素保留的位移（跨帧复用容量）
+    std::vector<float> pyr_lam, pyr_tmp;
+    std::vector<int> pyr_q, pyr_cand;
+
+    // 预留 pixels 个像素的中间图容量
+    void reserve(std::size_t pixels) {
+        lm.lam.reserve(pixels); lm.lam_hat.reserve(pixels); lm.lam_q.reserve(pixels);
+    }
+    std::size_t scratch_bytes() const {
+        return lm.lam.capacity() * sizeof(float) + lm.lam_hat.capacity() * sizeof(float)
+             + lm.lam_q.capacity() * sizeof(int)
+             + (pyr_lam.capacity() + pyr_tmp.capacity()) * sizeof(float)
+             + (pyr_q.capacity() + pyr_cand.capacity()) * sizeof(int);
+    }
+    std::size_t table_bytes() const { return table ? table->d.capacity() * sizeof(double) : 0; }
+    void release() {
+        std::vector<float>().swap(lm.lam);
+        std::vector<float>().swap(lm.lam_hat);
+        std::vector<int>().swap(lm.lam_q);
+        std::vector<float>().swap(pyr_lam);
+        std::vector<float>().swap(pyr_tmp);
+        std::vector<int>().swap(pyr_q);
+        std::vector<int>().swap(pyr_cand);
+        table.reset();
+    }
+};
+
+template <typename T>
+static inline void prepare_lambda_maps(const Plane<T>& gx_in, const Plane<T>& gy_in, int H, int W,
+                                       const NLMParams& prm, float* lam_bar, LambdaMaps& out,
+                                       const float* grad_mag = nullptr) {
+    const int patch_radius = prm.patch_radius;
+    const double count_target_mean = prm.count_target_mean, lam_quant = prm.lam_quant;
+
+    // 1) 计算 |G'| 与全图均值，确定 count_scale，使均值 λ ≈ count_target_mean
+    //    grad_mag 非空时为调用方（Step 1）已算好的 |G'|（H×W 行主序），直接读取
+    double sum_mag = 0.0;
+    #pragma omp parallel for reduction(+:sum_mag) if(H*W>100000)
+    for (int i = 0; i < H*W; ++i) {
+        if (grad_mag) { sum_mag += grad_mag[i]; continue; }
+        const int iy = i / W, ix = i - iy*W;
+        double gx = gx_in(iy, ix), gy = gy_in(iy, ix);
+        sum_mag += std::sqrt(gx*gx + gy*gy);
+    }
+    double gm = sum_mag / double(H*W);
+    double count_scale = (gm > 1e-12) ? (count_target_mean / gm) : 1.0;
+
+    // 2) 计算 λ 图（先不做盒均值），再计算 λ̂（局部均值）
+    std::vector<float>& lam = out.lam;
+    std::vector<float>& lam_hat = out.lam_hat;
+    lam.resize(std::size_t(H) * W);
+    lam_hat.resize(std::size_t(H) * W);
+    #pragma omp parallel for if(H*W>100000)
+    for (int i = 0; i < H*W; ++i) {
+        double mag;
+        if (grad_mag) {
+            mag = grad_mag[i];
+        } else {
+            const int iy = i / W, ix = i - iy*W;
+            double gx = gx_in(iy, ix), gy = gy_in(iy, ix);
+            mag = std::sqrt(gx*gx + gy*gy);
+        }
+        lam[i] = float(std::max(0.0, mag * count_scale));
+    }
+    // λ̂ = λ 的局部盒均值；λ̄ = λ̂ 在 patch 上的均值（主循环中的 λx̄，式(11)分母）
+    box_mean_truncated(lam.data(), lam_hat.data(), H, W, patch_radius);
+    box_mean_truncated(lam_hat.data(), lam_bar, H, W, patch_radius);
+
+    // λ̂ 量化为表下标（与原 round(λ/q)*q 完全一致）
+    std::vector<int>& lam_q = out.lam_q;
+    lam_q.resize(std::size_t(H) * W);
+    float lam_max = 0.0f;
+    #pragma omp parallel if(H*W>100000)
+    {
+        float local_max = 0.0f;
+        #pragma omp for
+        for (int i = 0; i < H*W; ++i) {
+            lam_q[i] = int(std::round(double(lam_hat[i]) / lam_quant));
+            local_max = std::max(local_max, lam_hat[i]);
+        }
+        #pragma omp critical
+        lam_max = std::max(lam_max, local_max);
+    }
+    if (double(lam_max) / lam_quant > 1e9) {
+        throw std::runtime_error("lam_quant too small for the λ range of this image");
+    }
+    out.count_scale = count_scale;
+    out.lam_max = lam_max;
+}
+
+// -------------------- 缓存分块：按 L2 大小选输出块边长 --------------------
+// 单核 L2 字节数；查询失败时按 512 KiB 估计
+static inline std::size_t l2_cache_bytes() {
+    static const std::size_t bytes = []() -> std::size_t {
+        long v = 0;
+#if defined(__linux__) && defined(_SC_LEVEL2_CACHE_SIZE)
+        v = sysconf(_SC_LEVEL2_CACHE_SIZE);
+#elif defined(__APPLE__)
+        std::int64_t s = 0; std::size_t len = sizeof(s);
+        if (sysctlbyname("hw.l2cachesize", &s, &len, nullptr, 0) == 0) v = (long)s;
+#endif
+        return v > 0 ? std::size_t(v) : std::size_t(512) * 1024;
+    }();
+    return bytes;
+}
+
+// 输出块 + 搜索/patch 晕圈内的 lam_q、gx、gy 约占 L2 的一半（其余留给候选缓冲与输出行）；
+// 再按线程数收小，使内部区域至少切成约 4×线程数 块，小图/小 tile 上各线程都有活干
+static inline int auto_nlm_block_size(int search_radius, int patch_radius, std::size_t grad_bytes,
+                                      int inner_h, int inner_w) {
+    const double bytes_per_px = double(sizeof(int) + 2 * grad_bytes);
+    const int halo = 2 * (search_radius + patch_radius);
+    int side = int(std::sqrt(0.5 * double(l2_cache_bytes()) / bytes_per_px)) - halo;
+#ifdef _OPENMP
+    const int threads = std::max(1, omp_get_max_threads());
+#else
+    const int threads = 1;
+#endif
+    const int balance_side = int(std::sqrt(double(inner_h) * double(inner_w) / (4.0 * threads)));
+    return std::max(16, std::min(std::min(side, balance_side), 512));
+}
+
+// -------------------- 权重 exp：double 用 std::exp，float 用多项式近似 --------------------
+// exp(x) = 2^n · 2^f，f∈[0,1) 上 5 次多项式，[-87, 0] 上相对误差 < 4e-6；x < -87 直接返回 0（权重已下溢）。
+// 只用比较/选择与整数位运算，循环内可被编译器向量化。
+static inline float fast_expf(float x) {
+    const float xc = std::min(std::max(x, -87.0f), 88.0f);
+    const float t = xc * 1.44269504088896341f;
+    float fi = float(int(t));            // 向下取整；不用 std::floor（SSE2 基线下为库函数调用）
+    if (fi > t) fi -= 1.0f;
+    const float f = t - fi;
+    float p = 1.8775767e-3f;
+    p = p * f + 8.9893397e-3f;
+    p = p * f + 5.5826318e-2f;
+    p = p * f + 2.4015361e-1f;
+    p = p * f + 6.9315308e-1f;
+    p = p * f + 9.9999994e-1f;
+    const std::int32_t bits = (std::int32_t(fi) + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(scale));
+    return (x < -87.0f) ? 0.0f : p * scale;
+}
+
+static inline double nlm_weight_exp(double x) { return std::exp(x); }
+static inline float nlm_weight_exp(float x) { return fast_expf(x); }
+
+// -------------------- 核心：泊松 NLM 在梯度域（纯 C++，不依赖 Python 对象） --------------------
+// 候选集合上的 topk（可选）→ 权重（式(11)）→ 加权平均 G'（式(12)）；逐块引擎与金字塔引擎共用。
+// 权重全部下溢时退化为候选的算术平均。cand/ws 容量至少为 n。
+template <typename Acc, typename T>
+static inline void nlm_weighted_average(std::vector<Candidate>& cand, int n, int topk, double denom,
+                                        const Plane<T>& gx_in, const Plane<T>& gy_in,
+                                        std::vector<Acc>& ws, float* gx_out, float* gy_out) {
+    // 选 topk（可选）：原地 nth_element，前 topk 个即为所选
+    if (topk > 0 && n > topk) {
+        std::nth_element(cand.begin(), cand.begin() + topk, cand.begin() + n,
+            [](const Candidate& a, const Candidate& b){ return a.D < b.D; });
+        n = topk;
+    }
+
+    // 权重
+    Acc wsum = 0;
+    for (int i = 0; i < n; ++i) {
+        Acc w = nlm_weight_exp(Acc(- cand[i].D) / Acc(denom));
+        ws[i] = w; wsum += w;
+    }
+    if (wsum <= 0) { std::fill(ws.begin(), ws.begin() + n, Acc(1)); wsum = Acc(n); }
+
+    // 加权平均 G'
+    Acc gxv = 0, gyv = 0;
+    for (int i = 0; i < n; ++i) {
+        Acc w = ws[i] / wsum;
+        gxv += w * Acc(gx_in(cand[i].y, cand[i].x));
+        gyv += w * Acc(gy_in(cand[i].y, cand[i].x));
+    }
+    *gx_out = float(gxv);
+    *gy_out = float(gyv);
+}
+
+// 输入为任意跨度的 float/double 视图；输出为 H×W 行主序 float，lam_bar 为 λ̄ 输出缓冲。返回 count_scale。
+// Acc 为权重与加权和的累加类型（double 为参考路径，float 为单精度快速路径）。
+// PR/SR > 0 时 patch/搜索半径为编译期常量（块距离核与搜索窗循环按常量展开），0 表示取 prm 中的运行期值；
+// 各实例的运算与累加顺序相同，结果逐位一致。
+template <typename Acc, int PR, int SR, typename T>
+static inline double poisson_nlm_patch_kernel(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                              const NLMParams& prm,
+                                              float* gx_out, float* gy_out, float* lam_bar,
+                                              RunControl* ctl, NLMWorkspace& ws) {
+    const int search_radius = SR > 0 ? SR : prm.search_radius;
+    const int patch_radius = PR > 0 ? PR : prm.patch_radius;
+    const int topk = prm.topk;
+    const double rho = prm.rho, lam_quant = prm.lam_quant;
+
+    LambdaMaps& lm = ws.lm;
+    prepare_lambda_maps(gx_in, gy_in, H, W, prm, lam_bar, lm, ws.grad_mag);
+    const std::vector<int>& lam_q = lm.lam_q;
+    const double count_scale = lm.count_scale;
+    const int k = 2*patch_radius + 1;
+
+    // 按观测最大值取得 d 表
+    const DistanceTable& tab = acquire_distance_table(ws.table, lam_quant, lm.lam_max);
+
+    const int pr = patch_radius, sr = search_radius;
+
+    // 4) 主循环：对每个像素做非局部权重加权（严格式(11)(12)）
+    // 每线程一次性分配候选/权重缓冲（容量 (2sr+1)²），循环内不再有堆分配
+    const int max_cand = (2*sr + 1) * (2*sr + 1);
+    const RowDistanceFn row_dist = current_row_distance().by_patch(k);
+    // 内部区域按 bs×bs 输出块遍历：块及其晕圈的 lam_q/gx/gy 驻留 L2，候选行不再横跨整幅宽度。
+    // 块数不少于约 4×线程数，逐块动态分发：右/下边缘的不足块与各块代价差异不会让线程空等，
+    // 取消与进度也按较小的块及时响应。
+    const int inner_h = std::max(0, H - 2*pr), inner_w = std::max(0, W - 2*pr);
+    const int bs = prm.block_size > 0 ? prm.block_size
+                                      : auto_nlm_block_size(sr, pr, sizeof(T), inner_h, inner_w);
+    const int nby = (inner_h + bs - 1) / bs, nbx = (inner_w + bs - 1) / bs;
+    const int nblocks = (inner_w > 0) ? nby * nbx : 0;
+    // 进度仍以行为单位（已完成像素 / 内部行宽），约 1% 或至少 16 行上报一次，只由调用线程回调
+    const int rows_total = inner_h;
+    const long long report_px = (long long)std::max(16, rows_total / 100) * inner_w;
+    std::atomic<long long> px_done(0);
+    long long px_reported = 0;
+    #pragma omp parallel if(H>16)
+    {
+        std::vector<Candidate> cand(max_cand);
+        std::vector<Acc> ws(max_cand);
+        std::vector<double> drow(2*sr + 1);
+        std::vector<int> qxp(k*k);
+        long long n_cand = 0, n_kept = 0;   // 本线程的候选计数，循环结束后一次性累加
+
+#ifdef _OPENMP
+        const bool is_caller = (omp_get_thread_num() == 0);
+#else
+        const bool is_caller = true;
+#endif
+        NLM_BUSY_TIMER();
+        // nowait：忙碌计时不含末尾的隐式屏障等待（并行区结尾仍有屏障）
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (int b = 0; b < nblocks; ++b) {
+            if (ctl && ctl->stop_requested()) continue;   // 取消后剩余块直接跳过
+            const int by0 = pr + (b / nbx) * bs, by1 = std::min(H - pr, by0 + bs);
+            const int bx0 = pr + (b % nbx) * bs, bx1 = std::min(W - pr, bx0 + bs);
+            for (int y = by0; y < by1; ++y) {
+                // λ̄ 与 patch 首行的行指针按行提出
+                const float* lam_bar_row = lam_bar + std::size_t(y) * W;
+                const int* lam_q_patch = lam_q.data() + std::size_t(y - pr) * W;
+                const int sy0 = std::max(pr, y - sr), sy1 = std::min(H - pr, y + sr + 1);
+                for (int x = bx0; x < bx1; ++x) {
+                    // x 的 patch 与 λ̂
+                    const int x0p = x - pr;
+                    float lam_x_bar = lam_bar_row[x];
+                    double denom = rho * std::max(double(lam_x_bar), 1e-8);
+
+                    // 搜索窗
+                    int sx0 = std::max(pr, x - sr), sx1 = std::min(W - pr, x + sr + 1);
+
+                    for (int j = 0; j < k; ++j) {
+                        const int* row_x = lam_q_patch + j*W + x0p;
+                        for (int i = 0; i < k; ++i) qxp[j*k + i] = row_x[i];
+                    }
+
+                    // 收集候选的 D 与坐标：D = Σ_m d(λx_m, λy_m)，按候选行批量计算
+                    int n = 0;
+                    for (int yy = sy0; yy < sy1; ++yy) {
+                        const int* base_y = lam_q.data() + (yy - pr)*W + (sx0 - pr);
+                        row_dist(tab, qxp.data(), base_y, W, k, sx1 - sx0, drow.data());
+                        for (int xx = sx0; xx < sx1; ++xx) {
+                            cand[n].D = drow[xx - sx0];
+                            cand[n].y = yy;
+                            cand[n].x = xx;
+                            ++n;
+                        }
+                    }
+
+                    n_cand += n;
+                    n_kept += (topk > 0 && n > topk) ? topk : n;
+                    nlm_weighted_average(cand, n, topk, denom, gx_in, gy_in, ws, gx_out + y*W + x, gy_out + y*W + x);
+                }
+            }
+            if (ctl) {
+                long long done = (px_done += (long long)(by1 - by0) * (bx1 - bx0));
+                if (is_caller && done - px_reported >= report_px) {
+                    px_reported = done;
+                    ctl->report(done / inner_w, rows_total);
+                }
+            }
+        }
+        NLM_STAT_ADD(kStatCandidates, n_cand);
+        NLM_STAT_ADD(kStatCandidatesKept, n_kept);
+    }
+    if (ctl) {
+        ctl->raise_if_stopped();
+        ctl->report(rows_total, rows_total);
+    }
+
+    // 边界直接拷回原值
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            if (y<pr || y>=H-pr || x<pr || x>=W-pr) {
+                gx_out[y*W + x] = float(gx_in(y, x));
+                gy_out[y*W + x] = float(gy_in(y, x));
+            }
+        }
+    }
+
+    return count_scale;
+}
+
+// 常用半径（pr ∈ {1,2}、sr ∈ {1..5}）走编译期特化实例，其余取通用实例
+template <typename Acc, int PR, typename T>
+static inline double poisson_nlm_patch_dispatch_sr(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                                   const NLMParams& prm,
+                                                   float* gx_out, float* gy_out, float* lam_bar,
+                                                   RunControl* ctl, NLMWorkspace& ws) {
+    switch (prm.search_radius) {
+    case 1: return poisson_nlm_patch_kernel<Acc, PR, 1>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    case 2: return poisson_nlm_patch_kernel<Acc, PR, 2>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    case 3: return poisson_nlm_patch_kernel<Acc, PR, 3>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    case 4: return poisson_nlm_patch_kernel<Acc, PR, 4>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    case 5: return poisson_nlm_patch_kernel<Acc, PR, 5>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    default: return poisson_nlm_patch_kernel<Acc, PR, 0>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    }
+}
+
+template <typename Acc, typename T>
+static inline double poisson_nlm_patch_core(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                            const NLMParams& prm,
+                                            float* gx_out, float* gy_out, float* lam_bar,
+                                            RunControl* ctl, NLMWorkspace& ws) {
+    switch (prm.patch_radius) {
+    case 1: return poisson_nlm_patch_dispatch_sr<Acc, 1>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    case 2: return poisson_nlm_patch_dispatch_sr<Acc, 2>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    default: return poisson_nlm_patch_kernel<Acc, 0, 0>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    }
+}
+
+// -------------------- 位移公式引擎（积分图式 NLM） --------------------
+// 对搜索窗内每个位移 o：e_o(p) = d(λ̂q(p), λ̂q(p+o)) 每像素只查一次表，
+// D_o(x) = Σ_{m∈patch} e_o(x+m) 用行内滑动和 + 列向滑动和得到，复杂度 O(H·W·(2sr+1)²)，与 k² 无关。
+// 权重与候选集合同逐块引擎（全搜索窗，不支持 topk）；求和顺序不同，结果只在浮点舍入范围内一致。
+// 按行带并行，每带的累加器与行和缓冲留在线程本地，带高固定为 kOffsetBandRows。
+static const int kOffsetBandRows = 32;
+
+template <typename Acc, typename T>
+static inline double poisson_nlm_offset_core(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                             const NLMParams& prm,
+                                             float* gx_out, float* gy_out, float* lam_bar,
+                                             RunControl* ctl, NLMWorkspace& ws) {
+    const int pr = prm.patch_radius, sr = prm.search_radius;
+    const double rho = prm.rho;
+
+    LambdaMaps& lm = ws.lm;
+    prepare_lambda_maps(gx_in, gy_in, H, W, prm, lam_bar, lm, ws.grad_mag);
+    const int* lam_q = lm.lam_q.data();
+    const DistanceTable& tab = acquire_distance_table(ws.table, prm.lam_quant, lm.lam_max);
+
+    const int y_begin = pr, y_end = H - pr;
+    const int nbands = (y_end > y_begin) ? (y_end - y_begin + kOffsetBandRows - 1) / kOffsetBandRows : 0;
+    const int rows_total = std::max(0, y_end - y_begin);
+    std::atomic<int> rows_done(0);
+    int rows_reported = 0;
+    const int report_rows = std::max(16, rows_total / 100);
+
+    #pragma omp parallel if(H>16)
+    {
+#ifdef _OPENMP
+        const bool is_caller = (omp_get_thread_num() == 0);
+#else
+        const bool is_caller = true;
+#endif
+        const std::size_t band_px = std::size_t(kOffsetBandRows) * W;
+        std::vector<Acc> wsum(band_px), ax(band_px), ay(band_px);
+        std::vector<Acc> hsum(std::size_t(kOffsetBandRows + 2*pr) * W);  // 带内各 patch 行的行向 k 和
+        std::vector<Acc> e(W), dcol(W);
+
+        NLM_BUSY_TIMER();
+        #pragma omp for schedule(dynamic, 1) nowait
+        for (int b = 0; b < nbands; ++b) {
+            if (ctl && ctl->stop_requested()) continue;
+            const int y0 = y_begin + b * kOffsetBandRows, y1 = std::min(y_end, y0 + kOffsetBandRows);
+            std::fill(wsum.begin(), wsum.end(), Acc(0));
+            std::fill(ax.begin(), ax.end(), Acc(0));
+            std::fill(ay.begin(), ay.end(), Acc(0));
+
+            for (int dy = -sr; dy <= sr; ++dy) {
+                // 候选中心 y+dy 也须在内部区域
+                const int ylo = std::max(y0, pr - dy), yhi = std::min(y1, H - pr - dy);
+                if (ylo >= yhi) continue;
+                for (int dx = -sr; dx <= sr; ++dx) {
+                    const int xlo = std::max(pr, pr - dx), xhi = std::min(W - pr, W - pr - dx);
+                    if (xlo >= xhi) continue;
+
+                    // 行向：对 patch 行 r ∈ [ylo-pr, yhi+pr) 求 e 的 k 点滑动和
+                    for (int r = ylo - pr; r < yhi + pr; ++r) {
+                        const int* qa = lam_q + std::size_t(r) * W;
+                        const int* qb = lam_q + std::size_t(r + dy) * W + dx;
+                        for (int x = xlo - pr; x < xhi + pr; ++x) e[x] = Acc(tab.query(qa[x], qb[x]));
+                        Acc* hr = hsum.data() + std::size_t(r - (ylo - pr)) * W;
+                        Acc s = 0;
+                        for (int x = xlo - pr; x <= xlo + pr; ++x) s += e[x];
+                        hr[xlo] = s;
+                        for (int x = xlo + 1; x < xhi; ++x) {
+                            s += e[x + pr] - e[x - pr - 1];
+                            hr[x] = s;
+                        }
+                    }
+
+                    // 列向：D(y,x) = Σ_{r=y-pr}^{y+pr} hsum(r,x)，随 y 滑动
+                    for (int x = xlo; x < xhi; ++x) dcol[x] = 0;
+                    for (int j = 0; j < 2*pr + 1; ++j) {
+                        const Acc* hr = hsum.data() + std::size_t(j) * W;
+                        for (int x = xlo; x < xhi; ++x) dcol[x] += hr[x];
+                    }
+                    for (int y = ylo; y < yhi; ++y) {
+                        if (y > ylo) {
+                            const Acc* add = hsum.data() + std::size_t(y + pr - (ylo - pr)) * W;
+                            const Acc* sub = hsum.data() + std::size_t(y - pr - 1 - (ylo - pr)) * W;
+                            for (int x = xlo; x < xhi; ++x) dcol[x] += add[x] - sub[x];
+                        }
+                        const float* lb = lam_bar + std::size_t(y) * W;
+                        const std::size_t acc_row = std::size_t(y - y0) * W;
+                        for (int x = xlo; x < xhi; ++x) {
+                            double denom = rho * std::max(double(lb[x]), 1e-8);
+                            Acc w = nlm_weight_exp(- std::max(Acc(0), dcol[x]) / Acc(denom));
+                            wsum[acc_row + x] += w;
+                            ax[acc_row + x] += w * Acc(gx_in(y + dy, x + dx));
+                            ay[acc_row + x] += w * Acc(gy_in(y + dy, x + dx));
+                        }
+                    }
+                }
+            }
+
+            // 归一化；权重全部下溢时退化为搜索窗内的算术平均（同逐块引擎）
+            for (int y = y0; y < y1; ++y) {
+                const std::size_t acc_row = std::size_t(y - y0) * W;
+                for (int x = pr; x < W - pr; ++x) {
+                    Acc ws = wsum[acc_row + x];
+                    double gxv, gyv;
+                    if (ws > 0.0) {
+                        gxv = ax[acc_row + x] / ws;
+                        gyv = ay[acc_row + x] / ws;
+                    } else {
+                        int sy0 = std::max(pr, y - sr), sy1 = std::min(H - pr, y + sr + 1);
+                        int sx0 = std::max(pr, x - sr), sx1 = std::min(W - pr, x + sr + 1);
+                        gxv = gyv = 0.0;
+                        for (int yy = sy0; yy < sy1; ++yy) {
+                            for (int xx = sx0; xx < sx1; ++xx) {
+                                gxv += (double)gx_in(yy, xx);
+                                gyv += (double)gy_in(yy, xx);
+                            }
+                        }
+                        double n = double(sy1 - sy0) * double(sx1 - sx0);
+                        gxv /= n; gyv /= n;
+                    }
+                    gx_out[std::size_t(y) * W + x] = float(gxv);
+                    gy_out[std::size_t(y) * W + x] = float(gyv);
+                }
+            }
+
+            if (ctl) {
+                int done = (rows_done += y1 - y0);
+                if (is_caller && done - rows_reported >= report_rows) {
+                    rows_reported = done;
+                    ctl->report(done, rows_total);
+                }
+            }
+        }
+    }
+    if (ctl) {
+        ctl->raise_if_stopped();
+        ctl->report(rows_total, rows_total);
+    }
+
+    // 边界直接拷回原值
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            if (y<pr || y>=H-pr || x<pr || x>=W-pr) {
+                gx_out[y*W + x] = float(gx_in(y, x));
+                gy_out[y*W + x] = float(gy_in(y, x));
+            }
+        }
+    }
+
+    return lm.count_scale;
+}
+
+// -------------------- 金字塔引擎（由粗到精） --------------------
+// 粗层：λ̂ 按 f×f（f = 2^pyramid_levels）面积平均缩小（即 cv2.INTER_AREA 的整数倍缩小，尾部不足 f 的行列舍去），
+// 在粗搜索窗内求块距离，每个粗像素保留最近的 refine_candidates 个粗位移；
+// 细层：每个保留的粗位移对应一个 f×f 细格，连同细层 3×3 邻域（限于搜索窗）求精确块距离，
+// 之后的 topk、权重与加权平均同逐块引擎。每像素约 (2⌈(sr+f-1)/f⌉+1)²/f² + refine·f² + 9 次块距离，
+// 与 (2sr+1)² 无关（图像边缘 f·pr 一带没有粗格代表，直接全搜索）。候选集合是全搜索窗的子集，
+// 结果为近似；refine_candidates 取满时与全搜索相同。
+// 粗层放不下一个内部 patch 时退回逐块引擎。
+// ws.guide 给出时粗层 λ 改由该引导图（调用方已有的金字塔层）的梯度幅值得到，按细层 λ̂ 均值定标，
+// 不再从细层缩小。
+static inline void build_coarse_lambda(const NLMParams& prm, int H, int W, int Hc, int Wc, NLMWorkspace& ws) {
+    const int f = 1 << prm.pyramid_levels;
+    const std::vector<float>& lam_hat = ws.lm.lam_hat;
+    std::vector<float>& cl = ws.pyr_lam;
+    cl.resize(std::size_t(Hc) * Wc);
+    if (!ws.guide.p) {
+        const double inv = 1.0 / double(f * f);
+        #pragma omp parallel for if(H*W>100000)
+        for (int cy = 0; cy < Hc; ++cy) {
+            for (int cx = 0; cx < Wc; ++cx) {
+                double s = 0.0;
+                for (int j = 0; j < f; ++j) {
+                    const float* row = lam_hat.data() + std::size_t(cy*f + j) * W + cx*f;
+                    for (int i = 0; i < f; ++i) s += row[i];
+                }
+                cl[std::size_t(cy) * Wc + cx] = float(s * inv);
+            }
+        }
+        return;
+    }
+    // 引导图：中心差分梯度幅值（边界单侧），均值对齐细层 λ̂，再按 ⌈pr/f⌉ 做盒均值（同细层 λ → λ̂）
+    const Plane<float>& g = ws.guide;
+    std::vector<float>& mag = ws.pyr_tmp;
+    mag.resize(cl.size());
+    double sum_mag = 0.0, sum_hat = 0.0;
+    #pragma omp parallel for reduction(+:sum_mag) if(H*W>100000)
+    for (int cy = 0; cy < Hc; ++cy) {
+        const int yu = std::max(0, cy - 1), yd = std::min(Hc - 1, cy + 1);
+        for (int cx = 0; cx < Wc; ++cx) {
+            const int xl = std::max(0, cx - 1), xr = std::min(Wc - 1, cx + 1);
+            double gx = (double(g(cy, xr)) - double(g(cy, xl))) / std::max(1, xr - xl);
+            double gy = (double(g(yd, cx)) - double(g(yu, cx))) / std::max(1, yd - yu);
+            double m = std::sqrt(gx*gx + gy*gy);
+            mag[std::size_t(cy) * Wc + cx] = float(m);
+            sum_mag += m;
+        }
+    }
+    #pragma omp parallel for reduction(+:sum_hat) if(H*W>100000)
+    for (int i = 0; i < H*W; ++i) sum_hat += lam_hat[i];
+    const double scale = (sum_mag > 1e-12) ? (sum_hat / double(H*W)) / (sum_mag / double(Hc*Wc)) : 0.0;
+    #pragma omp parallel for if(H*W>100000)
+    for (int i = 0; i < Hc*Wc; ++i) mag[i] = float(mag[i] * scale);
+    box_mean_truncated(mag.data(), cl.data(), Hc, Wc, (prm.patch_radius + f - 1) / f);
+}
+
+template <typename Acc, typename T>
+static inline double poisson_nlm_pyramid_core(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                              const NLMParams& prm,
+                                              float* gx_out, float* gy_out, float* lam_bar,
+                                              RunControl* ctl, NLMWorkspace& ws) {
+    const int pr = prm.patch_radius, sr = prm.search_radius, topk = prm.topk;
+    const int levels = prm.pyramid_levels, f = 1 << levels;
+    const int Hc = H >> levels, Wc = W >> levels;
+    if (ws.guide.p && (ws.guide_h != Hc || ws.guide_w != Wc)) {
+        throw std::runtime_error("guide must have shape (H >> pyramid_levels, W >> pyramid_levels)");
+    }
+    if (Hc <= 2*pr || Wc <= 2*pr) {
+        return poisson_nlm_patch_core<Acc>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, ws);
+    }
+    const double rho = prm.rho, lam_quant = prm.lam_quant;
+
+    LambdaMaps& lm = ws.lm;
+    prepare_lambda_maps(gx_in, gy_in, H, W, prm, lam_bar, lm, ws.grad_mag);
+    const int* lam_q = lm.lam_q.data();
+
+    // 1) 粗层 λ̂ 与量化下标；d 表覆盖细层与粗层两者的 λ 范围
+    build_coarse_lambda(prm, H, W, Hc, Wc, ws);
+    const std::size_t nc = std::size_t(Hc) * Wc;
+    ws.pyr_q.resize(nc);
+    int* cq = ws.pyr_q.data();
+    float coarse_max = 0.0f;
+    #pragma omp parallel if(H*W>100000)
+    {
+        float local_max = 0.0f;
+        #pragma omp for
+        for (int i = 0; i < (int)nc; ++i) {
+            cq[i] = int(std::round(double(ws.pyr_lam[i]) / lam_quant));
+            local_max = std::max(local_max, ws.pyr_lam[i]);
+        }
+        #pragma omp critical
+        coarse_max = std::max(coarse_max, local_max);
+    }
+    const DistanceTable& tab = acquire_distance_table(ws.table, lam_quant, std::max(lm.lam_max, coarse_max));
+    const int k = 2*pr + 1;
+    const RowDistanceFn row_dist = current_row_distance().by_patch(k);
+
+    // 2) 粗层搜索：每个内部粗像素保留 K 个最近的粗位移，以 (dy+src)·(2src+1) + (dx+src) 存储
+    // 粗搜索半径取 ⌈(sr + f - 1)/f⌉，使父粗像素窗内的细格覆盖细层整个搜索窗
+    const int src = (sr + 2*f - 2) / f, cw = 2*src + 1;
+    const int K = std::min(prm.refine_candidates, cw * cw);
+    ws.pyr_cand.assign(nc * K, src * cw + src);      // 默认全为零位移
+    int* cc = ws.pyr_cand.data();
+    #pragma omp parallel if(H>16)
+    {
+        std::vector<Candidate> cand(cw * cw);
+        std::vector<double> drow(cw);
+        std::vector<int> qxp(k*k);
+        #pragma omp for schedule(static)
+        for (int cy = pr; cy < Hc - pr; ++cy) {
+            if (ctl && ctl->stop_requested()) continue;
+            for (int cx = pr; cx < Wc - pr; ++cx) {
+                for (int j = 0; j < k; ++j) {
+                    const int* row_x = cq + (cy - pr + j)*Wc + (cx - pr);
+                    for (int i = 0; i < k; ++i) qxp[j*k + i] = row_x[i];
+                }
+                const int sy0 = std::max(pr, cy - src), sy1 = std::min(Hc - pr, cy + src + 1);
+                const int sx0 = std::max(pr, cx - src), sx1 = std::min(Wc - pr, cx + src + 1);
+                int n = 0;
+                for (int yy = sy0; yy < sy1; ++yy) {
+                    row_dist(tab, qxp.data(), cq + (yy - pr)*Wc + (sx0 - pr), Wc, k, sx1 - sx0, drow.data());
+                    for (int xx = sx0; xx < sx1; ++xx) {
+                        cand[n].D = drow[xx - sx0];
+                        cand[n].y = yy - cy;
+                        cand[n].x = xx - cx;
+                        ++n;
+                    }
+                }
+                const int keep = std::min(K, n);
+                if (n > keep) {
+                    std::nth_element(cand.begin(), cand.begin() + keep, cand.begin() + n,
+                        [](const Candidate& a, const Candidate& b){ return a.D < b.D; });
+                }
+                // 零位移（自身）始终保留：平坦区大量 D=0 并列时 nth_element 未必选中它
+                int* out = cc + (std::size_t(cy) * Wc + cx) * K;
+                bool has_self = false;
+                for (int i = 0; i < keep; ++i) {
+                    out[i] = (cand[i].y + src) * cw + (cand[i].x + src);
+                    has_self = has_self || (cand[i].y == 0 && cand[i].x == 0);
+                }
+                if (!has_self) out[keep - 1] = src * cw + src;
+            }
+        }
+    }
+    if (ctl) ctl->raise_if_stopped();
+
+    // 3) 细层：父粗像素（钳到粗层内部）的 K 个粗位移各对应一个 f×f 细格，外加细层 3×3 邻域与边缘带，
+    //    限于搜索窗与内部区域、去重后求精确块距离
+    const int sw = 2*sr + 1;
+    const int rows_total = std::max(0, H - 2*pr);
+    std::atomic<int> rows_done(0);
+    int rows_reported = 0;
+    const int report_rows = std::max(16, rows_total / 100);
+    #pragma omp parallel if(H>16)
+    {
+#ifdef _OPENMP
+        const bool is_caller = (omp_get_thread_num() == 0);
+#else
+        const bool is_caller = true;
+#endif
+        const int max_cand = sw * sw;
+        std::vector<Candidate> cand(max_cand);
+        std::vector<Acc> wts(max_cand);
+        std::vector<double> drow(sw);
+        std::vector<int> qxp(k*k);
+        std::vector<std::uint32_t> seen(sw * sw, 0);   // 按像素编号打标去重
+        std::uint32_t stamp = 0;
+        long long n_cand = 0, n_kept = 0;
+        NLM_BUSY_TIMER();
+        #pragma omp for schedule(static) nowait
+        for (int y = pr; y < H - pr; ++y) {
+            if (ctl && ctl->stop_requested()) continue;
+            const int pcy = std::min(std::max(y >> levels, pr), Hc - pr - 1);
+            const int wy0 = std::max(pr, y - sr), wy1 = std::min(H - pr - 1, y + sr);
+            for (int x = pr; x < W - pr; ++x) {
+                const int pcx = std::min(std::max(x >> levels, pr), Wc - pr - 1);
+                const int wx0 = std::max(pr, x - sr), wx1 = std::min(W - pr - 1, x + sr);
+                const int* pc = cc + (std::size_t(pcy) * Wc + pcx) * K;
+                if (++stamp == 0) { std::fill(seen.begin(), seen.end(), 0u); stamp = 1; }
+
+                for (int j = 0; j < k; ++j) {
+                    const int* row_x = lam_q + (y - pr + j)*W + (x - pr);
+                    for (int i = 0; i < k; ++i) qxp[j*k + i] = row_x[i];
+                }
+                int n = 0;
+                // 细层矩形 [y0,y1]×[x0,x1]（闭区间）中尚未出现的候选
+                auto add_rect = [&](int y0, int y1, int x0, int x1) {
+                    y0 = std::max(y0, wy0); y1 = std::min(y1, wy1);
+                    x0 = std::max(x0, wx0); x1 = std::min(x1, wx1);
+                    for (int yy = y0; yy <= y1; ++yy) {
+                        if (x0 > x1) break;
+                        row_dist(tab, qxp.data(), lam_q + (yy - pr)*W + (x0 - pr), W, k, x1 - x0 + 1, drow.data());
+                        for (int xx = x0; xx <= x1; ++xx) {
+                            const int s_idx = (yy - y + sr) * sw + (xx - x + sr);
+                            if (seen[s_idx] == stamp) continue;
+                            seen[s_idx] = stamp;
+                            cand[n].D = drow[xx - x0];
+                            cand[n].y = yy;
+                            cand[n].x = xx;
+                            ++n;
+                        }
+                    }
+                };
+                add_rect(y - 1, y + 1, x - 1, x + 1);
+                // 粗层内部之外的细层行列（图像边缘 f·pr 一带及缩小时舍去的尾部）没有粗格代表，直接全部加入
+                add_rect(wy0, pr*f - 1, wx0, wx1);
+                add_rect((Hc - pr)*f, wy1, wx0, wx1);
+                add_rect(wy0, wy1, wx0, pr*f - 1);
+                add_rect(wy0, wy1, (Wc - pr)*f, wx1);
+                for (int c = 0; c < K; ++c) {
+                    const int gy0 = (pcy + pc[c] / cw - src) * f, gx0 = (pcx + pc[c] % cw - src) * f;
+                    add_rect(gy0, gy0 + f - 1, gx0, gx0 + f - 1);
+                }
+                const double denom = rho * std::max(double(lam_bar[y*W + x]), 1e-8);
+                n_cand += n;
+                n_kept += (topk > 0 && n > topk) ? topk : n;
+                nlm_weighted_average(cand, n, topk, denom, gx_in, gy_in, wts, gx_out + y*W + x, gy_out + y*W + x);
+            }
+            if (ctl) {
+                int done = ++rows_done;
+                if (is_caller && done - rows_reported >= report_rows) {
+                    rows_reported = done;
+                    ctl->report(done, rows_total);
+                }
+            }
+        }
+        NLM_STAT_ADD(kStatCandidates, n_cand);
+        NLM_STAT_ADD(kStatCandidatesKept, n_kept);
+    }
+    if (ctl) {
+        ctl->raise_if_stopped();
+        ctl->report(rows_total, rows_total);
+    }
+
+    // 边界直接拷回原值
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            if (y<pr || y>=H-pr || x<pr || x>=W-pr) {
+                gx_out[y*W + x] = float(gx_in(y, x));
+                gy_out[y*W + x] = float(gy_in(y, x));
+            }
+        }
+    }
+
+    return lm.count_scale;
+}
+
+// -------------------- 计算后端：OpenMP（CPU）或可选的 CUDA --------------------
+// "auto" 在编译了 CUDA 后端且有设备时用 GPU，否则 CPU；首次使用时读取环境变量 POISSON_NLM_BACKEND，
+// 之后可由 set_compute_backend 随时切换（影响之后所有调用，含流水线分块）。
+// GPU 出错或配置超出 GPU 核支持范围时自动回退到 OpenMP 路径，原因记入 compute_backend_fallback_reason。
+enum { kComputeAuto = 0, kComputeCPU = 1, kComputeCUDA = 2 };
+
+static inline int parse_compute_backend(const std::string& name) {
+    if (name == "auto") return kComputeAuto;
+    if (name == "cpu" || name == "openmp") return kComputeCPU;
+    if (name == "cuda" || name == "gpu") return kComputeCUDA;
+    throw std::runtime_error("compute backend must be 'auto', 'cpu' or 'cuda': " + name);
+}
+
+static inline bool cuda_backend_usable() {
+#ifdef POISSON_NLM_WITH_CUDA
+    static const bool ok = nlm_cuda_available();
+    return ok;
+#else
+    return false;
+#endif
+}
+
+static std::atomic<int> g_compute_backend(-1);   // -1：尚未读取环境变量
+static std::mutex g_fallback_mtx;
+static std::string g_fallback_reason;
+
+static inline int requested_compute_backend() {
+    int b = g_compute_backend.load();
+    if (b < 0) {
+        const char* env = std::getenv("POISSON_NLM_BACKEND");
+        int parsed = kComputeAuto;
+        if (env && *env) {
+            try { parsed = parse_compute_backend(env); } catch (const std::exception&) { parsed = kComputeAuto; }
+        }
+        int expected = -1;
+        g_compute_backend.compare_exchange_strong(expected, parsed);
+        b = g_compute_backend.load();
+    }
+    return b;
+}
+
+static inline bool use_cuda_backend() {
+    const int b = requested_compute_backend();
+    return b != kComputeCPU && cuda_backend_usable();
+}
+
+static inline void set_fallback_reason(const std::string& why) {
+    std::lock_guard<std::mutex> lock(g_fallback_mtx);
+    g_fallback_reason = why;
+}
+
+static inline std::string compute_backend_fallback_reason() {
+    std::lock_guard<std::mutex> lock(g_fallback_mtx);
+    return g_fallback_reason;
+}
+
+#ifdef POISSON_NLM_WITH_CUDA
+// GPU 路径：λ 预处理与 d 表在主机端（与 CPU 路径共用），逐像素加权在设备上完成。
+// 成功返回 true 并写 *count_scale；返回 false 表示需回退到 CPU。取消时抛出 CancelledError。
+template <typename T>
+static inline bool poisson_nlm_cuda_core(Plane<T> gx_in, Plane<T> gy_in, int H, int W, const NLMParams& prm,
+                                         float* gx_out, float* gy_out, float* lam_bar,
+                                         RunControl* ctl, NLMWorkspace& ws, double* count_scale) {
+    if (prm.engine == kNLMEnginePyramid) {
+        set_fallback_reason("pyramid engine has no CUDA kernel");
+        return false;
+    }
+    const int max_cand = (2*prm.search_radius + 1) * (2*prm.search_radius + 1);
+    if (prm.topk > 0 && max_cand > nlm_cuda_max_candidates()) {
+        set_fallback_reason("search window too large for the CUDA topk kernel");
+        return false;
+    }
+    LambdaMaps& lm = ws.lm;
+    prepare_lambda_maps(gx_in, gy_in, H, W, prm, lam_bar, lm, ws.grad_mag);
+    const DistanceTable& tab = acquire_distance_table(ws.table, prm.lam_quant, lm.lam_max);
+
+    // 设备端按行主序 float 读取梯度；已是连续 float 时直接使用
+    std::vector<float> gx_buf, gy_buf;
+    const float* gx = nullptr;
+    const float* gy = nullptr;
+    if (std::is_same<T, float>::value && gx_in.sx == 1 && gx_in.sy == W && gy_in.sx == 1 && gy_in.sy == W) {
+        gx = reinterpret_cast<const float*>(gx_in.p);
+        gy = reinterpret_cast<const float*>(gy_in.p);
+    } else {
+        gx_buf.resize(std::size_t(H) * W);
+        gy_buf.resize(std::size_t(H) * W);
+        copy_plane(gx_in, H, W, gx_buf.data());
+        copy_plane(gy_in, H, W, gy_buf.data());
+        gx = gx_buf.data();
+        gy = gy_buf.data();
+    }
+
+    NLMCudaJob job;
+    job.H = H; job.W = W;
+    job.search_radius = prm.search_radius; job.patch_radius = prm.patch_radius; job.topk = prm.topk;
+    job.rho = prm.rho;
+    job.use_float = (prm.precision == kNLMPrecisionFloat32);
+    job.lam_q = lm.lam_q.data(); job.lam_bar = lam_bar;
+    job.gx = gx; job.gy = gy;
+    job.gx_out = gx_out; job.gy_out = gy_out;
+    job.table = tab.d.data(); job.table_n = tab.n; job.lam_quant = tab.lam_quant; job.table_key = &tab;
+    if (ctl) {
+        job.user = ctl;
+        job.band_done = [](void* user, int done, int total) -> bool {
+            RunControl* c = static_cast<RunControl*>(user);
+            c->report(done, total);
+            return !c->stop_requested();
+        };
+    }
+
+    std::string err;
+    const int rc = nlm_cuda_run(job, &err);
+    if (rc == kNLMCudaFailed) {
+        set_fallback_reason(err);
+        return false;
+    }
+    if (ctl) ctl->raise_if_stopped();
+
+    const int pr = prm.patch_radius;
+    for (int y = 0; y < H; ++y) {
+        for (int x = 0; x < W; ++x) {
+            if (y<pr || y>=H-pr || x<pr || x>=W-pr) {
+                gx_out[y*W + x] = float(gx_in(y, x));
+                gy_out[y*W + x] = float(gy_in(y, x));
+            }
+        }
+    }
+    *count_scale = lm.count_scale;
+    return true;
+}
+#endif
+
+// 按 prm.engine / prm.precision 分派到逐块引擎或位移引擎的 double / float 累加实例。
+// ws 为可选的跨帧工作区；不给时使用本次调用的临时工作区。
+template <typename T>
+static inline double poisson_nlm_core(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                      const NLMParams& prm,
+                                      float* gx_out, float* gy_out, float* lam_bar,
+                                      RunControl* ctl = nullptr, NLMWorkspace* ws = nullptr) {
+    validate_nlm_params(prm);
+    NLM_SCOPED_TIMER(kStatNLM, (long long)H * W);
+    NLMWorkspace local;
+    NLMWorkspace& w = ws ? *ws : local;
+#ifdef POISSON_NLM_WITH_CUDA
+    if (use_cuda_backend()) {
+        double count_scale = 0.0;
+        if (poisson_nlm_cuda_core(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w, &count_scale)) {
+            return count_scale;
+        }
+    }
+#endif
+    const bool f32 = (prm.precision == kNLMPrecisionFloat32);
+    if (prm.engine == kNLMEnginePyramid) {
+        return f32 ? poisson_nlm_pyramid_core<float>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w)
+                   : poisson_nlm_pyramid_core<double>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w);
+    }
+    if (prm.engine == kNLMEngineOffset) {
+        return f32 ? poisson_nlm_offset_core<float>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w)
+                   : poisson_nlm_offset_core<double>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w);
+    }
+    return f32 ? poisson_nlm_patch_core<float>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w)
+               : poisson_nlm_patch_core<double>(gx_in, gy_in, H, W, prm, gx_out, gy_out, lam_bar, ctl, w);
+}
+
+// -------------------- 精度验证：float32 路径相对 double 路径的偏差 --------------------
+// 同一输入分别以 double / float32 累加跑一遍（其余参数相同），统计输出梯度的逐像素偏差。
+// rel 为相对 double 路径 |G| 峰值的比例，可直接对照 16-bit 量化步长（1/65535 ≈ 1.5e-5）。
+struct PrecisionDeviation {
+    double max_abs = 0.0;     // max |G_f32 - G_f64|（Gx、Gy 两个分量合计）
+    double rms = 0.0;
+    double ref_peak = 0.0;    // double 路径的 max |G|
+    double max_rel = 0.0;     // max_abs / ref_peak
+};
+
+template <typename T>
+static inline PrecisionDeviation nlm_precision_deviation(Plane<T> gx_in, Plane<T> gy_in, int H, int W,
+                                                         NLMParams prm, RunControl* ctl = nullptr) {
+    const std::size_t n = std::size_t(H) * W;
+    std::vector<float> rx(n), ry(n), fx(n), fy(n), lb(n);
+    prm.precision = kNLMPrecisionDouble;
+    poisson_nlm_core(gx_in, gy_in, H, W, prm, rx.data(), ry.data(), lb.data(), ctl);
+    prm.precision = kNLMPrecisionFloat32;
+    poisson_nlm_core(gx_in, gy_in, H, W, prm, fx.data(), fy.data(), lb.data(), ctl);
+
+    PrecisionDeviation dev;
+    double sq = 0.0;
+    for (std::size_t i = 0; i < n; ++i) {
+        const double ex = std::fabs(double(fx[i]) - rx[i]), ey = std::fabs(double(fy[i]) - ry[i]);
+        dev.max_abs = std::max(dev.max_abs, std::max(ex, ey));
+        dev.ref_peak = std::max(dev.ref_peak, std::max(std::fabs(double(rx[i])), std::fabs(double(ry[i]))));
+        sq += ex*ex + ey*ey;
+    }
+    dev.rms = n ? std::sqrt(sq / double(2 * n)) : 0.0;
+    dev.max_rel = dev.ref_peak > 0.0 ? dev.max_abs / dev.ref_peak : 0.0;
+    return dev;
+}
+
+// -------------------- Step 3：变分重建（TV + 泊松项，与 paper_enhance.variational_reconstruct_unit 同式） --------------------
+// I ← clip(I - dt·(γ·div(∇I/|∇I|) + 2δ·(ΔI - div G)), 0, 1)，差分与 np.roll 一致（周期边界）。
+// 每次迭代只做一遍按行块划分的融合扫描：p=∇I/|∇I| 只在 3 行环形缓冲中存在，div G 现算，
+// 除一张双缓冲图外不产生任何整图临时量。结果写回 I。
+static inline void variational_reconstruct_core(float* I, int H, int W, const float* Gx, const float* Gy,
+                                                double gamma, double delta, int iters, double dt) {
+    if (iters <= 0 || H <= 0 || W <= 0) return;
+    NLM_SCOPED_TIMER(kStatReconstruct, (long long)H * W);
+    const float g = float(gamma), c2d = float(2.0 * delta), dtf = float(dt);
+    std::vector<int> xl(W), xr(W);
+    for (int x = 0; x < W; ++x) { xl[x] = (x + W - 1) % W; xr[x] = (x + 1) % W; }
+    auto wrap = [H](int y) { return (y % H + H) % H; };
+
+    std::vector<float> other(std::size_t(H) * W);
+    float* src = I;
+    float* dst = other.data();
+    const int kRowBlock = 32;
+    const int nblk = (H + kRowBlock - 1) / kRowBlock;
+
+    #pragma omp parallel if(H*W>100000)
+    {
+        // 行 r 的 (px, py) 存在槽 (r - ya + 1) % 3
+        std::vector<float> pring(std::size_t(6) * W);
+
+        for (int it = 0; it < iters; ++it) {
+            #pragma omp for schedule(static)
+            for (int b = 0; b < nblk; ++b) {
+                const int ya = b * kRowBlock, yb = std::min(H, ya + kRowBlock);
+                auto px_row = [&](int r) { return pring.data() + std::size_t((r - ya + 1) % 3) * 2 * W; };
+                auto compute_p = [&](int r) {
+                    const float* Ic = src + std::size_t(wrap(r)) * W;
+                    const float* Iu = src + std::size_t(wrap(r - 1)) * W;
+                    const float* Id = src + std::size_t(wrap(r + 1)) * W;
+                    float* px = px_row(r);
+                    float* py = px + W;
+                    for (int x = 0; x < W; ++x) {
+                        float ix = 0.5f * (Ic[xr[x]] - Ic[xl[x]]);
+                        float iy = 0.5f * (Id[x] - Iu[x]);
+                        float gn = std::sqrt(ix*ix + iy*iy) + 1e-12f;
+                        px[x] = ix / gn;
+                        py[x] = iy / gn;
+                    }
+                };
+                compute_p(ya - 1);
+                compute_p(ya);
+                for (int y = ya; y < yb; ++y) {
+                    compute_p(y + 1);
+                    const float* pxc = px_row(y);
+                    const float* pyu = px_row(y - 1) + W;
+                    const float* pyd = px_row(y + 1) + W;
+                    const float* Ic = src + std::size_t(y) * W;
+                    const float* Iu = src + std::size_t(wrap(y - 1)) * W;
+                    const float* Id = src + std::size_t(wrap(y + 1)) * W;
+                    const float* gxc = Gx + std::size_t(y) * W;
+                    const float* gyu = Gy + std::size_t(wrap(y - 1)) * W;
+                    const float* gyd = Gy + std::size_t(wrap(y + 1)) * W;
+                    float* out = dst + std::size_t(y) * W;
+                    for (int x = 0; x < W; ++x) {
+                        float div_p = 0.5f * (pxc[xr[x]] - pxc[xl[x]]) + 0.5f * (pyd[x] - pyu[x]);
+                        float lap = Iu[x] + Id[x] + Ic[xl[x]] + Ic[xr[x]] - 4.0f * Ic[x];
+                        float div_G = 0.5f * (gxc[xr[x]] - gxc[xl[x]]) + 0.5f * (gyd[x] - gyu[x]);
+                        float v = Ic[x] - dtf * (g * div_p + c2d * (lap - div_G));
+                        out[x] = std::min(1.0f, std::max(0.0f, v));
+                    }
+                }
+            }
+            #pragma omp single
+            std::swap(src, dst);
+        }
+    }
+    if (src != I) std::copy(src, src + std::size_t(H) * W, I);
+}
+
+// -------------------- 常驻工作窃取线程池（分块级并行） --------------------
+// 每个参与的 worker 有自己的任务双端队列：从队首取自己的任务，空了从别人的队尾窃取。
+// 任务内部仍可使用 OpenMP；每个 worker 在作业开始时把自己的 OpenMP 线程数设为 inner_threads，
+// 避免 分块数 × OpenMP 线程数 的超额订阅。
+// run() 调用之间串行：多个 Python 线程同时提交的作业排队依次执行。不可重入：在 poll（进度回调）
+// 或任务内部再调用 run() 会抛出 std::runtime_error，而不是在 run_mtx_ 上自锁。
+class WorkStealingPool {
+public:
+    typedef std::function<void(int task, int worker)> TaskFn;
+
+    explicit WorkStealingPool(int n_workers) : queues_(std::max(1, n_workers)) {
+        for (int w = 0; w < (int)queues_.size(); ++w) threads_.emplace_back([this, w] { worker_loop(w); });
+    }
+
+    ~WorkStealingPool() {
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        for (auto& t : threads_) t.join();
+    }
+
+    int size() const { return (int)queues_.size(); }
+
+    // 以 width 个 worker 执行 fn(0..n_tasks-1)，阻塞至全部完成；任务抛出的首个异常在此重新抛出。
+    // poll 非空时，调用线程在等待期间约每 50ms 执行一次（不持有池内锁），用于上报进度/转发取消
+    void run(int n_tasks, int width, int inner_threads, const TaskFn& fn,
+             const std::function<void()>& poll = std::function<void()>()) {
+        if (n_tasks <= 0) return;
+        if (in_pool())
+            throw std::runtime_error("tile pipeline is not re-entrant: do not start it from a progress callback");
+        std::lock_guard<std::mutex> run_lock(run_mtx_);
+        in_pool() = true;
+        struct Leave { ~Leave() { in_pool() = false; } } leave;
+        width = std::max(1, std::min(width, std::min(size(), n_tasks)));
+        // 连续分段初始分配，保持相邻分块的数据局部性
+        for (int w = 0; w < width; ++w) {
+            std::lock_guard<std::mutex> ql(queues_[w].mtx);
+            queues_[w].tasks.clear();
+            int a = int((long long)n_tasks * w / width), b = int((long long)n_tasks * (w + 1) / width);
+            for (int t = a; t < b; ++t) queues_[w].tasks.push_back(t);
+        }
+        {
+            std::lock_guard<std::mutex> lock(mtx_);
+            fn_ = &fn;
+            width_ = width;
+            inner_threads_ = std::max(1, inner_threads);
+            active_ = width;
+            error_ = nullptr;
+            ++generation_;
+        }
+        cv_.notify_all();
+        std::unique_lock<std::mutex> lock(mtx_);
+        while (!done_cv_.wait_for(lock, std::chrono::milliseconds(50), [this] { return active_ == 0; })) {
+            if (!poll) continue;
+            lock.unlock();
+            poll();
+            lock.lock();
+        }
+        fn_ = nullptr;
+        if (error_) std::rethrow_exception(error_);
+    }
+
+private:
+    struct Queue {
+        std::mutex mtx;
+        std::deque<int> tasks;
+    };
+
+    bool pop_or_steal(int w, int& task) {
+        {
+            std::lock_guard<std::mutex> ql(queues_[w].mtx);
+            if (!queues_[w].tasks.empty()) {
+                task = queues_[w].tasks.front();
+                queues_[w].tasks.pop_front();
+                return true;
+            }
+        }
+        for (int d = 1; d < width_; ++d) {
+            Queue& victim = queues_[(w + d) % width_];
+            std::lock_guard<std::mutex> ql(victim.mtx);
+            if (!victim.tasks.empty()) {
+                task = victim.tasks.back();
+                victim.tasks.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // 当前线程正在 run() 中等待（调用线程），或本身是池线程
+    static bool& in_pool() {
+        static thread_local bool flag = false;
+        return flag;
+    }
+
+    void worker_loop(int w) {
+        in_pool() = true;
+        std::uint64_t seen = 0;
+        for (;;) {
+            const TaskFn* fn;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                cv_.wait(lock, [&] { return stop_ || (generation_ != seen && w < width_); });
+                if (stop_) return;
+                seen = generation_;
+                fn = fn_;
+            }
+#ifdef _OPENMP
+            omp_set_num_threads(inner_threads_);
+#endif
+            int task;
+            while (pop_or_steal(w, task)) {
+                if (failed_.load()) continue;          // 已有任务失败：清空剩余任务
+                try {
+                    (*fn)(task, w);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    if (!error_) error_ = std::current_exception();
+                    failed_ = true;
+                }
+            }
+            std::lock_guard<std::mutex> lock(mtx_);
+            if (--active_ == 0) {
+                failed_ = false;
+                done_cv_.notify_all();
+            }
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> threads_;
+    std::mutex run_mtx_, mtx_;
+    std::condition_variable cv_, done_cv_;
+    const TaskFn* fn_ = nullptr;
+    int width_ = 0, inner_threads_ = 1, active_ = 0;
+    std::uint64_t generation_ = 0;
+    std::exception_ptr error_;
+    std::atomic<bool> failed_{false};
+    bool stop_ = false;
+};
+
+static inline int hardware_threads() {
+#ifdef _OPENMP
+    return std::max(1, omp_get_max_threads());
+#else
+    return std::max(1, (int)std::thread::hardware_concurrency());
+#endif
+}
+
+// 进程级常驻池（有意不析构：避免解释器退出时在静态析构阶段 join 线程）
+static inline WorkStealingPool& global_pool() {
+    static WorkStealingPool* pool = new WorkStealingPool(hardware_threads());
+    return *pool;
+}
+
+// -------------------- 端到端流水线：uint16 → [0,1] → Step1 → Step2 → Step3 → uint16 --------------------
+// 与 paper_enhance.enhance_xray_poisson_nlm_strict_tiled_cpp 逐步对应，全程不经过 Python。
+
+// 65536 档直方图；按秩取值可精确复现 np.percentile（linear 插值）
+struct U16Histogram {
+    std::vector<std::uint64_t> counts;
+    std::uint64_t n = 0;
+
+    // 每线程 4 份交错的 uint32 子直方图：大片相同灰度（过曝背景、零填充）时相邻像素的自增
+    // 落在不同子表上，不会串行等待同一计数。子表计数接近 uint32 上限前并入总表
+    void build(const Plane<std::uint16_t>& v, int H, int W) {
+        counts.assign(65536, 0);
+        n = std::uint64_t(H) * W;
+        #pragma omp parallel if(n>100000)
+        {
+            std::vector<std::uint32_t> local(4 * 65536, 0);
+            std::uint32_t* h0 = local.data();
+            std::uint32_t* h1 = h0 + 65536;
+            std::uint32_t* h2 = h1 + 65536;
+            std::uint32_t* h3 = h2 + 65536;
+            std::vector<std::uint16_t> row(v.sx == 1 ? 0 : W);
+            std::uint64_t pending = 0;
+            #pragma omp for schedule(static)
+            for (int y = 0; y < H; ++y) {
+                if (pending + std::uint64_t(W) > 0xFFFFFFFFull) {
+                    #pragma omp critical(u16_histogram)
+                    merge(local);
+                    std::fill(local.begin(), local.end(), 0u);
+                    pending = 0;
+                }
+                const std::uint16_t* p = v.p + y * v.sy;
+                if (v.sx != 1) {
+                    for (int x = 0; x < W; ++x) row[x] = v(y, x);
+                    p = row.data();
+                }
+                int x = 0;
+                for (; x + 4 <= W; x += 4) { ++h0[p[x]]; ++h1[p[x + 1]]; ++h2[p[x + 2]]; ++h3[p[x + 3]]; }
+                for (; x < W; ++x) ++h0[p[x]];
+                pending += std::uint64_t(W);
+            }
+            #pragma omp critical(u16_histogram)
+            merge(local);
+        }
+    }
+    void merge(const std::vector<std::uint32_t>& local) {
+        for (int b = 0; b < 65536; ++b) {
+            counts[b] += std::uint64_t(local[b]) + local[65536 + b] + local[2 * 65536 + b] + local[3 * 65536 + b];
+        }
+    }
+    // 升序排列后第 rank 个值（0 起）
+    int value_at_rank(std::uint64_t rank) const {
+        std::uint64_t c = 0;
+        for (int b = 0; b < 65536; ++b) {
+            c += counts[b];
+            if (c > rank) return b;
+        }
+        return 65535;
+    }
+    double percentile(double p) const {
+        if (n == 0) return 0.0;
+        double pos = p / 100.0 * double(n - 1);
+        std::uint64_t lo = (std::uint64_t)std::floor(pos);
+        std::uint64_t hi = std::min<std::uint64_t>(lo + 1, n - 1);
+        double vlo = value_at_rank(lo), vhi = value_at_rank(hi);
+        return vlo + (pos - double(lo)) * (vhi - vlo);
+    }
+    int max_value() const {
+        for (int b = 65535; b >= 0; --b) if (counts[b]) return b;
+        return 0;
+    }
+};
+
+// 与 np.percentile(linear) 一致的浮点分位数；v 会被重排
+static inline double percentile_inplace(std::vector<float>& v, double p) {
+    if (v.empty()) return 0.0;
+    double pos = p / 100.0 * double(v.size() - 1);
+    std::size_t lo = (std::size_t)std::floor(pos);
+    std::nth_element(v.begin(), v.begin() + lo, v.end());
+    double vlo = v[lo];
+    double vhi = (lo + 1 < v.size()) ? *std::min_element(v.begin() + lo + 1, v.end()) : vlo;
+    return vlo + (pos - double(lo)) * (vhi - vlo);
+}
+
+// cv2::BORDER_REFLECT 下标映射（fedcba|abcdef|fedcba）
+static inline int reflect_index(int i, int n) {
+    if (n == 1) return 0;
+    while (i < 0 || i >= n) i = (i < 0) ? (-i - 1) : (2*n - i - 1);
+    return i;
+}
+
+// 反射边界盒均值：同时给出 E[v] 与 E[v²]（等价于两次 cv2.blur），每像素 O(1)
+static inline void box_moments_reflect(const float* src, float* mean, float* mean2, int H, int W, int r) {
+    const int kRowBlock = 64;
+    const int nblk = (H + kRowBlock - 1) / kRowBlock;
+    const double inv = 1.0 / double((2*r + 1) * (2*r + 1));
+    #pragma omp parallel for schedule(static) if(H*W>100000)
+    for (int b = 0; b < nblk; ++b) {
+        const int ya = b * kRowBlock, yb = std::min(H, ya + kRowBlock);
+        std::vector<double> c1(W, 0.0), c2(W, 0.0);
+        for (int t = -r; t <= r; ++t) {
+            const float* row = src + std::size_t(reflect_index(ya + t, H)) * W;
+            for (int x = 0; x < W; ++x) { double v = row[x]; c1[x] += v; c2[x] += v*v; }
+        }
+        for (int y = ya; y < yb; ++y) {
+            if (y > ya) {
+                const float* add = src + std::size_t(reflect_index(y + r, H)) * W;
+                const float* sub = src + std::size_t(reflect_index(y - r - 1, H)) * W;
+                for (int x = 0; x < W; ++x) {
+                    double a = add[x], s = sub[x];
+                    c1[x] += a - s; c2[x] += a*a - s*s;
+                }
+            }
+            double s1 = 0.0, s2 = 0.0;
+            for (int t = -r; t <= r; ++t) { int xi = reflect_index(t, W); s1 += c1[xi]; s2 += c2[xi]; }
+            float* m1 = mean + std::size_t(y) * W;
+            float* m2 = mean2 + std::size_t(y) * W;
+            for (int x = 0; x < W; ++x) {
+                if (x > 0) {
+                    int xa = reflect_index(x + r, W), xs = reflect_index(x - r - 1, W);
+                    s1 += c1[xa] - c1[xs]; s2 += c2[xa] - c2[xs];
+                }
+                m1[x] = float(s1 * inv);
+                m2[x] = float(s2 * inv);
+            }
+        }
+    }
+}
+
+// -------------------- Step 1 的 σ 分位数：直方图近似 --------------------
+// σ 在 [0, hi) 上等宽分 kSigmaHistBins 个桶；第 r 个顺序统计量取其所在桶内按秩线性插值的位置，
+// 误差不超过一个桶宽（hi = 0.5 时约 7.6e-6）。分位位置与 np.percentile（linear）相同。
+static const int kSigmaHistBins = 1 << 16;
+
+struct SigmaHistogram {
+    std::vector<std::uint32_t> counts;
+    double hi = 0.5;
+    std::uint64_t n = 0;
+
+    double value_at_rank(std::uint64_t rank) const {
+        const double width = hi / double(counts.size());
+        std::uint64_t c = 0;
+        for (std::size_t b = 0; b < counts.size(); ++b) {
+            if (c + counts[b] > rank) {
+                return (double(b) + (double(rank - c) + 0.5) / double(counts[b])) * width;
+            }
+            c += counts[b];
+        }
+        return hi;
+    }
+    double percentile(double p) const {
+        if (n == 0) return 0.0;
+        const double pos = p / 100.0 * double(n - 1);
+        const std::uint64_t lo = (std::uint64_t)std::floor(pos);
+        const double vlo = value_at_rank(lo);
+        const double vhi = (lo + 1 < n) ? value_at_rank(lo + 1) : vlo;
+        return vlo + (pos - double(lo)) * (vhi - vlo);
+    }
+};
+
+// 按 [0, hi) 重新统计 σ（仅当融合遍历中出现超出预设上界的 σ 时使用）
+static inline void build_sigma_histogram(const float* sigma, std::size_t N, double hi, SigmaHistogram& h) {
+    h.counts.assign(kSigmaHistBins, 0);
+    h.hi = hi;
+    h.n = N;
+    const double inv_w = double(kSigmaHistBins) / hi;
+    #pragma omp parallel if(N>100000)
+    {
+        std::vector<std::uint32_t> local(kSigmaHistBins, 0);
+        #pragma omp for
+        for (std::ptrdiff_t i = 0; i < (std::ptrdiff_t)N; ++i) {
+            ++local[std::min(kSigmaHistBins - 1, int(double(sigma[i]) * inv_w))];
+        }
+        #pragma omp critical
+        for (int b = 0; b < kSigmaHistBins; ++b) h.counts[b] += local[b];
+    }
+}
+
+// Step 1（式(5)(6)）：与 adaptive_gradient_enhance_unit 同式，梯度为周期边界中心差分。
+// 盒矩之后只有两遍逐像素遍历：
+//   1) 局部方差 σ² 与 σ 原地写回两张盒矩图，同时统计 σ 直方图（[0,1] 输入下 σ ≤ 0.5，预设上界即够用）；
+//   2) 梯度 × k × mask，grad_mag 非空时顺带写出 |G'|（交给 NLM 的 λ 预处理，免得再算一遍）。
+// exact_percentile 为 true 时改用选择算法求精确分位数（与 np.percentile 一致，多一份 σ 拷贝）。
+// 返回式(5)中的 C。
+static inline double adaptive_gradient_enhance_core(const float* R, int H, int W,
+                                                    double epsilon_unit, double mu, int ksize_var,
+                                                    float* gxp, float* gyp, float* grad_mag = nullptr,
+                                                    bool exact_percentile = false) {
+    if (ksize_var % 2 == 0) ksize_var += 1;
+    NLM_SCOPED_TIMER(kStatStep1, (long long)H * W);
+    const std::size_t N = std::size_t(H) * W;
+    std::vector<float> sigma2(N), sigma(N);
+    box_moments_reflect(R, sigma.data(), sigma2.data(), H, W, ksize_var / 2);
+
+    SigmaHistogram hist;
+    hist.counts.assign(exact_percentile ? 0 : kSigmaHistBins, 0);
+    hist.hi = 0.5 + 1e-6;
+    hist.n = N;
+    const double inv_w = double(kSigmaHistBins) / hist.hi;
+    float sigma_max = 0.0f;
+    #pragma omp parallel if(N>100000)
+    {
+        std::vector<std::uint32_t> local(exact_percentile ? 0 : kSigmaHistBins, 0);
+        float local_max = 0.0f;
+        #pragma omp for
+        for (std::ptrdiff_t i = 0; i < (std::ptrdiff_t)N; ++i) {
+            float m = sigma[i];
+            sigma2[i] = std::max(0.0f, sigma2[i] - m*m);        // 局部方差
+            sigma[i] = std::sqrt(sigma2[i] + 1e-12f);
+            local_max = std::max(local_max, sigma[i]);
+            if (!exact_percentile) ++local[std::min(kSigmaHistBins - 1, int(double(sigma[i]) * inv_w))];
+        }
+        #pragma omp critical
+        {
+            sigma_max = std::max(sigma_max, local_max);
+            for (std::size_t b = 0; b < local.size(); ++b) hist.counts[b] += local[b];
+        }
+    }
+    double C;
+    if (exact_percentile) {
+        std::vector<float> tmp(sigma);
+        C = percentile_inplace(tmp, 90.0) + 1e-12;
+    } else {
+        // 输入超出 [0,1] 时 σ 可能越过预设上界：按实际最大值重新统计一次
+        if (double(sigma_max) >= hist.hi) build_sigma_histogram(sigma.data(), N, double(sigma_max) * (1.0 + 1e-6), hist);
+        C = hist.percentile(90.0) + 1e-12;
+    }
+
+    const double k_num = 1.0 + mu;
+    #pragma omp parallel for if(N>100000)
+    for (int y = 0; y < H; ++y) {
+        const float* rc = R + std::size_t(y) * W;
+        const float* ru = R + std::size_t((y + H - 1) % H) * W;
+        const float* rd = R + std::size_t((y + 1) % H) * W;
+        for (int x = 0; x < W; ++x) {
+            std::size_t i = std::size_t(y) * W + x;
+            float gx = 0.5f * (rc[(x + 1) % W] - rc[(x + W - 1) % W]);
+            float gy = 0.5f * (rd[x] - ru[x]);
+            double s = sigma[i] / C;
+            float kf = (sigma2[i] > epsilon_unit) ? float(k_num / (1.0 + s*s)) : 0.0f;
+            gxp[i] = kf * gx;
+            gyp[i] = kf * gy;
+            if (grad_mag) {
+                double ax = gxp[i], ay = gyp[i];
+                grad_mag[i] = float(std::sqrt(ax*ax + ay*ay));
+            }
+        }
+    }
+    return C;
+}
+
+// 分块：与 paper_enhance._iter_tiles 相同的遍历顺序与区域（后写覆盖先写）
+struct TileRect {
+    int in_y0, in_y1, in_x0, in_x1;      // 输入区域（含 overlap）
+    int core_y0, core_y1, core_x0, core_x1;
+    // 实际写回区域：串行循环中后块覆盖前块，最终每个像素归属于覆盖它的最后一块，
+    // 即 [core_y0, core_y0+stride) × [core_x0, core_x0+stride)；各块互不相交，可并发写回
+    int own_y1, own_x1;
+};
+
+static inline std::vector<TileRect> iter_tiles(int H, int W, int tile_h, int tile_w, int overlap) {
+    if (!(tile_h > 2*overlap && tile_w > 2*overlap) || overlap < 0) {
+        throw std::runtime_error("tile 尺寸必须大于 2*overlap 才能得到正的核心区域");
+    }
+    std::vector<TileRect> tiles;
+    for (int y = 0; y < H; y += tile_h - 2*overlap) {
+        for (int x = 0; x < W; x += tile_w - 2*overlap) {
+            TileRect t;
+            t.core_y0 = y; t.core_y1 = std::min(y + tile_h, H);
+            t.core_x0 = x; t.core_x1 = std::min(x + tile_w, W);
+            t.in_y0 = std::max(0, t.core_y0 - overlap); t.in_y1 = std::min(H, t.core_y1 + overlap);
+            t.in_x0 = std::max(0, t.core_x0 - overlap); t.in_x1 = std::min(W, t.core_x1 + overlap);
+            t.own_y1 = std::min(y + tile_h - 2*overlap, H);
+            t.own_x1 = std::min(x + tile_w - 2*overlap, W);
+            tiles.push_back(t);
+        }
+    }
+    return tiles;
+}
+
+struct PipelineParams {
+    // 归一化：percentile（p_lo/p_hi）或 window（wl/ww）
+    bool norm_window = false;
+    double p_lo = 0.5, p_hi = 99.5, wl = 0.0, ww = 0.0;
+    // Step1
+    double epsilon_8bit = 2.3, mu = 10.0;
+    int ksize_var = 5;
+    // Step2
+    NLMParams nlm;
+    // Step3
+    double gamma = 0.2, delta = 0.8, dt = 0.15;
+    int iters = 6;
+    // 分块
+    int tile_h = 1024, tile_w = 1024, overlap = 32;
+    // 同时处理的分块数上限（决定峰值内存 ≈ 块数 × 单块工作集）；0 = 自动（不超过硬件线程数）
+    int max_tiles_in_flight = 0;
+};
+
+// normalize_to_unit 的 (vmin, vmax)
+static inline std::pair<double,double> normalization_range(const Plane<std::uint16_t>& R16, int H, int W,
+                                                           const PipelineParams& pp) {
+    if (pp.norm_window) return std::make_pair(pp.wl - pp.ww/2.0, pp.wl + pp.ww/2.0);
+    NLM_SCOPED_TIMER(kStatNormalize, (long long)H * W);
+    U16Histogram hist;
+    hist.build(R16, H, W);
+    double vmin = hist.percentile(pp.p_lo), vmax = hist.percentile(pp.p_hi);
+    if (vmax <= vmin) {
+        double mx = hist.max_value();
+        vmax = (mx > vmin) ? mx : (vmin + 1.0);
+    }
+    return std::make_pair(vmin, vmax);
+}
+
+// 单块：Step1 → Step2 → Step3，返回块内 [0,1] 结果。R16 的第 0 行对应整幅图像的第 in_row0 行
+static inline void process_tile(const Plane<std::uint16_t>& R16, const TileRect& t,
+                                double vmin, double vmax, const PipelineParams& pp,
+                                std::vector<float>& I, RunControl* ctl, int in_row0 = 0) {
+    const int h = t.in_y1 - t.in_y0, w = t.in_x1 - t.in_x0;
+    const std::size_t n = std::size_t(h) * w;
+    // 池 worker 上的整块计入忙碌时间；块内 NLM 并行区的同线程作用域不重复计
+    NLM_BUSY_TIMER();
+    NLM_SCOPED_TIMER(kStatPipelineTile, (long long)h * w);
+    const double scale = 1.0 / (vmax - vmin);
+    I.resize(n);
+    for (int y = 0; y < h; ++y) {
+        float* dst = I.data() + std::size_t(y) * w;
+        for (int x = 0; x < w; ++x) {
+            double v = R16(t.in_y0 - in_row0 + y, t.in_x0 + x);
+            dst[x] = float(std::min(1.0, std::max(0.0, (v - vmin) * scale)));
+        }
+    }
+    // |G'| 由 Step 1 写进 lam_bar 缓冲交给 λ 预处理（λ 预处理读完 |G'| 后才覆写 λ̄）
+    std::vector<float> gxp(n), gyp(n), gx(n), gy(n), lam_bar(n);
+    NLM_STAT_ADD(kStatBytesAllocated, 6 * n * sizeof(float));
+    adaptive_gradient_enhance_core(I.data(), h, w, pp.epsilon_8bit / (255.0 * 255.0),
+                                   pp.mu, pp.ksize_var, gxp.data(), gyp.data(), lam_bar.data());
+    NLMWorkspace ws;
+    ws.grad_mag = lam_bar.data();
+    poisson_nlm_core(contiguous_plane(gxp.data(), w), contiguous_plane(gyp.data(), w), h, w, pp.nlm,
+                     gx.data(), gy.data(), lam_bar.data(), ctl, &ws);
+    variational_reconstruct_core(I.data(), h, w, gx.data(), gy.data(),
+                                 pp.gamma, pp.delta, pp.iters, pp.dt);
+}
+
+// 归属区写回 uint16（denormalize_from_unit：clip → 线性反变换 → 截断取整）。out 的第 0 行为整幅的第 out_row0 行
+static inline void store_tile_core(const std::vector<float>& I, const TileRect& t, int W,
+                                   double vmin, double vmax, std::uint16_t* out, int out_row0 = 0) {
+    const int w = t.in_x1 - t.in_x0;
+    for (int y = t.core_y0; y < t.own_y1; ++y) {
+        const float* src = I.data() + std::size_t(y - t.in_y0) * w + (t.core_x0 - t.in_x0);
+        std::uint16_t* dst = out + std::size_t(y - out_row0) * W + t.core_x0;
+        for (int x = 0; x < t.own_x1 - t.core_x0; ++x) {
+            double v = double(std::min(1.0f, std::max(0.0f, src[x]))) * (vmax - vmin) + vmin;
+            dst[x] = (std::uint16_t)std::min(65535.0, std::max(0.0, v));
+        }
+    }
+}
+
+// 在归一化区间 vr 下处理给定分块并写回。R16 / out 的第 0 行分别为整幅的第 in_row0 / out_row0 行。
+// ctl 非空时按已完成分块数上报进度（只在调用线程上回调），并在块内按行轮询取消
+static inline void run_pipeline_tiles(const Plane<std::uint16_t>& R16, const std::vector<TileRect>& tiles, int W,
+                                      std::pair<double,double> vr, const PipelineParams& pp,
+                                      std::uint16_t* out, RunControl* ctl, int in_row0 = 0, int out_row0 = 0) {
+    const int ntiles = (int)tiles.size();
+    const int total_threads = hardware_threads();
+    int in_flight = pp.max_tiles_in_flight > 0 ? pp.max_tiles_in_flight : total_threads;
+    in_flight = std::max(1, std::min(in_flight, std::min(ntiles, global_pool().size())));
+
+    // 块内只轮询取消、不回调进度（块可能运行在池线程上）；调用线程把 ctl 的取消转发给它
+    RunControl tile_ctl;
+    if (ctl) tile_ctl.cancel_flag = ctl->cancel_flag;
+    auto forward = [&](int tiles_done) {
+        if (!ctl) return;
+        ctl->report(tiles_done, ntiles);
+        if (ctl->stop_requested()) tile_ctl.cancelled = true;
+    };
+
+    try {
+        if (in_flight == 1) {
+            std::vector<float> I;
+            for (int i = 0; i < ntiles && !tile_ctl.stop_requested(); ++i) {
+                process_tile(R16, tiles[i], vr.first, vr.second, pp, I, &tile_ctl, in_row0);
+                store_tile_core(I, tiles[i], W, vr.first, vr.second, out, out_row0);
+                forward(i + 1);
+            }
+        } else {
+            // 每个 worker 复用一份块缓冲；块内 OpenMP 线程数按在飞块数均分
+            std::vector<std::vector<float>> bufs(in_flight);
+            const int inner = std::max(1, total_threads / in_flight);
+            std::atomic<int> tiles_done(0);
+            int last_reported = 0;
+            global_pool().run(ntiles, in_flight, inner, [&](int i, int worker) {
+                if (tile_ctl.stop_requested()) return;
+                process_tile(R16, tiles[i], vr.first, vr.second, pp, bufs[worker], &tile_ctl, in_row0);
+                store_tile_core(bufs[worker], tiles[i], W, vr.first, vr.second, out, out_row0);
+                ++tiles_done;
+            }, [&] {
+                int done = tiles_done.load();
+                if (done != last_reported) { last_reported = done; forward(done); }
+                else if (ctl && ctl->stop_requested()) tile_ctl.cancelled = true;
+            });
+            if (tiles_done.load() != last_reported) forward(tiles_done.load());
+        }
+    } catch (const CancelledError&) {
+        if (ctl) ctl->raise_if_stopped();   // 优先抛出进度回调自身的异常
+        throw;
+    }
+    if (ctl) ctl->raise_if_stopped();
+    tile_ctl.raise_if_stopped();
+}
+
+static inline void enhance_pipeline_core(const Plane<std::uint16_t>& R16, int H, int W,
+                                         const PipelineParams& pp, std::uint16_t* out,
+                                         RunControl* ctl = nullptr) {
+    validate_nlm_params(pp.nlm);
+    std::vector<TileRect> tiles = iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap);
+    run_pipeline_tiles(R16, tiles, W, normalization_range(R16, H, W, pp), pp, out, ctl);
+}
+
+// -------------------- 行带流式处理（超长图像，内存与带高成正比） --------------------
+// 整幅按分块行切成若干水平带：带的归属行 [row0, row1) 的两端须落在分块行边界上
+// （即 tile_h - 2*overlap 的整数倍，或 row1 = H），其输入行 [in_row0, in_row1) 由 pipeline_band_input_rows 给出。
+// 逐带调用 enhance_pipeline_band_core 的结果与整幅 enhance_pipeline_core 逐位一致（归一化区间由调用方给出，
+// percentile 模式下须对整幅统计，即 normalization_range 的结果）。
+static inline std::pair<int,int> pipeline_band_input_rows(int H, const PipelineParams& pp, int row0, int row1) {
+    const int stride = pp.tile_h - 2*pp.overlap;
+    if (stride <= 0 || pp.overlap < 0) {
+        throw std::runtime_error("tile 尺寸必须大于 2*overlap 才能得到正的核心区域");
+    }
+    if (row0 < 0 || row1 > H || row0 >= row1 || row0 % stride != 0 || (row1 != H && row1 % stride != 0)) {
+        throw std::runtime_error("band rows must lie on tile-row boundaries (multiples of tile_h - 2*overlap)");
+    }
+    const int last = ((row1 - 1) / stride) * stride;          // 带内最后一个分块行的起始行
+    return std::make_pair(std::max(0, row0 - pp.overlap), std::min(H, last + pp.tile_h + pp.overlap));
+}
+
+static inline void enhance_pipeline_band_core(const Plane<std::uint16_t>& R16band, int H, int W, int row0, int row1,
+                                              std::pair<double,double> vr, const PipelineParams& pp,
+                                              std::uint16_t* out, RunControl* ctl = nullptr) {
+    validate_nlm_params(pp.nlm);
+    const std::pair<int,int> in_rows = pipeline_band_input_rows(H, pp, row0, row1);
+    std::vector<TileRect> tiles;
+    for (const TileRect& t : iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap)) {
+        if (t.core_y0 >= row0 && t.core_y0 < row1) tiles.push_back(t);
+    }
+    run_pipeline_tiles(R16band, tiles, W, vr, pp, out, ctl, in_rows.first, row0);
+}
+
+// -------------------- 渐进式细化（先预览、再从视口中心向外逐块细化） --------------------
+// 分块按归属区中心到 (cy, cx) 的距离由近到远排序（距离相同保持遍历顺序），返回 iter_tiles 中的下标
+static inline std::vector<int> pipeline_tile_order(int H, int W, const PipelineParams& pp, double cy, double cx) {
+    const std::vector<TileRect> tiles = iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap);
+    std::vector<double> d2(tiles.size());
+    for (std::size_t i = 0; i < tiles.size(); ++i) {
+        const TileRect& t = tiles[i];
+        const double dy = 0.5 * (t.core_y0 + t.own_y1) - cy, dx = 0.5 * (t.core_x0 + t.own_x1) - cx;
+        d2[i] = dy*dy + dx*dx;
+    }
+    std::vector<int> order(tiles.size());
+    for (std::size_t i = 0; i < order.size(); ++i) order[i] = (int)i;
+    std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return d2[a] < d2[b]; });
+    return order;
+}
+
+// 只处理下标列表中的分块（按列表顺序调度）并写回各自的归属区，其余像素保持 out 原值。
+// 各批次的并集覆盖全部分块时，结果与整幅 enhance_pipeline_core 逐位一致
+static inline void enhance_pipeline_tile_list_core(const Plane<std::uint16_t>& R16, int H, int W,
+                                                   const std::vector<int>& index,
+                                                   std::pair<double,double> vr, const PipelineParams& pp,
+                                                   std::uint16_t* out, RunControl* ctl = nullptr) {
+    validate_nlm_params(pp.nlm);
+    const std::vector<TileRect> all = iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap);
+    std::vector<TileRect> tiles;
+    tiles.reserve(index.size());
+    for (int i : index) {
+        if (i < 0 || i >= (int)all.size()) throw std::runtime_error("tile index out of range");
+        tiles.push_back(all[i]);
+    }
+    run_pipeline_tiles(R16, tiles, W, vr, pp, out, ctl);
+}
+
+// -------------------- 脏区域重算（局部编辑后只重跑受影响的分块） --------------------
+// 只有 [y0, y1) × [x0, x1) 内的输入像素变化时，受影响的是输入区域（核心 + overlap halo）与脏区相交的分块；
+// 只重跑这些块并写回各自的归属区，其余像素沿用 out 中上一次的结果，整体与整幅 enhance_pipeline_core 逐位一致。
+// 前提是归一化区间 vr 与上一次相同（percentile 模式下编辑可能移动分位点，由调用方比较后决定是否整幅重算）。
+// 返回重跑的分块数
+static inline int enhance_pipeline_region_core(const Plane<std::uint16_t>& R16, int H, int W,
+                                               int y0, int y1, int x0, int x1,
+                                               std::pair<double,double> vr, const PipelineParams& pp,
+                                               std::uint16_t* out, RunControl* ctl = nullptr) {
+    validate_nlm_params(pp.nlm);
+    y0 = std::max(0, y0); x0 = std::max(0, x0);
+    y1 = std::min(H, y1); x1 = std::min(W, x1);
+    if (y0 >= y1 || x0 >= x1) return 0;
+    std::vector<TileRect> tiles;
+    for (const TileRect& t : iter_tiles(H, W, pp.tile_h, pp.tile_w, pp.overlap)) {
+        if (t.in_y0 < y1 && y0 < t.in_y1 && t.in_x0 < x1 && x0 < t.in_x1) tiles.push_back(t);
+    }
+    run_pipeline_tiles(R16, tiles, W, vr, pp, out, ctl);
+    return (int)tiles.size();
+}
+
+// -------------------- 多帧批处理（多幅图像的分块共用常驻池） --------------------
+// 小帧只有一两个分块，逐帧调用时多数核心空转；批处理把所有帧的 (帧, 分块) 平铺成一个任务表，
+// 一次交给常驻工作窃取池，每个 worker 复用一份块缓冲。各帧先并行统计归一化区间，再并行处理全部分块。
+// 每帧结果与单独调用 enhance_pipeline_core 逐位一致
+struct BatchFrame {
+    Plane<std::uint16_t> src;
+    int H, W;
+    std::uint16_t* out;        // H×W，C 连续
+};
+
+// 每帧耗时（毫秒）：start/end 为首块开始与末块结束，相对批次开始
+struct BatchFrameTiming {
+    double norm_ms = 0.0;      // 归一化区间统计
+    double compute_ms = 0.0;   // 各分块计算耗时之和
+    double start_ms = 0.0, end_ms = 0.0;
+    int tiles = 0;
+};
+
+static inline void enhance_pipeline_batch_core(const std::vector<BatchFrame>& frames, const PipelineParams& pp,
+                                               std::vector<BatchFrameTiming>& timing, RunControl* ctl = nullptr) {
+    validate_nlm_params(pp.nlm);
+    const int nframes = (int)frames.size();
+    timing.assign(nframes, BatchFrameTiming());
+    if (nframes == 0) return;
+
+    std::vector<std::vector<TileRect>> tiles(nframes);
+    std::vector<std::pair<int,int>> tasks;     // (帧, 分块)
+    for (int f = 0; f < nframes; ++f) {
+        tiles[f] = iter_tiles(frames[f].H, frames[f].W, pp.tile_h, pp.tile_w, pp.overlap);
+        for (int i = 0; i < (int)tiles[f].size(); ++i) tasks.push_back(std::make_pair(f, i));
+    }
+    const int ntasks = (int)tasks.size();
+    const int total_threads = hardware_threads();
+    WorkStealingPool& pool = global_pool();
+
+    const auto t0 = std::chrono::steady_clock::now();
+    auto elapsed_ms = [&t0]() {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - t0).count();
+    };
+
+    RunControl tile_ctl;
+    if (ctl) tile_ctl.cancel_flag = ctl->cancel_flag;
+    std::atomic<int> tiles_done(0);
+    int last_reported = 0;
+    auto poll = [&] {
+        if (!ctl) return;
+        int done = tiles_done.load();
+        if (done != last_reported) { last_reported = done; ctl->report(done, ntasks); }
+        if (ctl->stop_requested()) tile_ctl.cancelled = true;
+    };
+
+    try {
+        std::vector<std::pair<double,double>> ranges(nframes);
+        const int norm_width = std::max(1, std::min(nframes, pool.size()));
+        pool.run(nframes, norm_width, std::max(1, total_threads / norm_width), [&](int f, int) {
+            if (tile_ctl.stop_requested()) return;
+            const double a = elapsed_ms();
+            ranges[f] = normalization_range(frames[f].src, frames[f].H, frames[f].W, pp);
+            timing[f].norm_ms = elapsed_ms() - a;
+        }, poll);
+
+        const int width = std::max(1, std::min(ntasks, pool.size()));
+        std::vector<std::vector<float>> bufs(width);
+        std::mutex timing_mtx;
+        pool.run(ntasks, width, std::max(1, total_threads / width), [&](int k, int worker) {
+            if (tile_ctl.stop_requested()) return;
+            const int f = tasks[k].first;
+            const BatchFrame& fr = frames[f];
+            const TileRect& t = tiles[f][tasks[k].second];
+            const double a = elapsed_ms();
+            process_tile(fr.src, t, ranges[f].first, ranges[f].second, pp, bufs[worker], &tile_ctl);
+            store_tile_core(bufs[worker], t, fr.W, ranges[f].first, ranges[f].second, fr.out);
+            const double b = elapsed_ms();
+            {
+                std::lock_guard<std::mutex> lock(timing_mtx);
+                BatchFrameTiming& tm = timing[f];
+                if (tm.tiles == 0 || a < tm.start_ms) tm.start_ms = a;
+                tm.end_ms = std::max(tm.end_ms, b);
+                tm.compute_ms += b - a;
+                ++tm.tiles;
+            }
+            ++tiles_done;
+        }, poll);
+        if (ctl && tiles_done.load() != last_reported) ctl->report(tiles_done.load(), ntasks);
+    } catch (const CancelledError&) {
+        if (ctl) ctl->raise_if_stopped();   // 优先抛出进度回调自身的异常
+        throw;
+    }
+    if (ctl) ctl->raise_if_stopped();
+    tile_ctl.raise_if_stopped();
+}
+
+// -------------------- 窗宽窗位显示映射（65536 项 LUT，反相与 2×/4× 面积降采样同遍完成） --------------------
+// 16 位像素经 uint8 查找表映射到显示灰度，直接写入调用方缓冲（可为 QImage 的带行填充的内存）。
+// 非 uint16 输入逐像素裁剪到 [0, 65535] 后截断取整（同 np.clip(...).astype(np.uint16)，NaN 视为 0），不生成中间下标数组。
+// factor>1 时输出 (H/factor)×(W/factor)（向下取整，丢弃不足一格的尾部行列），每格为 LUT 值的四舍五入均值，反相在均值之后。
+// LUT 只有 64 KB，常驻 L1/L2；逐字节 gather 指令并不比标量查表快，这里用编译器可展开的标量循环，按输出行多线程。
+template <typename T>
+static inline std::uint16_t window_lut_index(T v) {
+    if (!(v > (T)0)) return 0;                     // 含 NaN
+    if (v >= (T)65535) return 65535;
+    return (std::uint16_t)v;
+}
+
+template <>
+inline std::uint16_t window_lut_index<std::uint16_t>(std::uint16_t v) { return v; }
+
+template <typename T>
+static inline void apply_window_lut_core(const Plane<T>& src, int H, int W, const std::uint8_t* lut,
+                                         bool invert, int factor, std::uint8_t* out, std::ptrdiff_t out_stride) {
+    if (factor != 1 && factor != 2 && factor != 4) {
+        throw std::runtime_error("downsample must be 1, 2 or 4");
+    }
+    NLM_SCOPED_TIMER(kStatWindowLUT, (long long)H * W);
+    const int Ho = H / factor, Wo = W / factor;
+    const int shift = factor == 1 ? 0 : (factor == 2 ? 2 : 4);
+    const unsigned half = (1u << shift) >> 1;
+    const std::uint8_t flip = invert ? 255 : 0;
+
+    #pragma omp parallel for schedule(static)
+    for (int yo = 0; yo < Ho; ++yo) {
+        std::uint8_t* o = out + (std::ptrdiff_t)yo*out_stride;
+        if (factor == 1) {
+            const T* s = src.p + src.offset(yo, 0);
+            if (src.sx == 1) {
+                for (int x = 0; x < Wo; ++x) o[x] = (std::uint8_t)(lut[window_lut_index(s[x])] ^ flip);
+            } else {
+                for (int x = 0; x < Wo; ++x) o[x] = (std::uint8_t)(lut[window_lut_index(s[x*src.sx])] ^ flip);
+            }
+            continue;
+        }
+        if (factor == 2 && src.sx == 1) {
+            const T* a = src.p + src.offset(2*yo, 0);
+            const T* b = src.p + src.offset(2*yo + 1, 0);
+            for (int xo = 0; xo < Wo; ++xo) {
+                const unsigned sum = (unsigned)lut[window_lut_index(a[2*xo])] + lut[window_lut_index(a[2*xo + 1])]
+                                   + lut[window_lut_index(b[2*xo])] + lut[window_lut_index(b[2*xo + 1])];
+                o[xo] = (std::uint8_t)(((sum + 2) >> 2) ^ flip);
+            }
+            continue;
+        }
+        for (int xo = 0; xo < Wo; ++xo) {
+            unsigned sum = 0;
+            for (int dy = 0; dy < factor; ++dy) {
+                const T* s = src.p + src.offset(yo*factor + dy, xo*factor);
+                for (int dx = 0; dx < factor; ++dx) sum += lut[window_lut_index(s[dx*src.sx])];
+            }
+            o[xo] = (std::uint8_t)(((sum + half) >> shift) ^ flip);
+        }
+    }
+}
@@ -0,0 +1,379 @@
+// cpp/poisson_nlm_cuda.cu
+// 泊松 NLM 的 CUDA 后端：每个输出像素一个线程，d 表常驻显存并经只读缓存（__ldg）读取。
+// 主机端按行带推进：拷贝流上传下一带所需的 lam_q/λ̄/gx/gy 行，计算流同时处理当前带并把结果异步拷回，
+// 上传、计算、回传三者重叠。与 OpenMP 路径的公式、候选集合与 (j,i) 累加顺序相同，
+// 但 exp 与最终归一化的舍入不同，结果只在浮点误差范围内一致（topk 并列时的取舍也可能不同）。
+#include "poisson_nlm_cuda.h"
+
+#include <cuda_runtime.h>
+
+#include <algorithm>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+namespace {
+
+// topk 模式每像素的候选缓冲容量：sr ≤ 7
+const int kMaxCand = 225;
+// 每个行带的内部行数；越小重叠越细，越大启动开销越少
+const int kBandRows = 64;
+
+// -------------------- 设备端 d(λx,λy)：与主机 poisson_L2_distance 同一闭式 --------------------
+// S(a,b) = e^{-(a+b)}·I₀(2√(ab))：小参数幂级数，大参数渐近展开（阈值同主机 kBesselAsymptoticZ）
+__device__ double poisson_pmf_inner_dev(double a, double sa, double ea, double b, double sb, double eb) {
+    const double s = a * b;
+    if (s < 0.25 * 30.0 * 30.0) {
+        double term = 1.0, sum = 1.0;
+        for (int k = 1; term > sum * 1e-17; ++k) {
+            term *= s / (double(k) * k);
+            sum += term;
+        }
+        return ea * eb * sum;
+    }
+    const double z = 2.0 * sa * sb, t = 0.125 / z;
+    double term = 1.0, sum = 1.0;
+    for (int k = 1; k < 64; ++k) {
+        term *= double(2*k - 1) * (2*k - 1) * t / k;
+        sum += term;
+        if (term < sum * 1e-17) break;
+    }
+    const double dr = sa - sb;
+    return exp(-dr * dr) * sum / sqrt(2.0 * 3.14159265358979323846 * z);
+}
+
+__device__ double poisson_L2_distance_dev(double lx, double ly) {
+    if (lx <= 0.0 && ly <= 0.0) return 0.0;
+    const double sx = sqrt(lx), sy = sqrt(ly), ex = exp(-lx), ey = exp(-ly);
+    const double d = poisson_pmf_inner_dev(lx, sx, ex, lx, sx, ex) + poisson_pmf_inner_dev(ly, sy, ey, ly, sy, ey)
+                   - 2.0 * poisson_pmf_inner_dev(lx, sx, ex, ly, sy, ey);
+    return fmax(0.0, d);
+}
+
+__device__ __forceinline__ double table_query(const double* __restrict__ tab, int n, double lam_quant,
+                                              int qa, int qb) {
+    int hi = max(qa, qb), lo = min(qa, qb);
+    if (hi < n) return __ldg(tab + (size_t)hi * (hi + 1) / 2 + lo);
+    return poisson_L2_distance_dev(qa * lam_quant, qb * lam_quant);
+}
+
+__device__ __forceinline__ double weight_exp(double x) { return exp(x); }
+__device__ __forceinline__ float weight_exp(float x) { return __expf(x); }
+
+// 块距离 D = Σ_m d(λx_m, λy_m)，按 (j,i) 行主序累加（与主机标量核一致）
+__device__ double patch_distance(const int* __restrict__ lam_q, int W, int k,
+                                 int y0p, int x0p, int yy0p, int xx0p,
+                                 const double* __restrict__ tab, int n, double lam_quant) {
+    double s = 0.0;
+    for (int j = 0; j < k; ++j) {
+        const int* ra = lam_q + (size_t)(y0p + j) * W + x0p;
+        const int* rb = lam_q + (size_t)(yy0p + j) * W + xx0p;
+        for (int i = 0; i < k; ++i) s += table_query(tab, n, lam_quant, __ldg(ra + i), __ldg(rb + i));
+    }
+    return s;
+}
+
+template <typename Acc>
+__global__ void nlm_patch_kernel(const int* __restrict__ lam_q, const float* __restrict__ lam_bar,
+                                 const float* __restrict__ gx, const float* __restrict__ gy,
+                                 float* __restrict__ gx_out, float* __restrict__ gy_out,
+                                 const double* __restrict__ tab, int tab_n, double lam_quant,
+                                 int H, int W, int sr, int pr, int topk, double rho,
+                                 int y_begin, int y_end) {
+    const int x = blockIdx.x * blockDim.x + threadIdx.x + pr;
+    const int y = blockIdx.y * blockDim.y + threadIdx.y + y_begin;
+    if (x >= W - pr || y >= y_end) return;
+
+    const int k = 2 * pr + 1;
+    const double denom = rho * fmax((double)lam_bar[(size_t)y * W + x], 1e-8);
+    const int sy0 = max(pr, y - sr), sy1 = min(H - pr, y + sr + 1);
+    const int sx0 = max(pr, x - sr), sx1 = min(W - pr, x + sr + 1);
+
+    Acc wsum = 0, ax = 0, ay = 0;
+    int n = 0;
+    if (topk <= 0) {
+        // 全搜索窗：单遍流式累加
+        for (int yy = sy0; yy < sy1; ++yy) {
+            for (int xx = sx0; xx < sx1; ++xx) {
+                double D = patch_distance(lam_q, W, k, y - pr, x - pr, yy - pr, xx - pr, tab, tab_n, lam_quant);
+                Acc w = weight_exp(Acc(-D) / Acc(denom));
+                wsum += w;
+                ax += w * Acc(gx[(size_t)yy * W + xx]);
+                ay += w * Acc(gy[(size_t)yy * W + xx]);
+                ++n;
+            }
+        }
+        if (wsum <= 0) {
+            ax = 0; ay = 0;
+            for (int yy = sy0; yy < sy1; ++yy) {
+                for (int xx = sx0; xx < sx1; ++xx) {
+                    ax += Acc(gx[(size_t)yy * W + xx]);
+                    ay += Acc(gy[(size_t)yy * W + xx]);
+                }
+            }
+            wsum = Acc(n);
+        }
+    } else {
+        // topk：按 D 升序插入维护前 topk 个候选
+        double bestD[kMaxCand];
+        int bestI[kMaxCand];
+        const int cap = min(topk, kMaxCand);
+        for (int yy = sy0; yy < sy1; ++yy) {
+            for (int xx = sx0; xx < sx1; ++xx) {
+                double D = patch_distance(lam_q, W, k, y - pr, x - pr, yy - pr, xx - pr, tab, tab_n, lam_quant);
+                if (n == cap && D >= bestD[n - 1]) continue;
+                int pos = (n < cap) ? n++ : n - 1;
+                while (pos > 0 && bestD[pos - 1] > D) {
+                    bestD[pos] = bestD[pos - 1];
+                    bestI[pos] = bestI[pos - 1];
+                    --pos;
+                }
+                bestD[pos] = D;
+                bestI[pos] = yy * W + xx;
+            }
+        }
+        for (int i = 0; i < n; ++i) {
+            Acc w = weight_exp(Acc(-bestD[i]) / Acc(denom));
+            wsum += w;
+            ax += w * Acc(gx[bestI[i]]);
+            ay += w * Acc(gy[bestI[i]]);
+        }
+        if (wsum <= 0) {
+            ax = 0; ay = 0;
+            for (int i = 0; i < n; ++i) { ax += Acc(gx[bestI[i]]); ay += Acc(gy[bestI[i]]); }
+            wsum = Acc(n);
+        }
+    }
+    gx_out[(size_t)y * W + x] = float(ax / wsum);
+    gy_out[(size_t)y * W + x] = float(ay / wsum);
+}
+
+// -------------------- 进程级设备上下文：显存、锁页缓冲与流按需增长后复用 --------------------
+struct CudaContext {
+    std::size_t cap_px = 0;
+    int* d_lam_q = nullptr;
+    float* d_lam_bar = nullptr;
+    float* d_gx = nullptr;
+    float* d_gy = nullptr;
+    float* d_gx_out = nullptr;
+    float* d_gy_out = nullptr;
+    // 锁页主机缓冲：异步拷贝只对锁页内存真正异步
+    int* h_lam_q = nullptr;
+    float* h_lam_bar = nullptr;
+    float* h_gx = nullptr;
+    float* h_gy = nullptr;
+    float* h_gx_out = nullptr;
+    float* h_gy_out = nullptr;
+
+    double* d_table = nullptr;
+    std::size_t table_cap = 0;
+    const void* table_key = nullptr;
+    int table_n = 0;
+    double table_lq = 0.0;
+
+    cudaStream_t copy_stream = nullptr;
+    cudaStream_t compute_stream = nullptr;
+};
+
+CudaContext g_ctx;
+std::mutex g_ctx_mtx;
+
+void free_buffers(CudaContext& c) {
+    cudaFree(c.d_lam_q); cudaFree(c.d_lam_bar); cudaFree(c.d_gx); cudaFree(c.d_gy);
+    cudaFree(c.d_gx_out); cudaFree(c.d_gy_out);
+    cudaFreeHost(c.h_lam_q); cudaFreeHost(c.h_lam_bar); cudaFreeHost(c.h_gx); cudaFreeHost(c.h_gy);
+    cudaFreeHost(c.h_gx_out); cudaFreeHost(c.h_gy_out);
+    c.d_lam_q = nullptr; c.d_lam_bar = c.d_gx = c.d_gy = c.d_gx_out = c.d_gy_out = nullptr;
+    c.h_lam_q = nullptr; c.h_lam_bar = c.h_gx = c.h_gy = c.h_gx_out = c.h_gy_out = nullptr;
+    c.cap_px = 0;
+}
+
+#define NLM_CUDA_CHECK(call)                                        \
+    do {                                                            \
+        cudaError_t e_ = (call);                                    \
+        if (e_ != cudaSuccess) {                                    \
+            if (err) *err = std::string(#call ": ") + cudaGetErrorString(e_); \
+            return false;                                           \
+        }                                                           \
+    } while (0)
+
+bool ensure_buffers(CudaContext& c, std::size_t px, std::string* err) {
+    if (!c.copy_stream) {
+        NLM_CUDA_CHECK(cudaStreamCreateWithFlags(&c.copy_stream, cudaStreamNonBlocking));
+        NLM_CUDA_CHECK(cudaStreamCreateWithFlags(&c.compute_stream, cudaStreamNonBlocking));
+    }
+    if (px <= c.cap_px) return true;
+    free_buffers(c);
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_lam_q, px * sizeof(int)));
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_lam_bar, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_gx, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_gy, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_gx_out, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMalloc(&c.d_gy_out, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_lam_q, px * sizeof(int)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_lam_bar, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_gx, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_gy, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_gx_out, px * sizeof(float)));
+    NLM_CUDA_CHECK(cudaMallocHost(&c.h_gy_out, px * sizeof(float)));
+    c.cap_px = px;
+    return true;
+}
+
+bool ensure_table(CudaContext& c, const NLMCudaJob& job, std::string* err) {
+    if (c.d_table && c.table_key == job.table_key && c.table_n == job.table_n && c.table_lq == job.lam_quant) {
+        return true;
+    }
+    const std::size_t elems = std::size_t(job.table_n) * (job.table_n + 1) / 2;
+    if (elems > c.table_cap) {
+        cudaFree(c.d_table);
+        c.d_table = nullptr;
+        c.table_cap = 0;
+        NLM_CUDA_CHECK(cudaMalloc(&c.d_table, std::max<std::size_t>(elems, 1) * sizeof(double)));
+        c.table_cap = elems;
+    }
+    NLM_CUDA_CHECK(cudaMemcpy(c.d_table, job.table, elems * sizeof(double), cudaMemcpyHostToDevice));
+    c.table_key = job.table_key;
+    c.table_n = job.table_n;
+    c.table_lq = job.lam_quant;
+    return true;
+}
+
+struct EventSet {
+    std::vector<cudaEvent_t> ev;
+    ~EventSet() { for (cudaEvent_t e : ev) cudaEventDestroy(e); }
+};
+
+// 成功返回 true；取消时 *cancelled=true
+bool run_locked(CudaContext& c, const NLMCudaJob& job, bool* cancelled, std::string* err) {
+    const int H = job.H, W = job.W, pr = job.patch_radius, sr = job.search_radius;
+    const std::size_t px = std::size_t(H) * W;
+    if (!ensure_buffers(c, px, err) || !ensure_table(c, job, err)) return false;
+
+    const int y_begin = pr, y_end = H - pr;
+    const int nbands = (y_end - y_begin + kBandRows - 1) / kBandRows;
+    const int rows_total = y_end - y_begin;
+    EventSet uploaded, finished;
+    uploaded.ev.resize(nbands, nullptr);
+    finished.ev.resize(nbands, nullptr);
+    for (int b = 0; b < nbands; ++b) {
+        NLM_CUDA_CHECK(cudaEventCreateWithFlags(&uploaded.ev[b], cudaEventDisableTiming));
+        NLM_CUDA_CHECK(cudaEventCreateWithFlags(&finished.ev[b], cudaEventDisableTiming));
+    }
+
+    int rows_uploaded = 0, rows_done = 0;
+    const dim3 block(32, 8);
+    // 完成第 b 带：等待回传、拷出到调用方缓冲并汇报进度
+    auto finish_band = [&](int b) -> cudaError_t {
+        const int y0 = y_begin + b * kBandRows, y1 = std::min(y_end, y0 + kBandRows);
+        cudaError_t e = cudaEventSynchronize(finished.ev[b]);
+        if (e != cudaSuccess) return e;
+        const std::size_t off = std::size_t(y0) * W, n = std::size_t(y1 - y0) * W;
+        std::memcpy(job.gx_out + off, c.h_gx_out + off, n * sizeof(float));
+        std::memcpy(job.gy_out + off, c.h_gy_out + off, n * sizeof(float));
+        rows_done += y1 - y0;
+        if (job.band_done && !job.band_done(job.user, rows_done, rows_total)) *cancelled = true;
+        return cudaSuccess;
+    };
+
+    for (int b = 0; b < nbands && !*cancelled; ++b) {
+        const int y0 = y_begin + b * kBandRows, y1 = std::min(y_end, y0 + kBandRows);
+        // 上传本带（含搜索/patch 晕圈）尚未上传的行；主机端先拷入锁页缓冲，再在拷贝流上异步传输
+        const int need = std::min(H, y1 + sr + pr);
+        if (need > rows_uploaded) {
+            const std::size_t off = std::size_t(rows_uploaded) * W, n = std::size_t(need - rows_uploaded) * W;
+            std::memcpy(c.h_lam_q + off, job.lam_q + off, n * sizeof(int));
+            std::memcpy(c.h_lam_bar + off, job.lam_bar + off, n * sizeof(float));
+            std::memcpy(c.h_gx + off, job.gx + off, n * sizeof(float));
+            std::memcpy(c.h_gy + off, job.gy + off, n * sizeof(float));
+            NLM_CUDA_CHECK(cudaMemcpyAsync(c.d_lam_q + off, c.h_lam_q + off, n * sizeof(int),
+                                           cudaMemcpyHostToDevice, c.copy_stream));
+            NLM_CUDA_CHECK(cudaMemcpyAsync(c.d_lam_bar + off, c.h_lam_bar + off, n * sizeof(float),
+                                           cudaMemcpyHostToDevice, c.copy_stream));
+            NLM_CUDA_CHECK(cudaMemcpyAsync(c.d_gx + off, c.h_gx + off, n * sizeof(float),
+                                           cudaMemcpyHostToDevice, c.copy_stream));
+            NLM_CUDA_CHECK(cudaMemcpyAsync(c.d_gy + off, c.h_gy + off, n * sizeof(float),
+                                           cudaMemcpyHostToDevice, c.copy_stream));
+            rows_uploaded = need;
+        }
+        NLM_CUDA_CHECK(cudaEventRecord(uploaded.ev[b], c.copy_stream));
+        NLM_CUDA_CHECK(cudaStreamWaitEvent(c.compute_stream, uploaded.ev[b], 0));
+
+        const dim3 grid((W - 2 * pr + block.x - 1) / block.x, (y1 - y0 + block.y - 1) / block.y);
+        if (job.use_float) {
+            nlm_patch_kernel<float><<<grid, block, 0, c.compute_stream>>>(
+                c.d_lam_q, c.d_lam_bar, c.d_gx, c.d_gy, c.d_gx_out, c.d_gy_out,
+                c.d_table, job.table_n, job.lam_quant, H, W, sr, pr, job.topk, job.rho, y0, y1);
+        } else {
+            nlm_patch_kernel<double><<<grid, block, 0, c.compute_stream>>>(
+                c.d_lam_q, c.d_lam_bar, c.d_gx, c.d_gy, c.d_gx_out, c.d_gy_out,
+                c.d_table, job.table_n, job.lam_quant, H, W, sr, pr, job.topk, job.rho, y0, y1);
+        }
+        NLM_CUDA_CHECK(cudaGetLastError());
+        const std::size_t off = std::size_t(y0) * W, n = std::size_t(y1 - y0) * W;
+        NLM_CUDA_CHECK(cudaMemcpyAsync(c.h_gx_out + off, c.d_gx_out + off, n * sizeof(float),
+                                       cudaMemcpyDeviceToHost, c.compute_stream));
+        NLM_CUDA_CHECK(cudaMemcpyAsync(c.h_gy_out + off, c.d_gy_out + off, n * sizeof(float),
+                                       cudaMemcpyDeviceToHost, c.compute_stream));
+        NLM_CUDA_CHECK(cudaEventRecord(finished.ev[b], c.compute_stream));
+
+        // 下一带已排队后再收尾上一带，使设备始终有活可做
+        if (b > 0) NLM_CUDA_CHECK(finish_band(b - 1));
+    }
+    if (*cancelled) {
+        cudaStreamSynchronize(c.copy_stream);
+        cudaStreamSynchronize(c.compute_stream);
+        return true;
+    }
+    if (nbands > 0) NLM_CUDA_CHECK(finish_band(nbands - 1));
+    NLM_CUDA_CHECK(cudaStreamSynchronize(c.compute_stream));
+    return true;
+}
+
+} // namespace
+
+bool nlm_cuda_available() {
+    int n = 0;
+    return cudaGetDeviceCount(&n) == cudaSuccess && n > 0;
+}
+
+std::string nlm_cuda_device_info() {
+    int dev = 0;
+    cudaDeviceProp p;
+    if (!nlm_cuda_available() || cudaGetDevice(&dev) != cudaSuccess ||
+        cudaGetDeviceProperties(&p, dev) != cudaSuccess) {
+        return std::string();
+    }
+    return std::string(p.name) + " (sm_" + std::to_string(p.major) + std::to_string(p.minor) + ")";
+}
+
+int nlm_cuda_max_candidates() { return kMaxCand; }
+
+int nlm_cuda_run(const NLMCudaJob& job, std::string* err) {
+    if (job.H <= 2 * job.patch_radius || job.W <= 2 * job.patch_radius) return kNLMCudaOk;
+    if (job.topk > 0 && (2 * job.search_radius + 1) * (2 * job.search_radius + 1) > kMaxCand) {
+        if (err) *err = "search window too large for the CUDA topk kernel";
+        return kNLMCudaFailed;
+    }
+    std::lock_guard<std::mutex> lock(g_ctx_mtx);
+    bool cancelled = false;
+    if (!run_locked(g_ctx, job, &cancelled, err)) {
+        // 出错后流中可能残留未完成的操作，丢弃上下文，下一次重新初始化
+        cudaDeviceSynchronize();
+        free_buffers(g_ctx);
+        return kNLMCudaFailed;
+    }
+    return cancelled ? kNLMCudaCancelled : kNLMCudaOk;
+}
+
+void nlm_cuda_release() {
+    std::lock_guard<std::mutex> lock(g_ctx_mtx);
+    // 从未在设备上运行过时不触碰 CUDA 运行时（无设备的机器上 reset() 也会调用到这里）
+    if (!g_ctx.copy_stream && !g_ctx.d_table && g_ctx.cap_px == 0) return;
+    cudaDeviceSynchronize();
+    free_buffers(g_ctx);
+    cudaFree(g_ctx.d_table);
+    g_ctx.d_table = nullptr;
+    g_ctx.table_cap = 0;
+    g_ctx.table_key = nullptr;
+}
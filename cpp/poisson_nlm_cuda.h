@@ -0,0 +1,42 @@
+// cpp/poisson_nlm_cuda.h
+// 泊松 NLM 的可选 CUDA 后端接口（纯 C++ 声明，不含 CUDA 类型）。
+// 实现在 poisson_nlm_cuda.cu，仅当 setup.py 以 POISSON_NLM_CUDA=1 编译时链接进扩展，
+// 此时 poisson_nlm_core.h 以 POISSON_NLM_WITH_CUDA 宏引入本头文件。
+#pragma once
+#include <cstddef>
+#include <string>
+
+// 一次 NLM 计算（逐块公式，全搜索窗或 topk）。λ 预处理与 d 表在主机端完成后交给设备。
+struct NLMCudaJob {
+    int H = 0, W = 0;
+    int search_radius = 0, patch_radius = 0, topk = 0;
+    double rho = 1.5;
+    bool use_float = false;          // true：单精度累加 + __expf；false：double 累加
+    const int* lam_q = nullptr;      // H×W，d 表下标
+    const float* lam_bar = nullptr;  // H×W，式(11)分母中的 λ̄
+    const float* gx = nullptr;       // H×W 行主序
+    const float* gy = nullptr;
+    float* gx_out = nullptr;         // H×W，只写内部区域（边界由调用方拷回）
+    float* gy_out = nullptr;
+    // d 表（下三角，行主序）；table_key 标识表对象，键不变时不重复上传
+    const double* table = nullptr;
+    int table_n = 0;
+    double lam_quant = 0.02;
+    const void* table_key = nullptr;
+    // 每完成一个行带回调一次；返回 false 即取消（已提交的行带仍会完成）
+    bool (*band_done)(void* user, int rows_done, int rows_total) = nullptr;
+    void* user = nullptr;
+};
+
+enum { kNLMCudaOk = 0, kNLMCudaCancelled = 1, kNLMCudaFailed = -1 };
+
+// 当前进程是否有可用的 CUDA 设备
+bool nlm_cuda_available();
+// 设备名与计算能力，如 "NVIDIA RTX A2000 (sm_86)"；无设备时为空串
+std::string nlm_cuda_device_info();
+// topk 模式下每像素候选缓冲的上限（(2sr+1)² 超出时由调用方走 CPU）
+int nlm_cuda_max_candidates();
+// 执行一次计算；失败时返回 kNLMCudaFailed 并写入 err（调用方据此回退到 OpenMP 路径）
+int nlm_cuda_run(const NLMCudaJob& job, std::string* err);
+// 释放设备与锁页缓冲（下次调用重新分配）
+void nlm_cuda_release();
@@ -6,6 +6,8 @@ from setuptools.command.build_ext import build_ext
 import sys
 import sysconfig
 import os
+import shutil
+import subprocess
 
 # 检查是否安装了pybind11
 try:
@@ -18,6 +20,8 @@ except ImportError:
     sys.exit(1)
 
 # 编译选项
+# 注意：不加 -march=native。AVX2/AVX-512/NEON 块距离核在源码中按函数单独开启，
+# 运行时按 CPU 特性分派，同一份二进制可在不同指令集的机器上运行。
 compile_args = {
     'msvc': ['/O2', '/openmp', '/std:c++14'],         # Visual Studio
     'mingw32': ['-O3', '-fopenmp', '-std=c++14'],    # MinGW
@@ -50,6 +54,13 @@ ext_modules = [
         sources=[
             "cpp/poisson_nlm.cpp",
         ],
+        depends=[
+            "cpp/poisson_nlm_core.h",
+            "cpp/frequency_filter_core.h",
+            "cpp/enhance_filters_core.h",
+            "cpp/poisson_nlm_cuda.h",
+            "cpp/pipeline_stats.h",
+        ],
         include_dirs=[
             # pybind11会自动添加
         ],
@@ -60,6 +71,43 @@ ext_modules = [
     ),
 ]
 
+# 可选 CUDA 后端：设置环境变量 POISSON_NLM_CUDA=1 且能找到 nvcc 时，
+# 另行用 nvcc 编译 cpp/poisson_nlm_cuda.cu 并链接 cudart；否则只构建 OpenMP 版本
+def find_cuda_home():
+    for key in ('CUDA_HOME', 'CUDA_PATH'):
+        if os.environ.get(key):
+            return os.environ[key]
+    nvcc = shutil.which('nvcc')
+    if nvcc:
+        return os.path.dirname(os.path.dirname(os.path.realpath(nvcc)))
+    return None
+
+
+def add_cuda_backend(ext, build_temp):
+    cuda_home = find_cuda_home()
+    if cuda_home is None:
+        print("未找到 CUDA（CUDA_HOME/CUDA_PATH/nvcc），跳过 GPU 后端")
+        return
+    nvcc = os.path.join(cuda_home, 'bin', 'nvcc.exe' if sys.platform == 'win32' else 'nvcc')
+    obj = os.path.join(build_temp, 'poisson_nlm_cuda' + ('.obj' if compiler_type == 'msvc' else '.o'))
+    os.makedirs(build_temp, exist_ok=True)
+    cmd = [nvcc, '-O3', '-std=c++14', '-c', 'cpp/poisson_nlm_cuda.cu', '-o', obj]
+    if compiler_type != 'msvc':
+        cmd += ['-Xcompiler', '-fPIC']
+    try:
+        subprocess.check_call(cmd)
+    except (OSError, subprocess.CalledProcessError) as e:
+        print(f"CUDA 后端编译失败，跳过: {e}")
+        return
+    lib_dir = os.path.join(cuda_home, 'lib', 'x64') if sys.platform == 'win32' else os.path.join(cuda_home, 'lib64')
+    ext.extra_objects.append(obj)
+    ext.define_macros.append(('POISSON_NLM_WITH_CUDA', '1'))
+    ext.include_dirs.append(os.path.join(cuda_home, 'include'))
+    ext.library_dirs.append(lib_dir)
+    ext.libraries.append('cudart')
+    print(f"CUDA 后端已启用: {cuda_home}")
+
+
 # 自定义构建命令
 class CustomBuildExt(build_ext):
     def build_extensions(self):
@@ -101,7 +149,16 @@ class CustomBuildExt(build_ext):
                     ext.extra_compile_args.remove('-fopenmp')
                 if '-fopenmp' in ext.extra_link_args:
                     ext.extra_link_args.remove('-fopenmp')
-        
+
+        if os.environ.get('POISSON_NLM_CUDA') == '1':
+            for ext in self.extensions:
+                add_cuda_backend(ext, self.build_temp)
+
+        # POISSON_NLM_STATS=0 时埋点整体编译为空操作（get_stats 仍可调用，compiled 为 False）
+        if os.environ.get('POISSON_NLM_STATS') == '0':
+            for ext in self.extensions:
+                ext.define_macros.append(('POISSON_NLM_NO_STATS', '1'))
+
         super().build_extensions()
 
 setup(
@@ -6,6 +6,23 @@ import numpy as np
 import cv2
 from typing import Optional, Callable
 
+# 尝试导入C++扩展（多尺度细节 + 光照归一化的融合实现）
+try:
+    from poisson_nlm_cpp import multiscale_enhance_cpp as multiscale_cpp
+except Exception:
+    multiscale_cpp = None
+
+# 高级/超级增强前三步的参数：D = clip(I + Σ(a_i + b_i·v)·h_i)，out = clip(w0·D + Σ w_j·L̂_j)
+_SUPER_SCALES = [0.5, 1.0, 2.0, 4.0]
+_SUPER_STRENGTHS = [0.8 - 0.1 * i for i in range(len(_SUPER_SCALES))]
+_MULTISCALE_PRESETS = {
+    'advanced': dict(var_ksize=7, detail_sigma=[1.0, 5.0], detail_a=[0.5, 0.3], detail_b=[1.0, 0.5],
+                     base_weight=0.7, illum_sigma=[30.0], illum_weight=[0.3]),
+    'super': dict(var_ksize=3, detail_sigma=_SUPER_SCALES,
+                  detail_a=[0.3 * s for s in _SUPER_STRENGTHS], detail_b=[0.7 * s for s in _SUPER_STRENGTHS],
+                  base_weight=0.5, illum_sigma=[20.0, 50.0], illum_weight=[0.3, 0.2]),
+}
+
 
 class DicomEnhancer:
     """DICOM图像增强处理器"""
@@ -69,43 +86,49 @@ class DicomEnhancer:
             if progress_callback:
                 progress_callback(5)
             
-            # 归一化到 0~1
-            img_norm = DicomEnhancer._normalize_image(data)
-            
-            if progress_callback:
-                progress_callback(15)
-            
-            # 1. 自适应高频增强
-            # 局部方差（噪声检测）
-            var_map = cv2.GaussianBlur(img_norm**2, (7, 7), 0) - cv2.GaussianBlur(img_norm, (7, 7), 0)**2
-            var_map = np.clip(var_map / var_map.max(), 0, 1)
-            
-            if progress_callback:
-                progress_callback(30)
-            
-            # 多尺度高频
-            blur_small = cv2.GaussianBlur(img_norm, (0, 0), 1)
-            high_freq_small = img_norm - blur_small
-            blur_large = cv2.GaussianBlur(img_norm, (0, 0), 5)
-            high_freq_large = img_norm - blur_large
-            
-            # 增强强度随方差变化（平坦区增强少）
-            img_detail = img_norm + (0.5 + 1.0 * var_map) * high_freq_small + (0.3 + 0.5 * var_map) * high_freq_large
-            img_detail = np.clip(img_detail, 0, 1)
-            
-            if progress_callback:
-                progress_callback(50)
-            
-            # 2. 光照归一化
-            illum = cv2.GaussianBlur(img_detail, (0, 0), 30)
-            img_light_norm = img_detail / (illum + 1e-6)
-            img_light_norm = np.clip(img_light_norm / img_light_norm.max(), 0, 1)
-            
-            # 保留原亮度
-            img_fused = np.clip(0.7 * img_detail + 0.3 * img_light_norm, 0, 1)
-            
-            if progress_callback:
-                progress_callback(70)
+            if multiscale_cpp is not None:
+                # C++：方差、多尺度细节与光照归一化一遍完成，大 σ 光照模糊在降采样网格上做
+                img_fused = multiscale_cpp(data, **_MULTISCALE_PRESETS['advanced'])
+                if progress_callback:
+                    progress_callback(70)
+            else:
+                # 归一化到 0~1
+                img_norm = DicomEnhancer._normalize_image(data)
+
+                if progress_callback:
+                    progress_callback(15)
+
+                # 1. 自适应高频增强
+                # 局部方差（噪声检测）
+                var_map = cv2.GaussianBlur(img_norm**2, (7, 7), 0) - cv2.GaussianBlur(img_norm, (7, 7), 0)**2
+                var_map = np.clip(var_map / var_map.max(), 0, 1)
+
+                if progress_callback:
+                    progress_callback(30)
+
+                # 多尺度高频
+                blur_small = cv2.GaussianBlur(img_norm, (0, 0), 1)
+                high_freq_small = img_norm - blur_small
+                blur_large = cv2.GaussianBlur(img_norm, (0, 0), 5)
+                high_freq_large = img_norm - blur_large
+
+                # 增强强度随方差变化（平坦区增强少）
+                img_detail = img_norm + (0.5 + 1.0 * var_map) * high_freq_small + (0.3 + 0.5 * var_map) * high_freq_large
+                img_detail = np.clip(img_detail, 0, 1)
+
+                if progress_callback:
+                    progress_callback(50)
+
+                # 2. 光照归一化
+                illum = cv2.GaussianBlur(img_detail, (0, 0), 30)
+                img_light_norm = img_detail / (illum + 1e-6)
+                img_light_norm = np.clip(img_light_norm / img_light_norm.max(), 0, 1)
+
+                # 保留原亮度
+                img_fused = np.clip(0.7 * img_detail + 0.3 * img_light_norm, 0, 1)
+
+                if progress_callback:
+                    progress_callback(70)
             
             # 3. 双边滤波降噪（保边）
             img_fused_8 = (img_fused * 255).astype(np.uint8)
@@ -143,59 +166,66 @@ class DicomEnhancer:
             if progress_callback:
                 progress_callback(5)
             
-            # 归一化到 0~1
-            img_norm = DicomEnhancer._normalize_image(data)
-            
-            if progress_callback:
-                progress_callback(10)
-            
-            # 1. 多层次噪声检测
-            var_map_fine = cv2.GaussianBlur(img_norm**2, (3, 3), 0) - cv2.GaussianBlur(img_norm, (3, 3), 0)**2
-            var_map_coarse = cv2.GaussianBlur(img_norm**2, (15, 15), 0) - cv2.GaussianBlur(img_norm, (15, 15), 0)**2
-            var_map_fine = np.clip(var_map_fine / var_map_fine.max(), 0, 1)
-            var_map_coarse = np.clip(var_map_coarse / var_map_coarse.max(), 0, 1)
-            
-            if progress_callback:
-                progress_callback(25)
-            
-            # 2. 多尺度高频增强
-            scales = [0.5, 1.0, 2.0, 4.0]
-            enhanced_components = []
-            
-            for i, sigma in enumerate(scales):
-                blur = cv2.GaussianBlur(img_norm, (0, 0), sigma)
-                high_freq = img_norm - blur
-                # 自适应增强强度
-                strength = 0.8 - 0.1 * i  # 细节越细，增强越强
-                enhanced_components.append(strength * high_freq)
-                
+            if multiscale_cpp is not None:
+                # C++：细节尺度与方差图按行条带共用一份归一化图像，各分量就地累加，
+                # σ=20/50 的光照模糊在降采样网格上做；粗尺度方差图在原算法中未被使用，不再计算
+                img_fused = multiscale_cpp(data, **_MULTISCALE_PRESETS['super'])
                 if progress_callback:
-                    progress_callback(25 + 15 * (i + 1) / len(scales))
-            
-            # 组合多尺度增强
-            img_detail = img_norm
-            for component in enhanced_components:
-                img_detail = img_detail + (0.3 + 0.7 * var_map_fine) * component
-            img_detail = np.clip(img_detail, 0, 1)
-            
-            if progress_callback:
-                progress_callback(50)
-            
-            # 3. 高级光照归一化
-            illum_fine = cv2.GaussianBlur(img_detail, (0, 0), 20)
-            illum_coarse = cv2.GaussianBlur(img_detail, (0, 0), 50)
-            
-            img_light_fine = img_detail / (illum_fine + 1e-6)
-            img_light_coarse = img_detail / (illum_coarse + 1e-6)
-            
-            img_light_fine = np.clip(img_light_fine / img_light_fine.max(), 0, 1)
-            img_light_coarse = np.clip(img_light_coarse / img_light_coarse.max(), 0, 1)
-            
-            # 融合不同尺度的光照归一化
-            img_fused = np.clip(0.5 * img_detail + 0.3 * img_light_fine + 0.2 * img_light_coarse, 0, 1)
-            
-            if progress_callback:
-                progress_callback(70)
+                    progress_callback(70)
+            else:
+                # 归一化到 0~1
+                img_norm = DicomEnhancer._normalize_image(data)
+
+                if progress_callback:
+                    progress_callback(10)
+
+                # 1. 多层次噪声检测
+                var_map_fine = cv2.GaussianBlur(img_norm**2, (3, 3), 0) - cv2.GaussianBlur(img_norm, (3, 3), 0)**2
+                var_map_coarse = cv2.GaussianBlur(img_norm**2, (15, 15), 0) - cv2.GaussianBlur(img_norm, (15, 15), 0)**2
+                var_map_fine = np.clip(var_map_fine / var_map_fine.max(), 0, 1)
+                var_map_coarse = np.clip(var_map_coarse / var_map_coarse.max(), 0, 1)
+
+                if progress_callback:
+                    progress_callback(25)
+
+                # 2. 多尺度高频增强
+                scales = [0.5, 1.0, 2.0, 4.0]
+                enhanced_components = []
+
+                for i, sigma in enumerate(scales):
+                    blur = cv2.GaussianBlur(img_norm, (0, 0), sigma)
+                    high_freq = img_norm - blur
+                    # 自适应增强强度
+                    strength = 0.8 - 0.1 * i  # 细节越细，增强越强
+                    enhanced_components.append(strength * high_freq)
+
+                    if progress_callback:
+                        progress_callback(25 + 15 * (i + 1) / len(scales))
+
+                # 组合多尺度增强
+                img_detail = img_norm
+                for component in enhanced_components:
+                    img_detail = img_detail + (0.3 + 0.7 * var_map_fine) * component
+                img_detail = np.clip(img_detail, 0, 1)
+
+                if progress_callback:
+                    progress_callback(50)
+
+                # 3. 高级光照归一化
+                illum_fine = cv2.GaussianBlur(img_detail, (0, 0), 20)
+                illum_coarse = cv2.GaussianBlur(img_detail, (0, 0), 50)
+
+                img_light_fine = img_detail / (illum_fine + 1e-6)
+                img_light_coarse = img_detail / (illum_coarse + 1e-6)
+
+                img_light_fine = np.clip(img_light_fine / img_light_fine.max(), 0, 1)
+                img_light_coarse = np.clip(img_light_coarse / img_light_coarse.max(), 0, 1)
+
+                # 融合不同尺度的光照归一化
+                img_fused = np.clip(0.5 * img_detail + 0.3 * img_light_fine + 0.2 * img_light_coarse, 0, 1)
+
+                if progress_callback:
+                    progress_callback(70)
             
             # 4. 边缘保护的降噪
             img_fused_8 = (img_fused * 255).astype(np.uint8)
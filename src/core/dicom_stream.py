@@ -0,0 +1,242 @@
+"""
+超大 DICOM 的流式处理与序列批处理
+
+像素数据未压缩时以内存映射读取，按水平带（含分块所需的 halo 行）逐带交给 C++ 流水线，
+结果逐带写入输出 memmap（.npy）或 DICOM。峰值内存与带高成正比，与图像大小无关；
+逐带拼接的结果与整幅调用 enhance_xray_poisson_nlm_strict_cpp 逐位一致。
+
+大量小帧（序列、夜间 QA）按批交给 C++ 批处理入口，所有帧的分块共用常驻线程池，
+下一批文件在后台线程读取，与当前批的计算重叠。
+"""
+import os
+import shutil
+import time
+from concurrent.futures import ThreadPoolExecutor
+import numpy as np
+import pydicom
+
+# 尝试导入C++扩展
+try:
+    from poisson_nlm_cpp import enhance_pipeline_band_cpp as band_cpp
+    from poisson_nlm_cpp import pipeline_band_input_rows_cpp as band_rows_cpp
+except Exception as e:
+    band_cpp = None
+    band_rows_cpp = None
+    _cpp_import_error = e
+
+from .paper_enhance import process_batch
+
+
+def open_dicom_pixel_memmap(file_path):
+    """以只读内存映射打开 DICOM 像素数据
+
+    只读取文件头（大元素延迟读取），像素数据不进内存。
+    支持未压缩、小端、单帧、单通道的 8/16 位数据。
+
+    Returns:
+        (pixels, ds, offset): pixels 为 (Rows, Columns) 的 np.memmap，
+        ds 为不含像素值的数据集，offset 为像素数据在文件中的字节偏移
+    """
+    ds = pydicom.dcmread(file_path, defer_size="1 MB")
+    ts = ds.file_meta.TransferSyntaxUID
+    if ts.is_compressed or not ts.is_little_endian:
+        raise ValueError(f"流式处理只支持未压缩的小端像素数据: {ts.name}")
+    if int(getattr(ds, 'SamplesPerPixel', 1)) != 1 or int(getattr(ds, 'NumberOfFrames', 1) or 1) != 1:
+        raise ValueError("流式处理只支持单帧灰度图像")
+
+    bits = int(ds.BitsAllocated)
+    signed = int(getattr(ds, 'PixelRepresentation', 0)) == 1
+    if bits == 16:
+        dtype = np.dtype('<i2' if signed else '<u2')
+    elif bits == 8:
+        dtype = np.dtype('i1' if signed else 'u1')
+    else:
+        raise ValueError(f"流式处理不支持 BitsAllocated={bits}")
+
+    rows, cols = int(ds.Rows), int(ds.Columns)
+    elem = ds.get_item('PixelData')
+    if elem is None:
+        raise ValueError("DICOM 文件不含像素数据")
+    offset = int(elem.value_tell)
+    if elem.length < rows * cols * dtype.itemsize:
+        raise ValueError("像素数据长度与 Rows×Columns 不符")
+    pixels = np.memmap(file_path, dtype=dtype, mode='r', offset=offset, shape=(rows, cols))
+    return pixels, ds, offset
+
+
+def _uint16_converter(pixels, band_rows):
+    """与 ImageManager.load_dicom 相同的 uint16 转换规则，逐带应用
+
+    非 uint16 数据需要整幅最大值判断是否按 8 位放大，这里逐带统计，不整幅读入。
+    """
+    if pixels.dtype == np.uint16:
+        return lambda band: band
+    data_max = 0
+    for r0 in range(0, pixels.shape[0], band_rows):
+        data_max = max(data_max, int(pixels[r0:r0 + band_rows].max()))
+    if data_max <= 255:
+        return lambda band: band.astype(np.uint16) * np.uint16(256)
+    return lambda band: band.astype(np.uint16)
+
+
+def _normalization_range(pixels, convert, band_rows, p_lo, p_hi):
+    """整幅 percentile 归一化区间：逐带累加 65536 桶直方图，分位定义同 C++ normalization_range"""
+    counts = np.zeros(65536, dtype=np.int64)
+    for r0 in range(0, pixels.shape[0], band_rows):
+        band = convert(pixels[r0:r0 + band_rows])
+        counts += np.bincount(band.ravel(), minlength=65536)
+    n = int(counts.sum())
+    cum = np.cumsum(counts)
+
+    def percentile(p):
+        pos = p / 100.0 * (n - 1)
+        lo = int(np.floor(pos))
+        hi = min(lo + 1, n - 1)
+        vlo = float(np.searchsorted(cum, lo, side='right'))
+        vhi = float(np.searchsorted(cum, hi, side='right'))
+        return vlo + (pos - lo) * (vhi - vlo)
+
+    vmin, vmax = percentile(p_lo), percentile(p_hi)
+    if vmax <= vmin:
+        mx = float(np.flatnonzero(counts)[-1]) if n > 0 else 0.0
+        vmax = mx if mx > vmin else vmin + 1.0
+    return vmin, vmax
+
+
+def _open_output(out_path, in_path, pixels, offset):
+    """输出 memmap：.dcm 复制输入文件后原地改写像素数据（须为 16 位无符号），否则为 .npy"""
+    H, W = pixels.shape
+    if out_path.lower().endswith('.dcm'):
+        if pixels.dtype != np.uint16:
+            raise ValueError("DICOM 输出要求输入为 16 位无符号像素；请改用 .npy 输出")
+        shutil.copyfile(in_path, out_path)
+        return np.memmap(out_path, dtype='<u2', mode='r+', offset=offset, shape=(H, W))
+    return np.lib.format.open_memmap(out_path, mode='w+', dtype=np.uint16, shape=(H, W))
+
+
+def enhance_dicom_streaming(in_path, out_path, band_rows=4096,
+                            norm_mode="percentile", p_lo=0.5, p_hi=99.5, wl=None, ww=None,
+                            tile=(1024, 1024), overlap=32,
+                            progress_callback=None, cancel_flag=None,
+                            **params):
+    """流式执行 X 光泊松 NLM 增强（归一化 → Step1 → NLM → Step3 → 反归一化）
+
+    Args:
+        in_path: 输入 DICOM（未压缩像素数据）
+        out_path: 输出路径；.dcm 写 DICOM（保留原文件头），其余写 .npy
+        band_rows: 每带的归属行数，向下取整到分块行（tile_h - 2*overlap）的整数倍
+        norm_mode/p_lo/p_hi/wl/ww/tile/overlap: 同 enhance_xray_poisson_nlm_strict_cpp
+        progress_callback: 可选 progress(rows_done, rows_total)，显式返回 False 即取消
+        cancel_flag: 可选单字节数组（如 np.zeros(1, np.uint8)），置 1 即取消
+        **params: 其余流水线参数（epsilon_8bit、search_radius、topk、iters、engine、precision 等）
+
+    Returns:
+        (H, W)
+    """
+    if band_cpp is None:
+        raise RuntimeError(
+            f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}\n"
+            "请先编译 poisson_nlm_cpp（pybind11 + OpenMP），或检查 PYTHONPATH。"
+        )
+    tile = (int(tile[0]), int(tile[1]))
+    overlap = int(overlap)
+    stride = tile[0] - 2 * overlap
+    if stride <= 0:
+        raise ValueError("tile 尺寸必须大于 2*overlap")
+
+    pixels, ds, offset = open_dicom_pixel_memmap(in_path)
+    H, W = pixels.shape
+    band = max(1, int(band_rows) // stride) * stride
+
+    convert = _uint16_converter(pixels, band)
+    if norm_mode == "window" and wl is not None and ww is not None:
+        vmin, vmax = wl - ww / 2.0, wl + ww / 2.0
+    else:
+        vmin, vmax = _normalization_range(pixels, convert, band, p_lo, p_hi)
+
+    out = _open_output(out_path, in_path, pixels, offset)
+    try:
+        for row0 in range(0, H, band):
+            if cancel_flag is not None and cancel_flag[0]:
+                raise InterruptedError("operation cancelled")
+            row1 = min(H, row0 + band)
+            in0, in1 = band_rows_cpp(H, row0, row1, tile=tile, overlap=overlap)
+            # 归属行直接写进输出 memmap 的对应切片（C 连续），不经过中间数组
+            band_cpp(convert(pixels[in0:in1]), H, row0, row1, float(vmin), float(vmax),
+                     tile=tile, overlap=overlap, cancel_flag=cancel_flag,
+                     out=out[row0:row1], **params)
+            out.flush()
+            if progress_callback is not None and progress_callback(row1, H) is False:
+                raise InterruptedError("operation cancelled")
+    finally:
+        del out
+    return H, W
+
+
+def load_dicom_frames_uint16(file_path):
+    """读取 DICOM 像素并按 ImageManager.load_dicom 的规则转成 uint16；多帧文件拆成逐帧列表"""
+    pixels = pydicom.dcmread(file_path).pixel_array
+    if pixels.dtype != np.uint16:
+        if pixels.max() <= 255:
+            pixels = (pixels * 256).astype(np.uint16)
+        else:
+            pixels = pixels.astype(np.uint16)
+    if pixels.ndim == 3:
+        return [np.ascontiguousarray(frame) for frame in pixels]
+    return [pixels]
+
+
+def enhance_dicom_series(paths, result_callback=None, out_dir=None, batch_frames=0,
+                         progress_callback=None, cancel_flag=None, **params):
+    """批量执行 X 光泊松 NLM 增强（每帧结果与逐帧调用逐位一致）
+
+    Args:
+        paths: DICOM 文件路径列表（多帧文件的每一帧单独处理）
+        result_callback: 可选 result_callback(path, frame_index, image, timing)，每帧结果就绪后调用
+        out_dir: 可选输出目录，每帧写为 <文件名>[_<帧号>].npy
+        batch_frames: 每批帧数，0 为自动（硬件线程数，保证小帧也能填满核心）
+        progress_callback: 可选 progress(files_done, files_total)，每批完成后回调，显式返回 False 即取消
+        cancel_flag: 可选单字节数组（如 np.zeros(1, np.uint8)），置 1 即取消
+        **params: 流水线参数（同 process_batch）
+
+    Returns:
+        每帧一个 dict：path、frame、load_ms 与 C++ 端的耗时统计（tiles、compute_ms、wall_ms 等）
+    """
+    paths = list(paths)
+    batch = int(batch_frames) if batch_frames and batch_frames > 0 else max(1, os.cpu_count() or 1)
+    if out_dir is not None:
+        os.makedirs(out_dir, exist_ok=True)
+
+    def load(chunk):
+        loaded = []
+        for path in chunk:
+            start = time.perf_counter()
+            frames = load_dicom_frames_uint16(path)
+            load_ms = (time.perf_counter() - start) * 1000.0 / len(frames)
+            loaded.extend((path, i if len(frames) > 1 else None, frame, load_ms)
+                          for i, frame in enumerate(frames))
+        return loaded
+
+    chunks = [paths[k:k + batch] for k in range(0, len(paths), batch)]
+    report = []
+    with ThreadPoolExecutor(max_workers=1) as loader:
+        pending = loader.submit(load, chunks[0]) if chunks else None
+        for ci in range(len(chunks)):
+            items = pending.result()
+            # 下一批在后台读取；C++ 计算期间释放 GIL，读取与计算重叠
+            pending = loader.submit(load, chunks[ci + 1]) if ci + 1 < len(chunks) else None
+            if cancel_flag is not None and cancel_flag[0]:
+                raise InterruptedError("operation cancelled")
+            results, timings = process_batch([it[2] for it in items], cancel_flag=cancel_flag, **params)
+            for (path, frame_index, _, load_ms), image, timing in zip(items, results, timings):
+                if out_dir is not None:
+                    name = os.path.splitext(os.path.basename(path))[0]
+                    if frame_index is not None:
+                        name += f"_{frame_index}"
+                    np.save(os.path.join(out_dir, name + ".npy"), image)
+                if result_callback is not None:
+                    result_callback(path, frame_index, image, timing)
+                report.append(dict(timing, path=path, frame=frame_index, load_ms=load_ms))
+            if progress_callback is not None and progress_callback(min(len(paths), (ci + 1) * batch), len(paths)) is False:
+                raise InterruptedError("operation cancelled")
+    return report
@@ -5,6 +5,18 @@ import numpy as np
 from skimage import feature, filters
 from typing import Tuple, Optional
 
+# 尝试导入C++扩展（uint16 输入时幅值、归一化与增强混合一遍完成，不生成浮点临时图）
+try:
+    from poisson_nlm_cpp import edge_filter_cpp, edge_enhance_cpp, canny_edge_cpp
+except Exception:
+    edge_filter_cpp = None
+    edge_enhance_cpp = None
+    canny_edge_cpp = None
+
+
+def _use_native(fn, data):
+    return fn is not None and isinstance(data, np.ndarray) and data.dtype == np.uint16 and data.ndim == 2
+
 class EdgeProcessor:
     """边缘检测算法集合"""
     
@@ -19,6 +31,9 @@ class EdgeProcessor:
         Returns:
             np.ndarray: 边缘检测结果
         """
+        if _use_native(edge_filter_cpp, data):
+            return edge_filter_cpp(data, "sobel", normalize=normalize)
+
         # 转换为float32以提高精度
         data_float = data.astype(np.float32)
         
@@ -59,6 +74,10 @@ class EdgeProcessor:
             low_threshold = 0.1
         if high_threshold <= low_threshold or high_threshold >= 1:
             high_threshold = 0.2
+
+        if _use_native(canny_edge_cpp, data):
+            return canny_edge_cpp(data, sigma=sigma, low_threshold=low_threshold,
+                                  high_threshold=high_threshold)
         
         # 归一化到0-1范围进行Canny检测
         data_normalized = data.astype(np.float32) / 65535.0
@@ -84,6 +103,9 @@ class EdgeProcessor:
         Returns:
             np.ndarray: 边缘检测结果
         """
+        if _use_native(edge_filter_cpp, data):
+            return edge_filter_cpp(data, "laplacian", normalize=normalize)
+
         # 转换为float32以提高精度
         data_float = data.astype(np.float32)
         
@@ -119,6 +141,10 @@ class EdgeProcessor:
         if edge_strength <= 0:
             edge_strength = 1.0
         edge_strength = min(max(edge_strength, 0.1), 3.0)
+
+        if _use_native(edge_enhance_cpp, data):
+            op = edge_method if edge_method in ('sobel', 'laplacian') else 'sobel'
+            return edge_enhance_cpp(data, edge_strength=edge_strength, op=op)
         
         # 获取边缘信息
         if edge_method == 'sobel':
@@ -151,6 +177,9 @@ class EdgeProcessor:
         Returns:
             np.ndarray: 边缘检测结果
         """
+        if _use_native(edge_filter_cpp, data):
+            return edge_filter_cpp(data, "roberts", normalize=normalize)
+
         # 转换为float32以提高精度
         data_float = data.astype(np.float32)
         
@@ -2,10 +2,20 @@
 频域增强处理器模块
 """
 import numpy as np
+from functools import lru_cache
 from typing import Tuple, Optional
 
+# 尝试导入C++扩展（实数 FFT，缓存计划、掩膜与频谱）
+try:
+    from poisson_nlm_cpp import FrequencyFilterEngine as _FrequencyFilterEngine
+except Exception:
+    _FrequencyFilterEngine = None
+
 class FrequencyProcessor:
     """频域增强算法集合"""
+
+    # C++ 引擎：同一幅图连续调 cutoff_ratio 时复用正变换频谱
+    _engine = _FrequencyFilterEngine() if _FrequencyFilterEngine is not None else None
     
     @staticmethod
     def _create_frequency_filter(shape: Tuple[int, int], cutoff_ratio: float, 
@@ -77,8 +87,8 @@ class FrequencyProcessor:
         f_ishift = np.fft.ifftshift(filtered_shift)
         filtered_data = np.fft.ifft2(f_ishift)
         
-        # 取实部并转换回原始数据类型
-        result = np.abs(filtered_data)
+        # 取实部并转换回原始数据类型（取模会丢掉高通结果的符号）
+        result = np.real(filtered_data)
         
         # 归一化到原始数据范围
         result_min, result_max = result.min(), result.max()
@@ -90,6 +100,39 @@ class FrequencyProcessor:
         
         return np.clip(result, 0, 65535).astype(np.uint16)
     
+    @staticmethod
+    @lru_cache(maxsize=16)
+    def _create_rfft_filter(shape: Tuple[int, int], cutoff_ratio: float,
+                            filter_type: str) -> np.ndarray:
+        """按 (形状, 截止比例, 类型) 缓存的半平面滤波器，对应未移位的 rfft2 频谱"""
+        full = FrequencyProcessor._create_frequency_filter(shape, cutoff_ratio, filter_type)
+        half = np.fft.ifftshift(full)[:, :shape[1] // 2 + 1]
+        half = np.ascontiguousarray(half, dtype=np.float32)
+        half.flags.writeable = False
+        return half
+
+    @staticmethod
+    def _filter(data: np.ndarray, cutoff_ratio: float, filter_type: str) -> np.ndarray:
+        """频域滤波：优先用 C++ 引擎，否则用 numpy 实数 FFT（结果与 _apply_frequency_filter 一致）"""
+        if FrequencyProcessor._engine is not None and data.ndim == 2:
+            return FrequencyProcessor._engine.filter(data, float(cutoff_ratio), filter_type)
+
+        filter_mask = FrequencyProcessor._create_rfft_filter(
+            tuple(data.shape), float(cutoff_ratio), filter_type)
+        spectrum = np.fft.rfft2(data.astype(np.float32))
+        spectrum *= filter_mask
+        result = np.fft.irfft2(spectrum, s=data.shape)
+
+        # 归一化到原始数据范围
+        result_min, result_max = result.min(), result.max()
+        if result_max > result_min:
+            result = (result - result_min) / (result_max - result_min)
+            result = result * (data.max() - data.min()) + data.min()
+        else:
+            result = data.astype(np.float32)
+
+        return np.clip(result, 0, 65535).astype(np.uint16)
+
     @staticmethod
     def ideal_low_pass(data: np.ndarray, cutoff_ratio: float = 0.1) -> np.ndarray:
         """理想低通滤波
@@ -104,10 +147,7 @@ class FrequencyProcessor:
         if cutoff_ratio <= 0 or cutoff_ratio >= 1:
             cutoff_ratio = 0.1
             
-        filter_mask = FrequencyProcessor._create_frequency_filter(
-            data.shape, cutoff_ratio, 'ideal_low')
-        
-        return FrequencyProcessor._apply_frequency_filter(data, filter_mask)
+        return FrequencyProcessor._filter(data, cutoff_ratio, 'ideal_low')
     
     @staticmethod
     def ideal_high_pass(data: np.ndarray, cutoff_ratio: float = 0.1) -> np.ndarray:
@@ -123,10 +163,7 @@ class FrequencyProcessor:
         if cutoff_ratio <= 0 or cutoff_ratio >= 1:
             cutoff_ratio = 0.1
             
-        filter_mask = FrequencyProcessor._create_frequency_filter(
-            data.shape, cutoff_ratio, 'ideal_high')
-        
-        return FrequencyProcessor._apply_frequency_filter(data, filter_mask)
+        return FrequencyProcessor._filter(data, cutoff_ratio, 'ideal_high')
     
     @staticmethod
     def gaussian_low_pass(data: np.ndarray, cutoff_ratio: float = 0.1) -> np.ndarray:
@@ -142,10 +179,7 @@ class FrequencyProcessor:
         if cutoff_ratio <= 0 or cutoff_ratio >= 1:
             cutoff_ratio = 0.1
             
-        filter_mask = FrequencyProcessor._create_frequency_filter(
-            data.shape, cutoff_ratio, 'gaussian_low')
-        
-        return FrequencyProcessor._apply_frequency_filter(data, filter_mask)
+        return FrequencyProcessor._filter(data, cutoff_ratio, 'gaussian_low')
     
     @staticmethod
     def gaussian_high_pass(data: np.ndarray, cutoff_ratio: float = 0.1) -> np.ndarray:
@@ -161,10 +195,7 @@ class FrequencyProcessor:
         if cutoff_ratio <= 0 or cutoff_ratio >= 1:
             cutoff_ratio = 0.1
             
-        filter_mask = FrequencyProcessor._create_frequency_filter(
-            data.shape, cutoff_ratio, 'gaussian_high')
-        
-        return FrequencyProcessor._apply_frequency_filter(data, filter_mask)
+        return FrequencyProcessor._filter(data, cutoff_ratio, 'gaussian_high')
     
     @staticmethod
     def get_algorithm_info() -> dict:
@@ -0,0 +1,87 @@
+"""
+图像直方图统计的共享缓存
+
+16 位图像只建一次 65536 档直方图（C++ 每线程子直方图并行累加），分位数、np.histogram 分箱、
+有效数据范围与智能滑块范围都从直方图得到，不再扫描像素。ImageManager、WindowBasedEnhancer、
+normalize_to_unit 与直方图窗口按图像数组共用同一份统计：加载后第一次显示只扫描一遍全图。
+
+缓存按数组对象识别（弱引用 + 数据指针/形状/步长），不复制也不哈希像素；
+原地修改过像素的数组须调用 invalidate_histogram_stats(data)。
+"""
+import threading
+import weakref
+from collections import OrderedDict
+from typing import Optional
+
+import numpy as np
+
+# 尝试导入C++扩展
+try:
+    from poisson_nlm_cpp import ImageHistogram as ImageHistogramCpp
+except Exception:
+    ImageHistogramCpp = None
+
+
+def _array_key(data: np.ndarray):
+    return (id(data), data.__array_interface__['data'][0], data.shape, data.strides)
+
+
+class HistogramStatsCache:
+    """按图像数组缓存 ImageHistogram（LRU）"""
+
+    def __init__(self, max_entries: int = 8):
+        self.max_entries = max(1, int(max_entries))
+        self._lock = threading.Lock()
+        self._entries: "OrderedDict[tuple, tuple]" = OrderedDict()
+        self.hits = 0
+        self.misses = 0
+
+    def get(self, data: np.ndarray):
+        """返回 data 的 ImageHistogram；C++ 扩展不可用或 data 不是二维 uint16 时返回 None"""
+        if (ImageHistogramCpp is None or not isinstance(data, np.ndarray)
+                or data.dtype != np.uint16 or data.ndim != 2 or data.size == 0):
+            return None
+        key = _array_key(data)
+        with self._lock:
+            entry = self._entries.get(key)
+            # 弱引用失效说明原数组已回收、id 被新数组复用
+            if entry is not None and entry[0]() is data:
+                self._entries.move_to_end(key)
+                self.hits += 1
+                return entry[1]
+            self.misses += 1
+        stats = ImageHistogramCpp(data)
+        with self._lock:
+            self._entries[key] = (weakref.ref(data), stats)
+            self._entries.move_to_end(key)
+            while len(self._entries) > self.max_entries:
+                self._entries.popitem(last=False)
+        return stats
+
+    def invalidate(self, data: Optional[np.ndarray] = None):
+        """丢弃 data 的统计；data 为 None 时清空"""
+        with self._lock:
+            if data is None:
+                self._entries.clear()
+            else:
+                self._entries.pop(_array_key(data), None)
+
+    def get_cache_stats(self) -> dict:
+        with self._lock:
+            return {'entries': len(self._entries), 'hits': self.hits, 'misses': self.misses}
+
+
+_global_histogram_cache = HistogramStatsCache()
+
+
+def get_histogram_stats(data: np.ndarray):
+    """全局缓存中 data 的 ImageHistogram（不可用时为 None，调用方回退到 numpy 实现）"""
+    return _global_histogram_cache.get(data)
+
+
+def invalidate_histogram_stats(data: Optional[np.ndarray] = None):
+    _global_histogram_cache.invalidate(data)
+
+
+def get_histogram_cache() -> HistogramStatsCache:
+    return _global_histogram_cache
@@ -10,6 +10,7 @@ from typing import Optional, Tuple, List, Dict, Any
 from dataclasses import dataclass
 from enum import Enum
 from .window_level_lut import get_global_lut
+from .histogram_stats import get_histogram_stats
 
 # 过滤DICOM字符编码警告
 warnings.filterwarnings('ignore', category=UserWarning, message='Incorrect value for Specific Character Set')
@@ -239,13 +240,8 @@ class ImageManager:
 
         # 使用LUT优化的窗宽窗位计算
         lut = get_global_lut()
-        windowed_data = lut.apply_lut(data, window_width, window_level)
-
-        # 如果启用反相，对显示数据进行反相
-        if invert:
-            windowed_data = 255 - windowed_data
-
-        return windowed_data
+        # 反相与查表同遍完成，不再额外生成一幅反相数组
+        return lut.apply_lut(data, window_width, window_level, invert=invert)
 
     def calculate_smart_slider_ranges(self, image_data: ImageData) -> tuple:
         """计算智能滑块范围
@@ -263,14 +259,22 @@ class ImageManager:
         current_ww = image_data.window_width
         current_wl = image_data.window_level
 
-        # 使用与自动优化算法相同的智能检测逻辑
+        # 使用与自动优化算法相同的智能检测逻辑；16 位图像的直方图按图像缓存，不再逐次扫描像素
+        stats = get_histogram_stats(data)
+        data_min, data_max = (stats.min, stats.max) if stats is not None else (data.min(), data.max())
         effective_min, effective_max = self._detect_effective_range(data)
 
         print(f"🎯 智能范围计算:")
-        print(f"   原始数据范围: {data.min()} - {data.max()}")
+        print(f"   原始数据范围: {data_min} - {data_max}")
         print(f"   有效数据范围: {effective_min:.1f} - {effective_max:.1f}")
         print(f"   当前窗宽窗位: {current_ww:.1f}, {current_wl:.1f}")
 
+        if stats is not None:
+            ww_range, wl_range = stats.slider_ranges(current_ww, current_wl)
+            print(f"   智能窗宽范围: {ww_range[0]} - {ww_range[1]}")
+            print(f"   智能窗位范围: {wl_range[0]} - {wl_range[1]}")
+            return ww_range, wl_range
+
         # 方法2：基于当前值和有效范围计算智能范围
         if current_ww > 0 and current_wl > 0:
             # 窗位范围：围绕当前值，考虑有效数据范围
@@ -325,6 +329,10 @@ class ImageManager:
         Returns:
             tuple: (effective_min, effective_max)
         """
+        stats = get_histogram_stats(data)
+        if stats is not None:
+            return stats.effective_range()
+
         data_min = int(data.min())
         data_max = int(data.max())
         total_pixels = data.size
@@ -10,7 +10,7 @@ import time
 import uuid
 from typing import Dict, Any, Optional, Callable
 from PyQt6.QtCore import QThread, QMutex, QWaitCondition, pyqtSignal, QObject
-from dataclasses import dataclass
+from dataclasses import dataclass, field
 from enum import Enum
 
 from .image_processor import ImageProcessor
@@ -40,6 +40,8 @@ class ProcessingTask:
     created_time: float = 0.0
     start_time: float = 0.0
     end_time: float = 0.0
+    # C++ 内核轮询的取消标志（释放 GIL 运行期间 cancel_task 置 1 即可中止）
+    cancel_flag: np.ndarray = field(default_factory=lambda: np.zeros(1, dtype=np.uint8))
     
     def __post_init__(self):
         if self.created_time == 0.0:
@@ -56,6 +58,7 @@ class ImageProcessingThread(QThread):
     task_started = pyqtSignal(str)  # task_id
     task_progress = pyqtSignal(str, float)  # task_id, progress
     task_completed = pyqtSignal(str, object, str)  # task_id, result_data, description
+    task_preview = pyqtSignal(str, object, str)  # task_id, preview_data, stage（渐进模式的中间结果）
     task_failed = pyqtSignal(str, str)  # task_id, error_message
     queue_status_changed = pyqtSignal(int, int)  # pending_count, total_count
     
@@ -166,6 +169,7 @@ class ImageProcessingThread(QThread):
             # 检查是否是当前正在处理的任务
             if self.current_task and self.current_task.task_id == task_id:
                 self.current_task.status = TaskStatus.CANCELLED
+                self.current_task.cancel_flag[0] = 1
                 return True
                 
         finally:
@@ -301,6 +305,10 @@ class ImageProcessingThread(QThread):
             # 发出完成信号
             self.task_completed.emit(task.task_id, result, task.description)
             
+        except InterruptedError:
+            # 协作式取消：内核已提前结束，不作为失败上报
+            task.status = TaskStatus.CANCELLED
+            task.end_time = time.time()
         except Exception as e:
             task.status = TaskStatus.FAILED
             task.error_message = str(e)
@@ -398,7 +406,17 @@ class ImageProcessingThread(QThread):
             def paper_enhance_cpp_with_progress():
                 def progress_wrapper(progress):
                     progress_callback(task, progress)
-                return self.processor.paper_enhance_cpp(data, progress_wrapper)
+                preview = None
+                if parameters.get('progressive', False):
+                    # 中间结果缓冲会被后续批次原地改写，发给界面线程前拷贝
+                    def preview(image, stage):
+                        if task.status != TaskStatus.CANCELLED:
+                            self.task_preview.emit(task.task_id, image.copy(), stage)
+                return self.processor.paper_enhance_cpp(data, progress_wrapper,
+                                                        cancel_flag=task.cancel_flag,
+                                                        preview_callback=preview,
+                                                        viewport=parameters.get('viewport'),
+                                                        view_scale=parameters.get('view_scale', 1.0))
 
             return paper_enhance_cpp_with_progress()
         else:
@@ -10,7 +10,8 @@ from .frequency_processor import FrequencyProcessor
 from .edge_processor import EdgeProcessor
 from .dicom_enhancer import DicomEnhancer
 from .window_based_enhancer import WindowBasedEnhancer
-from .paper_enhance import enhance_xray_poisson_nlm_strict, enhance_xray_poisson_nlm_strict_tiled_cpp
+from .paper_enhance import (enhance_xray_poisson_nlm_strict, enhance_xray_poisson_nlm_strict_tiled_cpp,
+                             enhance_progressive_tiled_cpp)
 from .image_analyzer import image_analysis_decorator
 
 class ImageProcessor:
@@ -390,8 +391,14 @@ class ImageProcessor:
             raise
 
     @staticmethod
-    def paper_enhance_cpp(data: np.ndarray, progress_callback=None) -> np.ndarray:
-        """论文算法：C++加速版本 - 基于梯度场和非局部均值的复杂工件图像增强算法"""
+    def paper_enhance_cpp(data: np.ndarray, progress_callback=None, cancel_flag=None,
+                          preview_callback=None, viewport=None, view_scale=1.0) -> np.ndarray:
+        """论文算法：C++加速版本 - 基于梯度场和非局部均值的复杂工件图像增强算法
+
+        cancel_flag: 可选的单字节 numpy 数组，处理期间置 1 即协作式取消（抛出 InterruptedError）
+        preview_callback: 给出时走渐进模式，preview_callback(image, stage) 先收到低分辨率层的预览，
+            再随视口 viewport=(y0, y1, x0, x1) 由近到远的分块细化多次收到更新；最终结果不变
+        """
         print(f"\n🚀 论文算法C++加速版处理:")
         print(f"   输入数据范围: {data.min()} - {data.max()}")
         print(f"   输入数据类型: {data.dtype}")
@@ -400,16 +407,32 @@ class ImageProcessor:
         if progress_callback:
             progress_callback(0.1)
 
+        # C++ 内核按已完成分块回调，映射到 0.1 ~ 0.95 区间
+        def tile_progress(done, total):
+            if progress_callback:
+                progress_callback(0.1 + 0.85 * done / max(total, 1))
+
+        params = dict(
+            tile=(1024, 1024), overlap=32,
+            epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+            search_radius=2, patch_radius=1, rho=1.5,
+            count_target_mean=30.0, lam_quant=0.02, topk=25,
+            gamma=0.2, delta=0.8, iters=6, dt=0.15,
+        )
+
+        def publish(image, stage, done, total):
+            preview_callback(image, stage)
+            tile_progress(done, total)
+
         try:
-            I_enh = enhance_xray_poisson_nlm_strict_tiled_cpp(
-                data,
-                tile=(1024, 1024), overlap=32,
-                epsilon_8bit=2.3, mu=10.0, ksize_var=5,
-                search_radius=2, patch_radius=1, rho=1.5,
-                count_target_mean=30.0, lam_quant=0.02, topk=25,
-                gamma=0.2, delta=0.8, iters=6, dt=0.15,
-                out_dtype=np.uint16,
-            )
+            if preview_callback is not None and data.dtype == np.uint16:
+                I_enh = enhance_progressive_tiled_cpp(
+                    data, publish, viewport=viewport, view_scale=view_scale,
+                    cancel_flag=cancel_flag, **params)
+            else:
+                I_enh = enhance_xray_poisson_nlm_strict_tiled_cpp(
+                    data, out_dtype=np.uint16,
+                    progress_callback=tile_progress, cancel_flag=cancel_flag, **params)
 
             if progress_callback:
                 progress_callback(1.0)
@@ -417,6 +440,9 @@ class ImageProcessor:
             print(f"   ✅ C++加速论文算法处理完成")
             return I_enh
 
+        except InterruptedError:
+            print(f"   ⏹ C++加速论文算法已取消")
+            raise
         except Exception as e:
             print(f"   ❌ C++加速论文算法处理失败: {e}")
             import traceback
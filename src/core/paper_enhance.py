@@ -1,24 +1,52 @@
+import os
+import threading
+import zlib
+from collections import OrderedDict
 import numpy as np
 import cv2
 from math import ceil, sqrt
-from functools import lru_cache
-from scipy.stats import poisson
+from scipy.special import i0e
 from skimage.restoration import denoise_nl_means
+from .histogram_stats import get_histogram_stats, invalidate_histogram_stats
 
 # 尝试导入C++扩展
 try:
     from poisson_nlm_cpp import poisson_nlm_on_gradient_exact_cpp as nlm_cpp
+    from poisson_nlm_cpp import poisson_nlm_reconstruct_cpp as nlm_recon_cpp
+    from poisson_nlm_cpp import variational_reconstruct_cpp as recon_cpp
+    from poisson_nlm_cpp import enhance_xray_poisson_nlm_strict_cpp as pipeline_cpp
+    from poisson_nlm_cpp import adaptive_gradient_enhance_cpp as step1_cpp
+    from poisson_nlm_cpp import enhance_pipeline_region_cpp as region_cpp
+    from poisson_nlm_cpp import pipeline_normalization_range_cpp as norm_range_cpp
+    from poisson_nlm_cpp import pipeline_tile_order_cpp as tile_order_cpp
+    from poisson_nlm_cpp import enhance_pipeline_tiles_cpp as tiles_cpp
+    from poisson_nlm_cpp import enhance_pipeline_batch_cpp as batch_cpp
 except Exception as e:
+    batch_cpp = None
+    tile_order_cpp = None
+    tiles_cpp = None
     nlm_cpp = None
+    region_cpp = None
+    norm_range_cpp = None
+    step1_cpp = None
+    nlm_recon_cpp = None
+    recon_cpp = None
+    pipeline_cpp = None
     _cpp_import_error = e
 
 # -------- 规范化到 [0,1]（浮点），并返回可逆上下文 --------
 def normalize_to_unit(img, mode="percentile", p_lo=0.5, p_hi=99.5,
                       wl=None, ww=None):
+    stats = get_histogram_stats(img)
     img = img.astype(np.float32)
     if mode == "window" and wl is not None and ww is not None:
         vmin = wl - ww/2.0
         vmax = wl + ww/2.0
+    elif stats is not None:
+        # 16 位输入：按图像缓存的 65536 档直方图按秩取值（同 np.percentile 的 linear 插值），不再排序
+        vmin, vmax = stats.percentile(p_lo), stats.percentile(p_hi)
+        if vmax <= vmin:
+            vmax = float(stats.max) if stats.max > vmin else (vmin + 1.0)
     else:
         vmin, vmax = np.percentile(img, [p_lo, p_hi])
         if vmax <= vmin:
@@ -59,7 +87,11 @@ def local_variance(img, ksize=5):
 # -------- Step 1：梯度场 + 局部方差自适应增强（严格按式(5)(6)） --------
 def adaptive_gradient_enhance_unit(R_unit,
                                    epsilon_unit=2.3/(255.0*255.0),  # ε 映射到 [0,1] 量纲
-                                   mu=10.0, ksize_var=5):
+                                   mu=10.0, ksize_var=5, use_cpp=False):
+    # use_cpp=True 走 C++ 路径：两遍融合计算，C 用 σ 直方图近似分位（误差不超过 7.6e-6），输出 float32；
+    # 数值与下方 np.percentile 精确分位略有差别，默认不启用，由原生/分块驱动显式选择
+    if use_cpp and step1_cpp is not None:
+        return step1_cpp(R_unit, epsilon_unit=float(epsilon_unit), mu=float(mu), ksize_var=int(ksize_var))
     gx, gy = grad2d(R_unit)
     sigma2 = local_variance(R_unit, ksize=ksize_var)  # 局部方差
     sigma = np.sqrt(sigma2 + 1e-12)
@@ -72,17 +104,24 @@ def adaptive_gradient_enhance_unit(R_unit,
     return Gx_prime, Gy_prime
 
 # -------- Step 2：泊松分布 NLM（严格按式(7)(8)(9)(10)(11)(12)） --------
-@lru_cache(maxsize=200000)
-def poisson_L2_distance(lx_r, ly_r):
-    lx = float(lx_r); ly = float(ly_r)
-    lmax = max(lx, ly)
-    if lmax <= 0:  # 两个都是0时距离为0
-        return 0.0
-    Rmax = int(ceil(lmax + 6.0*sqrt(lmax)))
-    r = np.arange(0, Rmax + 1)
-    px = poisson.pmf(r, lx)
-    py = poisson.pmf(r, ly)
-    return float(np.sum((px - py)**2))
+def _poisson_pmf_inner(lx, ly):
+    """Σ_r p_x(r)·p_y(r) = e^{-(λx+λy)}·I₀(2√(λxλy)) = e^{-(√λx-√λy)²}·i0e(2√λx√λy)"""
+    sx = np.sqrt(lx); sy = np.sqrt(ly)
+    return np.exp(-(sx - sy)**2) * i0e(2.0 * sx * sy)
+
+def poisson_L2_distance(lx, ly):
+    """式(9)(10) 的 L2 分布距离 Σ_r (p_x(r) - p_y(r))²，按 Bessel 闭式求值（无截断，可传数组）
+
+    与 C++ poisson_L2_distance 同一恒等式；λx == λy 时三项相同，距离精确为 0。
+    """
+    lx = np.asarray(lx, dtype=np.float64); ly = np.asarray(ly, dtype=np.float64)
+    d = _poisson_pmf_inner(lx, lx) + _poisson_pmf_inner(ly, ly) - 2.0 * _poisson_pmf_inner(lx, ly)
+    return np.maximum(d, 0.0)
+
+def _quantize_lambda(lam, lam_quant):
+    """λ 量化：lam_quant 为 None 时保留两位小数"""
+    lam = lam.astype(np.float64)
+    return np.round(lam, 2) if lam_quant is None else np.round(lam / lam_quant) * lam_quant
 
 def estimate_lambda_map(count_img, ksize=3):
     if ksize % 2 == 0: ksize += 1
@@ -93,7 +132,7 @@ def poisson_nlm_on_gradient_exact(Gx_prime, Gy_prime,
                                   search_radius=5, patch_radius=1,
                                   rho=1.5,
                                   count_target_mean=30.0,  # 目标平均 λ（数十更稳）
-                                  lam_quant=0.02,          # λ 量化步长→缓存命中
+                                  lam_quant=0.02,          # λ 量化步长（与 C++ d 表一致）
                                   topk=None,
                                   progress_callback=None):
     import time
@@ -114,6 +153,8 @@ def poisson_nlm_on_gradient_exact(Gx_prime, Gy_prime,
 
     pr = patch_radius
     sr = search_radius
+    # λ̄：λ 在 patch 上的均值，整图一次算好，循环内直接查
+    lam_bar_map = cv2.blur(lam_map, (2*pr+1, 2*pr+1), borderType=cv2.BORDER_REFLECT)
     Gx = np.zeros_like(Gx_prime, dtype=np.float32)
     Gy = np.zeros_like(Gy_prime, dtype=np.float32)
 
@@ -148,7 +189,8 @@ def poisson_nlm_on_gradient_exact(Gx_prime, Gy_prime,
             if y0p < 0 or x0p < 0 or y1p > H or x1p > W:
                 Gx[y, x] = Gx_prime[y, x]; Gy[y, x] = Gy_prime[y, x]; continue
             lam_patch_x = lam_map[y0p:y1p, x0p:x1p]
-            lam_x_bar = float(np.mean(lam_patch_x))
+            lam_x_bar = float(lam_bar_map[y, x])
+            lam_patch_x_r = _quantize_lambda(lam_patch_x, lam_quant)
 
             # 搜索窗（保证候选也有完整 patch）
             sy0, sy1 = max(pr, y-sr), min(H-pr, y+sr+1)
@@ -159,14 +201,9 @@ def poisson_nlm_on_gradient_exact(Gx_prime, Gy_prime,
                 for xx in range(sx0, sx1):
                     lam_patch_y = lam_map[yy-pr:yy+pr+1, xx-pr:xx+pr+1]
 
-                    # 严格：Σ_m d(λx_m, λy_m)；d 用式(9)(10) 的 L2 分布距离（离散求和）
-                    D_xy = 0.0
-                    for j in range(lam_patch_x.shape[0]):
-                        for i in range(lam_patch_x.shape[1]):
-                            lx = lam_patch_x[j, i]; ly = lam_patch_y[j, i]
-                            lx_r = round(float(lx), 2) if lam_quant is None else round(float(lx)/lam_quant)*lam_quant
-                            ly_r = round(float(ly), 2) if lam_quant is None else round(float(ly)/lam_quant)*lam_quant
-                            D_xy += poisson_L2_distance(lx_r, ly_r)
+                    # 严格：Σ_m d(λx_m, λy_m)；d 用式(9)(10) 的 L2 分布距离（闭式，整块一次求值）
+                    D_xy = float(np.sum(poisson_L2_distance(lam_patch_x_r,
+                                                            _quantize_lambda(lam_patch_y, lam_quant))))
                     ds.append(D_xy); coords.append((yy, xx))
 
             ds = np.array(ds, dtype=np.float32)
@@ -348,6 +385,11 @@ def fast_nlm_on_gradient(Gx_prime, Gy_prime,
 def variational_reconstruct_unit(R_unit, Gx, Gy,
                                  gamma=0.2, delta=0.8,
                                  iters=10, dt=0.15):
+    if recon_cpp is not None:
+        # C++ 融合扫描：每次迭代一遍，无 np.roll 整图临时量
+        I = np.array(R_unit, dtype=np.float32, order="C", copy=True)
+        recon_cpp(I, Gx, Gy, float(gamma), float(delta), int(iters), float(dt))
+        return I
     I = R_unit.copy().astype(np.float32)
     for _ in range(iters):
         Ix, Iy = grad2d(I)
@@ -360,12 +402,119 @@ def variational_reconstruct_unit(R_unit, Gx, Gy,
         I = np.clip(I, 0.0, 1.0)
     return I
 
+def pyramid_guide_level(pyramid, shape, levels=1):
+    """取 ImagePyramid 中已生成的第 levels 级（尺寸须为 shape 按 2^levels 缩小），作为金字塔 NLM 的粗层引导图。
+    只接受由 16-bit 原始数据建立的金字塔：显示端金字塔存的是窗位化后的 8-bit 数据，截断且非线性，
+    其梯度不能代表原图的 λ。没有合适的一级时返回 None，此时 C++ 端由 λ̂ 自行缩小。"""
+    if pyramid is None:
+        return None
+    level = pyramid.pyramid_levels.get(levels)
+    if level is None:
+        return None
+    img = level.image_data
+    if img.dtype != np.uint16 or img.ndim != 2 or img.shape != (shape[0] >> levels, shape[1] >> levels):
+        return None
+    return img
+
+# -------- 分阶段结果缓存：只改后段参数时跳过上游阶段 --------
+def image_fingerprint(img):
+    """图像内容指纹 (shape, dtype, crc32)；调优时同一幅图反复调用，按内容而非对象身份判断
+
+    每次调用都对整幅图像做一遍 crc32（非连续输入另加一次拷贝），代价约为一次整幅读取：
+    zlib.crc32 单核约 1 GB/s 量级，3000×3000 的 uint16 图像（约 18 MB）在十余毫秒左右。
+    反复调参时应对同一幅图只算一次，以 image_key= 传入 enhance_xray_poisson_nlm_strict（或直接用载入时生成的 ImageData.id）。
+    """
+    buf = np.ascontiguousarray(img)
+    return (tuple(buf.shape), buf.dtype.str, zlib.crc32(buf))
+
+
+class StageCache:
+    """enhance_xray_poisson_nlm_strict 的阶段结果缓存
+
+    各阶段结果以 (图像指纹, 本阶段及全部上游参数) 为键：只改 gamma/delta/iters/dt 时
+    归一化、Step1、NLM 全部命中，只重跑变分重建；改 Step1 参数则 NLM 随之重算。
+    最终输出（变分重建）不缓存，每次调用都返回新的可写数组。
+    缓存的数组设为只读，调用方拿到的 Gx/Gy 等不能被原地修改而污染缓存。
+    每个阶段默认只保留最近 max_entries 个结果（大图单个 NLM 结果可达数百 MB）。
+    """
+    STAGES = ("normalize", "step1", "nlm")
+
+    def __init__(self, max_entries=1):
+        self.max_entries = max(1, int(max_entries))
+        self._lock = threading.Lock()
+        self._entries = {s: OrderedDict() for s in self.STAGES}
+        self.hits = {s: 0 for s in self.STAGES}
+        self.misses = {s: 0 for s in self.STAGES}
+
+    def get(self, stage, key):
+        with self._lock:
+            entries = self._entries[stage]
+            if key in entries:
+                entries.move_to_end(key)
+                self.hits[stage] += 1
+                return entries[key]
+            self.misses[stage] += 1
+            return None
+
+    def put(self, stage, key, value):
+        for v in (value if isinstance(value, tuple) else (value,)):
+            if isinstance(v, np.ndarray):
+                v.flags.writeable = False
+        with self._lock:
+            entries = self._entries[stage]
+            entries[key] = value
+            entries.move_to_end(key)
+            while len(entries) > self.max_entries:
+                entries.popitem(last=False)
+        return value
+
+    def clear(self):
+        with self._lock:
+            for entries in self._entries.values():
+                entries.clear()
+
+    def memory_usage(self):
+        """各阶段缓存占用字节数与命中统计"""
+        with self._lock:
+            usage = {}
+            for stage, entries in self._entries.items():
+                nbytes = 0
+                for value in entries.values():
+                    for v in (value if isinstance(value, tuple) else (value,)):
+                        if isinstance(v, np.ndarray):
+                            nbytes += v.nbytes
+                usage[stage] = {"entries": len(entries), "bytes": nbytes,
+                                "hits": self.hits[stage], "misses": self.misses[stage]}
+            usage["total_bytes"] = sum(u["bytes"] for u in usage.values())
+            return usage
+
+
+_default_stage_cache = StageCache()
+
+
+def default_stage_cache():
+    """进程内共享的阶段缓存（调参调用方显式传入 stage_cache=）
+
+    每阶段只保留最近 max_entries 个结果，换图后第一次调用即把旧图的结果挤出；需要立即释放时调用 clear()。
+    """
+    return _default_stage_cache
+
+
+def _cached_stage(cache, stage, key, compute):
+    """cache 为 None 时直接计算；否则先查缓存，未命中时计算并存入"""
+    if cache is None:
+        return compute(), False
+    value = cache.get(stage, key)
+    if value is not None:
+        return value, True
+    return cache.put(stage, key, compute()), False
+
 # -------- 总封装：16-bit 进 → [0,1] 处理 → 16-bit 出 --------
 def enhance_xray_poisson_nlm_strict(R16,
     # 归一化方式：percentile 更稳，window 用 DICOM WL/WW
     norm_mode="percentile", p_lo=0.5, p_hi=99.5, wl=None, ww=None,
-    # Step1
-    epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+    # Step1（use_cpp_step1=True 时用 C++ 融合实现，C 取直方图近似分位）
+    epsilon_8bit=2.3, mu=10.0, ksize_var=5, use_cpp_step1=False,
     # Step2
     rho=1.5, search_radius=5, patch_radius=1, topk=None,
     count_target_mean=30.0, lam_quant=0.02,
@@ -376,7 +525,16 @@ def enhance_xray_poisson_nlm_strict(R16,
     # 进度回调
     progress_callback=None,
     # 快速模式
-    use_fast_nlm=None  # None=自动判断, True=强制快速, False=使用原始实现
+    use_fast_nlm=None,  # None=自动判断, True=强制快速, False=使用原始实现
+    # 原始实现下的 NLM 引擎：None=Python 参考实现；"offset"=C++ 位移引擎（须 topk=None，求和次序不同，
+    # 大图不再压低 search_radius/patch_radius）
+    nlm_engine=None,
+    # 调用方已有的 16-bit ImagePyramid（可选，由 R16 建立）：原始实现下用于金字塔 NLM 引擎的粗层
+    pyramid=None,
+    # 阶段结果缓存（可选，StageCache）：只改后段参数时跳过上游阶段；
+    # image_key 为调用方给出的图像标识（每幅图算一次 image_fingerprint 或用 ImageData.id），
+    # 省略时每次调用都对整幅图像重算指纹
+    stage_cache=None, image_key=None
 ):
     import time
     start_time = time.time()
@@ -385,37 +543,62 @@ def enhance_xray_poisson_nlm_strict(R16,
 
     print(f"   🔧 [enhance_xray_poisson_nlm_strict] 开始处理 {H}x{W} 图像 ({total_pixels:,} 像素)")
 
+    # 显式选择 nlm_engine="offset" 时走位移引擎：代价与 patch 大小无关，大图不再需要压低参数；
+    # 默认仍是 Python 参考实现
+    if nlm_engine not in (None, "offset"):
+        raise ValueError(f"unknown nlm_engine: {nlm_engine!r}")
+    if nlm_engine == "offset":
+        if topk is not None:
+            raise ValueError("nlm_engine='offset' requires topk=None (full search window)")
+        if nlm_cpp is None:
+            raise RuntimeError(f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}")
+    use_offset_engine = (use_fast_nlm is False and nlm_engine == "offset")
+    # 给了 ImagePyramid 且用 topk 时走金字塔引擎：粗层搜索候选位移、细层只细化少数候选，
+    # 大搜索半径的代价接近 search_radius=1，大图同样不必压低参数
+    use_pyramid_engine = (use_fast_nlm is False and topk is not None and pyramid is not None
+                          and nlm_cpp is not None)
+
     # 大图像警告和参数自动调整
     if total_pixels > 2000000:  # 2M像素
         print(f"   ⚠️  检测到大图像 ({total_pixels/1000000:.1f}M像素)，自动调整参数以提高速度...")
-        if search_radius > 1:
-            search_radius = 1
-            print(f"      - search_radius 调整为: {search_radius}")
-        if topk is None or topk > 5:
-            topk = 5
-            print(f"      - topk 调整为: {topk}")
+        if not (use_offset_engine or use_pyramid_engine):
+            if search_radius > 1:
+                search_radius = 1
+                print(f"      - search_radius 调整为: {search_radius}")
+            if topk is None or topk > 5:
+                topk = 5
+                print(f"      - topk 调整为: {topk}")
+            if patch_radius > 1:
+                patch_radius = 1
+                print(f"      - patch_radius 调整为: {patch_radius}")
         if iters > 2:
             iters = 2
             print(f"      - iters 调整为: {iters}")
-        if patch_radius > 1:
-            patch_radius = 1
-            print(f"      - patch_radius 调整为: {patch_radius}")
 
         # 超大图像(>5M像素)进一步优化
         if total_pixels > 5000000:
             print(f"   🚨 检测到超大图像 ({total_pixels/1000000:.1f}M像素)，使用极速模式...")
-            search_radius = 1
-            topk = 3
+            if not (use_offset_engine or use_pyramid_engine):
+                search_radius = 1
+                topk = 3
+                patch_radius = 1
             iters = 1
-            patch_radius = 1
             print(f"      - 极速参数: search_radius={search_radius}, topk={topk}, iters={iters}")
             print(f"      - 预计处理时间: {total_pixels*0.0005/60:.1f}分钟")
 
+    # 阶段缓存键：每一阶段的键都包含其全部上游参数（取大图自动调整之后的实际值）
+    if stage_cache is not None and image_key is None:
+        image_key = image_fingerprint(R16)
+    norm_key = (image_key, norm_mode, float(p_lo), float(p_hi), wl, ww)
+    step1_key = norm_key + (float(epsilon_8bit), float(mu), int(ksize_var), bool(use_cpp_step1))
+
     # 16-bit → [0,1] 浮点（不丢精度）
     print(f"   📊 [normalize_to_unit] 开始归一化...")
     norm_start = time.time()
-    R_unit, nctx = normalize_to_unit(R16, mode=norm_mode, p_lo=p_lo, p_hi=p_hi, wl=wl, ww=ww)
-    print(f"   ✅ [normalize_to_unit] 完成，耗时: {time.time()-norm_start:.2f}s")
+    (R_unit, nctx), hit = _cached_stage(
+        stage_cache, "normalize", norm_key,
+        lambda: normalize_to_unit(R16, mode=norm_mode, p_lo=p_lo, p_hi=p_hi, wl=wl, ww=ww))
+    print(f"   ✅ [normalize_to_unit] {'命中缓存' if hit else '完成'}，耗时: {time.time()-norm_start:.2f}s")
 
     # ε 从 8-bit 量纲换算到 [0,1]（注意：阈在 σ² 上 → 除以 255²）
     epsilon_unit = float(epsilon_8bit) / (255.0 * 255.0)
@@ -426,9 +609,12 @@ def enhance_xray_poisson_nlm_strict(R16,
     # Step1：梯度场增强
     print(f"   📊 [adaptive_gradient_enhance_unit] 开始梯度场增强...")
     step1_start = time.time()
-    Gx_p, Gy_p = adaptive_gradient_enhance_unit(R_unit, epsilon_unit=epsilon_unit,
-                                                mu=mu, ksize_var=ksize_var)
-    print(f"   ✅ [adaptive_gradient_enhance_unit] 完成，耗时: {time.time()-step1_start:.2f}s")
+    (Gx_p, Gy_p), hit = _cached_stage(
+        stage_cache, "step1", step1_key,
+        lambda: tuple(adaptive_gradient_enhance_unit(R_unit, epsilon_unit=epsilon_unit,
+                                                     mu=mu, ksize_var=ksize_var,
+                                                     use_cpp=use_cpp_step1)))
+    print(f"   ✅ [adaptive_gradient_enhance_unit] {'命中缓存' if hit else '完成'}，耗时: {time.time()-step1_start:.2f}s")
 
     if progress_callback:
         progress_callback(0.4)
@@ -444,45 +630,72 @@ def enhance_xray_poisson_nlm_strict(R16,
         use_fast_mode = use_fast_nlm
         print(f"      用户指定: 使用{'快速' if use_fast_mode else '原始'}模式")
 
-    if use_fast_mode:
-        print(f"   🚀 [fast_nlm] 使用快速NLM处理（基于skimage）...")
-        print(f"      原因: {'自动检测大图像' if use_fast_nlm is None else '用户指定'}")
-        step2_start = time.time()
+    def run_nlm():
+        if use_fast_mode:
+            print(f"   🚀 [fast_nlm] 使用快速NLM处理（基于skimage）...")
+            print(f"      原因: {'自动检测大图像' if use_fast_nlm is None else '用户指定'}")
 
-        # 参数映射：search_radius -> patch_distance, patch_radius -> patch_size
-        patch_size = max(3, patch_radius * 2 + 1)  # 最小3，1 -> 3, 2 -> 5
-        patch_distance = max(5, search_radius * 2 + 3)  # 最小5，1 -> 5, 2 -> 7
+            # 参数映射：search_radius -> patch_distance, patch_radius -> patch_size
+            patch_size = max(3, patch_radius * 2 + 1)  # 最小3，1 -> 3, 2 -> 5
+            patch_distance = max(5, search_radius * 2 + 3)  # 最小5，1 -> 5, 2 -> 7
 
-        # 关键修复：进一步优化h值，避免马赛克效应
-        # 对于梯度场，h值需要更精细调整
-        h = 0.0001  # 进一步降低到0.0001，减少马赛克效应
+            # 关键修复：进一步优化h值，避免马赛克效应
+            # 对于梯度场，h值需要更精细调整
+            h = 0.0001  # 进一步降低到0.0001，减少马赛克效应
 
-        print(f"      🔧 参数映射: patch_size={patch_size}, patch_distance={patch_distance}, h={h}")
+            print(f"      🔧 参数映射: patch_size={patch_size}, patch_distance={patch_distance}, h={h}")
 
-        Gx, Gy = fast_nlm_on_gradient(Gx_p, Gy_p,
-                                      patch_size=patch_size,
-                                      patch_distance=patch_distance,
-                                      h=h, fast_mode=True,
-                                      progress_callback=progress_callback)
-    else:
+            return tuple(fast_nlm_on_gradient(Gx_p, Gy_p,
+                                              patch_size=patch_size,
+                                              patch_distance=patch_distance,
+                                              h=h, fast_mode=True,
+                                              progress_callback=progress_callback))
         print(f"   📊 [poisson_nlm_on_gradient_exact] 使用原始泊松NLM处理...")
         print(f"      参数: search_radius={search_radius}, patch_radius={patch_radius}, topk={topk}")
-        step2_start = time.time()
-        Gx, Gy = poisson_nlm_on_gradient_exact(Gx_p, Gy_p,
-                                               search_radius=search_radius,
-                                               patch_radius=patch_radius,
-                                               rho=rho,
-                                               count_target_mean=count_target_mean,
-                                               lam_quant=lam_quant,
-                                               topk=topk,
-                                               progress_callback=progress_callback)
-
-    print(f"   ✅ [NLM处理] 完成，耗时: {time.time()-step2_start:.2f}s")
+        nlm_progress = None
+        if progress_callback:
+            nlm_progress = lambda done, total: progress_callback(0.4 + 0.4 * done / max(total, 1))
+        if use_offset_engine:
+            print(f"      C++ 位移引擎（engine='offset'）")
+            res = nlm_cpp(Gx_p, Gy_p,
+                          search_radius=int(search_radius), patch_radius=int(patch_radius),
+                          rho=float(rho), count_target_mean=float(count_target_mean),
+                          lam_quant=float(lam_quant), topk=0,
+                          engine="offset", progress_callback=nlm_progress)
+            return res[0], res[1]
+        if use_pyramid_engine:
+            guide = pyramid_guide_level(pyramid, Gx_p.shape, levels=1)
+            print(f"      C++ 金字塔引擎（engine='pyramid'，粗层{'复用金字塔第 1 级' if guide is not None else '由 λ̂ 缩小'}）")
+            res = nlm_cpp(Gx_p, Gy_p,
+                          search_radius=int(search_radius), patch_radius=int(patch_radius),
+                          rho=float(rho), count_target_mean=float(count_target_mean),
+                          lam_quant=float(lam_quant), topk=int(topk),
+                          engine="pyramid", pyramid_levels=1, guide=guide,
+                          progress_callback=nlm_progress)
+            return res[0], res[1]
+        return tuple(poisson_nlm_on_gradient_exact(Gx_p, Gy_p,
+                                                   search_radius=search_radius,
+                                                   patch_radius=patch_radius,
+                                                   rho=rho,
+                                                   count_target_mean=count_target_mean,
+                                                   lam_quant=lam_quant,
+                                                   topk=topk,
+                                                   progress_callback=progress_callback))
+
+    # 金字塔引擎的粗层引导图取自同一幅图的 ImagePyramid，键里只需记录是否可用
+    nlm_key = step1_key + (bool(use_fast_mode), bool(use_offset_engine), bool(use_pyramid_engine),
+                           use_pyramid_engine and pyramid_guide_level(pyramid, R16.shape, levels=1) is not None,
+                           float(rho), int(search_radius), int(patch_radius), topk,
+                           float(count_target_mean), float(lam_quant))
+    step2_start = time.time()
+    (Gx, Gy), hit = _cached_stage(stage_cache, "nlm", nlm_key, run_nlm)
+
+    print(f"   ✅ [NLM处理] {'命中缓存' if hit else '完成'}，耗时: {time.time()-step2_start:.2f}s")
 
     if progress_callback:
         progress_callback(0.8)
 
-    # Step3：变分重建（在 [0,1] 做）
+    # Step3：变分重建（在 [0,1] 做）；最终输出不进阶段缓存，调用方拿到的是新的可写数组
     print(f"   📊 [variational_reconstruct_unit] 开始变分重建...")
     step3_start = time.time()
     I_unit = variational_reconstruct_unit(R_unit, Gx, Gy,
@@ -545,8 +758,26 @@ def enhance_xray_poisson_nlm_strict_tiled_cpp(
     count_target_mean=30.0, lam_quant=0.02, topk=25,
     gamma=0.2, delta=0.8, iters=6, dt=0.15,
     out_dtype=np.uint16,
+    return_lambda=False,
+    max_tiles_in_flight=0,
+    progress_callback=None,
+    cancel_flag=None,
+    engine="patch",
+    precision="double",
 ):
-    """严格的论文算法实现（C++加速，分块处理）"""
+    """严格的论文算法实现（C++加速，分块处理）
+
+    return_lambda=True 时额外返回拼接好的 λ̄ 图（C++ 内核顺带算出，无需重算）。
+    max_tiles_in_flight：C++ 流水线中并发处理的分块数上限（控制峰值内存），0 为自动。
+    progress_callback(done, total)：按已完成分块数回调，显式返回 False 即取消。
+    cancel_flag：单字节可写数组（如 np.zeros(1, np.uint8)），置 1 即取消；
+    取消时抛出 InterruptedError（C++ 路径为其子类 poisson_nlm_cpp.CancelledError）。
+    engine：NLM 引擎，"patch" 逐块计算（支持 topk），"offset" 按位移盒求和（更快，须 topk=0/None）。
+    precision：NLM 权重与加权和的精度，"double"（参考）或 "float32"（单精度 + 快速 exp），
+    上线前可用 poisson_nlm_cpp.validate_nlm_precision_cpp 核对两者的最大偏差。
+    uint16 输入、输出且不要 λ̄ 时整条流水线在 C++ 内完成（与逐阶段 C++ 调用逐位一致，见 tests/test_pipeline_parity.py）；
+    其余情况走下面的 Python 分块循环，归一化用 numpy float32 计算，与 C++ 流水线可在末位舍入上不同。
+    """
     if nlm_cpp is None:
         raise RuntimeError(
             f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}\n"
@@ -556,29 +787,271 @@ def enhance_xray_poisson_nlm_strict_tiled_cpp(
     H, W = int(R16.shape[0]), int(R16.shape[1])
     tile_h, tile_w = int(tile[0]), int(tile[1])
 
+    if (pipeline_cpp is not None and not return_lambda
+            and R16.dtype == np.uint16 and out_dtype == np.uint16):
+        # 整条流水线（归一化→Step1→NLM→Step3→反归一化）一次进入 C++，期间释放 GIL
+        return pipeline_cpp(
+            R16,
+            norm_mode=norm_mode, p_lo=float(p_lo), p_hi=float(p_hi), wl=wl, ww=ww,
+            tile=(tile_h, tile_w), overlap=int(overlap),
+            epsilon_8bit=float(epsilon_8bit), mu=float(mu), ksize_var=int(ksize_var),
+            search_radius=int(search_radius), patch_radius=int(patch_radius), rho=float(rho),
+            count_target_mean=float(count_target_mean), lam_quant=float(lam_quant),
+            topk=int(topk if topk is not None else 0),
+            gamma=float(gamma), delta=float(delta), iters=int(iters), dt=float(dt),
+            max_tiles_in_flight=int(max_tiles_in_flight), engine=engine, precision=precision,
+            progress_callback=progress_callback, cancel_flag=cancel_flag,
+        )
+
     R_unit, nctx = normalize_to_unit(R16, mode=norm_mode, p_lo=p_lo, p_hi=p_hi, wl=wl, ww=ww)
     epsilon_unit = float(epsilon_8bit) / (255.0 * 255.0)
     I_unit_out = np.zeros_like(R_unit, dtype=np.float32)
+    lam_bar_out = np.zeros_like(R_unit, dtype=np.float32) if return_lambda else None
 
-    for (in_y, in_x), (core_y, core_x), (core_rel_y, core_rel_x) in _iter_tiles(H, W, tile_h, tile_w, overlap):
-        R_sub = R_unit[in_y, in_x].copy()
-        Gx_p, Gy_p = adaptive_gradient_enhance_unit(R_sub,
-                                                    epsilon_unit=epsilon_unit,
-                                                    mu=mu, ksize_var=ksize_var)
-        Gx, Gy, _ = nlm_cpp(
-            Gx_p.astype(np.float32), Gy_p.astype(np.float32),
+    tiles = list(_iter_tiles(H, W, tile_h, tile_w, overlap))
+    out_bufs = {}  # 按块形状复用 C++ 输出缓冲（核心区随即拷出，可安全覆盖）
+    for ti, ((in_y, in_x), (core_y, core_x), (core_rel_y, core_rel_x)) in enumerate(tiles):
+        if cancel_flag is not None and cancel_flag[0]:
+            raise InterruptedError("operation cancelled")
+        R_sub = R_unit[in_y, in_x]  # 视图即可：C++ 端按行跨度直接读取，不再拷贝
+        Gmag = None
+        if step1_cpp is not None:
+            # |G'| 随 Step1 一并算出，交给 NLM 的 λ 预处理
+            Gx_p, Gy_p, Gmag = step1_cpp(R_sub, epsilon_unit=epsilon_unit, mu=float(mu),
+                                         ksize_var=int(ksize_var), return_magnitude=True)
+        else:
+            Gx_p, Gy_p = adaptive_gradient_enhance_unit(R_sub,
+                                                        epsilon_unit=epsilon_unit,
+                                                        mu=mu, ksize_var=ksize_var)
+        if R_sub.shape not in out_bufs:
+            out_bufs[R_sub.shape] = np.empty(R_sub.shape, dtype=np.float32)
+        # Step2 + Step3 在 C++ 内一次完成，Gx/Gy 不回到 Python
+        res = nlm_recon_cpp(
+            R_sub, Gx_p.astype(np.float32, copy=False), Gy_p.astype(np.float32, copy=False),
             int(search_radius), int(patch_radius),
             float(rho), float(count_target_mean),
-            float(lam_quant), int(topk if topk is not None else 0)
+            float(lam_quant), int(topk if topk is not None else 0),
+            float(gamma), float(delta), int(iters), float(dt),
+            return_lambda=bool(return_lambda), engine=engine, precision=precision,
+            I_out=out_bufs[R_sub.shape], grad_mag=Gmag,
         )
-        I_sub = variational_reconstruct_unit(
-            R_sub.astype(np.float32), Gx, Gy,
-            gamma=float(gamma), delta=float(delta),
-            iters=int(iters), dt=float(dt)
-        ).astype(np.float32)
+        I_sub = res[0]
+        if return_lambda:
+            lam_bar_out[core_y, core_x] = res[2][core_rel_y, core_rel_x]
         I_unit_out[core_y, core_x] = I_sub[core_rel_y, core_rel_x]
+        if progress_callback is not None and progress_callback(ti + 1, len(tiles)) is False:
+            raise InterruptedError("operation cancelled")
 
-    I16 = denormalize_from_unit(I_unit_out, nctx, out_dtype=out_dtype, mode="window")
+    I16 = denormalize_from_unit(I_unit_out, nctx, out_dtype=out_dtype)
+    if return_lambda:
+        return I16, lam_bar_out
     return I16
 
 
+def reprocess_dirty_region_tiled_cpp(
+    R16, out, dirty_rect, norm_range=None,
+    norm_mode="percentile", p_lo=0.5, p_hi=99.5, wl=None, ww=None,
+    tile=(1024, 1024), overlap=32,
+    epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+    search_radius=2, patch_radius=1, rho=1.5,
+    count_target_mean=30.0, lam_quant=0.02, topk=25,
+    gamma=0.2, delta=0.8, iters=6, dt=0.15,
+    max_tiles_in_flight=0,
+    progress_callback=None,
+    cancel_flag=None,
+    engine="patch",
+    precision="double",
+):
+    """局部编辑后的增量重算（C++ 流水线）
+
+    R16 为编辑后的整幅图像，out 为同一组参数下 enhance_xray_poisson_nlm_strict_tiled_cpp 的上一次结果，
+    原地更新；dirty_rect = (y0, y1, x0, x1) 为编辑过的像素区域。只重跑输入区域（核心 + overlap halo）
+    与脏区相交的分块，结果与整幅重算逐位一致。
+    norm_range：上一次结果的归一化区间 (vmin, vmax)（可由 pipeline_normalization_range_cpp 在编辑前取得）；
+    编辑使区间改变时所有像素都受影响，退回整幅重算。省略时按编辑后的图像计算，视为未变。
+
+    Returns:
+        (out, norm_range, tiles)：tiles 为重跑的分块数（整幅重算时为 -1）
+    """
+    if region_cpp is None:
+        raise RuntimeError(
+            f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}\n"
+            "请先编译 poisson_nlm_cpp（pybind11 + OpenMP），或检查 PYTHONPATH。"
+        )
+    params = dict(tile=(int(tile[0]), int(tile[1])), overlap=int(overlap),
+                  epsilon_8bit=float(epsilon_8bit), mu=float(mu), ksize_var=int(ksize_var),
+                  search_radius=int(search_radius), patch_radius=int(patch_radius), rho=float(rho),
+                  count_target_mean=float(count_target_mean), lam_quant=float(lam_quant),
+                  topk=int(topk if topk is not None else 0),
+                  gamma=float(gamma), delta=float(delta), iters=int(iters), dt=float(dt),
+                  max_tiles_in_flight=int(max_tiles_in_flight), engine=engine, precision=precision,
+                  progress_callback=progress_callback, cancel_flag=cancel_flag)
+    vr = norm_range_cpp(R16, norm_mode=norm_mode, p_lo=float(p_lo), p_hi=float(p_hi), wl=wl, ww=ww)
+    if norm_range is not None and tuple(map(float, norm_range)) != tuple(vr):
+        pipeline_cpp(R16, norm_mode=norm_mode, p_lo=float(p_lo), p_hi=float(p_hi), wl=wl, ww=ww,
+                     out=out, **params)
+        invalidate_histogram_stats(out)  # out 被原地改写，共享直方图统计随之作废
+        return out, vr, -1
+    y0, y1, x0, x1 = (int(v) for v in dirty_rect)
+    tiles = region_cpp(R16, out, (y0, y1, x0, x1), float(vr[0]), float(vr[1]), **params)
+    invalidate_histogram_stats(out)
+    return out, vr, tiles
+
+
+def process_batch(frames,
+                  norm_mode="percentile", p_lo=0.5, p_hi=99.5, wl=None, ww=None,
+                  tile=(1024, 1024), overlap=32,
+                  epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+                  search_radius=2, patch_radius=1, rho=1.5,
+                  count_target_mean=30.0, lam_quant=0.02, topk=25,
+                  gamma=0.2, delta=0.8, iters=6, dt=0.15,
+                  outs=None,
+                  progress_callback=None,
+                  cancel_flag=None,
+                  engine="patch",
+                  precision="double"):
+    """多帧批处理（C++ 流水线，所有帧的分块在常驻线程池上统一调度，期间释放 GIL）
+
+    frames：uint16 二维数组列表，形状可各不相同；每帧结果与单独调用
+    enhance_xray_poisson_nlm_strict_tiled_cpp 逐位一致。小帧逐个调用时核心用不满，批处理按分块平铺后接近线性扩展。
+    outs：可选的输出缓冲列表（与 frames 等长，元素可为 None）。
+    progress_callback(done, total)：按全部帧的已完成分块数回调，显式返回 False 即取消。
+
+    Returns:
+        (results, timings)：timings 为每帧一个 dict（shape、tiles、norm_ms、compute_ms、start_ms、end_ms、wall_ms）
+    """
+    if batch_cpp is None:
+        raise RuntimeError(
+            f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}\n"
+            "请先编译 poisson_nlm_cpp（pybind11 + OpenMP），或检查 PYTHONPATH。"
+        )
+    return batch_cpp(
+        list(frames),
+        norm_mode=norm_mode, p_lo=float(p_lo), p_hi=float(p_hi), wl=wl, ww=ww,
+        tile=(int(tile[0]), int(tile[1])), overlap=int(overlap),
+        epsilon_8bit=float(epsilon_8bit), mu=float(mu), ksize_var=int(ksize_var),
+        search_radius=int(search_radius), patch_radius=int(patch_radius), rho=float(rho),
+        count_target_mean=float(count_target_mean), lam_quant=float(lam_quant),
+        topk=int(topk if topk is not None else 0),
+        gamma=float(gamma), delta=float(delta), iters=int(iters), dt=float(dt),
+        engine=engine, precision=precision,
+        progress_callback=progress_callback, cancel_flag=cancel_flag, outs=outs,
+    )
+
+
+# -------- 渐进式预览：先处理金字塔低分辨率层，再从视口中心向外逐块细化全分辨率 --------
+PREVIEW_MAX_PIXELS = 512 * 512  # 预览层像素上限：只限定低分辨率层上的流水线，全分辨率的归一化直方图与缩放另计
+
+
+def preview_level_for(shape, view_scale=1.0, max_pixels=PREVIEW_MAX_PIXELS, min_size=64):
+    """预览所用的金字塔级别：不低于当前缩放所需的级别（同 ImagePyramid.get_optimal_level），
+    且像素数不超过 max_pixels；边长不小于 min_size"""
+    H, W = int(shape[0]), int(shape[1])
+    level = 0 if view_scale is None or view_scale >= 1.0 else int(np.log2(1.0 / view_scale))
+    while ((H >> level) * (W >> level) > max_pixels
+           and min(H >> (level + 1), W >> (level + 1)) >= min_size):
+        level += 1
+    while level > 0 and min(H >> level, W >> level) < min_size:
+        level -= 1
+    return level
+
+
+def enhance_progressive_tiled_cpp(
+    R16, publish,
+    viewport=None, view_scale=1.0, pyramid=None,
+    preview_max_pixels=PREVIEW_MAX_PIXELS, batch_tiles=0,
+    norm_mode="percentile", p_lo=0.5, p_hi=99.5, wl=None, ww=None,
+    tile=(1024, 1024), overlap=32,
+    epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+    search_radius=2, patch_radius=1, rho=1.5,
+    count_target_mean=30.0, lam_quant=0.02, topk=25,
+    gamma=0.2, delta=0.8, iters=6, dt=0.15,
+    max_tiles_in_flight=0,
+    cancel_flag=None,
+    engine="patch",
+    precision="double",
+):
+    """渐进式执行 C++ 流水线，最终结果与 enhance_xray_poisson_nlm_strict_tiled_cpp 逐位一致
+
+    1. 在低分辨率层（ImagePyramid 中对应级别，或按 INTER_AREA 缩小）上跑整条流水线，
+       归一化区间取自全分辨率图像，放大到原尺寸后作为预览发布；
+    2. 全分辨率分块按到视口中心的距离由近到远分批细化，每批写回后发布一次。
+    publish(image, stage, done, total)：stage 为 "preview" / "refine"，image 为整幅 uint16 结果缓冲
+    （后续批次会继续原地改写，需要保留时自行拷贝；没有预览层时尚未细化的分块为原图）；显式返回 False 即取消。
+    viewport = (y0, y1, x0, x1)：当前可见区域（全分辨率坐标），第一批只含与之相交的分块；省略时取图像中心。
+    view_scale：当前显示缩放，决定预览层级；batch_tiles：后续每批的分块数，0 为自动（硬件线程数）。
+
+    Returns:
+        整幅 uint16 结果
+    """
+    if tiles_cpp is None:
+        raise RuntimeError(
+            f"[Poisson NLM C++] 扩展未就绪: {repr(_cpp_import_error)}\n"
+            "请先编译 poisson_nlm_cpp（pybind11 + OpenMP），或检查 PYTHONPATH。"
+        )
+    H, W = int(R16.shape[0]), int(R16.shape[1])
+    tile = (int(tile[0]), int(tile[1]))
+    params = dict(overlap=int(overlap),
+                  epsilon_8bit=float(epsilon_8bit), mu=float(mu), ksize_var=int(ksize_var),
+                  search_radius=int(search_radius), patch_radius=int(patch_radius), rho=float(rho),
+                  count_target_mean=float(count_target_mean), lam_quant=float(lam_quant),
+                  topk=int(topk if topk is not None else 0),
+                  gamma=float(gamma), delta=float(delta), iters=int(iters), dt=float(dt),
+                  max_tiles_in_flight=int(max_tiles_in_flight), engine=engine, precision=precision,
+                  cancel_flag=cancel_flag)
+    vmin, vmax = norm_range_cpp(R16, norm_mode=norm_mode, p_lo=float(p_lo), p_hi=float(p_hi), wl=wl, ww=ww)
+
+    order = tile_order_cpp(H, W, ((H - 1) / 2.0, (W - 1) / 2.0) if viewport is None else
+                           ((viewport[0] + viewport[1]) / 2.0, (viewport[2] + viewport[3]) / 2.0),
+                           tile=tile, overlap=int(overlap))
+    total = len(order)
+
+    # 预览：低分辨率层的分块按同样的 tile/overlap 切分（层越小块越少）
+    out = None
+    level = preview_level_for((H, W), view_scale, preview_max_pixels)
+    if level > 0:
+        Hl, Wl = H >> level, W >> level
+        low = pyramid_guide_level(pyramid, (H, W), levels=level)
+        if low is None:
+            low = cv2.resize(R16, (Wl, Hl), interpolation=cv2.INTER_AREA)
+        low_out = tiles_cpp(low, None, float(vmin), float(vmax), tile=tile, **params)
+        out = cv2.resize(low_out, (W, H), interpolation=cv2.INTER_LINEAR)
+        if publish(out, "preview", 0, total) is False:
+            raise InterruptedError("operation cancelled")
+    if out is None:
+        # 没有预览层（图像过小）时先以原图填充，尚未细化的分块显示原图而不是未初始化内存
+        out = np.array(R16, dtype=np.uint16, order="C")
+
+    # 细化：第一批为与视口相交的分块，其余按距离分批
+    if viewport is not None:
+        y0, y1, x0, x1 = (int(v) for v in viewport)
+        visible = set(region_tile_indices(H, W, (y0, y1, x0, x1), tile, int(overlap)))
+        first = [i for i in order if i in visible]
+    else:
+        first = []
+    first_set = set(first)
+    rest = [i for i in order if i not in first_set]
+    batch = int(batch_tiles) if batch_tiles and batch_tiles > 0 else max(1, os.cpu_count() or 1)
+    batches = ([first] if first else []) + [rest[k:k + batch] for k in range(0, len(rest), batch)]
+
+    done = 0
+    for idx in batches:
+        if cancel_flag is not None and cancel_flag[0]:
+            raise InterruptedError("operation cancelled")
+        tiles_cpp(R16, idx, float(vmin), float(vmax), tile=tile, out=out, **params)
+        # 同一缓冲逐批原地改写：发布前作废共享直方图统计，显示端拿到的统计总与当前内容一致
+        invalidate_histogram_stats(out)
+        done += len(idx)
+        if publish(out, "refine", done, total) is False:
+            raise InterruptedError("operation cancelled")
+    return out
+
+
+def region_tile_indices(H, W, rect, tile=(1024, 1024), overlap=32):
+    """核心区域与 rect = (y0, y1, x0, x1) 相交的分块下标（同 _iter_tiles 的遍历顺序）"""
+    y0, y1, x0, x1 = rect
+    hits = []
+    for i, (_, (core_y, core_x), _) in enumerate(_iter_tiles(H, W, int(tile[0]), int(tile[1]), int(overlap))):
+        if core_y.start < y1 and y0 < core_y.stop and core_x.start < x1 and x0 < core_x.stop:
+            hits.append(i)
+    return hits
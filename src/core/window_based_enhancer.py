@@ -6,6 +6,16 @@ import numpy as np
 import cv2
 from typing import Optional, Callable
 
+# 尝试导入C++扩展（统计一遍归约，ROI 权重、细节与光照融合在条带内完成）
+try:
+    from poisson_nlm_cpp import window_enhance_prepare_cpp as prepare_cpp
+    from poisson_nlm_cpp import window_enhance_finish_cpp as finish_cpp
+except Exception:
+    prepare_cpp = None
+    finish_cpp = None
+
+from .histogram_stats import get_histogram_stats
+
 
 class WindowBasedEnhancer:
     """基于窗宽窗位的DICOM图像增强处理器"""
@@ -20,6 +30,10 @@ class WindowBasedEnhancer:
         Returns:
             tuple: (effective_min, effective_max)
         """
+        stats = get_histogram_stats(data)
+        if stats is not None:
+            return stats.effective_range()
+
         data_min = int(data.min())
         data_max = int(data.max())
         total_pixels = data.size
@@ -81,7 +95,8 @@ class WindowBasedEnhancer:
     
     @staticmethod
     def window_based_enhance(data: np.ndarray, window_width: float, window_level: float, 
-                           progress_callback: Optional[Callable] = None) -> np.ndarray:
+                           progress_callback: Optional[Callable] = None,
+                           verbose: bool = False) -> np.ndarray:
         """
         基于窗宽窗位的缺陷检测增强算法
         
@@ -90,6 +105,7 @@ class WindowBasedEnhancer:
             window_width: 窗宽
             window_level: 窗位
             progress_callback: 进度回调函数
+            verbose: 是否打印调试统计（额外的全图统计只在此时计算）
             
         Returns:
             增强后的图像数据
@@ -98,12 +114,17 @@ class WindowBasedEnhancer:
             if progress_callback:
                 progress_callback(5)
 
-            print(f"\n🔍 窗位增强Debug日志:")
-            print(f"   输入数据范围: {data.min()} - {data.max()}")
-            print(f"   输入数据均值: {data.mean():.2f}")
-            print(f"   输入数据标准差: {data.std():.2f}")
-            print(f"   窗宽: {window_width}, 窗位: {window_level}")
-            print(f"   🔧 使用全范围处理策略（避免动态范围压缩）")
+            if prepare_cpp is not None and data.ndim == 2:
+                return WindowBasedEnhancer._window_based_enhance_cpp(
+                    data, window_width, window_level, progress_callback, verbose)
+
+            if verbose:
+                print(f"\n🔍 窗位增强Debug日志:")
+                print(f"   输入数据范围: {data.min()} - {data.max()}")
+                print(f"   输入数据均值: {data.mean():.2f}")
+                print(f"   输入数据标准差: {data.std():.2f}")
+                print(f"   窗宽: {window_width}, 窗位: {window_level}")
+                print(f"   🔧 使用全范围处理策略（避免动态范围压缩）")
 
             # 1. 检测感兴趣区域（用于自适应处理，但不裁剪数据）
             wl_min = window_level - window_width / 2
@@ -111,8 +132,9 @@ class WindowBasedEnhancer:
             roi_mask = (data >= wl_min) & (data <= wl_max)
             roi_ratio = np.sum(roi_mask) / data.size
 
-            print(f"   感兴趣区域: {wl_min} - {wl_max}")
-            print(f"   感兴趣像素比例: {roi_ratio*100:.1f}%")
+            if verbose:
+                print(f"   感兴趣区域: {wl_min} - {wl_max}")
+                print(f"   感兴趣像素比例: {roi_ratio*100:.1f}%")
 
             if progress_callback:
                 progress_callback(15)
@@ -122,10 +144,11 @@ class WindowBasedEnhancer:
             data_max = float(data.max())
             img_norm = (data.astype(np.float32) - data_min) / (data_max - data_min)
 
-            print(f"   全范围归一化: {data_min} - {data_max}")
-            print(f"   归一化后范围: {img_norm.min():.4f} - {img_norm.max():.4f}")
-            print(f"   归一化后均值: {img_norm.mean():.4f}")
-            print(f"   归一化后标准差: {img_norm.std():.4f}")
+            if verbose:
+                print(f"   全范围归一化: {data_min} - {data_max}")
+                print(f"   归一化后范围: {img_norm.min():.4f} - {img_norm.max():.4f}")
+                print(f"   归一化后均值: {img_norm.mean():.4f}")
+                print(f"   归一化后标准差: {img_norm.std():.4f}")
 
             # 3. 创建感兴趣区域的权重图（用于自适应增强）
             roi_weight = np.zeros_like(img_norm)
@@ -133,7 +156,8 @@ class WindowBasedEnhancer:
             # 对权重图进行高斯模糊，创建平滑过渡
             roi_weight = cv2.GaussianBlur(roi_weight, (21, 21), 7)
 
-            print(f"   感兴趣区域权重范围: {roi_weight.min():.4f} - {roi_weight.max():.4f}")
+            if verbose:
+                print(f"   感兴趣区域权重范围: {roi_weight.min():.4f} - {roi_weight.max():.4f}")
 
             if progress_callback:
                 progress_callback(25)
@@ -147,8 +171,9 @@ class WindowBasedEnhancer:
             noise_level = np.mean(roi_var) if len(roi_var) > 0 else np.mean(var_map)
             high_noise_ratio = np.sum(roi_var > 0.5) / len(roi_var) if len(roi_var) > 0 else 0
 
-            print(f"   感兴趣区域噪声水平: {noise_level:.4f}")
-            print(f"   感兴趣区域高噪声比例: {high_noise_ratio*100:.1f}%")
+            if verbose:
+                print(f"   感兴趣区域噪声水平: {noise_level:.4f}")
+                print(f"   感兴趣区域高噪声比例: {high_noise_ratio*100:.1f}%")
 
             # 5. 自适应多尺度高频增强
             blur_small = cv2.GaussianBlur(img_norm, (0, 0), 1)
@@ -156,19 +181,23 @@ class WindowBasedEnhancer:
             blur_large = cv2.GaussianBlur(img_norm, (0, 0), 5)
             high_freq_large = img_norm - blur_large
 
-            print(f"   小尺度高频范围: {high_freq_small.min():.4f} - {high_freq_small.max():.4f}")
-            print(f"   大尺度高频范围: {high_freq_large.min():.4f} - {high_freq_large.max():.4f}")
+            if verbose:
+                print(f"   小尺度高频范围: {high_freq_small.min():.4f} - {high_freq_small.max():.4f}")
+                print(f"   大尺度高频范围: {high_freq_large.min():.4f} - {high_freq_large.max():.4f}")
 
             # 根据噪声水平调整增强强度
             if noise_level > 0.1:
                 base_strength_small, base_strength_large = 0.8, 0.4
-                print(f"   🔧 检测到高噪声，使用保守增强")
+                if verbose:
+                    print(f"   🔧 检测到高噪声，使用保守增强")
             elif noise_level > 0.05:
                 base_strength_small, base_strength_large = 1.2, 0.6
-                print(f"   🔧 检测到中等噪声，使用中等增强")
+                if verbose:
+                    print(f"   🔧 检测到中等噪声，使用中等增强")
             else:
                 base_strength_small, base_strength_large = 1.5, 0.8
-                print(f"   🔧 检测到低噪声，使用正常增强")
+                if verbose:
+                    print(f"   🔧 检测到低噪声，使用正常增强")
 
             # 使用权重图进行空间自适应增强
             # 感兴趣区域内：使用设定的增强强度
@@ -176,14 +205,16 @@ class WindowBasedEnhancer:
             strength_small = base_strength_small * roi_weight + 0.3 * (1 - roi_weight)
             strength_large = base_strength_large * roi_weight + 0.2 * (1 - roi_weight)
 
-            print(f"   空间自适应增强: ROI内={base_strength_small:.1f}/{base_strength_large:.1f}, ROI外=0.3/0.2")
+            if verbose:
+                print(f"   空间自适应增强: ROI内={base_strength_small:.1f}/{base_strength_large:.1f}, ROI外=0.3/0.2")
 
             # 应用空间自适应增强
             img_detail = img_norm + strength_small * high_freq_small + strength_large * high_freq_large
             img_detail = np.clip(img_detail, 0, 1)
 
-            print(f"   增强后范围: {img_detail.min():.4f} - {img_detail.max():.4f}")
-            print(f"   增强后均值: {img_detail.mean():.4f}")
+            if verbose:
+                print(f"   增强后范围: {img_detail.min():.4f} - {img_detail.max():.4f}")
+                print(f"   增强后均值: {img_detail.mean():.4f}")
 
             if progress_callback:
                 progress_callback(45)
@@ -191,21 +222,24 @@ class WindowBasedEnhancer:
             # 5. 安全的光照归一化（防止数值爆炸）
             illum = cv2.GaussianBlur(img_detail, (0, 0), 50)
 
-            print(f"   光照归一化前: {img_detail.min():.4f} - {img_detail.max():.4f}")
-            print(f"   光照图范围: {illum.min():.4f} - {illum.max():.4f}")
+            if verbose:
+                print(f"   光照归一化前: {img_detail.min():.4f} - {img_detail.max():.4f}")
+                print(f"   光照图范围: {illum.min():.4f} - {illum.max():.4f}")
 
             # 安全的光照归一化：限制除法结果
             illum_safe = np.clip(illum, 0.1, 1.0)  # 防止除以过小的数
             img_light_norm = img_detail / illum_safe
             img_light_norm = np.clip(img_light_norm, 0, 2.0)  # 限制最大值为2倍
 
-            print(f"   安全光照归一化后: {img_light_norm.min():.4f} - {img_light_norm.max():.4f}")
+            if verbose:
+                print(f"   安全光照归一化后: {img_light_norm.min():.4f} - {img_light_norm.max():.4f}")
 
             # 弱化光照归一化效果，主要保留原图
             img_light_norm = 0.3 * img_light_norm + 0.7 * img_detail  # 降低光照归一化权重
             img_light_norm = np.clip(img_light_norm, 0, 1)
 
-            print(f"   混合后范围: {img_light_norm.min():.4f} - {img_light_norm.max():.4f}")
+            if verbose:
+                print(f"   混合后范围: {img_light_norm.min():.4f} - {img_light_norm.max():.4f}")
 
             if progress_callback:
                 progress_callback(65)
@@ -216,9 +250,11 @@ class WindowBasedEnhancer:
             else:
                 gamma = 0.8  # 低噪声：正常gamma
 
-            print(f"   Gamma值: {gamma}")
+            if verbose:
+                print(f"   Gamma值: {gamma}")
             img_gamma = np.power(img_light_norm, gamma)
-            print(f"   Gamma调整后: {img_gamma.min():.4f} - {img_gamma.max():.4f}")
+            if verbose:
+                print(f"   Gamma调整后: {img_gamma.min():.4f} - {img_gamma.max():.4f}")
 
             if progress_callback:
                 progress_callback(80)
@@ -230,17 +266,20 @@ class WindowBasedEnhancer:
                 # 高噪声：非常温和的CLAHE
                 clip_limit = 1.2
                 tile_size = (16, 16)
-                print(f"   🔧 高噪声模式：温和CLAHE clipLimit={clip_limit}, tileSize={tile_size}")
+                if verbose:
+                    print(f"   🔧 高噪声模式：温和CLAHE clipLimit={clip_limit}, tileSize={tile_size}")
             else:
                 # 低噪声：温和CLAHE
                 clip_limit = 1.5
                 tile_size = (8, 8)
-                print(f"   🔧 正常模式：温和CLAHE clipLimit={clip_limit}, tileSize={tile_size}")
+                if verbose:
+                    print(f"   🔧 正常模式：温和CLAHE clipLimit={clip_limit}, tileSize={tile_size}")
 
             clahe = cv2.createCLAHE(clipLimit=clip_limit, tileGridSize=tile_size)
             img_clahe = clahe.apply(img_16bit)
 
-            print(f"   CLAHE后范围: {img_clahe.min()} - {img_clahe.max()}")
+            if verbose:
+                print(f"   CLAHE后范围: {img_clahe.min()} - {img_clahe.max()}")
 
             if progress_callback:
                 progress_callback(95)
@@ -253,20 +292,23 @@ class WindowBasedEnhancer:
             result_float = (img_clahe.astype(np.float32) - clahe_min) / (clahe_max - clahe_min)
             result_float = result_float * (data_max - data_min) + data_min
 
-            print(f"   CLAHE范围: {clahe_min:.0f} - {clahe_max:.0f}")
-            print(f"   映射回全范围: {data_min:.0f} - {data_max:.0f}")
+            if verbose:
+                print(f"   CLAHE范围: {clahe_min:.0f} - {clahe_max:.0f}")
+                print(f"   映射回全范围: {data_min:.0f} - {data_max:.0f}")
 
             # 9. 轻微混合原图（保留质感和全范围）
             alpha = 0.85  # 增强结果权重
             result = cv2.addWeighted(result_float, alpha, data.astype(np.float32), 1 - alpha, 0)
             result = np.clip(result, data_min, data_max).astype(np.uint16)
 
-            print(f"   混合后范围: {result.min()} - {result.max()}")
+            if verbose:
+                print(f"   混合后范围: {result.min()} - {result.max()}")
 
-            print(f"   最终输出范围: {result.min()} - {result.max()}")
-            print(f"   最终输出均值: {result.mean():.2f}")
-            print(f"   最终输出标准差: {result.std():.2f}")
-            print(f"   ✅ 窗位增强完成\n")
+            if verbose:
+                print(f"   最终输出范围: {result.min()} - {result.max()}")
+                print(f"   最终输出均值: {result.mean():.2f}")
+                print(f"   最终输出标准差: {result.std():.2f}")
+                print(f"   ✅ 窗位增强完成\n")
 
             if progress_callback:
                 progress_callback(100)
@@ -276,6 +318,60 @@ class WindowBasedEnhancer:
         except Exception as e:
             raise RuntimeError(f"基于窗宽窗位的增强处理失败: {str(e)}")
     
+    @staticmethod
+    def _window_based_enhance_cpp(data: np.ndarray, window_width: float, window_level: float,
+                                  progress_callback: Optional[Callable], verbose: bool) -> np.ndarray:
+        """C++ 路径：CLAHE 前后两段各为一次融合计算，CLAHE 仍用 cv2"""
+        img_16bit, info = prepare_cpp(data, float(window_width), float(window_level), verbose=verbose)
+        noise_level = info['noise_level']
+
+        if verbose:
+            wl_min = window_level - window_width / 2
+            wl_max = window_level + window_width / 2
+            rng = info['data_max'] - info['data_min']
+            print(f"\n🔍 窗位增强Debug日志:")
+            print(f"   输入数据范围: {info['data_min']:.0f} - {info['data_max']:.0f}")
+            print(f"   输入数据均值: {info['mean']:.2f}")
+            print(f"   输入数据标准差: {info['std']:.2f}")
+            print(f"   窗宽: {window_width}, 窗位: {window_level}")
+            print(f"   感兴趣区域: {wl_min} - {wl_max}")
+            print(f"   感兴趣像素比例: {info['roi_ratio']*100:.1f}%")
+            if rng > 0:
+                print(f"   归一化后均值: {(info['mean'] - info['data_min']) / rng:.4f}")
+                print(f"   归一化后标准差: {info['std'] / rng:.4f}")
+            print(f"   感兴趣区域权重范围: {info['weight_range'][0]:.4f} - {info['weight_range'][1]:.4f}")
+            print(f"   感兴趣区域噪声水平: {noise_level:.4f}")
+            print(f"   感兴趣区域高噪声比例: {info['high_noise_ratio']*100:.1f}%")
+            print(f"   空间自适应增强: ROI内={info['strength_small']:.1f}/{info['strength_large']:.1f}, ROI外=0.3/0.2")
+            print(f"   增强后范围: {info['detail_range'][0]:.4f} - {info['detail_range'][1]:.4f}")
+            print(f"   增强后均值: {info['detail_mean']:.4f}")
+            print(f"   Gamma值: {info['gamma']}")
+
+        if progress_callback:
+            progress_callback(80)
+
+        if noise_level > 0.1:
+            clip_limit, tile_size = 1.2, (16, 16)
+        else:
+            clip_limit, tile_size = 1.5, (8, 8)
+        clahe = cv2.createCLAHE(clipLimit=clip_limit, tileGridSize=tile_size)
+        img_clahe = clahe.apply(img_16bit)
+
+        if progress_callback:
+            progress_callback(95)
+
+        result = finish_cpp(img_clahe, data, info['data_min'], info['data_max'], alpha=0.85)
+
+        if verbose:
+            print(f"   CLAHE clipLimit={clip_limit}, tileSize={tile_size}")
+            print(f"   最终输出范围: {result.min()} - {result.max()}")
+            print(f"   ✅ 窗位增强完成\n")
+
+        if progress_callback:
+            progress_callback(100)
+
+        return result
+
     @staticmethod
     def get_algorithm_info() -> dict:
         """获取算法信息"""
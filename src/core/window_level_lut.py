@@ -10,6 +10,12 @@ from typing import Dict, Tuple, Optional
 import time
 from collections import OrderedDict
 
+# 尝试导入C++扩展（一遍完成查表、反相与降采样，直接写入调用方缓冲）
+try:
+    from poisson_nlm_cpp import apply_window_lut_cpp as lut_cpp
+except Exception:
+    lut_cpp = None
+
 
 class WindowLevelLUT:
     """窗宽窗位查找表类
@@ -120,16 +126,22 @@ class WindowLevelLUT:
         # 添加新的缓存项（不需要copy，LUT是只读的）
         self.lut_cache[key] = lut
     
-    def apply_lut(self, image_data: np.ndarray, window_width: float, window_level: float) -> np.ndarray:
+    def apply_lut(self, image_data: np.ndarray, window_width: float, window_level: float,
+                  invert: bool = False, downsample: int = 1,
+                  out: Optional[np.ndarray] = None) -> np.ndarray:
         """应用查找表到图像数据
 
         Args:
             image_data: 原始图像数据
             window_width: 窗宽值
             window_level: 窗位值
+            invert: 是否反相（与查表同遍完成）
+            downsample: 1/2/4，按 2×2/4×4 面积均值降采样（尾部不足一格的行列丢弃）
+            out: 可选输出缓冲，uint8、形状 (H//downsample, W//downsample)、行内连续
+                （如 QImage 的内存，行跨度可带填充）；需要 C++ 扩展
 
         Returns:
-            np.ndarray: 处理后的8位图像数据
+            np.ndarray: 处理后的8位图像数据（给定 out 时即为 out）
         """
         if image_data is None or image_data.size == 0:
             return np.zeros((100, 100), dtype=np.uint8)
@@ -137,6 +149,12 @@ class WindowLevelLUT:
         # 获取查找表
         lut = self.get_lut(window_width, window_level)
 
+        # C++ 路径：不分配下标数组，多线程逐行查表
+        if lut_cpp is not None and image_data.ndim == 2:
+            return lut_cpp(image_data, lut, invert=invert, downsample=downsample, out=out)
+        if out is not None:
+            raise RuntimeError("apply_lut(out=...) 需要 poisson_nlm_cpp 扩展")
+
         # 高性能实现 - 平衡内存和速度
         if image_data.dtype == np.uint16:
             # 已经是正确类型，直接使用（零拷贝）
@@ -144,13 +162,28 @@ class WindowLevelLUT:
         else:
             # 需要转换类型，智能选择策略
             if image_data.size > 4 * 1024 * 1024:  # 大于4M像素才分块
-                return self._apply_lut_optimized(image_data, lut)
+                return self._finish_display(self._apply_lut_optimized(image_data, lut), invert, downsample)
             else:
                 # 中小图像直接转换（更快）
                 indices = np.clip(image_data, 0, 65535).astype(np.uint16)
 
         # 直接使用数组索引，这是最快的方法
-        return lut[indices]
+        return self._finish_display(lut[indices], invert, downsample)
+
+    @staticmethod
+    def _finish_display(windowed: np.ndarray, invert: bool, downsample: int) -> np.ndarray:
+        """numpy 回退路径的降采样与反相，结果与 C++ 路径一致"""
+        if downsample not in (1, 2, 4):
+            raise ValueError("downsample must be 1, 2 or 4")
+        if downsample > 1:
+            f = downsample
+            H, W = windowed.shape[0] // f, windowed.shape[1] // f
+            blocks = windowed[:H * f, :W * f].reshape(H, f, W, f)
+            sums = blocks.sum(axis=(1, 3), dtype=np.uint32)
+            windowed = ((sums + (f * f) // 2) // (f * f)).astype(np.uint8)
+        if invert:
+            windowed = 255 - windowed
+        return windowed
 
     def _apply_lut_optimized(self, image_data: np.ndarray, lut: np.ndarray) -> np.ndarray:
         """优化的LUT应用 - 平衡内存和性能"""
@@ -245,16 +278,20 @@ def get_global_lut() -> WindowLevelLUT:
     return _global_lut_instance
 
 
-def apply_window_level_fast(image_data: np.ndarray, window_width: float, window_level: float) -> np.ndarray:
+def apply_window_level_fast(image_data: np.ndarray, window_width: float, window_level: float,
+                            invert: bool = False, downsample: int = 1,
+                            out: Optional[np.ndarray] = None) -> np.ndarray:
     """快速应用窗宽窗位（便捷函数）
     
     Args:
         image_data: 原始图像数据
         window_width: 窗宽值
         window_level: 窗位值
+        invert/downsample/out: 同 WindowLevelLUT.apply_lut
         
     Returns:
         np.ndarray: 处理后的8位图像数据
     """
     lut = get_global_lut()
-    return lut.apply_lut(image_data, window_width, window_level)
+    return lut.apply_lut(image_data, window_width, window_level,
+                         invert=invert, downsample=downsample, out=out)
@@ -12,6 +12,7 @@ from PyQt6.QtWidgets import (QDialog, QVBoxLayout, QHBoxLayout, QPushButton,
                             QLabel, QCheckBox, QSpinBox, QGroupBox)
 from PyQt6.QtCore import Qt
 import matplotlib
+from ..core.histogram_stats import get_histogram_stats, invalidate_histogram_stats
 matplotlib.use('Qt5Agg')
 
 class HistogramWindow(QDialog):
@@ -55,7 +56,8 @@ class HistogramWindow(QDialog):
         if image is None:
             return None
         # 使用图像的形状、数据类型、均值和标准差作为快速哈希
-        # 这比计算完整哈希快得多，但足够检测图像变化
+        # 这比计算完整哈希快得多，但足够检测图像变化；直接读像素而不取共享直方图，
+        # 后者按数组对象缓存，察觉不到原地修改
         return hash((image.shape, image.dtype.name,
                     float(np.mean(image)), float(np.std(image))))
 
@@ -72,6 +74,16 @@ class HistogramWindow(QDialog):
         if cache_key in self.histogram_cache:
             return self.histogram_cache[cache_key]
 
+        stats = get_histogram_stats(image)
+        if stats is not None:
+            # 共享的 65536 档直方图直接分箱（同 np.histogram），不再展平与扫描像素
+            hist_values, bin_edges = stats.histogram(bins, data_range)
+            result = (bin_edges[:-1], hist_values)
+            self.histogram_cache[cache_key] = result
+            if len(self.histogram_cache) > 10:
+                del self.histogram_cache[next(iter(self.histogram_cache))]
+            return result
+
         # 准备数据
         flat_data = image.flatten()
 
@@ -123,6 +135,36 @@ class HistogramWindow(QDialog):
         if image_hash in self.stats_cache:
             return self.stats_cache[image_hash]
 
+        stats_cpp = get_histogram_stats(image)
+        if stats_cpp is not None:
+            # 全部统计量由共享直方图得到；过曝阈值以下的"有效数据"即 [0, 59999] 灰度区间
+            overexp_threshold = 60000
+            valid = stats_cpp.range_stats(0, overexp_threshold - 1)
+            stats = {
+                'mean': stats_cpp.mean,
+                'std': stats_cpp.std,
+                'min': stats_cpp.min,
+                'max': stats_cpp.max,
+                'median': stats_cpp.percentile(50.0),
+                'size': stats_cpp.size,
+                'overexposed_count': int(stats_cpp.size - valid['count']),
+            }
+            stats['overexposed_ratio'] = float(stats['overexposed_count'] / stats['size'] * 100)
+            if valid['count'] > 0:
+                stats['valid_mean'] = valid['mean']
+                stats['valid_std'] = valid['std']
+                stats['valid_min'] = valid['min']
+                stats['valid_max'] = valid['max']
+            else:
+                stats['valid_mean'] = stats['mean']
+                stats['valid_std'] = stats['std']
+                stats['valid_min'] = stats['min']
+                stats['valid_max'] = stats['max']
+            self.stats_cache[image_hash] = stats
+            if len(self.stats_cache) > 10:
+                del self.stats_cache[next(iter(self.stats_cache))]
+            return stats
+
         # 一次性计算所有统计量（向量化操作）
         flat_data = image.flatten()
         stats = {
@@ -266,6 +308,12 @@ class HistogramWindow(QDialog):
         if not current_changed and not original_changed:
             return
 
+        # 内容变了而数组对象可能没变（原地修改），按对象缓存的共享直方图统计须作废
+        if current_changed and current_image is not None:
+            invalidate_histogram_stats(current_image)
+        if original_changed and original_image is not None:
+            invalidate_histogram_stats(original_image)
+
         # 更新图像数据
         self.current_image = current_image
         if original_image is not None:
@@ -208,6 +208,23 @@ class ImageView(QGraphicsView):
     def get_current_transform(self) -> QTransform:
         """获取当前的变换矩阵"""
         return self.transform()
+
+    def get_view_scale(self) -> float:
+        """当前实际显示缩放（含 fitInView 的变换，scale_factor 只记录滚轮缩放）"""
+        return abs(self.transform().m11())
+
+    def visible_image_rect(self) -> Optional[tuple]:
+        """当前可见的图像区域 (y0, y1, x0, x1)，图像像素坐标；不可见时返回 None"""
+        if self.pixmap_item is None:
+            return None
+        rect = self.mapToScene(self.viewport().rect()).boundingRect()
+        rect = self.pixmap_item.mapFromScene(rect).boundingRect()
+        h, w = self.pixmap_item.pixmap().height(), self.pixmap_item.pixmap().width()
+        y0, y1 = max(0, int(rect.top())), min(h, int(np.ceil(rect.bottom())))
+        x0, x1 = max(0, int(rect.left())), min(w, int(np.ceil(rect.right())))
+        if y0 >= y1 or x0 >= x1:
+            return None
+        return (y0, y1, x0, x1)
         
     def set_sync_mode(self, enabled: bool):
         """设置同步模式"""
@@ -4,6 +4,7 @@
 import sys
 import os
 import numpy as np
+from dataclasses import replace
 from PyQt6.QtWidgets import (QMainWindow, QWidget, QHBoxLayout, QVBoxLayout,
                            QSplitter, QMenuBar, QMenu, QFileDialog, QStatusBar,
                            QMessageBox, QApplication, QProgressBar, QLabel)
@@ -14,6 +15,7 @@ from .image_view import ImageView
 from .control_panel import ControlPanel
 from .smooth_controller import SmoothWindowLevelController
 from ..core.image_manager import ImageManager
+from ..core.histogram_stats import get_histogram_stats
 from ..core.image_processor import ImageProcessor
 from ..core.image_processing_thread import ImageProcessingThread
 from ..utils.helpers import generate_output_filename, ensure_directory_exists
@@ -191,6 +193,7 @@ class MainWindow(QMainWindow):
         self.processing_thread.task_started.connect(self.on_task_started)
         self.processing_thread.task_progress.connect(self.on_task_progress)
         self.processing_thread.task_completed.connect(self.on_task_completed)
+        self.processing_thread.task_preview.connect(self.on_task_preview)
         self.processing_thread.task_failed.connect(self.on_task_failed)
         self.processing_thread.queue_status_changed.connect(self.on_queue_status_changed)
         
@@ -269,6 +272,12 @@ class MainWindow(QMainWindow):
             parameters['window_width'] = current_ww
             parameters['window_level'] = current_wl
 
+        # C++ 论文算法走渐进模式：先发布低分辨率预览，再从当前视口中心向外细化
+        if algorithm_name == 'paper_enhance_cpp':
+            parameters['progressive'] = True
+            parameters['viewport'] = self.processed_view.visible_image_rect()
+            parameters['view_scale'] = self.processed_view.get_view_scale()
+
         # 生成任务描述
         description = self._generate_task_description(algorithm_name, parameters)
 
@@ -389,9 +398,14 @@ class MainWindow(QMainWindow):
 
         # 获取图像数据
         data = self.image_manager.current_image.data
-        data_min = int(data.min())
-        data_max = int(data.max())
-        data_mean = float(data.mean())
+        # 16 位图像共用按图像缓存的 65536 档直方图：统计量与分箱都不再扫描像素
+        stats = get_histogram_stats(data)
+        if stats is not None:
+            data_min, data_max, data_mean = stats.min, stats.max, stats.mean
+        else:
+            data_min = int(data.min())
+            data_max = int(data.max())
+            data_mean = float(data.mean())
         total_pixels = data.size
 
         print(f"\n🎯 自动优化分析:")
@@ -400,7 +414,10 @@ class MainWindow(QMainWindow):
         print(f"   图像大小: {data.shape}")
 
         # 计算直方图
-        hist, bins = np.histogram(data.flatten(), bins=65536, range=(data_min, data_max))
+        if stats is not None:
+            hist, bins = stats.histogram(65536, (data_min, data_max))
+        else:
+            hist, bins = np.histogram(data.flatten(), bins=65536, range=(data_min, data_max))
         bin_centers = 0.5 * (bins[:-1] + bins[1:])  # 修正：使用真正的bin中心
         cumulative_pixels = np.cumsum(hist)
 
@@ -456,9 +473,9 @@ class MainWindow(QMainWindow):
                     print(f"   回退算法: 使用有效区域全范围")
             else:
                 # 最终回退：使用中位数算法
-                median_value = np.median(data)
+                median_value = stats.percentile(50.0) if stats is not None else np.median(data)
                 window_level = median_value * 0.8
-                window_width = data.std() * 3
+                window_width = (stats.std if stats is not None else data.std()) * 3
                 print(f"   最终回退: 使用中位数算法")
         else:
             print(f"   ✅ 未检测到过曝背景，使用标准算法")
@@ -701,6 +718,17 @@ class MainWindow(QMainWindow):
         """任务进度更新"""
         self.progress_bar.setValue(int(progress * 100))
 
+    def on_task_preview(self, task_id: str, preview_data: np.ndarray, stage: str):
+        """渐进模式的中间结果：只刷新显示，不写入图像管理器和处理历史"""
+        if task_id != self.current_task_id or self.image_manager.current_image is None:
+            return
+        preview_image = replace(self.image_manager.current_image, data=preview_data, id="")
+        display = self.image_manager.get_windowed_image(
+            preview_image, invert=self.control_panel.get_invert_state())
+        self.processed_view.set_image(display, reset_view=False)
+        if stage == "preview":
+            self.status_bar.showMessage("预览已就绪，正在细化全分辨率...")
+
     def on_task_completed(self, task_id: str, result_data: np.ndarray, description: str):
         """任务完成处理"""
         try:
@@ -0,0 +1,100 @@
+"""
+局部编辑增量重算逐位一致性测试
+
+reprocess_dirty_region_tiled_cpp 只重跑输入区域（核心 + overlap halo）与脏区相交的分块。
+这里对合成 uint16 图像做局部编辑，断言增量结果与编辑后整幅重算 np.array_equal：
+- 区域内像素重排（直方图不变，归一化区间不变）：只重跑部分分块；
+- 改变灰度分布的编辑：归一化区间改变，退回整幅重算（tiles == -1）；
+- window 归一化：区间与图像无关，总是走增量路径。
+"""
+
+import sys
+import os
+import numpy as np
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+from core.paper_enhance import (enhance_xray_poisson_nlm_strict_tiled_cpp, reprocess_dirty_region_tiled_cpp,
+                                region_cpp, norm_range_cpp)
+
+TILE = (48, 48)
+OVERLAP = 8
+PARAMS = dict(tile=TILE, overlap=OVERLAP, search_radius=2, patch_radius=1, topk=25, iters=6)
+
+
+def make_image(H=160, W=176, seed=23):
+    rng = np.random.default_rng(seed)
+    yy, xx = np.mgrid[0:H, 0:W]
+    base = 16000 + 8000 * np.sin(xx / 17.0) * np.cos(yy / 25.0)
+    return np.clip(base + rng.normal(0, 800, (H, W)), 0, 65535).astype(np.uint16)
+
+
+def full(R16, **kw):
+    return enhance_xray_poisson_nlm_strict_tiled_cpp(R16.copy(), **PARAMS, **kw)
+
+
+def test_permuted_region_reruns_only_dirty_tiles():
+    """区域内像素重排：归一化区间不变，只重跑相交分块，结果与整幅重算逐位一致"""
+    if region_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    rng = np.random.default_rng(1)
+    R16 = make_image()
+    out = full(R16)
+    vr = norm_range_cpp(R16)
+
+    y0, y1, x0, x1 = 70, 85, 100, 121
+    block = R16[y0:y1, x0:x1].copy().ravel()
+    R16[y0:y1, x0:x1] = rng.permutation(block).reshape(y1 - y0, x1 - x0)
+    out, vr2, tiles = reprocess_dirty_region_tiled_cpp(R16, out, (y0, y1, x0, x1), norm_range=vr, **PARAMS)
+    assert tuple(vr2) == tuple(vr), "重排像素不应改变归一化区间"
+
+    expected = full(R16)
+    diff = int(np.count_nonzero(out != expected))
+    print(f"重跑分块 {tiles}，不一致像素 {diff}")
+    assert 0 < tiles, "应走增量路径"
+    assert np.array_equal(out, expected), f"增量结果有 {diff} 个像素与整幅重算不一致"
+
+
+def test_range_change_falls_back_to_full_rerun():
+    """编辑改变 percentile 区间：退回整幅重算，结果仍逐位一致"""
+    if region_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    R16 = make_image()
+    out = full(R16)
+    vr = norm_range_cpp(R16)
+
+    y0, y1, x0, x1 = 0, 60, 0, 80
+    R16[y0:y1, x0:x1] = 60000
+    out, vr2, tiles = reprocess_dirty_region_tiled_cpp(R16, out, (y0, y1, x0, x1), norm_range=vr, **PARAMS)
+    assert tuple(vr2) != tuple(vr) and tiles == -1, "区间改变时应整幅重算"
+    assert np.array_equal(out, full(R16)), "整幅重算回退的结果不一致"
+
+
+def test_window_normalization_edits_incrementally():
+    """window 归一化：任意编辑都只重跑相交分块，结果与整幅重算逐位一致"""
+    if region_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    win = dict(norm_mode="window", wl=16000.0, ww=20000.0)
+    R16 = make_image(seed=5)
+    out = full(R16, **win)
+    vr = norm_range_cpp(R16, norm_mode="window", wl=16000.0, ww=20000.0)
+
+    for y0, y1, x0, x1 in ((5, 12, 5, 30), (150, 160, 160, 176), (40, 41, 90, 91)):
+        R16[y0:y1, x0:x1] = 30000
+        out, _, tiles = reprocess_dirty_region_tiled_cpp(R16, out, (y0, y1, x0, x1), norm_range=vr,
+                                                         **win, **PARAMS)
+        assert tiles > 0, "window 归一化下应走增量路径"
+        assert np.array_equal(out, full(R16, **win)), f"编辑 {(y0, y1, x0, x1)} 后增量结果不一致"
+
+
+if __name__ == '__main__':
+    print("开始局部编辑增量重算一致性测试...")
+    print("=" * 50)
+    test_permuted_region_reruns_only_dirty_tiles()
+    test_range_change_falls_back_to_full_rerun()
+    test_window_normalization_edits_incrementally()
+    print("\n所有测试通过！")
@@ -0,0 +1,122 @@
+"""
+共享直方图统计回归测试
+
+C++ ImageHistogram 的 effective_range / slider_ranges / histogram 是
+ImageManager._detect_effective_range、calculate_smart_slider_ranges 与 np.histogram 的移植。
+这里在合成 uint16 图像上分别走 C++ 路径与 numpy 回退路径，断言结果逐项相同：
+普通图像、带过曝背景峰的图像、常数图像与窄灰度跨度图像。
+"""
+
+import sys
+import os
+from contextlib import contextmanager
+import numpy as np
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+import core.image_manager as image_manager_module
+from core.image_manager import ImageManager, ImageData
+from core.histogram_stats import ImageHistogramCpp, get_histogram_stats, invalidate_histogram_stats
+
+# (窗宽, 窗位)：常规值、大窗宽、超出 16 位的窗宽，以及走回退分支的 0
+WINDOW_SETTINGS = [(400.0, 40.0), (4000.0, 8000.0), (1234.5, 20000.0), (70000.0, 30000.0), (0.0, 0.0)]
+
+
+def make_test_images():
+    rng = np.random.default_rng(2024)
+    images = {}
+
+    # 普通图像：缓变结构 + 噪声
+    yy, xx = np.mgrid[0:256, 0:320]
+    base = 12000 + 6000 * np.sin(xx / 40.0) * np.cos(yy / 55.0)
+    images["normal"] = np.clip(base + rng.normal(0, 800, base.shape), 0, 65535).astype(np.uint16)
+
+    # 过曝背景：约 30% 像素落在同一高灰度值上（> 80% 灰度跨度且占比 > 5%），工件在低灰度区
+    over = np.clip(rng.normal(5000, 1500, (300, 300)), 100, 20000).astype(np.uint16)
+    mask = rng.random(over.shape) < 0.3
+    over[mask] = 62000
+    images["overexposed"] = over
+
+    # 常数图像：np.histogram 把区间扩成 (v - 0.5, v + 0.5)
+    images["constant"] = np.full((64, 96), 1234, dtype=np.uint16)
+
+    # 窄灰度跨度：桶宽远小于 1，大多数桶为空
+    images["narrow"] = rng.integers(100, 111, (128, 128)).astype(np.uint16)
+
+    return images
+
+
+@contextmanager
+def numpy_fallback():
+    """ImageManager 取不到共享直方图时走 numpy 实现"""
+    original = image_manager_module.get_histogram_stats
+    image_manager_module.get_histogram_stats = lambda data: None
+    try:
+        yield
+    finally:
+        image_manager_module.get_histogram_stats = original
+
+
+def test_effective_range_matches_numpy():
+    """有效数据范围：C++ 与 numpy 回退完全一致"""
+    if ImageHistogramCpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    manager = ImageManager()
+    for name, data in make_test_images().items():
+        invalidate_histogram_stats(data)
+        cpp = manager._detect_effective_range(data)
+        with numpy_fallback():
+            ref = manager._detect_effective_range(data)
+        print(f"{name}: C++ {cpp}, numpy {ref}")
+        assert (float(cpp[0]), float(cpp[1])) == (float(ref[0]), float(ref[1])), \
+            f"{name}: 有效范围不一致 C++ {cpp} vs numpy {ref}"
+
+
+def test_slider_ranges_match_numpy():
+    """智能滑块范围：C++ 与 numpy 回退完全一致"""
+    if ImageHistogramCpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    manager = ImageManager()
+    for name, data in make_test_images().items():
+        invalidate_histogram_stats(data)
+        for ww, wl in WINDOW_SETTINGS:
+            image = ImageData(data=data, metadata={}, window_width=ww, window_level=wl)
+            cpp = manager.calculate_smart_slider_ranges(image)
+            with numpy_fallback():
+                ref = manager.calculate_smart_slider_ranges(image)
+            cpp = tuple(tuple(int(v) for v in r) for r in cpp)
+            ref = tuple(tuple(int(v) for v in r) for r in ref)
+            assert cpp == ref, f"{name} ww={ww} wl={wl}: 滑块范围不一致 C++ {cpp} vs numpy {ref}"
+
+
+def test_histogram_matches_np_histogram():
+    """分箱直方图：计数与 np.histogram 逐桶相同，边界一致"""
+    if ImageHistogramCpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    for name, data in make_test_images().items():
+        invalidate_histogram_stats(data)
+        stats = get_histogram_stats(data)
+        lo, hi = int(data.min()), int(data.max())
+        ranges = [None, (lo, hi), (0, 65535), (lo + 0.25, hi + 10.75)]
+        for bins in (1, 256, 1000, 65536):
+            for rng in ranges:
+                counts, edges = stats.histogram(bins, rng)
+                ref_counts, ref_edges = np.histogram(data, bins=bins, range=rng)
+                assert np.array_equal(counts, ref_counts), f"{name} bins={bins} range={rng}: 计数不一致"
+                assert np.array_equal(edges, ref_edges), f"{name} bins={bins} range={rng}: 边界不一致"
+        assert (stats.min, stats.max) == (lo, hi)
+        assert abs(stats.mean - float(np.mean(data))) <= 1e-9 * max(1.0, abs(stats.mean))
+        assert abs(stats.std - float(np.std(data))) <= 1e-9 * max(1.0, stats.std)
+
+
+if __name__ == '__main__':
+    print("开始共享直方图统计回归测试...")
+    print("=" * 50)
+    test_effective_range_matches_numpy()
+    test_slider_ranges_match_numpy()
+    test_histogram_matches_np_histogram()
+    print("\n所有测试通过！")
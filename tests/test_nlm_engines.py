@@ -0,0 +1,73 @@
+"""
+NLM 引擎一致性测试
+
+位移引擎（engine="offset"）按搜索窗位移逐个盒求和，与逐块引擎（engine="patch"）的求和次序不同。
+两者在 double 中累加、输出 float32，这里要求差异不超过 float32 舍入量级：
+|offset - patch| <= 1e-6 · max|patch|（合成梯度场，多组 search_radius / patch_radius，全搜索窗 topk=0）。
+"""
+
+import sys
+import os
+import numpy as np
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+try:
+    from poisson_nlm_cpp import poisson_nlm_on_gradient_exact_cpp
+except Exception:
+    poisson_nlm_on_gradient_exact_cpp = None
+
+REL_TOL = 1e-6
+
+
+def make_gradients(H, W, seed=7):
+    """缓变结构 + 噪声的梯度场，λ 分布接近实际 X 光片"""
+    rng = np.random.default_rng(seed)
+    yy, xx = np.mgrid[0:H, 0:W].astype(np.float32)
+    s = 0.02 * np.sin(0.2 * xx) * np.cos(0.15 * yy)
+    gx = (s + 0.01 * rng.standard_normal((H, W))).astype(np.float32)
+    gy = (0.5 * s + 0.01 * rng.standard_normal((H, W))).astype(np.float32)
+    return gx, gy
+
+
+def test_offset_engine_matches_patch_engine():
+    """全搜索窗下位移引擎与逐块引擎在 float32 舍入范围内一致"""
+    if poisson_nlm_on_gradient_exact_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    for H, W in ((37, 42), (64, 69)):
+        gx, gy = make_gradients(H, W)
+        for sr in (1, 2, 3):
+            for pr in (1, 2):
+                ref = poisson_nlm_on_gradient_exact_cpp(gx, gy, search_radius=sr, patch_radius=pr,
+                                                        topk=0, engine="patch")
+                off = poisson_nlm_on_gradient_exact_cpp(gx, gy, search_radius=sr, patch_radius=pr,
+                                                        topk=0, engine="offset")
+                assert ref[2] == off[2], "count_scale 不一致"
+                for a, b, name in ((ref[0], off[0], "Gx"), (ref[1], off[1], "Gy")):
+                    diff = float(np.max(np.abs(a.astype(np.float64) - b)))
+                    bound = REL_TOL * float(np.max(np.abs(a)))
+                    print(f"{H}x{W} sr={sr} pr={pr} {name}: 最大差 {diff:.3g}（上限 {bound:.3g}）")
+                    assert diff <= bound, f"{H}x{W} sr={sr} pr={pr} {name}: 差异 {diff:.3g} 超过 {bound:.3g}"
+
+
+def test_offset_engine_rejects_topk():
+    """位移引擎不支持 topk，显式报错而不是近似"""
+    if poisson_nlm_on_gradient_exact_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    gx, gy = make_gradients(32, 32)
+    try:
+        poisson_nlm_on_gradient_exact_cpp(gx, gy, search_radius=2, patch_radius=1, topk=5, engine="offset")
+    except Exception:
+        return
+    raise AssertionError("engine='offset' 配合 topk>0 应当报错")
+
+
+if __name__ == '__main__':
+    print("开始 NLM 引擎一致性测试...")
+    print("=" * 50)
+    test_offset_engine_matches_patch_engine()
+    test_offset_engine_rejects_topk()
+    print("\n所有测试通过！")
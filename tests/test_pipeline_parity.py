@@ -0,0 +1,98 @@
+"""
+端到端 C++ 流水线逐位一致性测试
+
+enhance_xray_poisson_nlm_strict_cpp 在一次调用内完成 归一化 → Step1 → NLM → Step3 → 反归一化。
+这里用逐阶段的 C++ 入口（pipeline_normalization_range_cpp、adaptive_gradient_enhance_cpp、
+poisson_nlm_reconstruct_cpp）在 Python 中按同样的分块、同样的 double 归一化/反归一化算术重组整条流水线，
+断言两者 np.array_equal。
+
+注意：enhance_xray_poisson_nlm_strict_tiled_cpp 的 Python 分块回退（return_lambda=True 或非 uint16 输入）
+用 numpy float32 归一化，与 C++ 流水线可在末位舍入上不同，不属于逐位一致的范围。
+"""
+
+import sys
+import os
+import numpy as np
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+try:
+    import poisson_nlm_cpp
+except Exception:
+    poisson_nlm_cpp = None
+
+from core.paper_enhance import _iter_tiles
+
+TILE = (64, 64)
+OVERLAP = 8
+PARAMS = dict(epsilon_8bit=2.3, mu=10.0, ksize_var=5,
+              search_radius=2, patch_radius=1, rho=1.5,
+              count_target_mean=30.0, lam_quant=0.02, topk=25,
+              gamma=0.2, delta=0.8, iters=6, dt=0.15)
+
+
+def make_image(H=150, W=170, seed=42):
+    """缓变结构 + 噪声 + 一条亮边的 uint16 图像；尺寸不是块步长的整数倍，覆盖边缘分块"""
+    rng = np.random.default_rng(seed)
+    yy, xx = np.mgrid[0:H, 0:W]
+    base = 15000 + 7000 * np.sin(xx / 19.0) * np.cos(yy / 27.0)
+    base[:, W // 2:W // 2 + 3] += 20000
+    return np.clip(base + rng.normal(0, 700, (H, W)), 0, 65535).astype(np.uint16)
+
+
+def staged_pipeline(R16, tile=TILE, overlap=OVERLAP, p=PARAMS):
+    """按 C++ 流水线的算术逐阶段重组：归一化/反归一化在 double 中进行，Step1/2/3 调用各自的 C++ 入口"""
+    H, W = R16.shape
+    vmin, vmax = poisson_nlm_cpp.pipeline_normalization_range_cpp(R16)
+    scale = 1.0 / (vmax - vmin)
+    out = np.zeros((H, W), dtype=np.uint16)
+    for (in_y, in_x), (core_y, core_x), (rel_y, rel_x) in _iter_tiles(H, W, tile[0], tile[1], overlap):
+        R_sub = np.clip((R16[in_y, in_x].astype(np.float64) - vmin) * scale, 0.0, 1.0).astype(np.float32)
+        Gx_p, Gy_p, Gmag = poisson_nlm_cpp.adaptive_gradient_enhance_cpp(
+            R_sub, epsilon_unit=p["epsilon_8bit"] / (255.0 * 255.0), mu=p["mu"],
+            ksize_var=p["ksize_var"], return_magnitude=True)
+        I_sub = poisson_nlm_cpp.poisson_nlm_reconstruct_cpp(
+            R_sub, Gx_p, Gy_p,
+            search_radius=p["search_radius"], patch_radius=p["patch_radius"], rho=p["rho"],
+            count_target_mean=p["count_target_mean"], lam_quant=p["lam_quant"], topk=p["topk"],
+            gamma=p["gamma"], delta=p["delta"], iters=p["iters"], dt=p["dt"], grad_mag=Gmag)[0]
+        v = np.clip(I_sub[rel_y, rel_x], 0.0, 1.0).astype(np.float64) * (vmax - vmin) + vmin
+        out[core_y, core_x] = np.clip(v, 0.0, 65535.0).astype(np.uint16)
+    return out
+
+
+def test_pipeline_matches_staged_calls():
+    """单次调用的 C++ 流水线与逐阶段 C++ 调用逐位一致（串行与多块并行各一次）"""
+    if poisson_nlm_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    R16 = make_image()
+    expected = staged_pipeline(R16)
+    for in_flight in (1, 0):
+        got = poisson_nlm_cpp.enhance_xray_poisson_nlm_strict_cpp(
+            R16, tile=TILE, overlap=OVERLAP, max_tiles_in_flight=in_flight, **PARAMS)
+        assert got.dtype == np.uint16 and got.shape == R16.shape
+        diff = int(np.count_nonzero(got != expected))
+        print(f"max_tiles_in_flight={in_flight}: 不一致像素 {diff}")
+        assert np.array_equal(got, expected), f"max_tiles_in_flight={in_flight}: {diff} 个像素不一致"
+
+
+def test_strided_input_matches_contiguous():
+    """非连续视图（转置）输入与其连续拷贝逐位一致：零拷贝读取不改变结果"""
+    if poisson_nlm_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    R16 = make_image(120, 100, seed=7).T
+    a = poisson_nlm_cpp.enhance_xray_poisson_nlm_strict_cpp(R16, tile=TILE, overlap=OVERLAP, **PARAMS)
+    b = poisson_nlm_cpp.enhance_xray_poisson_nlm_strict_cpp(np.ascontiguousarray(R16),
+                                                            tile=TILE, overlap=OVERLAP, **PARAMS)
+    assert np.array_equal(a, b), "转置视图与连续拷贝的结果不一致"
+
+
+if __name__ == '__main__':
+    print("开始端到端 C++ 流水线一致性测试...")
+    print("=" * 50)
+    test_pipeline_matches_staged_calls()
+    test_strided_input_matches_contiguous()
+    print("\n所有测试通过！")
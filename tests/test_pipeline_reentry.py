@@ -0,0 +1,91 @@
+"""
+流水线线程池并发/重入测试
+
+分块并行的流水线入口共用一个进程级线程池：
+- 在 progress_callback 内再次调用流水线须抛出 RuntimeError（或在池外的最终进度上报中正常完成），不能死锁；
+- 多个 Python 线程同时调用时排队执行，结果与单独调用逐位一致。
+"""
+
+import sys
+import os
+import threading
+import numpy as np
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+try:
+    from poisson_nlm_cpp import enhance_xray_poisson_nlm_strict_cpp as pipeline_cpp
+except Exception:
+    pipeline_cpp = None
+
+# 分块足够多、搜索窗足够大，使作业运行期间调用线程多次轮询进度（约每 50ms 一次）
+KW = dict(tile=(64, 64), overlap=8, search_radius=3, topk=25, iters=4, max_tiles_in_flight=4)
+
+
+def make_image(H=384, W=384, seed=3):
+    rng = np.random.default_rng(seed)
+    yy, xx = np.mgrid[0:H, 0:W]
+    base = 20000 + 8000 * np.sin(xx / 23.0) * np.cos(yy / 31.0)
+    return np.clip(base + rng.normal(0, 600, (H, W)), 0, 65535).astype(np.uint16)
+
+
+def test_reentrant_call_from_progress_callback():
+    """进度回调内再调用流水线：抛出不可重入错误或（池外上报时）正常完成，绝不死锁"""
+    if pipeline_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    R16 = make_image()
+    small = make_image(64, 64, seed=5)
+    expected_small = pipeline_cpp(small, tile=(32, 32), overlap=8)
+    nested = []
+
+    def progress(done, total):
+        try:
+            nested.append(pipeline_cpp(small, tile=(32, 32), overlap=8))
+        except RuntimeError as e:
+            nested.append(e)
+        return True
+
+    worker = threading.Thread(target=lambda: pipeline_cpp(R16, progress_callback=progress, **KW))
+    worker.start()
+    worker.join(timeout=300)
+    assert not worker.is_alive(), "回调内重入流水线导致死锁"
+
+    assert nested, "进度回调未被调用"
+    for r in nested:
+        if isinstance(r, RuntimeError):
+            assert "re-entrant" in str(r), f"意外的错误: {r}"
+        else:
+            assert np.array_equal(r, expected_small), "池外重入调用结果不一致"
+    print(f"回调 {len(nested)} 次，其中 {sum(isinstance(r, RuntimeError) for r in nested)} 次被拒绝重入")
+
+
+def test_concurrent_calls_are_serialized():
+    """两个 Python 线程同时调用：排队执行，结果与单独调用逐位一致"""
+    if pipeline_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过")
+        return
+    images = [make_image(seed=s) for s in (11, 12)]
+    expected = [pipeline_cpp(img, **KW) for img in images]
+    results = [None, None]
+
+    def run(i):
+        results[i] = pipeline_cpp(images[i], **KW)
+
+    threads = [threading.Thread(target=run, args=(i,)) for i in range(2)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join(timeout=300)
+        assert not t.is_alive(), "并发调用未结束"
+    for i in range(2):
+        assert np.array_equal(results[i], expected[i]), f"线程 {i} 的结果与单独调用不一致"
+
+
+if __name__ == '__main__':
+    print("开始流水线线程池并发/重入测试...")
+    print("=" * 50)
+    test_reentrant_call_from_progress_callback()
+    test_concurrent_calls_are_serialized()
+    print("\n所有测试通过！")
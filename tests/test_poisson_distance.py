@@ -0,0 +1,95 @@
+"""
+泊松 L2 分布距离回归测试
+
+poisson_L2_distance（Python）与 C++ 建 d 表所用的 poisson_l2_distance_cpp 都按
+S(a,a) + S(b,b) - 2·S(a,b)、S = e^{-(a+b)}·I₀(2√(ab)) 的闭式求值。
+这里与直接对 PMF 求和 Σ_r (p_x(r) - p_y(r))² 对照，覆盖 λ = 0、小 λ、中等 λ、
+I₀ 幂级数/渐近展开的切换点（2√(ab) = 30，即 λ ≈ 225）附近、d 表上限附近（≈82）与大 λ，
+以及差值很小、三项相消最严重的近邻对。
+"""
+
+import sys
+import os
+import math
+
+# 添加src目录到路径
+sys.path.insert(0, os.path.join(os.path.dirname(__file__), '..', 'src'))
+
+from core.paper_enhance import poisson_L2_distance
+
+try:
+    from poisson_nlm_cpp import poisson_l2_distance_cpp
+except Exception:
+    poisson_l2_distance_cpp = None
+
+LAMBDAS = [0.0, 0.02, 0.5, 3.0, 15.0, 30.0, 82.0, 224.0, 225.0, 226.0, 1000.0]
+# (λ, 增量)：增量取 d 表量化步长 0.02 与更小的 1e-3
+NEAR_PAIRS = [(lam, dl) for lam in (0.02, 15.0, 30.0, 82.0, 224.98, 225.0, 1000.0)
+              for dl in (0.02, 1e-3)]
+
+# 相对误差上限；另加绝对下限，容纳 S 量级（≤ 1）上的舍入在相消后留下的残差
+REL_TOL = 1e-9
+ABS_TOL = 1e-14
+
+
+def _poisson_pmf(lam, r):
+    if lam <= 0.0:
+        return 1.0 if r == 0 else 0.0
+    return math.exp(-lam + r * math.log(lam) - math.lgamma(r + 1.0))
+
+
+def direct_L2_distance(lx, ly):
+    """直接对 PMF 逐项求和（截到 λ + 40√λ，尾项远低于双精度）"""
+    hi = max(lx, ly)
+    r_max = int(hi + 40.0 * math.sqrt(hi) + 60)
+    return sum((_poisson_pmf(lx, r) - _poisson_pmf(ly, r)) ** 2 for r in range(r_max + 1))
+
+
+def _check(name, fn, pairs):
+    worst = 0.0
+    for lx, ly in pairs:
+        d = float(fn(lx, ly))
+        ref = direct_L2_distance(lx, ly)
+        err = abs(d - ref)
+        assert err <= REL_TOL * ref + ABS_TOL, \
+            f"{name}: d({lx}, {ly}) = {d!r}, 直接求和 {ref!r}, 误差 {err:.3g}"
+        if ref > 0.0:
+            worst = max(worst, err / ref)
+    print(f"{name}: {len(pairs)} 组，最大相对误差 {worst:.3g}")
+
+
+def _all_pairs():
+    pairs = [(a, b) for a in LAMBDAS for b in LAMBDAS]
+    pairs += [(lam, lam + dl) for lam, dl in NEAR_PAIRS]
+    pairs += [(lam + dl, lam) for lam, dl in NEAR_PAIRS]
+    return pairs
+
+
+def test_python_distance_matches_direct_sum():
+    """Python 闭式与直接 PMF 求和一致"""
+    _check("poisson_L2_distance", poisson_L2_distance, _all_pairs())
+
+
+def test_cpp_distance_matches_direct_sum():
+    """C++ 闭式与直接 PMF 求和一致（扩展未编译时跳过）"""
+    if poisson_l2_distance_cpp is None:
+        print("poisson_nlm_cpp 未编译，跳过 C++ 对照")
+        return
+    _check("poisson_l2_distance_cpp", poisson_l2_distance_cpp, _all_pairs())
+
+
+def test_equal_lambda_is_exactly_zero():
+    """λx == λy 时三项相同，距离精确为 0"""
+    fns = [poisson_L2_distance] + ([poisson_l2_distance_cpp] if poisson_l2_distance_cpp else [])
+    for fn in fns:
+        for lam in LAMBDAS:
+            assert float(fn(lam, lam)) == 0.0, f"d({lam}, {lam}) != 0"
+
+
+if __name__ == '__main__':
+    print("开始泊松 L2 距离回归测试...")
+    print("=" * 50)
+    test_python_distance_matches_direct_sum()
+    test_cpp_distance_matches_direct_sum()
+    test_equal_lambda_is_exactly_zero()
+    print("\n所有测试通过！")